@@ -0,0 +1,327 @@
+/*
+ * Time the read paths of the library on images: opening, fetching the
+ * descriptors, inode lookups, bitmap queries and full scans. Each result
+ * is one tab separated line, after a header line naming the columns, so
+ * runs can be diffed and fed to other tools:
+ *
+ *   image mode op ops bytes seconds ops_per_sec bytes_per_sec
+ *
+ * bytes are those of metadata the operation covers, 0 for queries served
+ * from the bitmap cache and only the inodes delivered for the scan of the
+ * inodes in use. Images are read through the page cache, the first
+ * pass over an image also warms it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filesystem.h"
+#include "scan.h"
+#include "bitmap.h"
+#include "space.h"
+
+/* Default repetitions and random lookups */
+#define BENCH_OPENS     200
+#define BENCH_LOOKUPS   200000
+#define BENCH_SCANS     3
+
+struct Bench {
+    const char *image;
+    char mode[8];
+    int flags;
+    int threads;
+    uint64_t opens;
+    uint64_t lookups;
+    uint64_t seed;
+};
+
+static double BenchNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t BenchRandom(uint64_t *state)
+{
+    uint64_t x = (*state += 0x9E3779B97F4A7C15ULL);
+
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static void BenchReport(struct Bench *b, const char *op, uint64_t ops, uint64_t bytes, double seconds)
+{
+    printf("%s\t%s\t%s\t%llu\t%llu\t%.6f\t%.1f\t%.1f\n", b->image, b->mode, op, ops, bytes, seconds,
+            seconds > 0 ? ops / seconds : 0, seconds > 0 ? bytes / seconds : 0);
+    fflush(stdout);
+}
+
+static struct FileSystem *BenchOpen(struct Bench *b)
+{
+    struct FileSystem *fs = (struct FileSystem *) malloc(sizeof(struct FileSystem));
+
+    /* FileSystemInit releases fs on failure */
+    if (fs == NULL || FileSystemInit(fs, (char *)b->image, b->flags) < 0) {
+        printf("BenchOpen: open %s failed\n", b->image);
+        return NULL;
+    }
+    return fs;
+}
+
+static int BenchOpens(struct Bench *b)
+{
+    struct FileSystem *fs = NULL;
+    uint64_t i = 0, bytes = 0, fetched = 0;
+    double open = 0, fetch = 0, start = 0;
+
+    for (i = 0; i < b->opens; i++) {
+        start = BenchNow();
+        fs = BenchOpen(b);
+        if (fs == NULL) {
+            return -1;
+        }
+        open += BenchNow() - start;
+
+        start = BenchNow();
+        fetched = GroupDescriptorsFetch(fs);
+        if (fetched == (uint64_t)-1) {
+            printf("BenchOpens: fetch descriptors failed\n");
+            FileSystemRelease(fs);
+            return -1;
+        }
+        fetch += BenchNow() - start;
+        bytes += fetched;
+        FileSystemRelease(fs);
+    }
+    BenchReport(b, "init", b->opens, b->opens * sizeof(struct ext4_super_block), open);
+    BenchReport(b, "descriptor_fetch", b->opens, bytes, fetch);
+    return 0;
+}
+
+/*
+ * Random lookups over the whole filesystem, most of them land on free
+ * inodes and blocks as they would for a scrubber
+ */
+static int BenchLookups(struct Bench *b)
+{
+    struct FileSystem *fs = NULL;
+    struct ext4_inode inode;
+    uint64_t *nums = NULL;
+    int *status = NULL;
+    uint64_t i = 0, state = b->seed, first = 0;
+    double start = 0;
+    int ret = -1;
+
+    fs = BenchOpen(b);
+    if (fs == NULL) {
+        return -1;
+    }
+    nums = (uint64_t *) malloc(sizeof(uint64_t) * b->lookups);
+    status = (int *) malloc(sizeof(int) * b->lookups);
+    if (nums == NULL || status == NULL || GroupDescriptorsFetch(fs) == (uint64_t)-1) {
+        printf("BenchLookups: setup failed\n");
+        goto end;
+    }
+
+    for (i = 0; i < b->lookups; i++) {
+        nums[i] = 1 + BenchRandom(&state) % fs->inode_count;
+    }
+    start = BenchNow();
+    for (i = 0; i < b->lookups; i++) {
+        InodeGetBynum(fs, nums[i], &inode);
+    }
+    BenchReport(b, "inode_lookup", b->lookups, b->lookups * fs->super.s_inode_size, BenchNow() - start);
+
+    start = BenchNow();
+    for (i = 0; i < b->lookups; i++) {
+        status[i] = InodeStatusGetBynum(fs, nums[i]);
+    }
+    BenchReport(b, "inode_status", b->lookups, 0, BenchNow() - start);
+
+    start = BenchNow();
+    if (InodeStatusGetBatch(fs, nums, b->lookups, status) < 0) {
+        printf("BenchLookups: inode status batch failed\n");
+        goto end;
+    }
+    BenchReport(b, "inode_status_batch", b->lookups, 0, BenchNow() - start);
+
+    first = fs->super.s_first_data_block;
+    for (i = 0; i < b->lookups; i++) {
+        nums[i] = first + BenchRandom(&state) % (fs->block_count - first);
+    }
+    start = BenchNow();
+    for (i = 0; i < b->lookups; i++) {
+        status[i] = BlockStatusGetBynum(fs, nums[i]);
+    }
+    BenchReport(b, "block_status", b->lookups, 0, BenchNow() - start);
+
+    start = BenchNow();
+    if (BlockStatusGetBatch(fs, nums, b->lookups, status) < 0) {
+        printf("BenchLookups: block status batch failed\n");
+        goto end;
+    }
+    BenchReport(b, "block_status_batch", b->lookups, 0, BenchNow() - start);
+    ret = 0;
+end:
+    free(nums);
+    free(status);
+    FileSystemRelease(fs);
+    return ret;
+}
+
+static int BenchInodeCount(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode, void *arg)
+{
+    __atomic_fetch_add((uint64_t *)arg, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Whole filesystem passes, each on a newly opened FileSystem so no cache
+ * of the library carries over from the previous pass. The block range
+ * query is one op per pass, the space scan one per group and the inode
+ * scans one per inode delivered.
+ */
+static int BenchScans(struct Bench *b)
+{
+    struct FileSystem *fs = NULL;
+    struct SpaceReport space;
+    struct BlockRange range;
+    struct BlockRangeStatus status;
+    uint64_t i = 0, count = 0, bitmaps = 0, itables = 0, inode_size = 0, groups = 0, space_bytes = 0;
+    double range_time = 0, space_time = 0, all_time = 0, inuse_time = 0, start = 0;
+    uint64_t all = 0, inuse = 0;
+
+    for (i = 0; i < BENCH_SCANS; i++) {
+        fs = BenchOpen(b);
+        if (fs == NULL) {
+            return -1;
+        }
+        bitmaps = fs->group_count * fs->block_size;
+        itables = fs->group_count * fs->itable_block_per_group * fs->block_size;
+        inode_size = fs->super.s_inode_size;
+        range.start = fs->super.s_first_data_block;
+        range.len = fs->block_count - range.start;
+        start = BenchNow();
+        if (BlockRangeStatusGet(fs, &range, 1, &status) < 0) {
+            printf("BenchScans: block range status failed\n");
+            FileSystemRelease(fs);
+            return -1;
+        }
+        range_time += BenchNow() - start;
+        FileSystemRelease(fs);
+
+        fs = BenchOpen(b);
+        if (fs == NULL) {
+            return -1;
+        }
+        start = BenchNow();
+        if (SpaceReportBuild(fs, b->threads, &space) < 0) {
+            printf("BenchScans: space report failed\n");
+            FileSystemRelease(fs);
+            return -1;
+        }
+        space_time += BenchNow() - start;
+        space_bytes += space.bytes_scanned;
+        groups = fs->group_count;
+        SpaceReportRelease(&space);
+        FileSystemRelease(fs);
+
+        fs = BenchOpen(b);
+        if (fs == NULL) {
+            return -1;
+        }
+        count = 0;
+        start = BenchNow();
+        if (InodeScan(fs, b->threads, 0, BenchInodeCount, &count) != 0) {
+            printf("BenchScans: inode scan failed\n");
+            FileSystemRelease(fs);
+            return -1;
+        }
+        all_time += BenchNow() - start;
+        all += count;
+        FileSystemRelease(fs);
+
+        fs = BenchOpen(b);
+        if (fs == NULL) {
+            return -1;
+        }
+        count = 0;
+        start = BenchNow();
+        if (InodeScan(fs, b->threads, SCAN_INUSE_ONLY, BenchInodeCount, &count) != 0) {
+            printf("BenchScans: inode scan failed\n");
+            FileSystemRelease(fs);
+            return -1;
+        }
+        inuse_time += BenchNow() - start;
+        inuse += count;
+        FileSystemRelease(fs);
+    }
+    BenchReport(b, "block_range_status", BENCH_SCANS, BENCH_SCANS * bitmaps, range_time);
+    BenchReport(b, "space_scan", BENCH_SCANS * groups, space_bytes, space_time);
+    BenchReport(b, "inode_scan", all, BENCH_SCANS * itables, all_time);
+    /* Free stretches of the tables are skipped, count what was delivered */
+    BenchReport(b, "inode_scan_inuse", inuse, inuse * inode_size, inuse_time);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct Bench b;
+    int opt = 0;
+    int i = 0;
+    int ret = 0;
+
+    memset(&b, 0, sizeof(struct Bench));
+    b.opens = BENCH_OPENS;
+    b.lookups = BENCH_LOOKUPS;
+    b.seed = 1;
+
+    while ((opt = getopt(argc, argv, "mnt:o:l:")) != -1) {
+        switch (opt) {
+            case 'm':
+                b.flags |= FS_OPEN_MMAP;
+                break;
+            case 'n':
+                b.flags |= FS_OPEN_NO_URING;
+                break;
+            case 't':
+                b.threads = atoi(optarg);
+                break;
+            case 'o':
+                b.opens = strtoull(optarg, NULL, 0);
+                break;
+            case 'l':
+                b.lookups = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                argc = 0;
+                break;
+        }
+    }
+    if (argc == 0 || optind >= argc || b.opens == 0 || b.lookups == 0) {
+        printf("Usage:\n");
+        printf("lsfsbench [-m] [-n] [-t threads] [-o opens] [-l lookups] image ...\n");
+        printf("\t-m: read the images through a memory mapping\n");
+        printf("\t-n: batched reads use pread instead of io_uring\n");
+        printf("\t-t: workers of the scans, 0 for one per CPU\n");
+        printf("\t-o: times each image is opened and its descriptors fetched, %d by default\n", BENCH_OPENS);
+        printf("\t-l: random inodes and blocks looked up, %d by default\n", BENCH_LOOKUPS);
+        return 1;
+    }
+    snprintf(b.mode, sizeof(b.mode), "%s%s%s", b.flags ? "-" : "default", (b.flags & FS_OPEN_MMAP) ? "m" : "",
+            (b.flags & FS_OPEN_NO_URING) ? "n" : "");
+
+    printf("image\tmode\top\tops\tbytes\tseconds\tops_per_sec\tbytes_per_sec\n");
+    for (i = optind; i < argc; i++) {
+        b.image = argv[i];
+        if (BenchOpens(&b) < 0 || BenchLookups(&b) < 0 || BenchScans(&b) < 0) {
+            ret = 1;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,901 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "bitmap.h"
+
+/*
+ * Set up the bitmap cache of the FileSystem
+ * @fs: FileSystem
+ * @capacity: how many bitmap blocks are kept at most, 0 for BITMAP_CACHE_ENTRIES
+ */
+int BitmapCacheInit(struct FileSystem *fs, uint64_t capacity)
+{
+    struct BitmapCache *cache = NULL;
+
+    if (fs == NULL) {
+        return -1;
+    }
+    if (capacity == 0) {
+        capacity = BITMAP_CACHE_ENTRIES;
+    }
+
+    cache = (struct BitmapCache *) calloc(1, sizeof(struct BitmapCache));
+    if (cache == NULL) {
+        return -1;
+    }
+    cache->capacity = capacity;
+    cache->bucket_count = capacity * 2;
+    cache->buckets = (struct BitmapCacheEntry **) calloc(cache->bucket_count, sizeof(struct BitmapCacheEntry *));
+    if (cache->buckets == NULL) {
+        free(cache);
+        return -1;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+
+    fs->bitmap_cache = cache;
+    return 0;
+}
+
+void BitmapCacheRelease(struct FileSystem *fs)
+{
+    struct BitmapCache *cache = NULL;
+    struct BitmapCacheEntry *entry = NULL;
+    struct LruNode *node = NULL, *next = NULL;
+
+    if (fs == NULL || fs->bitmap_cache == NULL) {
+        return;
+    }
+    cache = fs->bitmap_cache;
+    for (node = cache->lru.head; node != NULL; node = next) {
+        next = node->next;
+        entry = LRU_ENTRY(node, struct BitmapCacheEntry, lru);
+        free(entry->data);
+        free(entry);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->loaded);
+    free(cache->buckets);
+    free(cache);
+    fs->bitmap_cache = NULL;
+}
+
+void BitmapCachePrint(struct FileSystem *fs)
+{
+    struct BitmapCache *cache = fs->bitmap_cache;
+
+    if (cache == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    printf("Bitmap cache: %llu/%llu entries, %llu hits, %llu misses, %llu evictions\n",
+            cache->count, cache->capacity, cache->hits, cache->misses, cache->evictions);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static uint64_t BitmapHash(struct BitmapCache *cache, int type, uint64_t group)
+{
+    return ((group << 1 | type) * 0x9E3779B97F4A7C15ULL >> 17) % cache->bucket_count;
+}
+
+static struct BitmapCacheEntry *EntryLookup(struct BitmapCache *cache, int type, uint64_t group)
+{
+    struct BitmapCacheEntry *entry = cache->buckets[BitmapHash(cache, type, group)];
+
+    while (entry != NULL && (entry->type != type || entry->group != group)) {
+        entry = entry->hnext;
+    }
+    return entry;
+}
+
+/*
+ * Take an entry out of both the hash chain and the LRU list
+ */
+static void EntryUnlink(struct BitmapCache *cache, struct BitmapCacheEntry *entry)
+{
+    struct BitmapCacheEntry **pp = &(cache->buckets[BitmapHash(cache, entry->type, entry->group)]);
+
+    while (*pp != NULL && *pp != entry) {
+        pp = &((*pp)->hnext);
+    }
+    if (*pp != NULL) {
+        *pp = entry->hnext;
+    }
+    LruRemove(&cache->lru, &entry->lru);
+    cache->count--;
+}
+
+static bool EntryDrop(struct LruNode *node, void *arg)
+{
+    struct BitmapCache *cache = (struct BitmapCache *)arg;
+    struct BitmapCacheEntry *entry = LRU_ENTRY(node, struct BitmapCacheEntry, lru);
+
+    if (entry->refs != 0 || !entry->ready) {
+        return false;
+    }
+    EntryUnlink(cache, entry);
+    free(entry->data);
+    free(entry);
+    return true;
+}
+
+/*
+ * Drop least recently used entries nobody holds until there is room for one more
+ */
+static void CacheEvict(struct BitmapCache *cache)
+{
+    cache->evictions += LruEvict(&cache->lru, &cache->count, cache->capacity, EntryDrop, cache);
+}
+
+/*
+ * Flags of a group, 0 if its descriptor cannot be read so that reading
+ * the bitmap is tried and reports the error
+ */
+static uint16_t GroupFlagsGet(struct FileSystem *fs, uint64_t group)
+{
+    struct ext4_group_desc *pdesc = GroupDescriptorGet(fs, group);
+
+    if (pdesc == NULL) {
+        return 0;
+    }
+    return le16toh(pdesc->bg_flags);
+}
+
+static uint64_t BitmapLocationGet(struct FileSystem *fs, int type, uint64_t group)
+{
+    struct ext4_group_desc *pdesc = GroupDescriptorGet(fs, group);
+
+    if (pdesc == NULL) {
+        return 0;
+    }
+    if (type == BITMAP_INODE) {
+        return InodeBitmapLocationGet(fs, pdesc);
+    }
+    return BlockBitmapLocationGet(fs, pdesc);
+}
+
+/*
+ * Get the bitmap block of a group through the cache
+ * @fs: FileSystem
+ * @type: BITMAP_INODE or BITMAP_BLOCK
+ * @group: group number
+ * Return the bitmap, block_size bytes, or NULL on failure.
+ * The bitmap stays valid until it is released by BitmapPut.
+ */
+char *BitmapGet(struct FileSystem *fs, int type, uint64_t group)
+{
+    struct BitmapCache *cache = NULL;
+    struct BitmapCacheEntry *entry = NULL;
+    uint64_t bucket = 0, location = 0;
+    char *data = NULL;
+
+    if (fs == NULL || fs->bitmap_cache == NULL || group >= fs->group_count) {
+        return NULL;
+    }
+    cache = fs->bitmap_cache;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = EntryLookup(cache, type, group);
+    if (entry != NULL) {
+        cache->hits++;
+        entry->refs++;
+        LruTouch(&cache->lru, &entry->lru);
+        while (!entry->ready && !entry->failed) {
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+        }
+        if (entry->failed) {
+            entry->refs--;
+            if (entry->refs == 0) {
+                free(entry->data);
+                free(entry);
+            }
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+        data = entry->data;
+        pthread_mutex_unlock(&cache->lock);
+        return data;
+    }
+
+    cache->misses++;
+    CacheEvict(cache);
+    entry = (struct BitmapCacheEntry *) calloc(1, sizeof(struct BitmapCacheEntry));
+    if (entry != NULL) {
+        entry->data = (char *) malloc(fs->block_size);
+    }
+    if (entry == NULL || entry->data == NULL) {
+        free(entry);
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    entry->type = type;
+    entry->group = group;
+    entry->refs = 1;
+    bucket = BitmapHash(cache, type, group);
+    entry->hnext = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    LruPushFront(&cache->lru, &entry->lru);
+    cache->count++;
+    pthread_mutex_unlock(&cache->lock);
+
+    /* Read without the lock, others asking for this bitmap wait on loaded */
+    location = BitmapLocationGet(fs, type, group);
+    if (location == 0 || BlockRead(fs, location, 1, entry->data) == 0) {
+        printf("BitmapGet: read bitmap of group %llu failed\n", group);
+        pthread_mutex_lock(&cache->lock);
+        EntryUnlink(cache, entry);
+        entry->failed = true;
+        entry->refs--;
+        if (entry->refs == 0) {
+            free(entry->data);
+            free(entry);
+        }
+        pthread_cond_broadcast(&cache->loaded);
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    entry->ready = true;
+    data = entry->data;
+    pthread_cond_broadcast(&cache->loaded);
+    pthread_mutex_unlock(&cache->lock);
+
+    return data;
+}
+
+/*
+ * Insert a bitmap already read into the cache, caller holds cache->lock
+ */
+static void CacheInsert(struct FileSystem *fs, int type, uint64_t group, char *data)
+{
+    struct BitmapCache *cache = fs->bitmap_cache;
+    struct BitmapCacheEntry *entry = NULL;
+    uint64_t bucket = 0;
+
+    if (EntryLookup(cache, type, group) != NULL) {
+        return;
+    }
+    CacheEvict(cache);
+    entry = (struct BitmapCacheEntry *) calloc(1, sizeof(struct BitmapCacheEntry));
+    if (entry != NULL) {
+        entry->data = (char *) malloc(fs->block_size);
+    }
+    if (entry == NULL || entry->data == NULL) {
+        free(entry);
+        return;
+    }
+    memcpy(entry->data, data, fs->block_size);
+    entry->type = type;
+    entry->group = group;
+    entry->ready = true;
+    bucket = BitmapHash(cache, type, group);
+    entry->hnext = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    LruPushFront(&cache->lru, &entry->lru);
+    cache->count++;
+}
+
+struct BitmapLocation {
+    uint64_t block;
+    uint64_t group;
+};
+
+static int BitmapLocationCompare(const void *a, const void *b)
+{
+    const struct BitmapLocation *x = (const struct BitmapLocation *)a;
+    const struct BitmapLocation *y = (const struct BitmapLocation *)b;
+
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Load the bitmaps of many groups into the cache at once.
+ * Bitmaps not cached yet are sorted by location and adjacent ones, as laid
+ * out by flex_bg, are read together in runs of up to BITMAP_PREFETCH_BLOCKS.
+ * @fs: FileSystem
+ * @type: BITMAP_INODE or BITMAP_BLOCK
+ * @groups: group numbers
+ * @count: number of groups, should stay below the cache capacity
+ * Return how many bitmaps were read, -1 on failure
+ */
+int64_t BitmapPrefetch(struct FileSystem *fs, int type, uint64_t *groups, uint64_t count)
+{
+    struct BitmapCache *cache = NULL;
+    struct BitmapLocation *locs = NULL;
+    char *buf = NULL;
+    uint64_t i = 0, j = 0, n = 0, run = 0;
+    int64_t ret = 0;
+
+    if (fs == NULL || fs->bitmap_cache == NULL) {
+        return -1;
+    }
+    cache = fs->bitmap_cache;
+
+    locs = (struct BitmapLocation *) malloc(sizeof(struct BitmapLocation) * (count ? count : 1));
+    buf = (char *) malloc(fs->block_size * BITMAP_PREFETCH_BLOCKS);
+    if (locs == NULL || buf == NULL) {
+        ret = -1;
+        goto end;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < count; i++) {
+        if (groups[i] >= fs->group_count || EntryLookup(cache, type, groups[i]) != NULL) {
+            continue;
+        }
+        locs[n].block = BitmapLocationGet(fs, type, groups[i]);
+        if (locs[n].block == 0) {
+            /* Unreadable descriptor, BitmapGet reports it */
+            continue;
+        }
+        locs[n].group = groups[i];
+        n++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    qsort(locs, n, sizeof(struct BitmapLocation), BitmapLocationCompare);
+
+    for (i = 0; i < n; i += run) {
+        run = 1;
+        while (i + run < n && run < BITMAP_PREFETCH_BLOCKS && locs[i + run].block == locs[i].block + run) {
+            run++;
+        }
+        if (BlockRead(fs, locs[i].block, run, buf) == 0) {
+            printf("BitmapPrefetch: read %llu bitmaps at %llu failed\n", run, locs[i].block);
+            ret = -1;
+            goto end;
+        }
+        pthread_mutex_lock(&cache->lock);
+        cache->misses += run;
+        for (j = 0; j < run; j++) {
+            CacheInsert(fs, type, locs[i + j].group, buf + j * fs->block_size);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        ret += run;
+    }
+
+end:
+    free(locs);
+    free(buf);
+    return ret;
+}
+
+/*
+ * Release a bitmap got from BitmapGet
+ */
+void BitmapPut(struct FileSystem *fs, int type, uint64_t group)
+{
+    struct BitmapCache *cache = NULL;
+    struct BitmapCacheEntry *entry = NULL;
+
+    if (fs == NULL || fs->bitmap_cache == NULL) {
+        return;
+    }
+    cache = fs->bitmap_cache;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = EntryLookup(cache, type, group);
+    if (entry != NULL && entry->refs > 0) {
+        entry->refs--;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+struct InodeQuery {
+    uint64_t num;
+    uint64_t index;
+};
+
+static int InodeQueryCompare(const void *a, const void *b)
+{
+    const struct InodeQuery *x = (const struct InodeQuery *)a;
+    const struct InodeQuery *y = (const struct InodeQuery *)b;
+
+    if (x->num != y->num) {
+        return x->num < y->num ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Batch variant of InodeStatusGetBynum
+ * Queries are sorted by inode number, so each group's bitmap is fetched once
+ * and the bitmaps of a window of groups are prefetched together.
+ * @fs: FileSystem
+ * @nums: inode numbers
+ * @count: number of inode numbers
+ * @status: filled with one status per inode, as InodeStatusGetBynum returns
+ * Return 0 on success, -1 if the batch could not be run at all
+ */
+int InodeStatusGetBatch(struct FileSystem *fs, uint64_t *nums, uint64_t count, int *status)
+{
+    struct InodeQuery *queries = NULL;
+    uint64_t *groups = NULL;
+    uint64_t window = 0, nr_groups = 0, nr_seen = 0;
+    uint64_t i = 0, j = 0, k = 0, group = 0, last = 0, bit = 0;
+    unsigned char *bitmap = NULL;
+
+    if (fs == NULL || nums == NULL || status == NULL) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    window = fs->bitmap_cache->capacity / 2;
+    if (window == 0) {
+        window = 1;
+    }
+    queries = (struct InodeQuery *) malloc(sizeof(struct InodeQuery) * count);
+    groups = (uint64_t *) malloc(sizeof(uint64_t) * window);
+    if (queries == NULL || groups == NULL) {
+        free(queries);
+        free(groups);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        queries[i].num = nums[i];
+        queries[i].index = i;
+    }
+    qsort(queries, count, sizeof(struct InodeQuery), InodeQueryCompare);
+
+    for (i = 0; i < count && queries[i].num == 0; i++) {
+        status[queries[i].index] = -1;
+    }
+
+    while (i < count && queries[i].num <= fs->inode_count) {
+        /* Queries i ~ j-1 cover the next window of groups, prefetch their bitmaps */
+        nr_groups = 0;
+        nr_seen = 0;
+        for (j = i; j < count && queries[j].num <= fs->inode_count; j++) {
+            group = INODE_TO_GROUP(queries[j].num, fs->inodes_per_group);
+            if (nr_seen > 0 && group == last) {
+                continue;
+            }
+            if (nr_seen == window) {
+                break;
+            }
+            nr_seen++;
+            last = group;
+            if (!(GroupFlagsGet(fs, group) & EXT4_BG_INODE_UNINIT)) {
+                groups[nr_groups++] = group;
+            }
+        }
+        BitmapPrefetch(fs, BITMAP_INODE, groups, nr_groups);
+
+        for (; i < j; i = k) {
+            group = INODE_TO_GROUP(queries[i].num, fs->inodes_per_group);
+            bitmap = NULL;
+            if (!(GroupFlagsGet(fs, group) & EXT4_BG_INODE_UNINIT)) {
+                bitmap = (unsigned char *)BitmapGet(fs, BITMAP_INODE, group);
+            }
+            for (k = i; k < j && INODE_TO_GROUP(queries[k].num, fs->inodes_per_group) == group; k++) {
+                bit = (queries[k].num - 1) % fs->inodes_per_group;
+                if (GroupFlagsGet(fs, group) & EXT4_BG_INODE_UNINIT) {
+                    status[queries[k].index] = 2;
+                } else if (bitmap == NULL) {
+                    status[queries[k].index] = -1;
+                } else {
+                    status[queries[k].index] = (bitmap[bit / 8] >> (bit % 8)) & 0x1;
+                }
+            }
+            if (bitmap != NULL) {
+                BitmapPut(fs, BITMAP_INODE, group);
+            }
+        }
+    }
+
+    for (; i < count; i++) {
+        status[queries[i].index] = -1;
+    }
+
+    free(queries);
+    free(groups);
+    return 0;
+}
+
+static uint64_t PopcountScalar(const unsigned char *buf, uint64_t len)
+{
+    uint64_t i = 0, word = 0, set = 0;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, buf + i, sizeof(uint64_t));
+        set += __builtin_popcountll(word);
+    }
+    for (; i < len; i++) {
+        set += __builtin_popcount(buf[i]);
+    }
+    return set;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("popcnt")))
+static uint64_t PopcountPopcnt(const unsigned char *buf, uint64_t len)
+{
+    uint64_t i = 0, word = 0, set = 0;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, buf + i, sizeof(uint64_t));
+        set += __builtin_popcountll(word);
+    }
+    for (; i < len; i++) {
+        set += __builtin_popcount(buf[i]);
+    }
+    return set;
+}
+
+/*
+ * Nibble lookup popcount (Mula), 32 bytes per step, byte counts are summed
+ * with SAD into four 64-bit lanes
+ */
+__attribute__((target("avx2,popcnt")))
+static uint64_t PopcountAvx2(const unsigned char *buf, uint64_t len)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    __m256i v, lo, hi, cnt;
+    uint64_t lanes[4];
+    uint64_t i = 0;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        lo = _mm256_and_si256(v, low);
+        hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+        cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, total);
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + PopcountPopcnt(buf + i, len - i);
+}
+#endif
+
+static uint64_t (*popcount_impl)(const unsigned char *, uint64_t) = NULL;
+static const char *popcount_name = NULL;
+static pthread_once_t popcount_once = PTHREAD_ONCE_INIT;
+
+static void PopcountSelect(void)
+{
+    popcount_impl = PopcountScalar;
+    popcount_name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        popcount_impl = PopcountAvx2;
+        popcount_name = "avx2";
+    } else if (__builtin_cpu_supports("popcnt")) {
+        popcount_impl = PopcountPopcnt;
+        popcount_name = "popcnt";
+    }
+#endif
+}
+
+/*
+ * Count the bits set in len bytes, with the fastest implementation the CPU has
+ */
+uint64_t BitmapPopcount(const unsigned char *buf, uint64_t len)
+{
+    pthread_once(&popcount_once, PopcountSelect);
+    return popcount_impl(buf, len);
+}
+
+/*
+ * Name of the popcount implementation picked at runtime
+ */
+const char *BitmapPopcountImplGet(void)
+{
+    pthread_once(&popcount_once, PopcountSelect);
+    return popcount_name;
+}
+
+/*
+ * Count the bits set in [start, start + count) of a bitmap
+ */
+uint64_t BitmapRangeCount(unsigned char *bitmap, uint64_t start, uint64_t count)
+{
+    uint64_t end = start + count;
+    uint64_t i = start;
+    uint64_t set = 0;
+
+    while (i < end && (i & 7)) {
+        set += (bitmap[i / 8] >> (i & 7)) & 0x1;
+        i++;
+    }
+    if (end - i >= 8) {
+        set += BitmapPopcount(bitmap + i / 8, (end - i) / 8);
+        i += (end - i) / 8 * 8;
+    }
+    while (i < end) {
+        set += (bitmap[i / 8] >> (i & 7)) & 0x1;
+        i++;
+    }
+
+    return set;
+}
+
+/*
+ * Load the 64 bits of a bitmap holding bit i, bits past nbits are not read
+ */
+static uint64_t BitmapWordGet(unsigned char *bitmap, uint64_t i, uint64_t nbits)
+{
+    uint64_t offset = (i / 64) * 8;
+    uint64_t bytes = (nbits + 7) / 8 - offset;
+    uint64_t word = 0;
+
+    memcpy(&word, bitmap + offset, bytes < 8 ? bytes : 8);
+    return le64toh(word);
+}
+
+/*
+ * Find the first bit equal to set in [start, nbits), a word at a time.
+ * Whole words of the other value are skipped, the hit is found with ctz.
+ * Return the bit, or nbits when there is none
+ */
+static uint64_t BitmapFind(unsigned char *bitmap, uint64_t start, uint64_t nbits, bool set)
+{
+    uint64_t i = start;
+    uint64_t word = 0;
+
+    while (i < nbits) {
+        word = BitmapWordGet(bitmap, i, nbits);
+        if (!set) {
+            word = ~word;
+        }
+        word &= ~0ULL << (i & 63);
+        if (word) {
+            i = (i & ~63ULL) + __builtin_ctzll(word);
+            return i < nbits ? i : nbits;
+        }
+        i = (i & ~63ULL) + 64;
+    }
+
+    return nbits;
+}
+
+uint64_t BitmapFindZero(unsigned char *bitmap, uint64_t start, uint64_t nbits)
+{
+    return BitmapFind(bitmap, start, nbits, false);
+}
+
+uint64_t BitmapFindSet(unsigned char *bitmap, uint64_t start, uint64_t nbits)
+{
+    return BitmapFind(bitmap, start, nbits, true);
+}
+
+/* One range clipped to one group */
+struct RangePiece {
+    uint64_t group;
+    uint64_t start;     /* first block */
+    uint64_t len;       /* blocks */
+    uint64_t index;     /* range it belongs to */
+};
+
+static int RangePieceCompare(const void *a, const void *b)
+{
+    const struct RangePiece *x = (const struct RangePiece *)a;
+    const struct RangePiece *y = (const struct RangePiece *)b;
+
+    if (x->group != y->group) {
+        return x->group < y->group ? -1 : 1;
+    }
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Count the blocks in use of a piece against its group's block bitmap
+ */
+static uint64_t RangePieceUsedGet(struct FileSystem *fs, struct RangePiece *piece, unsigned char *bitmap)
+{
+    uint64_t first = fs->super.s_first_data_block;
+    uint64_t bit = BLOCK_TO_BIT(piece->start, first, fs->blocks_per_group, fs->cluster_block_ratio);
+    uint64_t block = 0, used = 0, n = 0;
+
+    if (fs->cluster_block_ratio == 1) {
+        return BitmapRangeCount(bitmap, bit, piece->len);
+    }
+
+    /* bigalloc, one bit stands for a cluster */
+    for (block = piece->start; block < piece->start + piece->len; block += n) {
+        bit = BLOCK_TO_BIT(block, first, fs->blocks_per_group, fs->cluster_block_ratio);
+        n = fs->cluster_block_ratio - (block - first) % fs->cluster_block_ratio;
+        if (n > piece->start + piece->len - block) {
+            n = piece->start + piece->len - block;
+        }
+        if ((bitmap[bit / 8] >> (bit % 8)) & 0x1) {
+            used += n;
+        }
+    }
+    return used;
+}
+
+static void RangeSummaryFill(struct BlockRangeStatus *status, uint64_t len)
+{
+    if (status->invalid > 0) {
+        status->summary = RANGE_ERROR;
+    } else if (status->used == len) {
+        status->summary = RANGE_USED;
+    } else if (status->free == len) {
+        status->summary = RANGE_FREE;
+    } else if (status->uninit == len) {
+        status->summary = RANGE_UNINIT;
+    } else {
+        status->summary = RANGE_MIXED;
+    }
+}
+
+/*
+ * Summarize the allocation state of many block ranges
+ * Ranges are cut at group boundaries and the pieces sorted by group, so
+ * each block bitmap is fetched once, a window of groups at a time.
+ * Groups flagged EXT4_BG_BLOCK_UNINIT are counted as uninit without I/O.
+ * @fs: FileSystem
+ * @ranges: block ranges, each at least one block long and not wrapping
+ * @count: number of ranges
+ * @status: filled with one summary per range
+ * Return 0 on success, -1 if a range is malformed or the batch could not
+ * be run at all
+ */
+int BlockRangeStatusGet(struct FileSystem *fs, struct BlockRange *ranges, uint64_t count, struct BlockRangeStatus *status)
+{
+    struct RangePiece *pieces = NULL;
+    uint64_t *groups = NULL;
+    uint64_t nr_pieces = 0, capacity = 0;
+    uint64_t window = 0, nr_groups = 0, nr_seen = 0;
+    uint64_t first = 0, start = 0, end = 0, group_end = 0;
+    uint64_t i = 0, j = 0, k = 0, group = 0, last = 0, used = 0;
+    unsigned char *bitmap = NULL;
+    bool uninit = false;
+    int ret = 0;
+
+    if (fs == NULL || ranges == NULL || status == NULL) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (ranges[i].len == 0 || ranges[i].start + ranges[i].len < ranges[i].start) {
+            printf("BlockRangeStatusGet: bad range %llu+%llu\n", ranges[i].start, ranges[i].len);
+            return -1;
+        }
+    }
+    first = fs->super.s_first_data_block;
+    memset(status, 0, sizeof(struct BlockRangeStatus) * count);
+
+    /* Cut every range at group boundaries, blocks outside the filesystem are invalid */
+    for (i = 0; i < count; i++) {
+        start = ranges[i].start < first ? first : ranges[i].start;
+        end = ranges[i].start + ranges[i].len;
+        if (end > fs->block_count) {
+            end = fs->block_count;
+        }
+        if (start >= end) {
+            status[i].invalid = ranges[i].len;
+            continue;
+        }
+        status[i].invalid = ranges[i].len - (end - start);
+        while (start < end) {
+            group = BLOCK_TO_GROUP(start, first, fs->blocks_per_group);
+            group_end = first + (group + 1) * fs->blocks_per_group;
+            if (ArrayReserve((void **)&pieces, &capacity, nr_pieces, sizeof(struct RangePiece), 1) < 0) {
+                ret = -1;
+                goto end;
+            }
+            pieces[nr_pieces].group = group;
+            pieces[nr_pieces].start = start;
+            pieces[nr_pieces].len = (group_end < end ? group_end : end) - start;
+            pieces[nr_pieces].index = i;
+            nr_pieces++;
+            start += pieces[nr_pieces - 1].len;
+        }
+    }
+    qsort(pieces, nr_pieces, sizeof(struct RangePiece), RangePieceCompare);
+
+    window = fs->bitmap_cache->capacity / 2;
+    if (window == 0) {
+        window = 1;
+    }
+    groups = (uint64_t *) malloc(sizeof(uint64_t) * window);
+    if (groups == NULL) {
+        ret = -1;
+        goto end;
+    }
+
+    for (i = 0; i < nr_pieces; ) {
+        /* Pieces i ~ j-1 cover the next window of groups, prefetch their bitmaps */
+        nr_groups = 0;
+        nr_seen = 0;
+        for (j = i; j < nr_pieces; j++) {
+            if (nr_seen > 0 && pieces[j].group == last) {
+                continue;
+            }
+            if (nr_seen == window) {
+                break;
+            }
+            nr_seen++;
+            last = pieces[j].group;
+            if (!(GroupFlagsGet(fs, last) & EXT4_BG_BLOCK_UNINIT)) {
+                groups[nr_groups++] = last;
+            }
+        }
+        BitmapPrefetch(fs, BITMAP_BLOCK, groups, nr_groups);
+
+        for (; i < j; i = k) {
+            group = pieces[i].group;
+            uninit = GroupFlagsGet(fs, group) & EXT4_BG_BLOCK_UNINIT;
+            bitmap = uninit ? NULL : (unsigned char *)BitmapGet(fs, BITMAP_BLOCK, group);
+            for (k = i; k < j && pieces[k].group == group; k++) {
+                if (uninit) {
+                    status[pieces[k].index].uninit += pieces[k].len;
+                } else if (bitmap == NULL) {
+                    status[pieces[k].index].invalid += pieces[k].len;
+                } else {
+                    used = RangePieceUsedGet(fs, &pieces[k], bitmap);
+                    status[pieces[k].index].used += used;
+                    status[pieces[k].index].free += pieces[k].len - used;
+                }
+            }
+            if (bitmap != NULL) {
+                BitmapPut(fs, BITMAP_BLOCK, group);
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        RangeSummaryFill(&status[i], ranges[i].len);
+    }
+
+end:
+    free(pieces);
+    free(groups);
+    return ret;
+}
+
+/*
+ * Batch variant of BlockStatusGetBynum
+ * @status: filled with one status per block, as BlockStatusGetBynum returns
+ */
+int BlockStatusGetBatch(struct FileSystem *fs, uint64_t *nums, uint64_t count, int *status)
+{
+    struct BlockRange *ranges = NULL;
+    struct BlockRangeStatus *summaries = NULL;
+    uint64_t i = 0;
+    int ret = 0;
+
+    if (fs == NULL || nums == NULL || status == NULL) {
+        return -1;
+    }
+
+    ranges = (struct BlockRange *) malloc(sizeof(struct BlockRange) * (count ? count : 1));
+    summaries = (struct BlockRangeStatus *) malloc(sizeof(struct BlockRangeStatus) * (count ? count : 1));
+    if (ranges == NULL || summaries == NULL) {
+        ret = -1;
+        goto end;
+    }
+    for (i = 0; i < count; i++) {
+        ranges[i].start = nums[i];
+        ranges[i].len = 1;
+    }
+
+    ret = BlockRangeStatusGet(fs, ranges, count, summaries);
+    if (ret == 0) {
+        for (i = 0; i < count; i++) {
+            status[i] = summaries[i].summary;
+        }
+    }
+
+end:
+    free(ranges);
+    free(summaries);
+    return ret;
+}
@@ -0,0 +1,77 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include "filesystem.h"
+#include "lru.h"
+
+/* Bitmap types */
+#define BITMAP_INODE    0
+#define BITMAP_BLOCK    1
+
+/* Default number of bitmap blocks kept by the cache */
+#define BITMAP_CACHE_ENTRIES    1024
+
+/* Most bitmap blocks read at once by BitmapPrefetch */
+#define BITMAP_PREFETCH_BLOCKS  64
+
+/* Summary of a block range, the single block states plus RANGE_MIXED */
+#define RANGE_ERROR     -1  /* some blocks are outside the filesystem or unreadable */
+#define RANGE_FREE      0
+#define RANGE_USED      1
+#define RANGE_UNINIT    2   /* all blocks in EXT4_BG_BLOCK_UNINIT groups */
+#define RANGE_MIXED     3
+
+struct BlockRange {
+    uint64_t start;
+    uint64_t len;
+};
+
+struct BlockRangeStatus {
+    uint64_t used;
+    uint64_t free;
+    uint64_t uninit;    /* blocks in EXT4_BG_BLOCK_UNINIT groups, not read */
+    uint64_t invalid;
+    int summary;        /* RANGE_* */
+};
+
+struct BitmapCacheEntry {
+    int type;
+    uint64_t group;
+    uint32_t refs;          /* users holding data, see BitmapGet */
+    bool ready;             /* data is loaded */
+    bool failed;            /* load failed, entry is already unlinked */
+    char *data;
+    struct LruNode lru;             /* most recently used first */
+    struct BitmapCacheEntry *hnext; /* hash chain */
+};
+
+struct BitmapCache {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t bucket_count;
+    struct BitmapCacheEntry **buckets;
+    struct LruList lru;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+int BitmapCacheInit(struct FileSystem *, uint64_t);
+void BitmapCacheRelease(struct FileSystem *);
+void BitmapCachePrint(struct FileSystem *);
+char *BitmapGet(struct FileSystem *, int, uint64_t);
+void BitmapPut(struct FileSystem *, int, uint64_t);
+int64_t BitmapPrefetch(struct FileSystem *, int, uint64_t *, uint64_t);
+
+int InodeStatusGetBatch(struct FileSystem *, uint64_t *, uint64_t, int *);
+uint64_t BitmapPopcount(const unsigned char *, uint64_t);
+const char *BitmapPopcountImplGet(void);
+uint64_t BitmapRangeCount(unsigned char *, uint64_t, uint64_t);
+uint64_t BitmapFindZero(unsigned char *, uint64_t, uint64_t);
+uint64_t BitmapFindSet(unsigned char *, uint64_t, uint64_t);
+int BlockRangeStatusGet(struct FileSystem *, struct BlockRange *, uint64_t, struct BlockRangeStatus *);
+int BlockStatusGetBatch(struct FileSystem *, uint64_t *, uint64_t, int *);
+
+#endif /* BITMAP_H */
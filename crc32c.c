@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <endian.h>
+
+#include "crc32c.h"
+
+static uint32_t crc32c_table[8][256];
+
+static void Crc32cTableInit(void)
+{
+    uint32_t crc = 0;
+    int i = 0, j = 0;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        crc = crc32c_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[j][i] = crc;
+        }
+    }
+}
+
+/*
+ * Slice-by-8, eight table lookups per 8 bytes
+ */
+static uint32_t Crc32cScalar(uint32_t crc, const unsigned char *buf, uint64_t len)
+{
+    uint64_t i = 0, word = 0;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, buf + i, sizeof(uint64_t));
+        word = le64toh(word) ^ crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+    }
+    for (; i < len; i++) {
+        crc = crc32c_table[0][(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cSse42(uint32_t crc, const unsigned char *buf, uint64_t len)
+{
+    uint64_t i = 0, word = 0, crc64 = crc;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, buf + i, sizeof(uint64_t));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; i < len; i++) {
+        crc = _mm_crc32_u8(crc, buf[i]);
+    }
+    return crc;
+}
+#endif
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+__attribute__((target("+crc")))
+static uint32_t Crc32cArm(uint32_t crc, const unsigned char *buf, uint64_t len)
+{
+    uint64_t i = 0, word = 0;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, buf + i, sizeof(uint64_t));
+        crc = __crc32cd(crc, word);
+    }
+    for (; i < len; i++) {
+        crc = __crc32cb(crc, buf[i]);
+    }
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t, const unsigned char *, uint64_t) = NULL;
+static const char *crc32c_name = NULL;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void Crc32cSelect(void)
+{
+    Crc32cTableInit();
+    crc32c_impl = Crc32cScalar;
+    crc32c_name = "slice-by-8";
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = Crc32cSse42;
+        crc32c_name = "sse4.2";
+    }
+#endif
+#if defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_impl = Crc32cArm;
+        crc32c_name = "armv8-crc";
+    }
+#endif
+}
+
+/*
+ * Go on with the crc32c checksum crc over len bytes, with the fastest
+ * implementation the CPU has
+ */
+uint32_t Crc32c(uint32_t crc, const void *buf, uint64_t len)
+{
+    pthread_once(&crc32c_once, Crc32cSelect);
+    return crc32c_impl(crc, (const unsigned char *)buf, len);
+}
+
+/*
+ * Name of the crc32c implementation picked at runtime
+ */
+const char *Crc32cImplGet(void)
+{
+    pthread_once(&crc32c_once, Crc32cSelect);
+    return crc32c_name;
+}
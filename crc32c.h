@@ -0,0 +1,17 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+
+/* Castagnoli polynomial, reflected */
+#define CRC32C_POLY     0x82F63B78U
+
+/*
+ * Crc32c follows the kernel crc32c_le: the caller passes the seed, ~0 to
+ * start a fresh checksum, and no final inversion is applied. This is what
+ * ext4 stores, and it lets a checksum go on over several buffers.
+ */
+uint32_t Crc32c(uint32_t, const void *, uint64_t);
+const char *Crc32cImplGet(void);
+
+#endif /* CRC32C_H */
@@ -0,0 +1,759 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <endian.h>
+
+#include "csum.h"
+#include "crc32c.h"
+#include "scan.h"
+#include "extent.h"
+#include "dir.h"
+#include "indirect.h"
+#include "workpool.h"
+#include "ext4_htree.h"
+
+static const char *csum_kind_names[CSUM_KINDS] = {
+    "superblock", "descriptor", "block bitmap", "inode bitmap", "inode",
+    "extent block", "directory block", "htree block", "xattr block"
+};
+
+/* Descriptor size needed for the high halves of the bitmap checksums */
+#define BLOCK_BITMAP_CSUM_HI_END    (offsetof(struct ext4_group_desc, bg_block_bitmap_csum_hi) + sizeof(uint16_t))
+#define INODE_BITMAP_CSUM_HI_END    (offsetof(struct ext4_group_desc, bg_inode_bitmap_csum_hi) + sizeof(uint16_t))
+
+/*
+ * What one worker found, only it touches it so no lock is needed
+ */
+struct ChecksumWorker {
+    uint64_t checked[CSUM_KINDS];
+    uint64_t bad[CSUM_KINDS];
+    uint64_t missing[CSUM_KINDS];
+    uint64_t unreadable;
+    uint64_t bytes;
+    uint64_t error_count;   /* kept in errors, at most CSUM_ERRORS_KEPT */
+    uint64_t error_capacity;
+    struct ChecksumError *errors;
+    uint64_t group;         /* being checked */
+    char *scan;             /* inode scan buffer */
+    char *blocks;           /* CSUM_READ_BLOCKS blocks */
+};
+
+struct ChecksumContext {
+    struct FileSystem *fs;
+    struct ChecksumWorker *workers;
+};
+
+static bool MetadataCsumHas(struct FileSystem *fs)
+{
+    return HAS_RO_COMPAT_FEATURE(fs->super, EXT4_FEATURE_RO_COMPAT_METADATA_CSUM);
+}
+
+/*
+ * crc16 of lib/crc16.c, polynomial 0x8005 reflected, for GDT_CSUM descriptors
+ */
+static uint16_t Crc16(uint16_t crc, const void *buf, uint64_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    uint64_t i = 0;
+    int j = 0;
+
+    for (i = 0; i < len; i++) {
+        crc ^= p[i];
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xA001 : 0);
+        }
+    }
+    return crc;
+}
+
+/*
+ * Checksum of the superblock, over everything in front of s_checksum
+ */
+uint32_t SuperBlockChecksumGet(struct ext4_super_block *sb)
+{
+    return Crc32c(~0U, sb, offsetof(struct ext4_super_block, s_checksum));
+}
+
+/*
+ * Checksum of a group descriptor, as stored in bg_checksum
+ * @group: group number, part of the checksum
+ * @pdesc: the descriptor, descriptor_size bytes
+ */
+uint16_t DescriptorChecksumGet(struct FileSystem *fs, uint64_t group, struct ext4_group_desc *pdesc)
+{
+    uint64_t offset = offsetof(struct ext4_group_desc, bg_checksum);
+    uint32_t le_group = htole32(group);
+    uint16_t zero = 0;
+    uint32_t crc = 0;
+    uint16_t crc16 = 0;
+
+    if (MetadataCsumHas(fs)) {
+        crc = Crc32c(fs->csum_seed, &le_group, sizeof(le_group));
+        crc = Crc32c(crc, pdesc, offset);
+        crc = Crc32c(crc, &zero, sizeof(zero));
+        offset += sizeof(zero);
+        if (offset < fs->descriptor_size) {
+            crc = Crc32c(crc, (char *)pdesc + offset, fs->descriptor_size - offset);
+        }
+        return crc & 0xFFFF;
+    }
+
+    crc16 = Crc16(~0, fs->super.s_uuid, sizeof(fs->super.s_uuid));
+    crc16 = Crc16(crc16, &le_group, sizeof(le_group));
+    crc16 = Crc16(crc16, pdesc, offset);
+    offset += sizeof(zero);
+    if (HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_64BIT) && offset < fs->descriptor_size) {
+        crc16 = Crc16(crc16, (char *)pdesc + offset, fs->descriptor_size - offset);
+    }
+    return crc16;
+}
+
+/*
+ * Checksum of a bitmap, the descriptor keeps its low 16 bits and, when
+ * large enough, the high 16 bits
+ * @size: bytes covered, a group's worth of bits
+ */
+uint32_t BitmapChecksumGet(struct FileSystem *fs, char *bitmap, uint64_t size)
+{
+    return Crc32c(fs->csum_seed, bitmap, size);
+}
+
+/*
+ * Seed of the checksums of an inode and of the blocks only it owns
+ */
+uint32_t InodeChecksumSeedGet(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode)
+{
+    uint32_t le_num = htole32(num);
+    uint32_t crc = 0;
+
+    crc = Crc32c(fs->csum_seed, &le_num, sizeof(le_num));
+    return Crc32c(crc, &pinode->i_generation, sizeof(pinode->i_generation));
+}
+
+static bool InodeChecksumHiFits(struct FileSystem *fs, struct ext4_inode *pinode)
+{
+    return le16toh(fs->super.s_inode_size) > EXT4_GOOD_OLD_INODE_SIZE &&
+        EXT4_GOOD_OLD_INODE_SIZE + le16toh(pinode->i_extra_isize) >=
+        offsetof(struct ext4_inode, i_checksum_hi) + sizeof(pinode->i_checksum_hi);
+}
+
+/*
+ * Checksum of an inode over s_inode_size bytes with both checksum fields
+ * as zero. Only the low 16 bits are stored when i_checksum_hi does not fit.
+ */
+uint32_t InodeChecksumGet(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode)
+{
+    const char *raw = (const char *)pinode;
+    uint64_t size = le16toh(fs->super.s_inode_size);
+    uint64_t offset = offsetof(struct ext4_inode, osd2.linux2.l_i_checksum_lo);
+    uint16_t zero = 0;
+    uint32_t crc = InodeChecksumSeedGet(fs, num, pinode);
+
+    crc = Crc32c(crc, raw, offset);
+    crc = Crc32c(crc, &zero, sizeof(zero));
+    offset += sizeof(zero);
+    crc = Crc32c(crc, raw + offset, EXT4_GOOD_OLD_INODE_SIZE - offset);
+    if (size > EXT4_GOOD_OLD_INODE_SIZE) {
+        offset = offsetof(struct ext4_inode, i_checksum_hi);
+        crc = Crc32c(crc, raw + EXT4_GOOD_OLD_INODE_SIZE, offset - EXT4_GOOD_OLD_INODE_SIZE);
+        if (InodeChecksumHiFits(fs, pinode)) {
+            crc = Crc32c(crc, &zero, sizeof(zero));
+            offset += sizeof(zero);
+        }
+        crc = Crc32c(crc, raw + offset, size - offset);
+    }
+    return crc;
+}
+
+/*
+ * Store the checksums of metadata about to be written. Nothing is stored
+ * where the filesystem keeps no checksum.
+ * Return true if a checksum was stored
+ */
+bool SuperBlockChecksumSet(struct FileSystem *fs, struct ext4_super_block *sb)
+{
+    if (!MetadataCsumHas(fs)) {
+        return false;
+    }
+    sb->s_checksum = htole32(SuperBlockChecksumGet(sb));
+    return true;
+}
+
+bool DescriptorChecksumSet(struct FileSystem *fs, uint64_t group, struct ext4_group_desc *pdesc)
+{
+    if (!MetadataCsumHas(fs) && !HAS_RO_COMPAT_FEATURE(fs->super, EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) {
+        return false;
+    }
+    pdesc->bg_checksum = htole16(DescriptorChecksumGet(fs, group, pdesc));
+    return true;
+}
+
+bool BlockBitmapChecksumSet(struct FileSystem *fs, struct ext4_group_desc *pdesc, char *bitmap)
+{
+    uint32_t crc = 0;
+
+    if (!MetadataCsumHas(fs)) {
+        return false;
+    }
+    crc = BitmapChecksumGet(fs, bitmap, le32toh(fs->super.s_clusters_per_group) / 8);
+    pdesc->bg_block_bitmap_csum_lo = htole16(crc & 0xFFFF);
+    if (fs->descriptor_size >= BLOCK_BITMAP_CSUM_HI_END) {
+        pdesc->bg_block_bitmap_csum_hi = htole16(crc >> 16);
+    }
+    return true;
+}
+
+bool InodeBitmapChecksumSet(struct FileSystem *fs, struct ext4_group_desc *pdesc, char *bitmap)
+{
+    uint32_t crc = 0;
+
+    if (!MetadataCsumHas(fs)) {
+        return false;
+    }
+    crc = BitmapChecksumGet(fs, bitmap, fs->inodes_per_group / 8);
+    pdesc->bg_inode_bitmap_csum_lo = htole16(crc & 0xFFFF);
+    if (fs->descriptor_size >= INODE_BITMAP_CSUM_HI_END) {
+        pdesc->bg_inode_bitmap_csum_hi = htole16(crc >> 16);
+    }
+    return true;
+}
+
+/*
+ * @pinode: s_inode_size bytes
+ */
+bool InodeChecksumSet(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode)
+{
+    uint32_t crc = 0;
+
+    if (!MetadataCsumHas(fs)) {
+        return false;
+    }
+    crc = InodeChecksumGet(fs, num, pinode);
+    pinode->osd2.linux2.l_i_checksum_lo = htole16(crc & 0xFFFF);
+    if (InodeChecksumHiFits(fs, pinode)) {
+        pinode->i_checksum_hi = htole16(crc >> 16);
+    }
+    return true;
+}
+
+/*
+ * Find the tail of an extent tree block and compute its checksum
+ * @seed: InodeChecksumSeedGet of the owner
+ * @computed: set to the checksum the tail should hold
+ * Return the checksum in the tail, NULL when eh_max leaves no room for it
+ */
+uint32_t *ExtentBlockChecksumLocate(struct FileSystem *fs, uint32_t seed, char *block, uint32_t *computed)
+{
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)block;
+    uint64_t offset = EXT4_EXTENT_TAIL_OFFSET(eh);
+
+    if (offset + sizeof(struct ext4_extent_tail) > fs->block_size) {
+        return NULL;
+    }
+    *computed = Crc32c(seed, block, offset);
+    return (uint32_t *)(block + offset);
+}
+
+/*
+ * Find the checksum of a directory block and compute it
+ * @seed: InodeChecksumSeedGet of the directory
+ * @dx: the block is an htree root or interior node, see ChecksumDirBlock
+ * @computed: set to the checksum the block should hold
+ * Return the stored checksum, NULL when the block has no tail or no room for one
+ */
+uint32_t *DirBlockChecksumLocate(struct FileSystem *fs, uint32_t seed, char *block, bool dx, uint32_t *computed)
+{
+    struct ext4_dir_entry_tail *tail = NULL;
+    struct fake_dirent *fake = (struct fake_dirent *)block;
+    struct dx_root_info *info = NULL;
+    struct dx_countlimit *c = NULL;
+    struct dx_tail *dt = NULL;
+    uint64_t count_offset = 0, limit = 0, count = 0;
+    uint32_t zero = 0;
+
+    if (!dx) {
+        tail = (struct ext4_dir_entry_tail *)(block + fs->block_size - sizeof(struct ext4_dir_entry_tail));
+        if (tail->det_reserved_zero1 != 0 || le16toh(tail->det_rec_len) != sizeof(struct ext4_dir_entry_tail) ||
+                tail->det_reserved_zero2 != 0 || tail->det_reserved_ft != 0xDE) {
+            return NULL;
+        }
+        *computed = Crc32c(seed, block, fs->block_size - sizeof(struct ext4_dir_entry_tail));
+        return &tail->det_checksum;
+    }
+
+    /* An interior node has one fake entry over the block, the root "." and ".." */
+    if (DirRecLenGet(fs, fake->rec_len) == fs->block_size) {
+        count_offset = sizeof(struct fake_dirent);
+    } else if (DirRecLenGet(fs, fake->rec_len) == 12) {
+        fake = (struct fake_dirent *)(block + 12);
+        info = (struct dx_root_info *)(block + 24);
+        if (DirRecLenGet(fs, fake->rec_len) != fs->block_size - 12 || info->reserved_zero != 0 ||
+                info->info_length != sizeof(struct dx_root_info)) {
+            return NULL;
+        }
+        count_offset = 24 + sizeof(struct dx_root_info);
+    } else {
+        return NULL;
+    }
+    c = (struct dx_countlimit *)(block + count_offset);
+    limit = le16toh(c->limit);
+    count = le16toh(c->count);
+    if (count_offset + limit * sizeof(struct dx_entry) > fs->block_size - sizeof(struct dx_tail)) {
+        return NULL;
+    }
+    if (count > limit) {
+        count = limit;
+    }
+    dt = (struct dx_tail *)(block + count_offset + limit * sizeof(struct dx_entry));
+    *computed = Crc32c(seed, block, count_offset + count * sizeof(struct dx_entry));
+    *computed = Crc32c(*computed, &dt->dt_reserved, sizeof(dt->dt_reserved));
+    *computed = Crc32c(*computed, &zero, sizeof(zero));
+    return &dt->dt_checksum;
+}
+
+/*
+ * Checksum of an xattr block, seeded with its block number since it may be shared
+ */
+uint32_t XattrBlockChecksumGet(struct FileSystem *fs, uint64_t blocknr, char *block)
+{
+    uint64_t le_block = htole64(blocknr);
+    uint64_t offset = offsetof(struct ext4_xattr_header, h_checksum);
+    uint32_t zero = 0;
+    uint32_t crc = 0;
+
+    crc = Crc32c(fs->csum_seed, &le_block, sizeof(le_block));
+    crc = Crc32c(crc, block, offset);
+    crc = Crc32c(crc, &zero, sizeof(zero));
+    offset += sizeof(zero);
+    return Crc32c(crc, block + offset, fs->block_size - offset);
+}
+
+static void ChecksumErrorAdd(struct ChecksumWorker *w, uint32_t kind, uint64_t inode, uint64_t block,
+        uint32_t stored, uint32_t computed)
+{
+    struct ChecksumError *err = NULL;
+
+    /* Only counted when memory runs out */
+    if (w->error_count == CSUM_ERRORS_KEPT ||
+            ArrayReserve((void **)&w->errors, &w->error_capacity, w->error_count, sizeof(struct ChecksumError), 1) < 0) {
+        return;
+    }
+    err = &(w->errors[w->error_count++]);
+    err->kind = kind;
+    err->group = w->group;
+    err->inode = inode;
+    err->block = block;
+    err->stored = stored;
+    err->computed = computed;
+}
+
+static void ChecksumCompare(struct ChecksumWorker *w, uint32_t kind, uint64_t inode, uint64_t block,
+        uint32_t stored, uint32_t computed)
+{
+    w->checked[kind]++;
+    if (stored != computed) {
+        w->bad[kind]++;
+        ChecksumErrorAdd(w, kind, inode, block, stored, computed);
+    }
+}
+
+static void ChecksumMissing(struct ChecksumWorker *w, uint32_t kind, uint64_t inode, uint64_t block)
+{
+    w->missing[kind]++;
+    ChecksumErrorAdd(w, kind, inode, block, 0, 0);
+}
+
+/*
+ * Check one directory block, htree nodes are told apart the way the kernel
+ * does: block 0 of an indexed directory, or a block with one entry over it
+ */
+static void ChecksumDirBlock(struct FileSystem *fs, struct ChecksumWorker *w, uint64_t num, uint32_t seed,
+        bool indexed, uint32_t logical, uint64_t physical, char *block)
+{
+    struct fake_dirent *fake = (struct fake_dirent *)block;
+    bool dx = indexed && (logical == 0 || DirRecLenGet(fs, fake->rec_len) == fs->block_size);
+    uint32_t kind = dx ? CSUM_DX : CSUM_DIR;
+    uint32_t computed = 0;
+    uint32_t *stored = DirBlockChecksumLocate(fs, seed, block, dx, &computed);
+
+    if (stored == NULL) {
+        ChecksumMissing(w, kind, num, physical);
+        return;
+    }
+    w->bytes += fs->block_size;
+    ChecksumCompare(w, kind, num, physical, le32toh(*stored), computed);
+}
+
+/*
+ * Check the nodes below an extent tree node, depth first. A node is checked
+ * before its children are trusted, so a corrupted pointer still shows up as
+ * a mismatch of the node holding it.
+ * @eh: the node, in the inode or in w->blocks
+ * @level: of eh below the inode, its children are read into block level of w->blocks
+ * @return: -1 when some nodes could not be read
+ */
+static int ChecksumExtentTree(struct FileSystem *fs, struct ChecksumWorker *w, uint64_t num, uint32_t seed,
+        struct ext4_extent_header *eh, uint64_t level)
+{
+    struct ext4_extent_idx *idx = NULL;
+    struct ext4_extent_header *child = NULL;
+    uint64_t i = 0, entries = le16toh(eh->eh_entries), depth = le16toh(eh->eh_depth);
+    uint64_t block = 0;
+    uint32_t computed = 0;
+    uint32_t *stored = NULL;
+    int ret = 0;
+
+    if (le16toh(eh->eh_magic) != EXT4_EXT_MAGIC || depth == 0 || level >= CSUM_READ_BLOCKS ||
+            entries > le16toh(eh->eh_max)) {
+        return 0;
+    }
+    for (i = 0; i < entries; i++) {
+        idx = (struct ext4_extent_idx *)((char *)eh + sizeof(struct ext4_extent_header)) + i;
+        block = (uint64_t)le32toh(idx->ei_leaf_lo) | (uint64_t)le16toh(idx->ei_leaf_hi) << 32;
+        if (block >= fs->block_count || BlockRead(fs, block, 1, w->blocks + level * fs->block_size) == 0) {
+            ret = -1;
+            continue;
+        }
+        child = (struct ext4_extent_header *)(w->blocks + level * fs->block_size);
+        stored = ExtentBlockChecksumLocate(fs, seed, (char *)child, &computed);
+        if (stored == NULL) {
+            ChecksumMissing(w, CSUM_EXTENT, num, block);
+            continue;
+        }
+        w->bytes += fs->block_size;
+        w->checked[CSUM_EXTENT]++;
+        if (le32toh(*stored) != computed) {
+            w->bad[CSUM_EXTENT]++;
+            ChecksumErrorAdd(w, CSUM_EXTENT, num, block, le32toh(*stored), computed);
+            continue;
+        }
+        if (le16toh(child->eh_depth) + 1 == depth && ChecksumExtentTree(fs, w, num, seed, child, level + 1) < 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Check the blocks of a directory
+ * @return: -1 when some blocks could not be read
+ */
+static int ChecksumDirBlocks(struct FileSystem *fs, struct ChecksumWorker *w, uint64_t num,
+        struct ext4_inode *pinode, uint32_t seed)
+{
+    struct ExtentMap map;
+    struct ExtentRecord *rec = NULL;
+    uint32_t flags = le32toh(pinode->i_flags);
+    uint64_t i = 0, j = 0, k = 0, n = 0, len = 0;
+    int ret = 0;
+
+    if (flags & EXT4_EXTENTS_FL) {
+        ret = ExtentMapBuild(fs, num, pinode, &map);
+    } else {
+        ret = IndirectMapBuild(fs, num, pinode, &map);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+    for (i = 0; i < map.count; i++) {
+        rec = &(map.records[i]);
+        len = EXTENT_RECORD_LEN(rec);
+        if (rec->len & EXTENT_RECORD_UNWRITTEN) {
+            continue;
+        }
+        for (j = 0; j < len; j += n) {
+            n = len - j;
+            if (n > CSUM_READ_BLOCKS) {
+                n = CSUM_READ_BLOCKS;
+            }
+            if (rec->physical + j + n > fs->block_count || BlockRead(fs, rec->physical + j, n, w->blocks) == 0) {
+                ret = -1;
+                continue;
+            }
+            for (k = 0; k < n; k++) {
+                ChecksumDirBlock(fs, w, num, seed, (flags & EXT4_INDEX_FL) != 0, rec->logical + j + k,
+                        rec->physical + j + k, w->blocks + k * fs->block_size);
+            }
+        }
+    }
+    ExtentMapRelease(&map);
+    return ret;
+}
+
+/*
+ * InodeScanFunc checking an inode, its xattr block and the blocks it owns
+ */
+static int ChecksumInode(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode, void *arg)
+{
+    struct ChecksumWorker *w = (struct ChecksumWorker *)arg;
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)pinode->i_block;
+    uint32_t flags = le32toh(pinode->i_flags);
+    uint16_t mode = le16toh(pinode->i_mode) & 0xF000;
+    uint32_t stored = le16toh(pinode->osd2.linux2.l_i_checksum_lo);
+    uint32_t computed = InodeChecksumGet(fs, num, pinode);
+    uint32_t seed = 0;
+    uint64_t acl = 0;
+    bool failed = false;
+
+    w->bytes += le16toh(fs->super.s_inode_size);
+    if (InodeChecksumHiFits(fs, pinode)) {
+        stored |= (uint32_t)le16toh(pinode->i_checksum_hi) << 16;
+    } else {
+        computed &= 0xFFFF;
+    }
+    ChecksumCompare(w, CSUM_INODE, num, 0, stored, computed);
+
+    acl = (uint64_t)le32toh(pinode->i_file_acl_lo) | (uint64_t)le16toh(pinode->osd2.linux2.l_i_file_acl_high) << 32;
+    if (acl != 0 && acl < fs->block_count) {
+        if (BlockRead(fs, acl, 1, w->blocks) == 0) {
+            failed = true;
+        } else {
+            w->bytes += fs->block_size;
+            ChecksumCompare(w, CSUM_XATTR, num, acl,
+                    le32toh(((struct ext4_xattr_header *)w->blocks)->h_checksum),
+                    XattrBlockChecksumGet(fs, acl, w->blocks));
+        }
+    }
+
+    /* Only extent trees deeper than the inode and directories have checksummed blocks */
+    seed = InodeChecksumSeedGet(fs, num, pinode);
+    if ((flags & EXT4_EXTENTS_FL) && ChecksumExtentTree(fs, w, num, seed, eh, 0) < 0) {
+        failed = true;
+    }
+    if (!(flags & EXT4_INLINE_DATA_FL) && mode == 0x4000 && ChecksumDirBlocks(fs, w, num, pinode, seed) < 0) {
+        failed = true;
+    }
+    if (failed) {
+        w->unreadable++;
+    }
+    return 0;
+}
+
+static int ChecksumWork(struct WorkPool *pool, int worker, uint64_t group, void *data)
+{
+    struct ChecksumContext *ctx = (struct ChecksumContext *)data;
+    struct FileSystem *fs = ctx->fs;
+    struct ChecksumWorker *w = &ctx->workers[worker];
+    struct ext4_group_desc *pdesc = GroupDescriptorGet(fs, group);
+    uint16_t bg_flags = 0;
+    uint32_t stored = 0, computed = 0;
+
+    if (pdesc == NULL) {
+        printf("ChecksumWork: read descriptor of group %llu failed\n", group);
+        return -1;
+    }
+    w->group = group;
+    w->bytes += fs->descriptor_size;
+    ChecksumCompare(w, CSUM_DESCRIPTOR, 0, 0, le16toh(pdesc->bg_checksum), DescriptorChecksumGet(fs, group, pdesc));
+    if (!MetadataCsumHas(fs)) {
+        return 0;
+    }
+
+    bg_flags = le16toh(pdesc->bg_flags);
+    if (!(bg_flags & EXT4_BG_BLOCK_UNINIT)) {
+        if (BlockRead(fs, BlockBitmapLocationGet(fs, pdesc), 1, w->blocks) == 0) {
+            printf("ChecksumWork: read block bitmap of group %llu failed\n", group);
+            return -1;
+        }
+        stored = le16toh(pdesc->bg_block_bitmap_csum_lo);
+        computed = BitmapChecksumGet(fs, w->blocks, le32toh(fs->super.s_clusters_per_group) / 8);
+        if (fs->descriptor_size >= BLOCK_BITMAP_CSUM_HI_END) {
+            stored |= (uint32_t)le16toh(pdesc->bg_block_bitmap_csum_hi) << 16;
+        } else {
+            computed &= 0xFFFF;
+        }
+        w->bytes += le32toh(fs->super.s_clusters_per_group) / 8;
+        ChecksumCompare(w, CSUM_BLOCK_BITMAP, 0, BlockBitmapLocationGet(fs, pdesc), stored, computed);
+    }
+    if (!(bg_flags & EXT4_BG_INODE_UNINIT)) {
+        if (BlockRead(fs, InodeBitmapLocationGet(fs, pdesc), 1, w->blocks) == 0) {
+            printf("ChecksumWork: read inode bitmap of group %llu failed\n", group);
+            return -1;
+        }
+        stored = le16toh(pdesc->bg_inode_bitmap_csum_lo);
+        computed = BitmapChecksumGet(fs, w->blocks, fs->inodes_per_group / 8);
+        if (fs->descriptor_size >= INODE_BITMAP_CSUM_HI_END) {
+            stored |= (uint32_t)le16toh(pdesc->bg_inode_bitmap_csum_hi) << 16;
+        } else {
+            computed &= 0xFFFF;
+        }
+        w->bytes += fs->inodes_per_group / 8;
+        ChecksumCompare(w, CSUM_INODE_BITMAP, 0, InodeBitmapLocationGet(fs, pdesc), stored, computed);
+    }
+
+    return InodeScanGroup(fs, group, SCAN_INUSE_ONLY, w->scan, ChecksumInode, w);
+}
+
+static int ChecksumErrorCompare(const void *a, const void *b)
+{
+    const struct ChecksumError *x = (const struct ChecksumError *)a;
+    const struct ChecksumError *y = (const struct ChecksumError *)b;
+
+    if (x->group != y->group) {
+        return x->group < y->group ? -1 : 1;
+    }
+    if (x->inode != y->inode) {
+        return x->inode < y->inode ? -1 : 1;
+    }
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+    return (int)x->kind - (int)y->kind;
+}
+
+/*
+ * Verify the checksums of all metadata, the groups are spread over the workers.
+ * Without METADATA_CSUM only GDT_CSUM descriptor checksums exist.
+ * @nr_workers: threads, 0 for one per CPU
+ * @report: filled with the counts and the mismatches, release with ChecksumReportRelease
+ */
+int ChecksumAudit(struct FileSystem *fs, int nr_workers, struct ChecksumReport *report)
+{
+    struct ChecksumContext ctx;
+    struct ChecksumWorker *w = NULL;
+    struct ChecksumWorker super;
+    struct timespec begin, end;
+    uint64_t *groups = NULL;
+    uint64_t i = 0, capacity = 0;
+    int k = 0;
+    int ret = -1;
+
+    if (fs == NULL || report == NULL) {
+        return -1;
+    }
+    memset(report, 0, sizeof(struct ChecksumReport));
+    memset(&ctx, 0, sizeof(struct ChecksumContext));
+    memset(&super, 0, sizeof(struct ChecksumWorker));
+    if (!MetadataCsumHas(fs) && !HAS_RO_COMPAT_FEATURE(fs->super, EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) {
+        printf("ChecksumAudit: the filesystem has no metadata checksums\n");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    nr_workers = WorkPoolWorkersGet(nr_workers);
+    if ((uint64_t)nr_workers > fs->group_count) {
+        nr_workers = fs->group_count;
+    }
+    if (GroupDescriptorsFetch(fs) == (uint64_t)-1) {
+        return -1;
+    }
+    ctx.fs = fs;
+    ctx.workers = (struct ChecksumWorker *) calloc(nr_workers, sizeof(struct ChecksumWorker));
+    groups = (uint64_t *) malloc(sizeof(uint64_t) * fs->group_count);
+    if (ctx.workers == NULL || groups == NULL) {
+        printf("ChecksumAudit: allocate memory failed\n");
+        goto end;
+    }
+    for (k = 0; k < nr_workers; k++) {
+        w = &ctx.workers[k];
+        w->scan = (char *) malloc(InodeScanBufferSizeGet(fs));
+        w->blocks = (char *) malloc(CSUM_READ_BLOCKS * fs->block_size);
+        if (w->scan == NULL || w->blocks == NULL) {
+            printf("ChecksumAudit: allocate memory failed\n");
+            goto end;
+        }
+    }
+    for (i = 0; i < fs->group_count; i++) {
+        groups[i] = i;
+    }
+
+    /* The superblock is checked here, as a worker of its own */
+    if (MetadataCsumHas(fs)) {
+        super.bytes += offsetof(struct ext4_super_block, s_checksum);
+        ChecksumCompare(&super, CSUM_SUPER, 0, 0, le32toh(fs->super.s_checksum), SuperBlockChecksumGet(&fs->super));
+    }
+
+    if (WorkPoolRun(nr_workers, groups, fs->group_count, ChecksumWork, &ctx) != 0) {
+        printf("ChecksumAudit: checksum scan failed\n");
+        goto end;
+    }
+
+    for (k = 0; k <= nr_workers; k++) {
+        w = (k == nr_workers) ? &super : &ctx.workers[k];
+        for (i = 0; i < CSUM_KINDS; i++) {
+            report->checked[i] += w->checked[i];
+            report->bad[i] += w->bad[i];
+            report->missing[i] += w->missing[i];
+        }
+        report->unreadable += w->unreadable;
+        report->bytes += w->bytes;
+        if (w->error_count == 0) {
+            continue;
+        }
+        if (ArrayReserve((void **)&report->errors, &capacity, report->error_count, sizeof(struct ChecksumError),
+                    w->error_count) < 0) {
+            printf("ChecksumAudit: allocate memory failed\n");
+            goto end;
+        }
+        memcpy(report->errors + report->error_count, w->errors, sizeof(struct ChecksumError) * w->error_count);
+        report->error_count += w->error_count;
+    }
+    if (report->error_count > 0) {
+        qsort(report->errors, report->error_count, sizeof(struct ChecksumError), ChecksumErrorCompare);
+    }
+    ret = 0;
+end:
+    if (ctx.workers != NULL) {
+        for (k = 0; k < nr_workers; k++) {
+            free(ctx.workers[k].scan);
+            free(ctx.workers[k].blocks);
+            free(ctx.workers[k].errors);
+        }
+    }
+    free(super.errors);
+    free(ctx.workers);
+    free(groups);
+    if (ret < 0) {
+        ChecksumReportRelease(report);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return ret;
+}
+
+void ChecksumReportRelease(struct ChecksumReport *report)
+{
+    if (report == NULL) {
+        return;
+    }
+    free(report->errors);
+    report->errors = NULL;
+    report->error_count = 0;
+}
+
+void ChecksumReportPrint(struct FileSystem *fs, struct ChecksumReport *report)
+{
+    struct ChecksumError *err = NULL;
+    uint64_t i = 0, bad = 0;
+
+    printf("Checksums with crc32c %s, %llu KiB in %.3f seconds\n", Crc32cImplGet(), report->bytes / 1024, report->seconds);
+    for (i = 0; i < CSUM_KINDS; i++) {
+        printf("%-16s %12llu checked %8llu bad %8llu missing\n", csum_kind_names[i],
+                report->checked[i], report->bad[i], report->missing[i]);
+        bad += report->bad[i] + report->missing[i];
+    }
+    if (report->unreadable > 0) {
+        printf("%llu inodes with unreadable blocks\n", report->unreadable);
+    }
+    for (i = 0; i < report->error_count; i++) {
+        err = &(report->errors[i]);
+        printf("Group %u", err->group);
+        if (err->inode != 0) {
+            printf(" inode %llu", err->inode);
+        }
+        if (err->block != 0) {
+            printf(" block %llu", err->block);
+        }
+        if (err->stored == err->computed) {
+            printf(": %s has no checksum\n", csum_kind_names[err->kind]);
+        } else {
+            printf(": %s checksum 0x%08x, expected 0x%08x\n", csum_kind_names[err->kind], err->stored, err->computed);
+        }
+    }
+    if (bad > report->error_count) {
+        printf("%llu more mismatches\n", bad - report->error_count);
+    }
+    printf("%llu bad checksums\n", bad);
+}
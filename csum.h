@@ -0,0 +1,63 @@
+#ifndef CSUM_H
+#define CSUM_H
+
+#include "filesystem.h"
+
+/* Kinds of checksummed metadata */
+#define CSUM_SUPER          0
+#define CSUM_DESCRIPTOR     1   /* crc16 with GDT_CSUM only, crc32c with METADATA_CSUM */
+#define CSUM_BLOCK_BITMAP   2
+#define CSUM_INODE_BITMAP   3
+#define CSUM_INODE          4
+#define CSUM_EXTENT         5   /* extent tree blocks, the in-inode root has none */
+#define CSUM_DIR            6   /* directory leaf blocks, in the dirent tail */
+#define CSUM_DX             7   /* htree root and interior blocks, in the dx tail */
+#define CSUM_XATTR          8
+#define CSUM_KINDS          9
+
+/* Mismatches kept per worker for printing, the counts are always exact */
+#define CSUM_ERRORS_KEPT    4096
+
+/* Directory and tree blocks read at once */
+#define CSUM_READ_BLOCKS    64
+
+struct ChecksumError {
+    uint32_t kind;      /* CSUM_* */
+    uint32_t group;
+    uint64_t inode;     /* 0 for group metadata */
+    uint64_t block;     /* 0 for the superblock, descriptors and inodes */
+    uint32_t stored;
+    uint32_t computed;  /* same as stored for a missing checksum */
+};
+
+struct ChecksumReport {
+    uint64_t checked[CSUM_KINDS];
+    uint64_t bad[CSUM_KINDS];
+    uint64_t missing[CSUM_KINDS];   /* blocks without room for their checksum */
+    uint64_t unreadable;            /* inodes whose blocks could not be read */
+    uint64_t bytes;                 /* checksummed */
+    uint64_t error_count;
+    struct ChecksumError *errors;   /* sorted by group, inode, block */
+    double seconds;
+};
+
+uint32_t SuperBlockChecksumGet(struct ext4_super_block *);
+uint16_t DescriptorChecksumGet(struct FileSystem *, uint64_t, struct ext4_group_desc *);
+uint32_t BitmapChecksumGet(struct FileSystem *, char *, uint64_t);
+uint32_t InodeChecksumSeedGet(struct FileSystem *, uint64_t, struct ext4_inode *);
+uint32_t InodeChecksumGet(struct FileSystem *, uint64_t, struct ext4_inode *);
+uint32_t *ExtentBlockChecksumLocate(struct FileSystem *, uint32_t, char *, uint32_t *);
+uint32_t *DirBlockChecksumLocate(struct FileSystem *, uint32_t, char *, bool, uint32_t *);
+uint32_t XattrBlockChecksumGet(struct FileSystem *, uint64_t, char *);
+
+bool SuperBlockChecksumSet(struct FileSystem *, struct ext4_super_block *);
+bool DescriptorChecksumSet(struct FileSystem *, uint64_t, struct ext4_group_desc *);
+bool BlockBitmapChecksumSet(struct FileSystem *, struct ext4_group_desc *, char *);
+bool InodeBitmapChecksumSet(struct FileSystem *, struct ext4_group_desc *, char *);
+bool InodeChecksumSet(struct FileSystem *, uint64_t, struct ext4_inode *);
+
+int ChecksumAudit(struct FileSystem *, int, struct ChecksumReport *);
+void ChecksumReportRelease(struct ChecksumReport *);
+void ChecksumReportPrint(struct FileSystem *, struct ChecksumReport *);
+
+#endif /* CSUM_H */
@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "extent.h"
+#include "path.h"
+
+struct DaemonBuffer {
+    char *data;
+    uint64_t len;
+    uint64_t capacity;
+};
+
+struct DaemonConnection {
+    struct DaemonServer *server;
+    int fd;
+    struct DaemonBuffer in;
+    struct DaemonBuffer out;
+    struct DaemonBuffer scratch;    /* payload being built */
+    struct DaemonConnection *next;
+};
+
+struct DaemonServer {
+    struct FileSystem *fs;
+    struct DaemonStats *stats;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    struct DaemonConnection *connections;   /* open ones */
+    uint64_t active;
+};
+
+/*
+ * The signal handler writes to this pipe, which the accept loop polls along
+ * with the listener, so a signal is seen whichever thread it interrupts
+ */
+static int daemon_pipe[2] = { -1, -1 };
+
+static void DaemonSignal(int sig)
+{
+    int saved = errno;
+
+    if (write(daemon_pipe[1], "", 1) < 0) {
+        /* the pipe is full, a wakeup is already pending */
+    }
+    errno = saved;
+}
+
+static int BufferReserve(struct DaemonBuffer *buf, uint64_t more)
+{
+    char *data = NULL;
+    uint64_t capacity = buf->capacity ? buf->capacity : DAEMON_BUFFER_SIZE;
+
+    if (buf->len + more <= buf->capacity) {
+        return 0;
+    }
+    while (capacity < buf->len + more) {
+        capacity *= 2;
+    }
+    data = (char *) realloc(buf->data, capacity);
+    if (data == NULL) {
+        return -1;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+static int BufferAppend(struct DaemonBuffer *buf, const void *data, uint64_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+    if (BufferReserve(buf, len) < 0) {
+        return -1;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+/*
+ * write until all of buf is out
+ * Return 0 on success, -1 if the peer is gone
+ */
+static int FullWrite(int fd, const char *buf, uint64_t len)
+{
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * read exactly len bytes
+ * Return 0 on success, -1 on EOF or error
+ */
+static int FullRead(int fd, char *buf, uint64_t len)
+{
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int XattrCollect(struct FileSystem *fs, const char *prefix, const char *name, uint32_t name_len,
+        const char *value, uint32_t value_size, void *arg)
+{
+    struct DaemonBuffer *buf = (struct DaemonBuffer *)arg;
+    struct DaemonXattr x;
+    uint64_t prefix_len = strlen(prefix);
+
+    x.name_len = prefix_len + name_len;
+    x.flags = value ? 0 : DAEMON_XATTR_EA_INODE;
+    x.value_len = value_size;
+    if (BufferAppend(buf, &x, sizeof(x)) < 0 || BufferAppend(buf, prefix, prefix_len) < 0 ||
+            BufferAppend(buf, name, name_len) < 0 || (value && BufferAppend(buf, value, value_size) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Answer one request into scratch
+ * Return 0 or -errno, which goes back as the status
+ */
+static int DaemonRequestHandle(struct DaemonConnection *conn, struct DaemonRequest *req, char *payload)
+{
+    struct FileSystem *fs = conn->server->fs;
+    struct DaemonBuffer *out = &conn->scratch;
+    struct ext4_group_desc *pdesc = NULL;
+    struct ext4_inode inode;
+    struct ExtentMap *map = NULL;
+    char path[DAEMON_PAYLOAD_MAX + 1];
+    uint64_t num = 0;
+    int32_t status = 0;
+    int ret = 0;
+
+    switch (req->op) {
+        case DAEMON_OP_SUPER:
+            return BufferAppend(out, &fs->super, sizeof(fs->super)) < 0 ? -ENOMEM : 0;
+        case DAEMON_OP_DESCRIPTOR:
+            pdesc = GroupDescriptorGet(fs, req->arg);
+            if (pdesc == NULL) {
+                return req->arg >= fs->group_count ? -EINVAL : -EIO;
+            }
+            return BufferAppend(out, pdesc, fs->descriptor_size) < 0 ? -ENOMEM : 0;
+        case DAEMON_OP_INODE:
+            if (req->arg == 0 || req->arg > fs->inode_count) {
+                return -EINVAL;
+            }
+            if (InodeGetBynum(fs, req->arg, &inode) == 0) {
+                return -EIO;
+            }
+            return BufferAppend(out, &inode, sizeof(inode)) < 0 ? -ENOMEM : 0;
+        case DAEMON_OP_INODE_STATUS:
+        case DAEMON_OP_BLOCK_STATUS:
+            if (req->op == DAEMON_OP_INODE_STATUS) {
+                if (req->arg == 0 || req->arg > fs->inode_count) {
+                    return -EINVAL;
+                }
+                status = InodeStatusGetBynum(fs, req->arg);
+            } else {
+                if (req->arg >= fs->block_count) {
+                    return -EINVAL;
+                }
+                status = BlockStatusGetBynum(fs, req->arg);
+            }
+            if (status < 0) {
+                return -EIO;
+            }
+            return BufferAppend(out, &status, sizeof(status)) < 0 ? -ENOMEM : 0;
+        case DAEMON_OP_XATTR:
+            if (req->arg == 0 || req->arg > fs->inode_count) {
+                return -EINVAL;
+            }
+            return XattrForEach(fs, req->arg, XattrCollect, out) != 0 ? -EIO : 0;
+        case DAEMON_OP_BLOCK_MAP:
+            map = ExtentMapGet(fs, req->arg);
+            if (map == NULL) {
+                return -ENOENT;
+            }
+            ret = BufferAppend(out, map->records, sizeof(struct ExtentRecord) * map->count);
+            ExtentMapPut(fs, req->arg);
+            return ret < 0 ? -ENOMEM : 0;
+        case DAEMON_OP_PATH:
+            memcpy(path, payload, req->len);
+            path[req->len] = '\0';
+            num = PathResolve(fs, path);
+            if (num == 0) {
+                return -ENOENT;
+            }
+            return BufferAppend(out, &num, sizeof(num)) < 0 ? -ENOMEM : 0;
+        default:
+            return -EOPNOTSUPP;
+    }
+}
+
+/*
+ * Answer every complete request in the input buffer, responses are
+ * gathered and written together
+ * Return 0 to go on, -1 to drop the connection
+ */
+static int DaemonRequestsServe(struct DaemonConnection *conn)
+{
+    struct DaemonStats *stats = conn->server->stats;
+    struct DaemonRequest req;
+    struct DaemonResponse resp;
+    uint64_t pos = 0;
+
+    while (conn->in.len - pos >= sizeof(req)) {
+        memcpy(&req, conn->in.data + pos, sizeof(req));
+        if (req.magic != DAEMON_MAGIC || req.len > DAEMON_PAYLOAD_MAX) {
+            return -1;
+        }
+        if (conn->in.len - pos < sizeof(req) + req.len) {
+            break;
+        }
+
+        conn->scratch.len = 0;
+        resp.magic = DAEMON_MAGIC;
+        resp.id = req.id;
+        resp.status = DaemonRequestHandle(conn, &req, conn->in.data + pos + sizeof(req));
+        if (resp.status != 0) {
+            conn->scratch.len = 0;
+            __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+        }
+        resp.len = conn->scratch.len;
+        __atomic_fetch_add(&stats->requests, 1, __ATOMIC_RELAXED);
+        if (BufferAppend(&conn->out, &resp, sizeof(resp)) < 0 ||
+                BufferAppend(&conn->out, conn->scratch.data, conn->scratch.len) < 0) {
+            return -1;
+        }
+        if (conn->out.len >= DAEMON_BUFFER_SIZE) {
+            if (FullWrite(conn->fd, conn->out.data, conn->out.len) < 0) {
+                return -1;
+            }
+            conn->out.len = 0;
+        }
+        pos += sizeof(req) + req.len;
+    }
+
+    memmove(conn->in.data, conn->in.data + pos, conn->in.len - pos);
+    conn->in.len -= pos;
+    if (conn->out.len > 0 && FullWrite(conn->fd, conn->out.data, conn->out.len) < 0) {
+        return -1;
+    }
+    conn->out.len = 0;
+    return 0;
+}
+
+static void *DaemonConnectionRun(void *arg)
+{
+    struct DaemonConnection *conn = (struct DaemonConnection *)arg;
+    struct DaemonServer *server = conn->server;
+    struct DaemonConnection **pp = NULL;
+    ssize_t n = 0;
+
+    while (BufferReserve(&conn->in, DAEMON_BUFFER_SIZE - conn->in.len) == 0) {
+        n = read(conn->fd, conn->in.data + conn->in.len, conn->in.capacity - conn->in.len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        conn->in.len += n;
+        if (DaemonRequestsServe(conn) < 0) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&server->lock);
+    for (pp = &server->connections; *pp != NULL && *pp != conn; pp = &((*pp)->next)) {
+    }
+    if (*pp != NULL) {
+        *pp = conn->next;
+    }
+    close(conn->fd);
+    server->active--;
+    pthread_cond_signal(&server->idle);
+    pthread_mutex_unlock(&server->lock);
+
+    free(conn->in.data);
+    free(conn->out.data);
+    free(conn->scratch.data);
+    free(conn);
+    return NULL;
+}
+
+/*
+ * Serve queries on the FileSystem over a Unix socket until SIGINT or
+ * SIGTERM. Each connection gets a thread, all share fs and its caches,
+ * so later queries find the descriptors, maps and names earlier ones
+ * loaded.
+ * @fs: FileSystem
+ * @path: socket path, an existing file there is replaced
+ * @stats: filled in, may be NULL
+ * Return 0 after a signal, -1 if the socket cannot be set up
+ */
+int DaemonRun(struct FileSystem *fs, const char *path, struct DaemonStats *stats)
+{
+    struct DaemonServer server;
+    struct DaemonStats local;
+    struct DaemonConnection *conn = NULL;
+    struct sockaddr_un addr;
+    struct sigaction sa, old_int, old_term;
+    pthread_t thread;
+    pthread_attr_t attr;
+    struct pollfd fds[2];
+    int listener = -1, fd = -1;
+
+    if (fs == NULL || path == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&local, 0, sizeof(local));
+    memset(&server, 0, sizeof(server));
+    server.fs = fs;
+    server.stats = stats ? stats : &local;
+    memset(server.stats, 0, sizeof(struct DaemonStats));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        perror("DaemonRun: socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 64) < 0) {
+        perror("DaemonRun: bind");
+        close(listener);
+        return -1;
+    }
+
+    if (pipe(daemon_pipe) < 0 || fcntl(daemon_pipe[1], F_SETFL, O_NONBLOCK) < 0) {
+        perror("DaemonRun: pipe");
+        close(daemon_pipe[0]);
+        close(daemon_pipe[1]);
+        daemon_pipe[0] = daemon_pipe[1] = -1;
+        close(listener);
+        unlink(path);
+        return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = DaemonSignal;
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+    signal(SIGPIPE, SIG_IGN);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.idle, NULL);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    fds[1].fd = daemon_pipe[0];
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("DaemonRun: poll");
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        /* The listener is nonblocking, a client may leave before accept */
+        fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            perror("DaemonRun: accept");
+            break;
+        }
+        conn = (struct DaemonConnection *) calloc(1, sizeof(struct DaemonConnection));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->server = &server;
+        conn->fd = fd;
+        pthread_mutex_lock(&server.lock);
+        conn->next = server.connections;
+        server.connections = conn;
+        server.active++;
+        server.stats->connections++;
+        if (pthread_create(&thread, &attr, DaemonConnectionRun, conn) != 0) {
+            server.connections = conn->next;
+            server.active--;
+            close(fd);
+            free(conn);
+        }
+        pthread_mutex_unlock(&server.lock);
+    }
+
+    /* Wake the connections up and wait for them to let go of fs */
+    close(listener);
+    unlink(path);
+    pthread_mutex_lock(&server.lock);
+    for (conn = server.connections; conn != NULL; conn = conn->next) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    while (server.active > 0) {
+        pthread_cond_wait(&server.idle, &server.lock);
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    pthread_attr_destroy(&attr);
+    pthread_cond_destroy(&server.idle);
+    pthread_mutex_destroy(&server.lock);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    close(daemon_pipe[0]);
+    close(daemon_pipe[1]);
+    daemon_pipe[0] = daemon_pipe[1] = -1;
+    return 0;
+}
+
+/*
+ * Return a socket connected to the daemon at path, -1 on failure
+ */
+int DaemonConnect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = -1;
+
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Send requests with one write, magic and len are filled in
+ * @payloads: payload of each request of len bytes, NULL when none has one
+ * Return 0 on success, -1 on failure
+ */
+int DaemonRequestsSend(int fd, struct DaemonRequest *reqs, const char **payloads, uint64_t count)
+{
+    struct DaemonBuffer buf;
+    uint64_t i = 0;
+    int ret = -1;
+
+    memset(&buf, 0, sizeof(buf));
+    for (i = 0; i < count; i++) {
+        reqs[i].magic = DAEMON_MAGIC;
+        if (payloads == NULL || payloads[i] == NULL) {
+            reqs[i].len = 0;
+        }
+        if (reqs[i].len > DAEMON_PAYLOAD_MAX || BufferAppend(&buf, &reqs[i], sizeof(reqs[i])) < 0 ||
+                (reqs[i].len > 0 && BufferAppend(&buf, payloads[i], reqs[i].len) < 0)) {
+            goto end;
+        }
+    }
+    ret = FullWrite(fd, buf.data, buf.len);
+end:
+    free(buf.data);
+    return ret;
+}
+
+/*
+ * Read the next response and its payload
+ * @payload, @capacity: buffer grown as needed, freed by the caller
+ * Return 0 on success, -1 on failure
+ */
+int DaemonResponseRead(int fd, struct DaemonResponse *resp, char **payload, uint64_t *capacity)
+{
+    char *grown = NULL;
+
+    if (FullRead(fd, (char *)resp, sizeof(*resp)) < 0 || resp->magic != DAEMON_MAGIC) {
+        return -1;
+    }
+    if (resp->len > *capacity) {
+        grown = (char *) realloc(*payload, resp->len);
+        if (grown == NULL) {
+            return -1;
+        }
+        *payload = grown;
+        *capacity = resp->len;
+    }
+    return FullRead(fd, *payload, resp->len);
+}
@@ -0,0 +1,69 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "filesystem.h"
+
+/*
+ * Binary protocol over a Unix stream socket. A client writes requests
+ * back to back without waiting; the daemon answers each connection in
+ * order, one response per request carrying the request id. All fields are
+ * in host byte order, both ends are on the same machine.
+ */
+#define DAEMON_MAGIC            0x4C534653U     /* "LSFS" */
+
+/* Request ops, arg is what the lsfs feature of the same name takes */
+#define DAEMON_OP_SUPER         1   /* the superblock */
+#define DAEMON_OP_DESCRIPTOR    2   /* arg group, descriptor_size bytes */
+#define DAEMON_OP_INODE         3   /* arg inode, struct ext4_inode */
+#define DAEMON_OP_INODE_STATUS  4   /* arg inode, int32_t as InodeStatusGetBynum */
+#define DAEMON_OP_BLOCK_STATUS  5   /* arg block, int32_t as BlockStatusGetBynum */
+#define DAEMON_OP_XATTR         6   /* arg inode, struct DaemonXattr records */
+#define DAEMON_OP_BLOCK_MAP     7   /* arg inode, struct ExtentRecord array */
+#define DAEMON_OP_PATH          8   /* path as payload, uint64_t inode */
+
+/* Largest request payload, a path */
+#define DAEMON_PAYLOAD_MAX      4096
+
+/* Bytes read from a connection at once, and responses kept before writing */
+#define DAEMON_BUFFER_SIZE      (64 * 1024)
+
+/* Requests a client has in flight before reading responses */
+#define DAEMON_PIPELINE         256
+
+struct DaemonRequest {
+    uint32_t magic;
+    uint16_t op;
+    uint16_t flags;     /* 0 */
+    uint32_t id;        /* echoed in the response */
+    uint32_t len;       /* payload bytes following */
+    uint64_t arg;
+};
+
+struct DaemonResponse {
+    uint32_t magic;
+    uint32_t id;
+    int32_t status;     /* 0, or -errno */
+    uint32_t len;       /* payload bytes following */
+};
+
+/* One attribute in a DAEMON_OP_XATTR payload, followed by name then value */
+struct DaemonXattr {
+    uint16_t name_len;  /* with the prefix */
+    uint16_t flags;     /* DAEMON_XATTR_* */
+    uint32_t value_len;
+};
+
+#define DAEMON_XATTR_EA_INODE   0x0001  /* value lives in an EA inode and is not sent */
+
+struct DaemonStats {
+    uint64_t connections;
+    uint64_t requests;
+    uint64_t errors;    /* requests answered with a non zero status */
+};
+
+int DaemonRun(struct FileSystem *, const char *, struct DaemonStats *);
+int DaemonConnect(const char *);
+int DaemonRequestsSend(int, struct DaemonRequest *, const char **, uint64_t);
+int DaemonResponseRead(int, struct DaemonResponse *, char **, uint64_t *);
+
+#endif /* DAEMON_H */
@@ -0,0 +1,552 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "delta.h"
+#include "journal.h"
+
+/* Blocks covered by one chunk of the bitmap */
+#define DELTA_CHUNK_BLOCKS      (DELTA_CHUNK_BYTES * 8ULL)
+
+static int DeltaHeaderFill(struct FileSystem *fs, uint64_t block_size, struct DeltaHeader *hdr)
+{
+    uint64_t bitmap_size = 0;
+
+    memset(hdr, 0, sizeof(struct DeltaHeader));
+    if (SidecarStampFill(fs, DELTA_MAGIC, DELTA_VERSION, sizeof(struct DeltaHeader), &(hdr->stamp)) < 0) {
+        return -1;
+    }
+    hdr->block_size = block_size;
+    hdr->block_count = (fs->image_size + block_size - 1) / block_size;
+    /* The header has the first block, the bitmap starts and ends on a block */
+    bitmap_size = (hdr->block_count + 7) / 8;
+    hdr->bitmap_offset = block_size;
+    hdr->data_offset = hdr->bitmap_offset + (bitmap_size + block_size - 1) / block_size * block_size;
+    return 0;
+}
+
+static int DeltaHeaderWrite(struct Delta *d)
+{
+    if (PositionalWrite(d->fd, (char *)&(d->hdr), sizeof(struct DeltaHeader), 0) != sizeof(struct DeltaHeader)) {
+        return -1;
+    }
+    return 0;
+}
+
+static bool DeltaHas(struct Delta *d, uint64_t block)
+{
+    uint8_t *chunk = __atomic_load_n(&(d->chunks[block / DELTA_CHUNK_BLOCKS]), __ATOMIC_ACQUIRE);
+
+    if (chunk == NULL) {
+        return false;
+    }
+    block %= DELTA_CHUNK_BLOCKS;
+    return (__atomic_load_n(&chunk[block / 8], __ATOMIC_ACQUIRE) >> (block % 8)) & 1;
+}
+
+/*
+ * First block in [block, end) held by the delta, end if none.
+ * Chunks never written and zero bytes of the bitmap are skipped whole.
+ */
+static uint64_t DeltaNext(struct Delta *d, uint64_t block, uint64_t end)
+{
+    uint8_t *chunk = NULL;
+    uint8_t byte = 0;
+
+    while (block < end) {
+        chunk = __atomic_load_n(&(d->chunks[block / DELTA_CHUNK_BLOCKS]), __ATOMIC_ACQUIRE);
+        if (chunk == NULL) {
+            block = (block / DELTA_CHUNK_BLOCKS + 1) * DELTA_CHUNK_BLOCKS;
+            continue;
+        }
+        byte = __atomic_load_n(&chunk[(block % DELTA_CHUNK_BLOCKS) / 8], __ATOMIC_ACQUIRE) >> (block % 8);
+        if (byte == 0) {
+            block = (block / 8 + 1) * 8;
+            continue;
+        }
+        block += __builtin_ctz(byte);
+        break;
+    }
+    return block < end ? block : end;
+}
+
+/*
+ * First block in [block, end) not held by the delta, end if none
+ */
+static uint64_t DeltaNextHole(struct Delta *d, uint64_t block, uint64_t end)
+{
+    while (block < end && DeltaHas(d, block)) {
+        block++;
+    }
+    return block;
+}
+
+/*
+ * Mark blocks [first, end) as held by the delta, in memory and in the file.
+ * Caller holds the lock and has written their data already.
+ */
+static int DeltaMark(struct Delta *d, uint64_t first, uint64_t end)
+{
+    uint8_t *chunk = NULL;
+    uint64_t block = 0, index = 0, byte = 0, stop = 0;
+    uint8_t bit = 0;
+
+    for (block = first; block < end; block++) {
+        index = block / DELTA_CHUNK_BLOCKS;
+        chunk = d->chunks[index];
+        if (chunk == NULL) {
+            chunk = (uint8_t *) calloc(DELTA_CHUNK_BYTES, 1);
+            if (chunk == NULL) {
+                return -1;
+            }
+            __atomic_store_n(&(d->chunks[index]), chunk, __ATOMIC_RELEASE);
+        }
+        bit = 1 << (block % 8);
+        if (!(__atomic_fetch_or(&chunk[(block % DELTA_CHUNK_BLOCKS) / 8], bit, __ATOMIC_RELEASE) & bit)) {
+            __atomic_fetch_add(&d->count, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* The bytes changed, one write per chunk */
+    for (byte = first / 8; byte <= (end - 1) / 8; byte = stop) {
+        index = byte / DELTA_CHUNK_BYTES;
+        stop = (index + 1) * DELTA_CHUNK_BYTES;
+        if (stop > (end - 1) / 8 + 1) {
+            stop = (end - 1) / 8 + 1;
+        }
+        if (PositionalWrite(d->fd, (char *)d->chunks[index] + byte % DELTA_CHUNK_BYTES, stop - byte,
+                    d->hdr.bitmap_offset + byte) != stop - byte) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Load the bitmap of the delta, chunks without a block set are not kept
+ */
+static int DeltaBitmapLoad(struct Delta *d)
+{
+    uint64_t bytes = (d->hdr.block_count + 7) / 8;
+    uint64_t i = 0, k = 0, len = 0;
+    uint8_t *buf = NULL;
+
+    d->chunk_count = (d->hdr.block_count + DELTA_CHUNK_BLOCKS - 1) / DELTA_CHUNK_BLOCKS;
+    d->chunks = (uint8_t **) calloc(d->chunk_count, sizeof(uint8_t *));
+    if (d->chunks == NULL) {
+        return -1;
+    }
+    for (i = 0; i < d->chunk_count; i++) {
+        if (buf == NULL) {
+            buf = (uint8_t *) malloc(DELTA_CHUNK_BYTES);
+            if (buf == NULL) {
+                return -1;
+            }
+        }
+        len = bytes - i * DELTA_CHUNK_BYTES;
+        if (len > DELTA_CHUNK_BYTES) {
+            len = DELTA_CHUNK_BYTES;
+        }
+        /* Past the end of the file the bitmap is zero */
+        memset(buf, 0, DELTA_CHUNK_BYTES);
+        PositionalRead(d->fd, (char *)buf, len, d->hdr.bitmap_offset + i * DELTA_CHUNK_BYTES);
+        for (k = 0; k < len && buf[k] == 0; k++) {
+        }
+        if (k == len) {
+            continue;
+        }
+        for (; k < len; k++) {
+            d->count += __builtin_popcount(buf[k]);
+        }
+        d->chunks[i] = buf;
+        buf = NULL;
+    }
+    free(buf);
+    return 0;
+}
+
+/*
+ * Attach the write overlay of the image at image, a delta file next to it,
+ * started empty if there is none. From then on BytesWrite lands in the
+ * delta and reads see what it holds over the image.
+ * @fs: FileSystem with the superblock of the image read
+ * @image: path of the image
+ * Return 0 on success, -1 if the delta cannot be used
+ */
+int DeltaOpen(struct FileSystem *fs, const char *image)
+{
+    struct Delta *d = NULL;
+    struct DeltaHeader expect;
+    struct stat st;
+    uint64_t block_size = EXT4_MIN_BLOCK_SIZE << fs->super.s_log_block_size;
+    int status = 0;
+
+    if (fs->super.s_log_block_size > 6) {
+        printf("DeltaOpen: block size out of range\n");
+        return -1;
+    }
+    d = (struct Delta *) calloc(1, sizeof(struct Delta));
+    if (d == NULL) {
+        return -1;
+    }
+    d->fd = -1;
+    d->image = strdup(image);
+    d->path = (char *) malloc(strlen(image) + sizeof(DELTA_SUFFIX));
+    if (d->image == NULL || d->path == NULL || DeltaHeaderFill(fs, block_size, &expect) < 0) {
+        goto fail;
+    }
+    sprintf(d->path, "%s%s", image, DELTA_SUFFIX);
+
+    d->fd = open(d->path, O_RDWR | O_CREAT, 0644);
+    if (d->fd < 0 || fstat(d->fd, &st) < 0) {
+        printf("DeltaOpen: open %s failed\n", d->path);
+        goto fail;
+    }
+    if (st.st_size == 0) {
+        d->hdr = expect;
+        if (DeltaHeaderWrite(d) < 0) {
+            printf("DeltaOpen: write the header of %s failed\n", d->path);
+            goto fail;
+        }
+    } else {
+        /* The superblock seen through the delta may differ from the image's, only the image is compared */
+        status = (PositionalRead(d->fd, (char *)&(d->hdr), sizeof(struct DeltaHeader), 0) != sizeof(struct DeltaHeader)) ?
+            SIDECAR_FOREIGN : SidecarStampCheck(fs, &(d->hdr.stamp), DELTA_MAGIC, DELTA_VERSION,
+                    sizeof(struct DeltaHeader), SIDECAR_CHECK_IMAGE);
+        if (status == SIDECAR_FOREIGN) {
+            printf("DeltaOpen: %s is not a delta of this version\n", d->path);
+            goto fail;
+        }
+        if (status != SIDECAR_CURRENT || d->hdr.block_size != expect.block_size || d->hdr.block_count != expect.block_count ||
+                d->hdr.bitmap_offset != expect.bitmap_offset || d->hdr.data_offset != expect.data_offset) {
+            printf("DeltaOpen: %s was started on another image, or the image changed since\n", d->path);
+            goto fail;
+        }
+    }
+    if (DeltaBitmapLoad(d) < 0) {
+        printf("DeltaOpen: load the bitmap of %s failed\n", d->path);
+        goto fail;
+    }
+
+    pthread_mutex_init(&d->lock, NULL);
+    fs->delta = d;
+    return 0;
+fail:
+    if (d->fd >= 0) {
+        close(d->fd);
+    }
+    if (d->chunks != NULL) {
+        for (; d->chunk_count > 0; d->chunk_count--) {
+            free(d->chunks[d->chunk_count - 1]);
+        }
+        free(d->chunks);
+    }
+    free(d->image);
+    free(d->path);
+    free(d);
+    return -1;
+}
+
+/*
+ * Detach the delta, what it holds is kept for the next DeltaOpen. An empty
+ * delta file is removed.
+ */
+void DeltaClose(struct FileSystem *fs)
+{
+    struct Delta *d = fs->delta;
+    uint64_t i = 0;
+
+    if (d == NULL) {
+        return;
+    }
+    if (d->count == 0) {
+        unlink(d->path);
+    } else if (fsync(d->fd) < 0) {
+        printf("DeltaClose: sync %s failed\n", d->path);
+    }
+    close(d->fd);
+    for (i = 0; i < d->chunk_count; i++) {
+        free(d->chunks[i]);
+    }
+    free(d->chunks);
+    pthread_mutex_destroy(&d->lock);
+    free(d->image);
+    free(d->path);
+    free(d);
+    fs->delta = NULL;
+}
+
+/*
+ * Whether any byte of [offset, offset + len) is held by the delta
+ */
+bool DeltaCovers(struct FileSystem *fs, uint64_t offset, uint64_t len)
+{
+    struct Delta *d = fs->delta;
+    uint64_t end = 0;
+
+    if (d == NULL || len == 0 || __atomic_load_n(&d->count, __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
+    end = (offset + len - 1) / d->hdr.block_size + 1;
+    if (end > d->hdr.block_count) {
+        end = d->hdr.block_count;
+    }
+    return DeltaNext(d, offset / d->hdr.block_size, end) < end;
+}
+
+/*
+ * Put what the delta holds over the bytes read from [offset, offset + len),
+ * one read per run of blocks in the delta
+ * Return 0 on success, -1 if the delta cannot be read
+ */
+int DeltaApply(struct FileSystem *fs, uint64_t offset, uint64_t len, char *buf)
+{
+    struct Delta *d = fs->delta;
+    uint64_t block = 0, stop = 0, end = 0, start = 0, last = 0;
+
+    if (d == NULL || len == 0 || __atomic_load_n(&d->count, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    end = (offset + len - 1) / d->hdr.block_size + 1;
+    if (end > d->hdr.block_count) {
+        end = d->hdr.block_count;
+    }
+    block = offset / d->hdr.block_size;
+    while ((block = DeltaNext(d, block, end)) < end) {
+        stop = DeltaNextHole(d, block, end);
+        start = block * d->hdr.block_size;
+        last = stop * d->hdr.block_size;
+        if (start < offset) {
+            start = offset;
+        }
+        if (last > offset + len) {
+            last = offset + len;
+        }
+        if (PositionalRead(d->fd, buf + (start - offset), last - start, d->hdr.data_offset + start) != last - start) {
+            printf("DeltaApply: read blocks %llu ~ %llu of the delta failed\n", block, stop - 1);
+            return -1;
+        }
+        block = stop;
+    }
+    return 0;
+}
+
+/*
+ * Write bytes into the delta, the image is not touched. A block written in
+ * part is completed with what reads of it returned so far.
+ * @fs: FileSystem with a delta
+ * @offset: the offset begin to write
+ * @len: How many bytes is gonna be write
+ * @buf: buffer for writing
+ * Return len on success, 0 on failure
+ */
+uint64_t DeltaWrite(struct FileSystem *fs, uint64_t offset, uint64_t len, char *buf)
+{
+    struct Delta *d = fs->delta;
+    uint64_t first = 0, end = 0, block = 0, start = 0, size = 0;
+    uint64_t edges[2];
+    char *fill = NULL;
+    uint64_t ret = 0;
+    int i = 0;
+
+    if (len == 0 || offset + len > d->hdr.stamp.image_size) {
+        printf("DeltaWrite: %llu bytes at %llu are not inside the image\n", len, offset);
+        return 0;
+    }
+    first = offset / d->hdr.block_size;
+    end = (offset + len - 1) / d->hdr.block_size + 1;
+    edges[0] = first;
+    edges[1] = end - 1;
+
+    pthread_mutex_lock(&d->lock);
+    for (i = 0; i < 2; i++) {
+        block = edges[i];
+        if ((i == 1 && block == first) || DeltaHas(d, block)) {
+            continue;
+        }
+        start = block * d->hdr.block_size;
+        size = d->hdr.stamp.image_size - start;
+        if (size > d->hdr.block_size) {
+            size = d->hdr.block_size;
+        }
+        if (start >= offset && start + size <= offset + len) {
+            continue;
+        }
+        if (fill == NULL) {
+            fill = (char *) malloc(d->hdr.block_size);
+            if (fill == NULL) {
+                goto end;
+            }
+        }
+        if (BytesRead(fs, start, size, fill) != size ||
+                PositionalWrite(d->fd, fill, size, d->hdr.data_offset + start) != size) {
+            printf("DeltaWrite: copy block %llu into the delta failed\n", block);
+            goto end;
+        }
+        d->filled++;
+    }
+
+    if (PositionalWrite(d->fd, buf, len, d->hdr.data_offset + offset) != len) {
+        printf("DeltaWrite: write %llu bytes at %llu into the delta failed\n", len, offset);
+        goto end;
+    }
+    if (DeltaMark(d, first, end) < 0) {
+        printf("DeltaWrite: update the bitmap of the delta failed\n");
+        goto end;
+    }
+    d->writes++;
+    d->bytes += len;
+    ret = len;
+end:
+    pthread_mutex_unlock(&d->lock);
+    free(fill);
+    return ret;
+}
+
+/*
+ * Empty the delta, caller holds the lock. The header is stamped again as
+ * the image may have been written.
+ */
+static int DeltaReset(struct FileSystem *fs, struct Delta *d)
+{
+    uint64_t i = 0;
+
+    for (i = 0; i < d->chunk_count; i++) {
+        free(d->chunks[i]);
+        d->chunks[i] = NULL;
+    }
+    d->count = 0;
+    if (ftruncate(d->fd, d->hdr.bitmap_offset) < 0 ||
+            DeltaHeaderFill(fs, d->hdr.block_size, &(d->hdr)) < 0 || DeltaHeaderWrite(d) < 0 || fsync(d->fd) < 0) {
+        printf("DeltaReset: truncate %s failed\n", d->path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write every block of the delta to the image, in runs of up to
+ * DELTA_COPY_BLOCKS, sync the image once, empty the delta and load the
+ * metadata again from the image. Refused when the journal has copies of
+ * any block of the delta, reads would go on returning those and a replay
+ * would overwrite the blocks written.
+ * Must not run concurrently with any other call on fs.
+ * Return 0 on success, -1 on failure, the delta is kept then unless only
+ * loading the metadata again failed
+ */
+int DeltaCommit(struct FileSystem *fs)
+{
+    struct Delta *d = fs->delta;
+    uint64_t block = 0, stop = 0, start = 0, len = 0;
+    char *buf = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (d == NULL) {
+        return -1;
+    }
+    buf = (char *) malloc(DELTA_COPY_BLOCKS * d->hdr.block_size);
+    if (buf == NULL) {
+        return -1;
+    }
+    fd = open(d->image, O_WRONLY);
+    if (fd < 0) {
+        printf("DeltaCommit: open %s for writing failed\n", d->image);
+        free(buf);
+        return -1;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    while ((block = DeltaNext(d, block, d->hdr.block_count)) < d->hdr.block_count) {
+        stop = DeltaNextHole(d, block, d->hdr.block_count);
+        if (JournalOverlayCovers(fs, block * d->hdr.block_size, (stop - block) * d->hdr.block_size)) {
+            printf("DeltaCommit: blocks %llu ~ %llu have journal copies over them\n", block, stop - 1);
+            goto end;
+        }
+        block = stop;
+    }
+
+    block = 0;
+    while ((block = DeltaNext(d, block, d->hdr.block_count)) < d->hdr.block_count) {
+        stop = block + DELTA_COPY_BLOCKS;
+        if (stop > d->hdr.block_count) {
+            stop = d->hdr.block_count;
+        }
+        stop = DeltaNextHole(d, block, stop);
+        start = block * d->hdr.block_size;
+        len = stop * d->hdr.block_size;
+        if (len > d->hdr.stamp.image_size) {
+            len = d->hdr.stamp.image_size;
+        }
+        len -= start;
+        if (PositionalRead(d->fd, buf, len, d->hdr.data_offset + start) != len ||
+                PositionalWrite(fd, buf, len, start) != len) {
+            printf("DeltaCommit: copy blocks %llu ~ %llu to the image failed\n", block, stop - 1);
+            goto end;
+        }
+        block = stop;
+    }
+    if (fsync(fd) < 0) {
+        printf("DeltaCommit: sync %s failed\n", d->image);
+        goto end;
+    }
+    ret = DeltaReset(fs, d);
+end:
+    pthread_mutex_unlock(&d->lock);
+    close(fd);
+    free(buf);
+    if (ret < 0) {
+        return ret;
+    }
+    /* The image changed under the caches and any index of it */
+    return FileSystemReload(fs);
+}
+
+/*
+ * Drop every block of the delta, reads see the image again. Everything
+ * read so far through the delta is read again.
+ * Must not run concurrently with any other call on fs.
+ * Return 0 on success, -1 on failure
+ */
+int DeltaDiscard(struct FileSystem *fs)
+{
+    struct Delta *d = fs->delta;
+    int ret = 0;
+
+    if (d == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&d->lock);
+    ret = DeltaReset(fs, d);
+    pthread_mutex_unlock(&d->lock);
+    if (ret < 0) {
+        return ret;
+    }
+    return FileSystemReload(fs);
+}
+
+void DeltaPrint(struct FileSystem *fs, bool verbose)
+{
+    struct Delta *d = fs->delta;
+    uint64_t block = 0, stop = 0;
+
+    if (d == NULL) {
+        printf("No delta attached\n");
+        return;
+    }
+    printf("Delta %s: %llu blocks of %llu bytes over %s\n", d->path, d->count, d->hdr.block_size, d->image);
+    printf("%llu writes, %llu bytes written, %llu blocks completed from the image in this session\n",
+            d->writes, d->bytes, d->filled);
+    while (verbose && (block = DeltaNext(d, block, d->hdr.block_count)) < d->hdr.block_count) {
+        stop = DeltaNextHole(d, block, d->hdr.block_count);
+        if (stop - block == 1) {
+            printf("block %llu\n", block);
+        } else {
+            printf("blocks %llu ~ %llu\n", block, stop - 1);
+        }
+        block = stop;
+    }
+}
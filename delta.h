@@ -0,0 +1,58 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "filesystem.h"
+#include "sidecar.h"
+
+/* The write overlay of an image is the image path with this appended */
+#define DELTA_SUFFIX            ".lsfsdelta"
+
+#define DELTA_MAGIC             "LSFSDLTA"
+#define DELTA_VERSION           2
+
+/* Bitmap bytes allocated at once, each chunk covers 8 times as many blocks */
+#define DELTA_CHUNK_BYTES       4096
+/* Most blocks copied at once by DeltaCommit */
+#define DELTA_COPY_BLOCKS       256
+
+/*
+ * The delta file: the header, one bit per image block telling whether the
+ * block is in the delta, and the data area where image byte x is kept at
+ * data_offset + x. Blocks never written are holes, the file is as sparse
+ * as the writes.
+ *
+ * The delta is only used on the image it was started on: same filesystem,
+ * same size and an image file not modified since, except by DeltaCommit.
+ */
+struct DeltaHeader {
+    struct SidecarStamp stamp;
+    uint64_t block_size;
+    uint64_t block_count;       /* covering image_size, the last may be short */
+    uint64_t bitmap_offset;
+    uint64_t data_offset;
+};
+
+struct Delta {
+    int fd;
+    char *path;                 /* of the delta file, removed when the delta is closed empty */
+    char *image;                /* path of the image, reopened for writing by DeltaCommit */
+    struct DeltaHeader hdr;
+    uint8_t **chunks;           /* the bitmap, NULL chunks have no block in the delta */
+    uint64_t chunk_count;
+    uint64_t count;             /* blocks in the delta */
+    pthread_mutex_t lock;       /* serializes writers */
+    uint64_t writes;            /* since DeltaOpen */
+    uint64_t bytes;
+    uint64_t filled;            /* blocks copied in from the image to complete a partial write */
+};
+
+int DeltaOpen(struct FileSystem *, const char *);
+void DeltaClose(struct FileSystem *);
+bool DeltaCovers(struct FileSystem *, uint64_t, uint64_t);
+int DeltaApply(struct FileSystem *, uint64_t, uint64_t, char *);
+uint64_t DeltaWrite(struct FileSystem *, uint64_t, uint64_t, char *);
+int DeltaCommit(struct FileSystem *);
+int DeltaDiscard(struct FileSystem *);
+void DeltaPrint(struct FileSystem *, bool);
+
+#endif /* DELTA_H */
@@ -0,0 +1,624 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "dir.h"
+
+#define DX_DEFAULT_SEED_0   0x67452301
+#define DX_DEFAULT_SEED_1   0xefcdab89
+#define DX_DEFAULT_SEED_2   0x98badcfe
+#define DX_DEFAULT_SEED_3   0x10325476
+
+static const char *dir_file_types[EXT4_FT_MAX] = {
+    "unknown", "file", "dir", "chrdev", "blkdev", "fifo", "sock", "symlink"
+};
+
+/*
+ * The name hashes of fs/ext4/hash.c
+ */
+static uint32_t DxHackHash(const char *name, uint32_t len, bool is_unsigned)
+{
+    uint32_t hash = 0, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    int c = 0;
+    uint32_t i = 0;
+
+    for (i = 0; i < len; i++) {
+        c = is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        if (hash & 0x80000000) {
+            hash -= 0x7fffffff;
+        }
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+static void DxStr2Hashbuf(const char *msg, uint32_t len, uint32_t *buf, int num, bool is_unsigned)
+{
+    uint32_t pad = 0, val = 0, i = 0;
+    int c = 0;
+
+    pad = len | (len << 8);
+    pad |= pad << 16;
+    val = pad;
+    if (len > (uint32_t)num * 4) {
+        len = num * 4;
+    }
+    for (i = 0; i < len; i++) {
+        c = is_unsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = (uint32_t)c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) {
+        *buf++ = val;
+    }
+    while (--num >= 0) {
+        *buf++ = pad;
+    }
+}
+
+#define ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) ((a) += f((b), (c), (d)) + (x), (a) = ROL32((a), (s)))
+#define MD4_K1 0
+#define MD4_K2 013240474631U
+#define MD4_K3 015666365641U
+
+static void DxHalfMd4Transform(uint32_t buf[4], const uint32_t in[8])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    MD4_ROUND(MD4_F, a, b, c, d, in[0] + MD4_K1, 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[1] + MD4_K1, 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[2] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[3] + MD4_K1, 19);
+    MD4_ROUND(MD4_F, a, b, c, d, in[4] + MD4_K1, 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[5] + MD4_K1, 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[6] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[7] + MD4_K1, 19);
+
+    MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+    MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static void DxTeaTransform(uint32_t buf[4], const uint32_t in[4])
+{
+    uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    int n = 16;
+
+    do {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    } while (--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/*
+ * Hash a name the way the htree of a directory does
+ * @name, @len: the name
+ * @version: DX_HASH_*, the unsigned variants included
+ * @seed: s_hash_seed, NULL or all zeros for the default seed
+ * @hash: major hash, bit 0 clear
+ * @minor: minor hash, may be NULL
+ * Return 0 on success, -1 if the hash version is not supported
+ */
+int DxHash(const char *name, uint32_t len, int version, uint32_t *seed, uint32_t *hash, uint32_t *minor)
+{
+    uint32_t buf[4] = {DX_DEFAULT_SEED_0, DX_DEFAULT_SEED_1, DX_DEFAULT_SEED_2, DX_DEFAULT_SEED_3};
+    uint32_t in[8];
+    uint32_t major = 0, minor_hash = 0, i = 0;
+    const char *p = name;
+    int remain = len;
+    bool is_unsigned = false;
+
+    if (seed != NULL && (seed[0] | seed[1] | seed[2] | seed[3]) != 0) {
+        for (i = 0; i < 4; i++) {
+            buf[i] = le32toh(seed[i]);
+        }
+    }
+
+    switch (version) {
+        case DX_HASH_LEGACY_UNSIGNED:
+            is_unsigned = true;
+            /* fall through */
+        case DX_HASH_LEGACY:
+            major = DxHackHash(name, len, is_unsigned);
+            break;
+        case DX_HASH_HALF_MD4_UNSIGNED:
+            is_unsigned = true;
+            /* fall through */
+        case DX_HASH_HALF_MD4:
+            for (; remain > 0; remain -= 32, p += 32) {
+                DxStr2Hashbuf(p, remain, in, 8, is_unsigned);
+                DxHalfMd4Transform(buf, in);
+            }
+            major = buf[1];
+            minor_hash = buf[2];
+            break;
+        case DX_HASH_TEA_UNSIGNED:
+            is_unsigned = true;
+            /* fall through */
+        case DX_HASH_TEA:
+            for (; remain > 0; remain -= 16, p += 16) {
+                DxStr2Hashbuf(p, remain, in, 4, is_unsigned);
+                DxTeaTransform(buf, in);
+            }
+            major = buf[0];
+            minor_hash = buf[1];
+            break;
+        default:
+            return -1;
+    }
+
+    major &= ~1U;
+    if (major == (EXT4_HTREE_EOF_32BIT << 1)) {
+        major = (EXT4_HTREE_EOF_32BIT - 1) << 1;
+    }
+    *hash = major;
+    if (minor != NULL) {
+        *minor = minor_hash;
+    }
+    return 0;
+}
+
+/*
+ * Length of a directory entry from its rec_len, which is encoded to reach
+ * 65536 on filesystems with blocks that large
+ */
+uint32_t DirRecLenGet(struct FileSystem *fs, uint16_t dlen)
+{
+    uint32_t len = le16toh(dlen);
+
+    if (fs->block_size < 65536) {
+        return len;
+    }
+    if (len == EXT4_MAX_REC_LEN || len == 0) {
+        return 65536;
+    }
+    return (len & 65532) | ((len & 3) << 16);
+}
+
+static void DirBlockRelease(struct DirIterator *it)
+{
+    if (it->mapped) {
+        BlockUnmap(it->fs, it->physical);
+    }
+    it->mapped = false;
+    it->physical = 0;
+    it->data = NULL;
+}
+
+/*
+ * Make a logical block of the directory current
+ * Return 1 when it is loaded, 0 for a hole, -1 on failure
+ */
+static int DirBlockLoad(struct DirIterator *it, uint64_t logical)
+{
+    struct FileSystem *fs = it->fs;
+    uint64_t physical = 0;
+
+    DirBlockRelease(it);
+    it->block = logical;
+    it->offset = 0;
+    if (logical > UINT32_MAX || logical * fs->block_size >= it->size) {
+        return -1;
+    }
+    physical = ExtentPhysicalGet(it->map, logical);
+    if (physical == 0) {
+        return 0;
+    }
+
+    it->data = BlockMap(fs, physical, 1);
+    if (it->data != NULL) {
+        it->mapped = true;
+        it->physical = physical;
+        return 1;
+    }
+    if (it->buf == NULL) {
+        it->buf = (char *) malloc(fs->block_size);
+        if (it->buf == NULL) {
+            return -1;
+        }
+    }
+    if (BlockRead(fs, physical, 1, it->buf) == 0) {
+        printf("DirBlockLoad: directory %llu read block %llu failed\n", it->inode, physical);
+        return -1;
+    }
+    it->data = it->buf;
+    it->physical = physical;
+    return 1;
+}
+
+/*
+ * Return the entry at offset of the current block, NULL if it is corrupt
+ */
+static struct ext4_dir_entry_2 *DirEntryGet(struct DirIterator *it, uint32_t offset, uint32_t *rec_len)
+{
+    struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(it->data + offset);
+    uint32_t len = 0;
+
+    if (offset + EXT4_DIR_REC_LEN(0) > it->fs->block_size) {
+        return NULL;
+    }
+    len = DirRecLenGet(it->fs, de->rec_len);
+    if (len < EXT4_DIR_REC_LEN(0) || len % EXT4_DIR_PAD != 0 ||
+            offset + len > it->fs->block_size || EXT4_DIR_REC_LEN(de->name_len) > len) {
+        return NULL;
+    }
+    *rec_len = len;
+    return de;
+}
+
+/*
+ * Open a directory for DirNext
+ * Return 0 on success, -1 if the inode is not a readable directory
+ */
+int DirOpen(struct FileSystem *fs, uint64_t num, struct DirIterator *it)
+{
+    struct ext4_inode inode;
+
+    if (fs == NULL || it == NULL) {
+        return -1;
+    }
+    memset(it, 0, sizeof(struct DirIterator));
+    it->fs = fs;
+    it->inode = num;
+    if (num == 0 || num > fs->inode_count || InodeGetBynum(fs, num, &inode) == 0) {
+        return -1;
+    }
+    if ((le16toh(inode.i_mode) & 0xF000) != 0x4000) {
+        return -1;
+    }
+    if (le32toh(inode.i_flags) & EXT4_INLINE_DATA_FL) {
+        printf("DirOpen: directory %llu has inline data, not supported\n", num);
+        return -1;
+    }
+    it->size = (uint64_t)le32toh(inode.i_size_lo) | (uint64_t)le32toh(inode.i_size_high) << 32;
+    it->map = ExtentMapGet(fs, num);
+    if (it->map == NULL) {
+        return -1;
+    }
+    /* Nothing loaded yet, DirNext starts at block 0 */
+    it->offset = fs->block_size;
+    it->block = (uint64_t)-1;
+    return 0;
+}
+
+/*
+ * Return the next entry in use, NULL at the end or when it->error is set.
+ * The entries of htree directories come in block order, not hash order.
+ */
+struct ext4_dir_entry_2 *DirNext(struct DirIterator *it)
+{
+    struct ext4_dir_entry_2 *de = NULL;
+    uint32_t rec_len = 0;
+    int ret = 0;
+
+    if (it == NULL || it->map == NULL || it->error != 0) {
+        return NULL;
+    }
+    while (true) {
+        if (it->data == NULL || it->offset >= it->fs->block_size) {
+            if ((it->block + 1) * it->fs->block_size >= it->size) {
+                DirBlockRelease(it);
+                return NULL;
+            }
+            ret = DirBlockLoad(it, it->block + 1);
+            if (ret < 0) {
+                it->error = -1;
+                return NULL;
+            }
+            if (ret == 0) {
+                /* A hole, carry on with the next block */
+                it->offset = it->fs->block_size;
+                continue;
+            }
+        }
+        de = DirEntryGet(it, it->offset, &rec_len);
+        if (de == NULL) {
+            printf("DirNext: directory %llu block %llu is corrupt at %u\n", it->inode, it->block, it->offset);
+            it->error = -1;
+            return NULL;
+        }
+        it->offset += rec_len;
+        /* Deleted entries, checksum tails and htree nodes have no inode */
+        if (le32toh(de->inode) != 0) {
+            return de;
+        }
+    }
+}
+
+void DirClose(struct DirIterator *it)
+{
+    if (it == NULL) {
+        return;
+    }
+    DirBlockRelease(it);
+    if (it->map != NULL) {
+        ExtentMapPut(it->fs, it->inode);
+    }
+    free(it->buf);
+    memset(it, 0, sizeof(struct DirIterator));
+}
+
+/*
+ * Look for a name in the current block
+ * Return the inode number, 0 if it is not there
+ */
+static uint64_t DirBlockSearch(struct DirIterator *it, const char *name, uint32_t len, uint8_t *file_type)
+{
+    struct ext4_dir_entry_2 *de = NULL;
+    uint32_t offset = 0, rec_len = 0;
+
+    while (offset < it->fs->block_size) {
+        de = DirEntryGet(it, offset, &rec_len);
+        if (de == NULL) {
+            printf("DirLookup: directory %llu block %llu is corrupt at %u\n", it->inode, it->block, offset);
+            it->error = -1;
+            return 0;
+        }
+        if (le32toh(de->inode) != 0 && de->name_len == len && memcmp(de->name, name, len) == 0) {
+            if (file_type != NULL) {
+                *file_type = de->file_type;
+            }
+            return le32toh(de->inode);
+        }
+        offset += rec_len;
+    }
+    return 0;
+}
+
+/*
+ * Load an index block and return its entries, NULL if it is not one
+ */
+static struct dx_entry *DxEntriesGet(struct DirIterator *it, uint64_t logical, uint32_t *count)
+{
+    struct dx_root *root = NULL;
+    struct dx_node *node = NULL;
+    struct dx_entry *entries = NULL;
+    struct dx_countlimit *cl = NULL;
+    uint32_t limit = 0;
+
+    if (DirBlockLoad(it, logical) <= 0) {
+        return NULL;
+    }
+    if (logical == 0) {
+        root = (struct dx_root *)it->data;
+        entries = (struct dx_entry *)((char *)&root->info + root->info.info_length);
+    } else {
+        node = (struct dx_node *)it->data;
+        if (le32toh(node->fake.inode) != 0 || DirRecLenGet(it->fs, node->fake.rec_len) != it->fs->block_size) {
+            return NULL;
+        }
+        entries = node->entries;
+    }
+    cl = (struct dx_countlimit *)entries;
+    *count = le16toh(cl->count);
+    limit = le16toh(cl->limit);
+    if (*count == 0 || *count > limit ||
+            (char *)(entries + limit) > it->data + it->fs->block_size) {
+        return NULL;
+    }
+    return entries;
+}
+
+/*
+ * Hashed lookup in an htree directory, reads one block per tree level
+ * plus the leaves holding the hash.
+ * The path down is kept per level, so names whose hashes collide can be
+ * followed into the next leaf even when it hangs off another index node,
+ * stepping up and over the way ext4_htree_next_block does.
+ * Return 0 when the lookup is done, *num is 0 if the name is not there,
+ * -1 if the index cannot be used and the directory has to be searched
+ */
+static int DxLookup(struct DirIterator *it, const char *name, uint32_t len, uint8_t *file_type, uint64_t *num)
+{
+    struct FileSystem *fs = it->fs;
+    struct dx_root *root = NULL;
+    struct dx_entry *entries = NULL, *p = NULL, *q = NULL, *m = NULL;
+    uint64_t nodes[EXT4_HTREE_LEVEL];   /* index block of each level */
+    uint32_t counts[EXT4_HTREE_LEVEL], indexes[EXT4_HTREE_LEVEL];
+    uint64_t node = 0;
+    uint32_t hash = 0, next = 0, count = 0, index = 0, levels = 0, level = 0, max_levels = 0;
+    int version = 0;
+
+    *num = 0;
+    if (DirBlockLoad(it, 0) <= 0) {
+        return -1;
+    }
+    root = (struct dx_root *)it->data;
+    version = root->info.hash_version;
+    levels = root->info.indirect_levels;
+    max_levels = HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_LARGEDIR) ?
+            EXT4_HTREE_LEVEL : EXT4_HTREE_LEVEL_COMPAT;
+    if (root->info.reserved_zero != 0 || root->info.info_length != 8 || levels >= max_levels) {
+        return -1;
+    }
+    if (version <= DX_HASH_TEA && (le32toh(fs->super.s_flags) & EXT2_FLAGS_UNSIGNED_HASH)) {
+        version += 3;
+    }
+    if (DxHash(name, len, version, fs->super.s_hash_seed, &hash, NULL) < 0) {
+        return -1;
+    }
+
+    for (level = 0; ; level++) {
+        entries = DxEntriesGet(it, node, &count);
+        if (entries == NULL) {
+            return -1;
+        }
+        /* entries[0] holds the count, its block covers hashes below entries[1] */
+        p = entries + 1;
+        q = entries + count - 1;
+        while (p <= q) {
+            m = p + (q - p) / 2;
+            if (le32toh(m->hash) > hash) {
+                q = m - 1;
+            } else {
+                p = m + 1;
+            }
+        }
+        index = p - 1 - entries;
+        nodes[level] = node;
+        counts[level] = count;
+        indexes[level] = index;
+        node = le32toh(entries[index].block) & 0x0fffffff;
+        if (level == levels) {
+            break;
+        }
+    }
+
+    /* Names whose hashes collide may go on in the following leaves */
+    while (true) {
+        if (DirBlockLoad(it, node) <= 0) {
+            return -1;
+        }
+        *num = DirBlockSearch(it, name, len, file_type);
+        if (*num != 0 || it->error != 0) {
+            break;
+        }
+
+        /* Up to the nearest level with an entry to the right */
+        level = levels;
+        while (indexes[level] + 1 >= counts[level] && level > 0) {
+            level--;
+        }
+        if (indexes[level] + 1 >= counts[level]) {
+            break;
+        }
+        entries = DxEntriesGet(it, nodes[level], &count);
+        if (entries == NULL || count != counts[level]) {
+            return -1;
+        }
+        indexes[level]++;
+        next = le32toh(entries[indexes[level]].hash);
+        if ((next & ~1U) != hash) {
+            break;
+        }
+        node = le32toh(entries[indexes[level]].block) & 0x0fffffff;
+
+        /* and down the first entries of the nodes below it */
+        while (level < levels) {
+            level++;
+            entries = DxEntriesGet(it, node, &count);
+            if (entries == NULL) {
+                return -1;
+            }
+            nodes[level] = node;
+            counts[level] = count;
+            indexes[level] = 0;
+            node = le32toh(entries[0].block) & 0x0fffffff;
+        }
+    }
+    return it->error != 0 ? -1 : 0;
+}
+
+/*
+ * Find a name in a directory, through the htree index when there is one
+ * @fs: FileSystem
+ * @dir: inode number of the directory
+ * @name, @len: the name, not NUL terminated
+ * @file_type: EXT4_FT_* of the entry, may be NULL
+ * Return the inode number, 0 if the name is not there, (uint64_t)-1 if
+ * dir is not a directory or cannot be read
+ */
+uint64_t DirLookup(struct FileSystem *fs, uint64_t dir, const char *name, uint32_t len, uint8_t *file_type)
+{
+    struct DirIterator it;
+    struct ext4_dir_entry_2 *de = NULL;
+    struct ext4_inode inode;
+    uint64_t num = 0;
+    bool dots = false;
+
+    if (name == NULL || len == 0 || len > EXT4_NAME_LEN) {
+        return 0;
+    }
+    if (DirOpen(fs, dir, &it) < 0) {
+        return -1;
+    }
+
+    dots = (len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.');
+    if (!dots && HAS_COMPAT_FEATURE(fs->super, EXT4_FEATURE_COMPAT_DIR_INDEX) &&
+            InodeGetBynum(fs, dir, &inode) != 0 &&
+            (le32toh(inode.i_flags) & EXT4_INDEX_FL) &&
+            !(le32toh(inode.i_flags) & (EXT4_CASEFOLD_FL | EXT4_ENCRYPT_FL))) {
+        if (DxLookup(&it, name, len, file_type, &num) == 0) {
+            DirClose(&it);
+            return num;
+        }
+        /* Like the kernel, a broken index falls back to the linear search */
+        DirClose(&it);
+        if (DirOpen(fs, dir, &it) < 0) {
+            return -1;
+        }
+    }
+
+    while ((de = DirNext(&it)) != NULL) {
+        if (de->name_len == len && memcmp(de->name, name, len) == 0) {
+            num = le32toh(de->inode);
+            if (file_type != NULL) {
+                *file_type = de->file_type;
+            }
+            break;
+        }
+    }
+    if (it.error != 0) {
+        num = -1;
+    }
+    DirClose(&it);
+    return num;
+}
+
+void DirPrintBynum(struct FileSystem *fs, uint64_t num)
+{
+    struct DirIterator it;
+    struct ext4_dir_entry_2 *de = NULL;
+    uint64_t count = 0;
+
+    if (DirOpen(fs, num, &it) < 0) {
+        printf("Inode %llu is not a readable directory\n", num);
+        return;
+    }
+    while ((de = DirNext(&it)) != NULL) {
+        printf("%u\t%s\t%.*s\n", le32toh(de->inode),
+                (de->file_type & 7) < EXT4_FT_MAX ? dir_file_types[de->file_type & 7] : "unknown",
+                de->name_len, de->name);
+        count++;
+    }
+    if (it.error != 0) {
+        printf("Listing stopped by a corrupt block\n");
+    }
+    printf("%llu entries\n", count);
+    DirClose(&it);
+}
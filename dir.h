@@ -0,0 +1,39 @@
+#ifndef DIR_H
+#define DIR_H
+
+#include "filesystem.h"
+#include "extent.h"
+#include "ext4_htree.h"
+
+/*
+ * Walks the entries of a directory in place, in block order.
+ * Entries point into the current block and stay valid until the next
+ * DirNext that moves to another block, nothing is allocated per entry.
+ * In mmap mode blocks are used straight from the mapping, otherwise they
+ * are read into one buffer.
+ */
+struct DirIterator {
+    struct FileSystem *fs;
+    uint64_t inode;
+    struct ExtentMap *map;  /* held with ExtentMapGet */
+    uint64_t size;
+    uint64_t block;         /* logical block of data */
+    uint64_t physical;      /* physical block of data, 0 if it is not loaded */
+    bool mapped;            /* data is in the mapping and must be unmapped */
+    char *data;
+    char *buf;              /* block_size bytes when blocks are read */
+    uint32_t offset;        /* of the next entry in data */
+    int error;              /* set when a block is corrupt or unreadable */
+};
+
+int DirOpen(struct FileSystem *, uint64_t, struct DirIterator *);
+struct ext4_dir_entry_2 *DirNext(struct DirIterator *);
+void DirClose(struct DirIterator *);
+
+uint64_t DirLookup(struct FileSystem *, uint64_t, const char *, uint32_t, uint8_t *);
+int DxHash(const char *, uint32_t, int, uint32_t *, uint32_t *, uint32_t *);
+uint32_t DirRecLenGet(struct FileSystem *, uint16_t);
+
+void DirPrintBynum(struct FileSystem *, uint64_t);
+
+#endif /* DIR_H */
@@ -0,0 +1,83 @@
+#ifndef _EXT4_HTREE
+#define _EXT4_HTREE
+
+#include <stdint.h>
+#include <linux/types.h>
+
+/*
+ * Hash tree directory index, from fs/ext4/namei.c.
+ * The root lives in the first directory block behind fake "." and ".."
+ * entries, interior nodes behind one fake empty entry covering the block.
+ */
+
+struct fake_dirent
+{
+	__le32 inode;
+	__le16 rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
+};
+
+struct dx_countlimit
+{
+	__le16 limit;
+	__le16 count;
+};
+
+struct dx_entry
+{
+	__le32 hash;
+	__le32 block;
+};
+
+/*
+ * dx_root_info is laid out so that if it should somehow get overlaid by a
+ * dirent the two low bits of the hash version will be zero.  Therefore, the
+ * hash version mod 4 should never be 0.  Sincerely, the paranoia department.
+ */
+
+struct dx_root
+{
+	struct fake_dirent dot;
+	char dot_name[4];
+	struct fake_dirent dotdot;
+	char dotdot_name[4];
+	struct dx_root_info
+	{
+		__le32 reserved_zero;
+		uint8_t hash_version;
+		uint8_t info_length; /* 8 */
+		uint8_t indirect_levels;
+		uint8_t unused_flags;
+	}
+	info;
+	struct dx_entry	entries[0];
+};
+
+struct dx_node
+{
+	struct fake_dirent fake;
+	struct dx_entry	entries[0];
+};
+
+/*
+ * This goes at the end of each htree block.
+ */
+struct dx_tail {
+	__le32 dt_reserved;
+	__le32 dt_checksum;	/* crc32c(uuid+inum+dirblock) */
+};
+
+/* s_flags, the hash of the filesystem treats names as unsigned char */
+#define EXT2_FLAGS_SIGNED_HASH		0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002
+
+#define EXT4_CASEFOLD_FL		0x40000000 /* Casefolded directory */
+
+#define DX_HASH_SIPHASH			6
+
+/* Levels below the root, EXT4_FEATURE_INCOMPAT_LARGEDIR allows one more */
+#define EXT4_HTREE_LEVEL_COMPAT		2
+#define EXT4_HTREE_LEVEL		3
+
+#endif /* _EXT4_HTREE */
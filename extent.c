@@ -0,0 +1,607 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "extent.h"
+#include "readbatch.h"
+#include "indirect.h"
+#include "metaindex.h"
+
+/*
+ * Check a tree node header
+ * @hdr: the header
+ * @max: most entries the node can hold
+ * @depth: depth the node must have
+ * Return 0 if the header is sane, -1 otherwise
+ */
+static int ExtentHeaderCheck(struct ext4_extent_header *hdr, uint16_t max, uint16_t depth)
+{
+    if (le16toh(hdr->eh_magic) != EXT4_EXT_MAGIC) {
+        return -1;
+    }
+    if (le16toh(hdr->eh_max) > max || le16toh(hdr->eh_entries) > le16toh(hdr->eh_max)) {
+        return -1;
+    }
+    if (le16toh(hdr->eh_depth) != depth) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Add a run at the end of a map, it is merged into the last record when
+ * it continues it
+ * @len: blocks, with EXTENT_RECORD_UNWRITTEN
+ * Return 0 on success, -1 if memory runs out
+ */
+int ExtentMapAppend(struct ExtentMap *map, uint32_t logical, uint64_t physical, uint32_t len)
+{
+    struct ExtentRecord *records = NULL, *last = NULL;
+    uint64_t capacity = 0;
+
+    map->blocks += len & ~EXTENT_RECORD_UNWRITTEN;
+    if (map->count > 0) {
+        last = &(map->records[map->count - 1]);
+        if ((uint64_t)last->logical + EXTENT_RECORD_LEN(last) == logical &&
+                last->physical + EXTENT_RECORD_LEN(last) == physical &&
+                (last->len & EXTENT_RECORD_UNWRITTEN) == (len & EXTENT_RECORD_UNWRITTEN) &&
+                (uint64_t)EXTENT_RECORD_LEN(last) + (len & ~EXTENT_RECORD_UNWRITTEN) < EXTENT_RECORD_UNWRITTEN) {
+            last->len += len & ~EXTENT_RECORD_UNWRITTEN;
+            return 0;
+        }
+    }
+    if (map->count == map->capacity) {
+        capacity = map->capacity ? map->capacity * 2 : 16;
+        records = (struct ExtentRecord *) realloc(map->records, sizeof(struct ExtentRecord) * capacity);
+        if (records == NULL) {
+            return -1;
+        }
+        map->records = records;
+        map->capacity = capacity;
+    }
+    map->records[map->count].logical = logical;
+    map->records[map->count].physical = physical;
+    map->records[map->count].len = len;
+    map->count++;
+    return 0;
+}
+
+/*
+ * Remember a tree node or pointer block of the map
+ * Return 0 on success, -1 if memory runs out
+ */
+int ExtentMapMetaAdd(struct ExtentMap *map, uint64_t block)
+{
+    uint64_t *meta = NULL;
+    uint64_t capacity = 0;
+
+    if (map->meta_count == map->meta_capacity) {
+        capacity = map->meta_capacity ? map->meta_capacity * 2 : 4;
+        meta = (uint64_t *) realloc(map->meta, sizeof(uint64_t) * capacity);
+        if (meta == NULL) {
+            return -1;
+        }
+        map->meta = meta;
+        map->meta_capacity = capacity;
+    }
+    map->meta[map->meta_count++] = block;
+    return 0;
+}
+
+static int ExtentRecordCompare(const void *a, const void *b)
+{
+    const struct ExtentRecord *x = (const struct ExtentRecord *)a;
+    const struct ExtentRecord *y = (const struct ExtentRecord *)b;
+
+    if (x->logical != y->logical) {
+        return x->logical < y->logical ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Decode the extents of a leaf into map
+ * Return 0 on success, -1 on a corrupt extent or allocation failure
+ */
+static int ExtentLeafDecode(struct FileSystem *fs, struct ext4_extent_header *hdr, struct ExtentMap *map)
+{
+    struct ext4_extent *ex = EXT_FIRST_EXTENT(hdr);
+    uint64_t physical = 0;
+    uint32_t len = 0, flag = 0;
+    uint16_t i = 0;
+
+    for (i = 0; i < le16toh(hdr->eh_entries); i++, ex++) {
+        len = le16toh(ex->ee_len);
+        flag = 0;
+        if (len > EXT_INIT_MAX_LEN) {
+            len -= EXT_INIT_MAX_LEN;
+            flag = EXTENT_RECORD_UNWRITTEN;
+        }
+        if (len == 0) {
+            continue;
+        }
+        physical = (uint64_t)le32toh(ex->ee_start_lo) | (uint64_t)le16toh(ex->ee_start_hi) << 32;
+        if (physical + len > fs->block_count || physical + len < physical) {
+            printf("ExtentMapBuild: inode %llu extent at %u points outside the filesystem\n",
+                    map->inode, le32toh(ex->ee_block));
+            return -1;
+        }
+        if (ExtentMapAppend(map, le32toh(ex->ee_block), physical, len | flag) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Sort the records, refuse overlaps, and merge runs contiguous both in
+ * logical and physical blocks
+ */
+static int ExtentMapCompact(struct ExtentMap *map)
+{
+    struct ExtentRecord *cur = NULL, *last = NULL;
+    uint64_t i = 0, n = 0;
+    bool sorted = true;
+
+    for (i = 1; i < map->count; i++) {
+        if (map->records[i].logical < map->records[i - 1].logical) {
+            sorted = false;
+            break;
+        }
+    }
+    if (!sorted) {
+        qsort(map->records, map->count, sizeof(struct ExtentRecord), ExtentRecordCompare);
+    }
+
+    map->blocks = 0;
+    for (i = 0; i < map->count; i++) {
+        cur = &(map->records[i]);
+        map->blocks += EXTENT_RECORD_LEN(cur);
+        if (n > 0) {
+            last = &(map->records[n - 1]);
+            if ((uint64_t)last->logical + EXTENT_RECORD_LEN(last) > cur->logical) {
+                printf("ExtentMapBuild: inode %llu extents overlap at %u\n", map->inode, cur->logical);
+                return -1;
+            }
+            if (last->logical + EXTENT_RECORD_LEN(last) == cur->logical &&
+                    last->physical + EXTENT_RECORD_LEN(last) == cur->physical &&
+                    (last->len & EXTENT_RECORD_UNWRITTEN) == (cur->len & EXTENT_RECORD_UNWRITTEN) &&
+                    (uint64_t)EXTENT_RECORD_LEN(last) + EXTENT_RECORD_LEN(cur) < EXTENT_RECORD_UNWRITTEN) {
+                last->len += EXTENT_RECORD_LEN(cur);
+                continue;
+            }
+        }
+        map->records[n++] = *cur;
+    }
+    map->count = n;
+    return 0;
+}
+
+/*
+ * Flatten the extent tree of an inode into a sorted array of records.
+ * The tree is walked a level at a time and all nodes of a level are read
+ * together with ReadBatch, so a deep tree costs one batch per level rather
+ * than one read per node.
+ * @fs: FileSystem
+ * @num: inode number, kept in the map and used in messages
+ * @pinode: the inode
+ * @map: filled in, released by ExtentMapRelease
+ * Return 0 on success, -1 if the inode has no extent tree or it is corrupt
+ */
+int ExtentMapBuild(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode, struct ExtentMap *map)
+{
+    struct ext4_extent_header *root = NULL, *hdr = NULL;
+    struct ext4_extent_idx *idx = NULL;
+    struct ReadRequest *reqs = NULL;
+    char *nodes = NULL, *children = NULL;
+    uint64_t node_count = 1, child_count = 0, leaf = 0, i = 0;
+    uint16_t depth = 0, node_max = 0, j = 0;
+
+    if (fs == NULL || pinode == NULL || map == NULL) {
+        return -1;
+    }
+    memset(map, 0, sizeof(struct ExtentMap));
+    map->inode = num;
+    if (!(le32toh(pinode->i_flags) & EXT4_EXTENTS_FL)) {
+        return -1;
+    }
+
+    root = (struct ext4_extent_header *)pinode->i_block;
+    depth = le16toh(root->eh_depth);
+    node_max = (fs->block_size - sizeof(struct ext4_extent_header)) / sizeof(struct ext4_extent);
+    if (depth > EXT4_MAX_EXTENT_DEPTH ||
+            ExtentHeaderCheck(root, (sizeof(pinode->i_block) - sizeof(struct ext4_extent_header)) / sizeof(struct ext4_extent), depth) < 0) {
+        printf("ExtentMapBuild: inode %llu has a bad extent header\n", num);
+        return -1;
+    }
+
+    /* Until the first level is read, the only node is the one in the inode */
+    while (depth > 0) {
+        child_count = 0;
+        for (i = 0; i < node_count; i++) {
+            hdr = nodes ? (struct ext4_extent_header *)(nodes + i * fs->block_size) : root;
+            child_count += le16toh(hdr->eh_entries);
+        }
+        children = (char *) malloc(fs->block_size * (child_count ? child_count : 1));
+        reqs = (struct ReadRequest *) calloc(child_count ? child_count : 1, sizeof(struct ReadRequest));
+        if (children == NULL || reqs == NULL) {
+            printf("ExtentMapBuild: allocate memory failed\n");
+            goto fail;
+        }
+
+        child_count = 0;
+        for (i = 0; i < node_count; i++) {
+            hdr = nodes ? (struct ext4_extent_header *)(nodes + i * fs->block_size) : root;
+            idx = EXT_FIRST_INDEX(hdr);
+            for (j = 0; j < le16toh(hdr->eh_entries); j++, idx++) {
+                leaf = (uint64_t)le32toh(idx->ei_leaf_lo) | (uint64_t)le16toh(idx->ei_leaf_hi) << 32;
+                if (leaf == 0 || leaf >= fs->block_count) {
+                    printf("ExtentMapBuild: inode %llu index at %u points outside the filesystem\n",
+                            num, le32toh(idx->ei_block));
+                    goto fail;
+                }
+                if (ExtentMapMetaAdd(map, leaf) < 0) {
+                    printf("ExtentMapBuild: allocate memory failed\n");
+                    goto fail;
+                }
+                reqs[child_count].offset = leaf * fs->block_size;
+                reqs[child_count].len = fs->block_size;
+                reqs[child_count].buf = children + child_count * fs->block_size;
+                child_count++;
+            }
+        }
+        if (ReadBatch(fs, reqs, child_count, NULL, NULL) < 0) {
+            printf("ExtentMapBuild: inode %llu read tree nodes failed\n", num);
+            goto fail;
+        }
+
+        depth--;
+        for (i = 0; i < child_count; i++) {
+            if (ExtentHeaderCheck((struct ext4_extent_header *)(children + i * fs->block_size), node_max, depth) < 0) {
+                printf("ExtentMapBuild: inode %llu node at block %llu is corrupt\n",
+                        num, reqs[i].offset / fs->block_size);
+                goto fail;
+            }
+        }
+        free(reqs);
+        reqs = NULL;
+        free(nodes);
+        nodes = children;
+        children = NULL;
+        node_count = child_count;
+    }
+
+    for (i = 0; i < node_count; i++) {
+        hdr = nodes ? (struct ext4_extent_header *)(nodes + i * fs->block_size) : root;
+        if (ExtentLeafDecode(fs, hdr, map) < 0) {
+            goto fail;
+        }
+    }
+    free(nodes);
+    nodes = NULL;
+    if (ExtentMapCompact(map) < 0) {
+        goto fail;
+    }
+
+    return 0;
+fail:
+    free(reqs);
+    free(children);
+    free(nodes);
+    ExtentMapRelease(map);
+    return -1;
+}
+
+void ExtentMapRelease(struct ExtentMap *map)
+{
+    if (map == NULL) {
+        return;
+    }
+    free(map->records);
+    free(map->meta);
+    map->records = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->blocks = 0;
+    map->meta = NULL;
+    map->meta_count = 0;
+    map->meta_capacity = 0;
+}
+
+/*
+ * Find the record mapping a logical block
+ * Return the index of the record, -1 if the block is in a hole
+ */
+int64_t ExtentLookup(struct ExtentMap *map, uint32_t logical)
+{
+    uint64_t low = 0, high = 0, mid = 0;
+
+    if (map == NULL || map->count == 0) {
+        return -1;
+    }
+    /* Last record starting at or before logical */
+    high = map->count;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (map->records[mid].logical <= logical) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return -1;
+    }
+    low--;
+    if ((uint64_t)map->records[low].logical + EXTENT_RECORD_LEN(&(map->records[low])) <= logical) {
+        return -1;
+    }
+    return low;
+}
+
+/*
+ * Return the physical block of a logical block, 0 if it is in a hole
+ */
+uint64_t ExtentPhysicalGet(struct ExtentMap *map, uint32_t logical)
+{
+    int64_t index = ExtentLookup(map, logical);
+
+    if (index < 0) {
+        return 0;
+    }
+    return map->records[index].physical + (logical - map->records[index].logical);
+}
+
+void ExtentMapPrint(struct ExtentMap *map)
+{
+    struct ExtentRecord *rec = NULL;
+    uint64_t i = 0;
+
+    printf("Inode: %llu\tExtents: %llu\tBlocks: %llu\n", map->inode, map->count, map->blocks);
+    for (i = 0; i < map->count; i++) {
+        rec = &(map->records[i]);
+        printf("\t%u ~ %u -> %llu ~ %llu%s\n", rec->logical, rec->logical + EXTENT_RECORD_LEN(rec) - 1,
+                rec->physical, rec->physical + EXTENT_RECORD_LEN(rec) - 1,
+                (rec->len & EXTENT_RECORD_UNWRITTEN) ? " unwritten" : "");
+    }
+}
+
+/*
+ * Set up the extent map cache of the FileSystem
+ * @fs: FileSystem
+ * @capacity: how many inodes' maps are kept at most, 0 for EXTENT_CACHE_ENTRIES
+ */
+int ExtentCacheInit(struct FileSystem *fs, uint64_t capacity)
+{
+    struct ExtentCache *cache = NULL;
+
+    if (fs == NULL) {
+        return -1;
+    }
+    if (capacity == 0) {
+        capacity = EXTENT_CACHE_ENTRIES;
+    }
+
+    cache = (struct ExtentCache *) calloc(1, sizeof(struct ExtentCache));
+    if (cache == NULL) {
+        return -1;
+    }
+    cache->capacity = capacity;
+    cache->bucket_count = capacity * 2;
+    cache->buckets = (struct ExtentCacheEntry **) calloc(cache->bucket_count, sizeof(struct ExtentCacheEntry *));
+    if (cache->buckets == NULL) {
+        free(cache);
+        return -1;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+
+    fs->extent_cache = cache;
+    return 0;
+}
+
+static void EntryFree(struct ExtentCacheEntry *entry)
+{
+    ExtentMapRelease(&(entry->map));
+    free(entry);
+}
+
+void ExtentCacheRelease(struct FileSystem *fs)
+{
+    struct ExtentCache *cache = NULL;
+    struct LruNode *node = NULL, *next = NULL;
+
+    if (fs == NULL || fs->extent_cache == NULL) {
+        return;
+    }
+    cache = fs->extent_cache;
+    for (node = cache->lru.head; node != NULL; node = next) {
+        next = node->next;
+        EntryFree(LRU_ENTRY(node, struct ExtentCacheEntry, lru));
+    }
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->loaded);
+    free(cache->buckets);
+    free(cache);
+    fs->extent_cache = NULL;
+}
+
+void ExtentCachePrint(struct FileSystem *fs)
+{
+    struct ExtentCache *cache = fs->extent_cache;
+
+    if (cache == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    printf("Extent cache: %llu/%llu entries, %llu hits, %llu misses, %llu evictions\n",
+            cache->count, cache->capacity, cache->hits, cache->misses, cache->evictions);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static uint64_t ExtentHash(struct ExtentCache *cache, uint64_t num)
+{
+    return (num * 0x9E3779B97F4A7C15ULL >> 17) % cache->bucket_count;
+}
+
+static struct ExtentCacheEntry *EntryLookup(struct ExtentCache *cache, uint64_t num)
+{
+    struct ExtentCacheEntry *entry = cache->buckets[ExtentHash(cache, num)];
+
+    while (entry != NULL && entry->inode != num) {
+        entry = entry->hnext;
+    }
+    return entry;
+}
+
+/*
+ * Take an entry out of both the hash chain and the LRU list
+ */
+static void EntryUnlink(struct ExtentCache *cache, struct ExtentCacheEntry *entry)
+{
+    struct ExtentCacheEntry **pp = &(cache->buckets[ExtentHash(cache, entry->inode)]);
+
+    while (*pp != NULL && *pp != entry) {
+        pp = &((*pp)->hnext);
+    }
+    if (*pp != NULL) {
+        *pp = entry->hnext;
+    }
+    LruRemove(&cache->lru, &entry->lru);
+    cache->count--;
+}
+
+static bool EntryDrop(struct LruNode *node, void *arg)
+{
+    struct ExtentCache *cache = (struct ExtentCache *)arg;
+    struct ExtentCacheEntry *entry = LRU_ENTRY(node, struct ExtentCacheEntry, lru);
+
+    if (entry->refs != 0 || !entry->ready) {
+        return false;
+    }
+    EntryUnlink(cache, entry);
+    EntryFree(entry);
+    return true;
+}
+
+/*
+ * Drop least recently used entries nobody holds until there is room for one more
+ */
+static void CacheEvict(struct ExtentCache *cache)
+{
+    cache->evictions += LruEvict(&cache->lru, &cache->count, cache->capacity, EntryDrop, cache);
+}
+
+/*
+ * Get the flattened block map of an inode through the cache, built from
+ * the extent tree or from the indirect blocks
+ * @fs: FileSystem
+ * @num: inode number
+ * Return the map or NULL if the inode cannot be read or has no block map.
+ * The map stays valid until it is released by ExtentMapPut.
+ */
+struct ExtentMap *ExtentMapGet(struct FileSystem *fs, uint64_t num)
+{
+    struct ExtentCache *cache = NULL;
+    struct ExtentCacheEntry *entry = NULL;
+    struct ExtentMap *map = NULL;
+    struct ext4_inode inode;
+    uint64_t bucket = 0;
+    int ret = -1;
+
+    if (fs == NULL || fs->extent_cache == NULL || num == 0 || num > fs->inode_count) {
+        return NULL;
+    }
+    cache = fs->extent_cache;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = EntryLookup(cache, num);
+    if (entry != NULL) {
+        cache->hits++;
+        entry->refs++;
+        LruTouch(&cache->lru, &entry->lru);
+        while (!entry->ready && !entry->failed) {
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+        }
+        if (entry->failed) {
+            entry->refs--;
+            if (entry->refs == 0) {
+                EntryFree(entry);
+            }
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+        map = &(entry->map);
+        pthread_mutex_unlock(&cache->lock);
+        return map;
+    }
+
+    cache->misses++;
+    CacheEvict(cache);
+    entry = (struct ExtentCacheEntry *) calloc(1, sizeof(struct ExtentCacheEntry));
+    if (entry == NULL) {
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    entry->inode = num;
+    entry->refs = 1;
+    bucket = ExtentHash(cache, num);
+    entry->hnext = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    LruPushFront(&cache->lru, &entry->lru);
+    cache->count++;
+    pthread_mutex_unlock(&cache->lock);
+
+    /* Build without the lock, others asking for this inode wait on loaded */
+    if (MetaIndexExtentMapGet(fs, num, &(entry->map)) == 0) {
+        ret = 0;
+    } else if (InodeGetBynum(fs, num, &inode) != 0) {
+        if (le32toh(inode.i_flags) & EXT4_EXTENTS_FL) {
+            ret = ExtentMapBuild(fs, num, &inode, &(entry->map));
+        } else {
+            ret = IndirectMapBuild(fs, num, &inode, &(entry->map));
+        }
+    }
+    if (ret < 0) {
+        pthread_mutex_lock(&cache->lock);
+        EntryUnlink(cache, entry);
+        entry->failed = true;
+        entry->refs--;
+        if (entry->refs == 0) {
+            EntryFree(entry);
+        }
+        pthread_cond_broadcast(&cache->loaded);
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    entry->ready = true;
+    map = &(entry->map);
+    pthread_cond_broadcast(&cache->loaded);
+    pthread_mutex_unlock(&cache->lock);
+
+    return map;
+}
+
+/*
+ * Release a map got by ExtentMapGet
+ */
+void ExtentMapPut(struct FileSystem *fs, uint64_t num)
+{
+    struct ExtentCache *cache = NULL;
+    struct ExtentCacheEntry *entry = NULL;
+
+    if (fs == NULL || fs->extent_cache == NULL) {
+        return;
+    }
+    cache = fs->extent_cache;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = EntryLookup(cache, num);
+    if (entry != NULL && entry->refs > 0) {
+        entry->refs--;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
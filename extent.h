@@ -0,0 +1,74 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include "filesystem.h"
+#include "lru.h"
+#include "ext4_extents.h"
+
+/* Default number of extent maps kept by the cache */
+#define EXTENT_CACHE_ENTRIES    256
+
+/* Set in ExtentRecord.len for unwritten (preallocated) blocks */
+#define EXTENT_RECORD_UNWRITTEN 0x80000000U
+#define EXTENT_RECORD_LEN(r)    ((r)->len & ~EXTENT_RECORD_UNWRITTEN)
+
+/*
+ * One run of logical blocks mapped to contiguous physical blocks.
+ * Adjacent on-disk extents are merged, so a record may be longer than
+ * EXT_INIT_MAX_LEN.
+ */
+struct ExtentRecord {
+    uint64_t physical;
+    uint32_t logical;
+    uint32_t len;       /* blocks, with EXTENT_RECORD_UNWRITTEN */
+};
+
+struct ExtentMap {
+    uint64_t inode;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t blocks;                /* mapped blocks */
+    struct ExtentRecord *records;   /* sorted by logical, not overlapping */
+    uint64_t meta_count;
+    uint64_t meta_capacity;
+    uint64_t *meta;                 /* tree node or pointer blocks, a level at a time */
+};
+
+struct ExtentCacheEntry {
+    uint64_t inode;
+    uint32_t refs;          /* users holding map, see ExtentMapGet */
+    bool ready;             /* map is built */
+    bool failed;            /* build failed, entry is already unlinked */
+    struct ExtentMap map;
+    struct LruNode lru;             /* most recently used first */
+    struct ExtentCacheEntry *hnext; /* hash chain */
+};
+
+struct ExtentCache {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t bucket_count;
+    struct ExtentCacheEntry **buckets;
+    struct LruList lru;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+int ExtentMapBuild(struct FileSystem *, uint64_t, struct ext4_inode *, struct ExtentMap *);
+void ExtentMapRelease(struct ExtentMap *);
+int ExtentMapAppend(struct ExtentMap *, uint32_t, uint64_t, uint32_t);
+int ExtentMapMetaAdd(struct ExtentMap *, uint64_t);
+int64_t ExtentLookup(struct ExtentMap *, uint32_t);
+uint64_t ExtentPhysicalGet(struct ExtentMap *, uint32_t);
+void ExtentMapPrint(struct ExtentMap *);
+
+int ExtentCacheInit(struct FileSystem *, uint64_t);
+void ExtentCacheRelease(struct FileSystem *);
+void ExtentCachePrint(struct FileSystem *);
+struct ExtentMap *ExtentMapGet(struct FileSystem *, uint64_t);
+void ExtentMapPut(struct FileSystem *, uint64_t);
+
+#endif /* EXTENT_H */
@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/sendfile.h>
+
+#include "extract.h"
+#include "extent.h"
+#include "readbatch.h"
+
+/* Longest single sendfile, the kernel caps it there anyway */
+#define EXTRACT_SENDFILE_MAX    0x7ffff000ULL
+
+/*
+ * The data goes to out, which is usually stdout, so every message of this
+ * file goes to stderr.
+ */
+struct ExtractContext {
+    struct FileSystem *fs;
+    int out;
+    uint64_t readahead;
+    struct ExtractSegment *segs;
+    uint64_t count;
+    uint64_t capacity;
+    char *buf;              /* readahead bytes, only without sendfile */
+    struct ExtractStats *stats;
+};
+
+static const char extract_zeros[65536];
+
+static double ExtractSecondsGet(struct timespec *begin)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+static int SegmentAppend(struct ExtractContext *ctx, uint64_t offset, uint64_t physical, uint64_t len)
+{
+    struct ExtractSegment *last = NULL;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (ctx->count > 0) {
+        last = &(ctx->segs[ctx->count - 1]);
+        if (physical == 0 && last->physical == 0) {
+            last->len += len;
+            return 0;
+        }
+    }
+    if (ArrayReserve((void **)&ctx->segs, &ctx->capacity, ctx->count, sizeof(struct ExtractSegment), 1) < 0) {
+        return -1;
+    }
+    ctx->segs[ctx->count].offset = offset;
+    ctx->segs[ctx->count].physical = physical;
+    ctx->segs[ctx->count].len = len;
+    ctx->count++;
+    return 0;
+}
+
+/*
+ * Turn the extent map into the segments of the file up to size.
+ * Data segments are cut to at most readahead bytes, holes and unwritten
+ * extents become zeros.
+ */
+static int SegmentsBuild(struct ExtractContext *ctx, struct ExtentMap *map, uint64_t size)
+{
+    struct ExtentRecord *rec = NULL;
+    uint64_t block_size = ctx->fs->block_size;
+    uint64_t pos = 0, start = 0, len = 0, piece = 0, i = 0;
+
+    for (i = 0; i < map->count && pos < size; i++) {
+        rec = &(map->records[i]);
+        start = (uint64_t)rec->logical * block_size;
+        if (start >= size) {
+            break;
+        }
+        if (SegmentAppend(ctx, pos, 0, start - pos) < 0) {
+            return -1;
+        }
+        len = (uint64_t)EXTENT_RECORD_LEN(rec) * block_size;
+        if (len > size - start) {
+            len = size - start;
+        }
+        if (rec->len & EXTENT_RECORD_UNWRITTEN) {
+            if (SegmentAppend(ctx, start, 0, len) < 0) {
+                return -1;
+            }
+        } else {
+            for (pos = 0; pos < len; pos += piece) {
+                piece = (len - pos > ctx->readahead) ? ctx->readahead : len - pos;
+                if (SegmentAppend(ctx, start + pos, rec->physical * block_size + pos, piece) < 0) {
+                    return -1;
+                }
+            }
+        }
+        pos = start + len;
+    }
+    return SegmentAppend(ctx, pos, 0, size - pos);
+}
+
+/*
+ * End of the window starting at first, as many segments as fit in
+ * readahead bytes of data, at least one
+ */
+static uint64_t WindowEndGet(struct ExtractContext *ctx, uint64_t first)
+{
+    uint64_t i = first, bytes = 0;
+
+    while (i < ctx->count) {
+        if (ctx->segs[i].physical != 0) {
+            if (i > first && bytes + ctx->segs[i].len > ctx->readahead) {
+                break;
+            }
+            bytes += ctx->segs[i].len;
+        }
+        i++;
+    }
+    return i;
+}
+
+/*
+ * Ask the kernel to start reading a window, physically adjacent segments
+ * are advised as one range
+ */
+static void WindowAdvise(struct ExtractContext *ctx, uint64_t first, uint64_t last)
+{
+    uint64_t start = 0, len = 0, i = 0;
+
+    for (i = first; i < last; i++) {
+        if (ctx->segs[i].physical == 0) {
+            continue;
+        }
+        if (len > 0 && start + len == ctx->segs[i].physical) {
+            len += ctx->segs[i].len;
+            continue;
+        }
+        if (len > 0) {
+            posix_fadvise(ctx->fs->fd, start, len, POSIX_FADV_WILLNEED);
+        }
+        start = ctx->segs[i].physical;
+        len = ctx->segs[i].len;
+    }
+    if (len > 0) {
+        posix_fadvise(ctx->fs->fd, start, len, POSIX_FADV_WILLNEED);
+    }
+}
+
+static int WriteAll(int fd, const char *buf, uint64_t len)
+{
+    ssize_t ret = 0;
+
+    while (len > 0) {
+        ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int ZerosWrite(struct ExtractContext *ctx, uint64_t len)
+{
+    uint64_t n = 0;
+
+    ctx->stats->zeros += len;
+    ctx->stats->bytes += len;
+    while (len > 0) {
+        n = (len > sizeof(extract_zeros)) ? sizeof(extract_zeros) : len;
+        if (WriteAll(ctx->out, extract_zeros, n) < 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Send a window with sendfile
+ * Return the segment it stopped at, last when the window is done and an
+ * earlier one if out does not take sendfile, -1 on failure
+ */
+static int64_t WindowSend(struct ExtractContext *ctx, uint64_t first, uint64_t last)
+{
+    struct ExtractSegment *seg = NULL;
+    uint64_t i = 0, sent = 0, n = 0;
+    off_t offset = 0;
+    ssize_t ret = 0;
+
+    for (i = first; i < last; i++) {
+        seg = &(ctx->segs[i]);
+        if (seg->physical == 0) {
+            if (ZerosWrite(ctx, seg->len) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        for (sent = 0; sent < seg->len; sent += ret) {
+            n = (seg->len - sent > EXTRACT_SENDFILE_MAX) ? EXTRACT_SENDFILE_MAX : seg->len - sent;
+            offset = seg->physical + sent;
+            ret = sendfile(ctx->out, ctx->fs->fd, &offset, n);
+            ctx->stats->reads++;
+            if (ret < 0 && errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            if (ret < 0 && sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                ctx->stats->zero_copy = false;
+                return i;
+            }
+            if (ret <= 0) {
+                fprintf(stderr, "FileExtract: sendfile at image offset %llu failed, errno %d\n",
+                        seg->physical + sent, ret < 0 ? errno : EIO);
+                return -1;
+            }
+            ctx->stats->bytes += ret;
+        }
+    }
+    return last;
+}
+
+/*
+ * Read a window into the buffer with one ReadBatch, physically adjacent
+ * segments with one request, and write it out in file order
+ */
+static int WindowCopy(struct ExtractContext *ctx, uint64_t first, uint64_t last)
+{
+    struct ExtractSegment *seg = NULL;
+    struct ReadRequest *reqs = NULL;
+    uint64_t nreqs = 0, used = 0, i = 0;
+    int ret = -1;
+
+    if (ctx->buf == NULL) {
+        ctx->buf = (char *) malloc(ctx->readahead);
+        if (ctx->buf == NULL) {
+            fprintf(stderr, "FileExtract: allocate buffer failed\n");
+            return -1;
+        }
+    }
+    reqs = (struct ReadRequest *) calloc(last - first, sizeof(struct ReadRequest));
+    if (reqs == NULL) {
+        fprintf(stderr, "FileExtract: allocate requests failed\n");
+        return -1;
+    }
+
+    for (i = first; i < last; i++) {
+        seg = &(ctx->segs[i]);
+        if (seg->physical == 0) {
+            continue;
+        }
+        if (nreqs > 0 && reqs[nreqs - 1].offset + reqs[nreqs - 1].len == seg->physical) {
+            reqs[nreqs - 1].len += seg->len;
+        } else {
+            reqs[nreqs].offset = seg->physical;
+            reqs[nreqs].len = seg->len;
+            reqs[nreqs].buf = ctx->buf + used;
+            nreqs++;
+        }
+        used += seg->len;
+    }
+    if (ReadBatch(ctx->fs, reqs, nreqs, NULL, NULL) < 0) {
+        fprintf(stderr, "FileExtract: read data failed\n");
+        goto end;
+    }
+    ctx->stats->reads += nreqs;
+
+    used = 0;
+    for (i = first; i < last; i++) {
+        seg = &(ctx->segs[i]);
+        if (seg->physical == 0) {
+            if (ZerosWrite(ctx, seg->len) < 0) {
+                goto end;
+            }
+            continue;
+        }
+        if (WriteAll(ctx->out, ctx->buf + used, seg->len) < 0) {
+            goto end;
+        }
+        ctx->stats->bytes += seg->len;
+        used += seg->len;
+    }
+    ret = 0;
+end:
+    free(reqs);
+    return ret;
+}
+
+/*
+ * Inline data lives in i_block, the part beyond it in the system.data
+ * xattr is not read
+ */
+static int InlineExtract(struct ExtractContext *ctx, struct ext4_inode *pinode, uint64_t size)
+{
+    if (size > sizeof(pinode->i_block)) {
+        fprintf(stderr, "FileExtract: inline data beyond i_block is not supported\n");
+        return -1;
+    }
+    if (WriteAll(ctx->out, (char *)pinode->i_block, size) < 0) {
+        return -1;
+    }
+    ctx->stats->bytes += size;
+    return 0;
+}
+
+/*
+ * Write the content of a file to a descriptor.
+ * The data is read by physical extent a window at a time, the next window
+ * is handed to the kernel readahead while the current one is written.
+ * Data goes out with sendfile when out takes it, otherwise each window is
+ * read with one ReadBatch and written. Holes and unwritten extents are
+ * written as zeros.
+ * @fs: FileSystem
+ * @num: inode number
+ * @out: descriptor to write to
+ * @readahead: window size in bytes, 0 for EXTRACT_READAHEAD
+ * @stats: filled in, may be NULL
+ * Return 0 on success, -1 on failure
+ */
+int FileExtract(struct FileSystem *fs, uint64_t num, int out, uint64_t readahead, struct ExtractStats *stats)
+{
+    struct ExtractContext ctx;
+    struct ExtractStats local;
+    struct ExtentMap *map = NULL;
+    struct ext4_inode inode;
+    struct timespec begin;
+    uint64_t size = 0, i = 0, next = 0;
+    int64_t stop = 0;
+    int ret = -1;
+
+    if (fs == NULL) {
+        return -1;
+    }
+    if (stats == NULL) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof(struct ExtractStats));
+    if (readahead == 0) {
+        readahead = EXTRACT_READAHEAD;
+    }
+    if (readahead < EXTRACT_READAHEAD_MIN) {
+        readahead = EXTRACT_READAHEAD_MIN;
+    }
+    readahead -= readahead % fs->block_size;
+
+    memset(&ctx, 0, sizeof(struct ExtractContext));
+    ctx.fs = fs;
+    ctx.out = out;
+    ctx.readahead = readahead;
+    ctx.stats = stats;
+    /* sendfile takes the data as it is on disk, journal copies and the delta need the buffer */
+    stats->zero_copy = (fs->journal == NULL && fs->delta == NULL);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    if (num == 0 || num > fs->inode_count || InodeGetBynum(fs, num, &inode) == 0) {
+        fprintf(stderr, "FileExtract: read inode %llu failed\n", num);
+        return -1;
+    }
+    size = (uint64_t)le32toh(inode.i_size_lo) | (uint64_t)le32toh(inode.i_size_high) << 32;
+
+    if (le32toh(inode.i_flags) & EXT4_INLINE_DATA_FL) {
+        stats->zero_copy = false;
+        ret = InlineExtract(&ctx, &inode, size);
+        goto end;
+    }
+    map = ExtentMapGet(fs, num);
+    if (map == NULL) {
+        fprintf(stderr, "FileExtract: inode %llu has no readable block map\n", num);
+        goto end;
+    }
+    if (SegmentsBuild(&ctx, map, size) < 0) {
+        fprintf(stderr, "FileExtract: allocate segments failed\n");
+        goto end;
+    }
+
+    for (i = 0; i < ctx.count; i = next) {
+        next = WindowEndGet(&ctx, i);
+        WindowAdvise(&ctx, next, WindowEndGet(&ctx, next));
+        stop = i;
+        if (stats->zero_copy) {
+            stop = WindowSend(&ctx, i, next);
+            if (stop < 0) {
+                goto end;
+            }
+        }
+        if ((uint64_t)stop < next && WindowCopy(&ctx, stop, next) < 0) {
+            goto end;
+        }
+    }
+    ret = 0;
+end:
+    if (stats->bytes == stats->zeros) {
+        stats->zero_copy = false;
+    }
+    stats->seconds = ExtractSecondsGet(&begin);
+    if (map != NULL) {
+        ExtentMapPut(fs, num);
+    }
+    free(ctx.segs);
+    free(ctx.buf);
+    return ret;
+}
+
+void ExtractStatsPrint(struct ExtractStats *stats)
+{
+    fprintf(stderr, "%llu bytes (%llu zeros) in %.3f s, %.1f MiB/s, %llu reads, %s\n",
+            stats->bytes, stats->zeros, stats->seconds,
+            stats->seconds > 0 ? stats->bytes / stats->seconds / 1048576 : 0.0,
+            stats->reads, stats->zero_copy ? "sendfile" : "copy");
+}
@@ -0,0 +1,32 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include "filesystem.h"
+
+/* Default bytes read ahead of the data being written out */
+#define EXTRACT_READAHEAD       (8ULL << 20)
+
+/* Smallest readahead window, one request never spans more */
+#define EXTRACT_READAHEAD_MIN   (64ULL << 10)
+
+/*
+ * A piece of the file, either data at an image offset or zeros
+ */
+struct ExtractSegment {
+    uint64_t offset;    /* byte offset in the file */
+    uint64_t physical;  /* byte offset in the image, 0 for zeros */
+    uint64_t len;
+};
+
+struct ExtractStats {
+    uint64_t bytes;     /* bytes written out */
+    uint64_t zeros;     /* of which holes and unwritten extents */
+    uint64_t reads;     /* reads or sendfile calls issued */
+    bool zero_copy;     /* data went out with sendfile */
+    double seconds;
+};
+
+int FileExtract(struct FileSystem *, uint64_t, int, uint64_t, struct ExtractStats *);
+void ExtractStatsPrint(struct ExtractStats *);
+
+#endif /* EXTRACT_H */
@@ -1,12 +1,29 @@
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <endian.h>
 
 #include "filesystem.h"
+#include "scan.h"
+#include "bitmap.h"
+#include "extent.h"
+#include "path.h"
+#include "metaindex.h"
+#include "readbatch.h"
+#include "crc32c.h"
+#include "journal.h"
+#include "delta.h"
+#include "mutate.h"
 
 void Hexdump(char *buf, uint64_t len) {
     uint64_t row = len / 16;
@@ -88,7 +105,8 @@ uint32_t FreeBlocksCountGet(struct FileSystem *fs, struct ext4_group_desc *pdesc
     if (pdesc == NULL) {
         return 0;
     }
-    return (uint32_t)le16toh(pdesc->bg_free_blocks_count_lo) | (uint32_t)le16toh(pdesc->bg_free_blocks_count_hi) << 16;
+    return (uint32_t)le16toh(pdesc->bg_free_blocks_count_lo) | (HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_64BIT) ? 
+            ((uint32_t)le16toh(pdesc->bg_free_blocks_count_hi)) << 16 : 0);
 }
 
 uint32_t UsedDirsCountGet(struct FileSystem *fs, struct ext4_group_desc *pdesc)
@@ -99,7 +117,8 @@ uint32_t UsedDirsCountGet(struct FileSystem *fs, struct ext4_group_desc *pdesc)
     if (pdesc == NULL) {
         return 0;
     }
-    return (uint32_t)le16toh(pdesc->bg_used_dirs_count_lo) | (uint32_t)le16toh(pdesc->bg_used_dirs_count_hi) << 16;
+    return (uint32_t)le16toh(pdesc->bg_used_dirs_count_lo) | (HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_64BIT) ? 
+            ((uint32_t)le16toh(pdesc->bg_used_dirs_count_hi)) << 16 : 0);
 }
 
 uint32_t UnusedInodesCountGet(struct FileSystem *fs, struct ext4_group_desc *pdesc)
@@ -110,7 +129,8 @@ uint32_t UnusedInodesCountGet(struct FileSystem *fs, struct ext4_group_desc *pde
     if (pdesc == NULL) {
         return 0;
     }
-    return ((uint32_t)le16toh(pdesc->bg_itable_unused_lo) | (uint32_t)le16toh(pdesc->bg_itable_unused_hi) << 16);
+    return (uint32_t)le16toh(pdesc->bg_itable_unused_lo) | (HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_64BIT) ? 
+            ((uint32_t)le16toh(pdesc->bg_itable_unused_hi)) << 16 : 0);
 }
 
 uint32_t FreeInodesCountGet(struct FileSystem *fs, struct ext4_group_desc *pdesc)
@@ -125,6 +145,33 @@ uint32_t FreeInodesCountGet(struct FileSystem *fs, struct ext4_group_desc *pdesc
             ((uint32_t)le16toh(pdesc->bg_free_inodes_count_hi)) << 16 : 0);
 }
 
+/*
+ * Setters of the counts above, the high halves only exist with 64bit
+ */
+void FreeBlocksCountSet(struct FileSystem *fs, struct ext4_group_desc *pdesc, uint32_t count)
+{
+    pdesc->bg_free_blocks_count_lo = htole16(count & 0xFFFF);
+    if (HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_64BIT)) {
+        pdesc->bg_free_blocks_count_hi = htole16(count >> 16);
+    }
+}
+
+void FreeInodesCountSet(struct FileSystem *fs, struct ext4_group_desc *pdesc, uint32_t count)
+{
+    pdesc->bg_free_inodes_count_lo = htole16(count & 0xFFFF);
+    if (HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_64BIT)) {
+        pdesc->bg_free_inodes_count_hi = htole16(count >> 16);
+    }
+}
+
+void UnusedInodesCountSet(struct FileSystem *fs, struct ext4_group_desc *pdesc, uint32_t count)
+{
+    pdesc->bg_itable_unused_lo = htole16(count & 0xFFFF);
+    if (HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_64BIT)) {
+        pdesc->bg_itable_unused_hi = htole16(count >> 16);
+    }
+}
+
 uint64_t div_ceil(uint64_t dividen, uint64_t divisor)
 {
     if (dividen == 0) {
@@ -134,15 +181,18 @@ uint64_t div_ceil(uint64_t dividen, uint64_t divisor)
     return (dividen - 1) / divisor + 1;
 }
 
+/*
+ * Whether num is a power of root
+ */
 bool HasRoot(uint32_t num, uint32_t root)
 {
     while (num >= root) {
-        if (num == root) {
-            return true;
+        if (num % root) {
+            return false;
         }
         num = num / root;
     }
-    return false;
+    return num == 1;
 }
 
 bool GroupHasSuperblock(uint32_t group, struct FileSystem *fs)
@@ -220,65 +270,540 @@ uint64_t GroupDescriptorLocationGet(struct FileSystem *fs, uint32_t descblock)
 }
 
 /*
- * Fetch all the Group Descriptors.
- * Firstly figure out how many blocks these Descriptors takes
- * Find the start location, and read data block by block
+ * Load descriptor block index, caller holds descriptor_lock.
+ * With the whole image mapped the block is used in place, otherwise it is copied.
+ * Return the block, NULL on read failure
+ */
+static char *DescriptorBlockLoad(struct FileSystem *fs, uint64_t index, char *data)
+{
+    char *block = NULL;
+    uint64_t location = GroupDescriptorLocationGet(fs, index);
+
+    if (fs->map != NULL && (location + 1) * fs->block_size <= fs->image_size &&
+            !JournalOverlayCovers(fs, location * fs->block_size, fs->block_size) &&
+            !DeltaCovers(fs, location * fs->block_size, fs->block_size)) {
+        block = fs->map + location * fs->block_size;
+    } else {
+        block = (char *) malloc(fs->block_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        if (data == NULL) {
+            data = MetaIndexDescriptorBlockGet(fs, index);
+        }
+        if (data != NULL) {
+            memcpy(block, data, fs->block_size);
+        } else if (!BlockRead(fs, location, 1, block)) {
+            printf("DescriptorBlockLoad: read descriptor block %llu at %llu failed\n", index, location);
+            free(block);
+            return NULL;
+        }
+    }
+
+    __atomic_store_n(&(fs->descriptor_blocks[index]), block, __ATOMIC_RELEASE);
+    fs->descriptor_loaded++;
+    return block;
+}
+
+/*
+ * Given group number, get its descriptor
+ * Descriptors are descriptor_size bytes apart, which is not always
+ * sizeof(struct ext4_group_desc). Without 64bit only the first
+ * EXT4_MIN_DESC_SIZE bytes are valid.
+ * The descriptor block is read on first touch.
+ * Return NULL if group is out of range or its descriptor block cannot be read
+ */
+struct ext4_group_desc *GroupDescriptorGet(struct FileSystem *fs, uint64_t group)
+{
+    uint64_t index = 0;
+    char *block = NULL;
+
+    if (group >= fs->group_count) {
+        return NULL;
+    }
+
+    index = group / fs->descriptor_per_block;
+    block = __atomic_load_n(&(fs->descriptor_blocks[index]), __ATOMIC_ACQUIRE);
+    if (block == NULL) {
+        pthread_mutex_lock(&fs->descriptor_lock);
+        block = fs->descriptor_blocks[index];
+        if (block == NULL) {
+            block = DescriptorBlockLoad(fs, index, NULL);
+        }
+        pthread_mutex_unlock(&fs->descriptor_lock);
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    return (struct ext4_group_desc *)(block + (group % fs->descriptor_per_block) * fs->descriptor_size);
+}
+
+/*
+ * Fetch all the Group Descriptors which are not loaded yet, for callers
+ * about to walk every group.
+ * Descriptor blocks at adjacent locations are read together, that is all of
+ * them before s_first_meta_bg. The scattered meta_bg ones are all queued at
+ * once with ReadBatch.
+ * Return how many bytes are read, -1 on failure
  */
 uint64_t GroupDescriptorsFetch(struct FileSystem *fs)
 {
-    int ret = 0;
+    struct ReadRequest *reqs = NULL;
+    uint64_t *first = NULL;     /* descriptor block index of each request */
     char *buf = NULL;
     uint64_t block = 0;
-    uint64_t first_meta_bg = 0;
-    uint64_t i = 0, count = 0;
-
-    // TODO: Loading consideration
-    fs->group_descriptors = (struct ext4_group_desc *) malloc(fs->descriptor_used_block_count * fs->block_size);
-    memset(fs->group_descriptors, 0, fs->descriptor_used_block_count * fs->block_size);
-    // TODO: initialize
-    buf = (char *)fs->group_descriptors;
-
-    if (HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_META_BG)) {
-        first_meta_bg = le32toh(fs->super.s_first_meta_bg);
-        if (first_meta_bg > fs->descriptor_used_block_count) {
-            // TODO: this should not happen
-            goto fail;
+    uint64_t i = 0, j = 0, run = 0, n = 0, missing = 0, count = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->descriptor_lock);
+    for (i = 0; i < fs->descriptor_used_block_count; i++) {
+        if (fs->descriptor_blocks[i] == NULL) {
+            missing++;
         }
-    } else {
-        first_meta_bg = fs->descriptor_used_block_count;
     }
-
-    // TODO: Fix, skip the previous block, see spec
-    // TODO: merge two section below
-    // see: https://elixir.bootlin.com/linux/latest/source/fs/ext4/resize.c#L1877
-    // first_meta_bg indicate which block number is expended to
-    if (first_meta_bg > 0) {
-        block = GroupDescriptorLocationGet(fs, 0);
-        if (!BlockRead(fs, block, first_meta_bg, buf)) {
-            ret = -1;
-            goto fail;
+    if (missing == 0) {
+        goto end;
+    }
+    if (fs->map != NULL || MetaIndexDescriptorBlockGet(fs, 0) != NULL) {
+        for (i = 0; i < fs->descriptor_used_block_count; i++) {
+            if (fs->descriptor_blocks[i] == NULL && DescriptorBlockLoad(fs, i, NULL) == NULL) {
+                ret = -1;
+                goto end;
+            }
         }
+        count = missing * fs->block_size;
+        goto end;
+    }
 
-        buf += fs->block_size * first_meta_bg;
-        count += fs->block_size * first_meta_bg;
+    reqs = (struct ReadRequest *) calloc(missing, sizeof(struct ReadRequest));
+    first = (uint64_t *) malloc(sizeof(uint64_t) * missing);
+    buf = (char *) malloc(fs->block_size * missing);
+    if (reqs == NULL || first == NULL || buf == NULL) {
+        ret = -1;
+        goto end;
     }
 
-    for (i = first_meta_bg; i < fs->descriptor_used_block_count; i++) {
+    for (i = 0; i < fs->descriptor_used_block_count; i += run) {
+        run = 1;
+        if (fs->descriptor_blocks[i] != NULL) {
+            continue;
+        }
         block = GroupDescriptorLocationGet(fs, i);
+        while (i + run < fs->descriptor_used_block_count && run < DESCRIPTOR_READ_BLOCKS &&
+                fs->descriptor_blocks[i + run] == NULL && GroupDescriptorLocationGet(fs, i + run) == block + run) {
+            run++;
+        }
+        reqs[n].offset = block * fs->block_size;
+        reqs[n].len = run * fs->block_size;
+        reqs[n].buf = buf + count;
+        first[n] = i;
+        count += reqs[n].len;
+        n++;
+    }
 
-        if (!BlockRead(fs, block, 1, buf)) {
-            ret = -1;
-            goto fail;
+    if (ReadBatch(fs, reqs, n, NULL, NULL) != 0) {
+        printf("GroupDescriptorsFetch: read descriptor blocks failed\n");
+        ret = -1;
+        goto end;
+    }
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < reqs[i].len / fs->block_size; j++) {
+            if (DescriptorBlockLoad(fs, first[i] + j, reqs[i].buf + j * fs->block_size) == NULL) {
+                ret = -1;
+                goto end;
+            }
         }
+    }
+
+end:
+    pthread_mutex_unlock(&fs->descriptor_lock);
+    free(reqs);
+    free(first);
+    free(buf);
+    return (ret < 0) ? -1 : count;
+}
 
-        buf += fs->block_size;
-        count += fs->block_size;
+/*
+ * Set up the empty descriptor block table, and load the first block to
+ * check the descriptors are readable at all
+ */
+static int GroupDescriptorsInit(struct FileSystem *fs)
+{
+    fs->descriptor_blocks = (char **) calloc(fs->descriptor_used_block_count, sizeof(char *));
+    if (fs->descriptor_blocks == NULL) {
+        return -1;
     }
+    pthread_mutex_init(&fs->descriptor_lock, NULL);
+    if (GroupDescriptorGet(fs, 0) == NULL) {
+        return -1;
+    }
+    return 0;
+}
 
-    return count;
-fail:
-    free(fs->group_descriptors);
-    return -1;
+/*
+ * Whether a loaded descriptor block was copied by DescriptorBlockLoad.
+ * Even with the image mapped, blocks an overlay covers or that lie past the end
+ * of the image are copies, only blocks inside the mapping are used in place.
+ */
+static bool DescriptorBlockOwned(struct FileSystem *fs, const char *block)
+{
+    return fs->map == NULL || block < fs->map || block >= fs->map + fs->image_size;
+}
+
+static void GroupDescriptorsRelease(struct FileSystem *fs)
+{
+    uint64_t i = 0;
+
+    if (fs->descriptor_blocks == NULL) {
+        return;
+    }
+    for (i = 0; i < fs->descriptor_used_block_count; i++) {
+        if (DescriptorBlockOwned(fs, fs->descriptor_blocks[i])) {
+            free(fs->descriptor_blocks[i]);
+        }
+    }
+    free(fs->descriptor_blocks);
+    fs->descriptor_blocks = NULL;
+    pthread_mutex_destroy(&fs->descriptor_lock);
+}
+
+/*
+ * pread until len bytes are read, EOF or error
+ * Return how many bytes are read
+ */
+uint64_t PositionalRead(int fd, char *buf, uint64_t len, uint64_t offset)
+{
+    uint64_t done = 0;
+    ssize_t count = 0;
+
+    while (done < len) {
+        count = pread(fd, buf + done, len - done, offset + done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        done += count;
+    }
+
+    return done;
+}
+
+/*
+ * pwrite until len bytes are written or error
+ * Return how many bytes are written
+ */
+uint64_t PositionalWrite(int fd, char *buf, uint64_t len, uint64_t offset)
+{
+    uint64_t done = 0;
+    ssize_t count = 0;
+
+    while (done < len) {
+        count = pwrite(fd, buf + done, len - done, offset + done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        done += count;
+    }
+
+    return done;
+}
+
+/*
+ * Grow an array of size bytes elements, doubling it, until it holds more
+ * elements past its first count
+ * @array: the array, NULL for none yet, moved by the growth
+ * @capacity: elements *array holds, updated
+ * Return 0 on success, -1 if memory runs out, the array is kept then
+ */
+int ArrayReserve(void **array, uint64_t *capacity, uint64_t count, uint64_t size, uint64_t more)
+{
+    void *grown = NULL;
+    uint64_t n = *capacity ? *capacity : 64;
+
+    if (count + more <= *capacity) {
+        return 0;
+    }
+    while (n < count + more) {
+        n *= 2;
+    }
+    grown = realloc(*array, size * n);
+    if (grown == NULL) {
+        return -1;
+    }
+    *array = grown;
+    *capacity = n;
+    return 0;
+}
+
+/*
+ * Get the size of the image, either a regular file or a block device
+ */
+static uint64_t ImageSizeGet(int fd)
+{
+    struct stat st;
+    uint64_t size = 0;
+
+    if (fstat(fd, &st) < 0) {
+        return 0;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+            return 0;
+        }
+        return size;
+    }
+    return st.st_size;
+}
+
+/*
+ * Set up the memory mapping of the image.
+ * The whole image is mapped at once when it fits in FS_MMAP_BUDGET,
+ * otherwise windows are mapped on first touch and the least recently used
+ * unreferenced window is unmapped once the budget is used up.
+ */
+int ImageMapInit(struct FileSystem *fs)
+{
+    if (fs == NULL) {
+        return -1;
+    }
+
+    fs->image_size = ImageSizeGet(fs->fd);
+    if (fs->image_size == 0) {
+        printf("ImageMapInit: cannot get the size of image\n");
+        return -1;
+    }
+
+    if (fs->image_size <= FS_MMAP_BUDGET) {
+        fs->map = mmap(NULL, fs->image_size, PROT_READ, MAP_SHARED, fs->fd, 0);
+        if (fs->map == MAP_FAILED) {
+            printf("ImageMapInit: mmap failed\n");
+            fs->map = NULL;
+            return -1;
+        }
+        return 0;
+    }
+
+    fs->window_count = div_ceil(fs->image_size, FS_MMAP_WINDOW_SIZE);
+    fs->window_max = FS_MMAP_BUDGET / (FS_MMAP_WINDOW_SIZE + FS_MMAP_WINDOW_SLACK);
+    if (fs->window_max == 0) {
+        fs->window_max = 1;
+    }
+    fs->windows = (struct MapWindow *) calloc(fs->window_count, sizeof(struct MapWindow));
+    fs->window_mapped = (uint64_t *) calloc(fs->window_max, sizeof(uint64_t));
+    if (fs->windows == NULL || fs->window_mapped == NULL) {
+        printf("ImageMapInit: allocate windows failed\n");
+        ImageMapRelease(fs);
+        return -1;
+    }
+
+    return 0;
+}
+
+void ImageMapRelease(struct FileSystem *fs)
+{
+    uint64_t i = 0;
+    struct MapWindow *w = NULL;
+
+    if (fs == NULL) {
+        return;
+    }
+    if (fs->map != NULL) {
+        munmap(fs->map, fs->image_size);
+        fs->map = NULL;
+    }
+    if (fs->windows != NULL) {
+        for (i = 0; i < fs->window_mapped_count; i++) {
+            w = &(fs->windows[fs->window_mapped[i]]);
+            munmap(w->addr, w->len);
+        }
+    }
+    free(fs->windows);
+    free(fs->window_mapped);
+    fs->windows = NULL;
+    fs->window_mapped = NULL;
+    fs->window_mapped_count = 0;
+}
+
+/*
+ * Given a window index, make sure the window is mapped.
+ * Return NULL if the budget is used up by windows still referenced.
+ * Caller holds fs->map_lock.
+ */
+static struct MapWindow *WindowGet(struct FileSystem *fs, uint64_t index)
+{
+    struct MapWindow *w = &(fs->windows[index]);
+    struct MapWindow *victim = NULL;
+    uint64_t start = index * FS_MMAP_WINDOW_SIZE;
+    uint64_t i = 0, slot = 0;
+    char *addr = NULL;
+
+    if (w->addr != NULL) {
+        w->last_use = ++fs->map_clock;
+        return w;
+    }
+
+    slot = fs->window_mapped_count;
+    if (fs->window_mapped_count == fs->window_max) {
+        for (i = 0; i < fs->window_mapped_count; i++) {
+            struct MapWindow *cand = &(fs->windows[fs->window_mapped[i]]);
+            if (cand->refs == 0 && (victim == NULL || cand->last_use < victim->last_use)) {
+                victim = cand;
+                slot = i;
+            }
+        }
+        if (victim == NULL) {
+            return NULL;
+        }
+        munmap(victim->addr, victim->len);
+        victim->addr = NULL;
+        victim->len = 0;
+    }
+
+    w->len = fs->image_size - start;
+    if (w->len > FS_MMAP_WINDOW_SIZE + FS_MMAP_WINDOW_SLACK) {
+        w->len = FS_MMAP_WINDOW_SIZE + FS_MMAP_WINDOW_SLACK;
+    }
+    addr = mmap(NULL, w->len, PROT_READ, MAP_SHARED, fs->fd, start);
+    if (addr == MAP_FAILED) {
+        printf("WindowGet: mmap window %llu failed\n", index);
+        w->len = 0;
+        if (victim != NULL) {
+            fs->window_mapped[slot] = fs->window_mapped[--fs->window_mapped_count];
+        }
+        return NULL;
+    }
+    w->addr = addr;
+    w->last_use = ++fs->map_clock;
+    fs->window_mapped[slot] = index;
+    if (slot == fs->window_mapped_count) {
+        fs->window_mapped_count++;
+    }
+
+    return w;
+}
+
+/*
+ * Map bytes, zero-copy
+ * @fs: FileSystem opened with FS_OPEN_MMAP
+ * @offset: the offset of the first byte
+ * @len: How many bytes have to be contiguous
+ *
+ * Return a pointer into the mapping, or NULL if the range cannot be mapped
+ * (not in mmap mode, beyond the image, or spanning two windows).
+ * Every non-NULL pointer must be released by BytesUnmap with the same offset.
+ */
+char *BytesMap(struct FileSystem *fs, uint64_t offset, uint64_t len)
+{
+    uint64_t index = 0;
+    struct MapWindow *w = NULL;
+
+    if (fs == NULL || !(fs->flags & FS_OPEN_MMAP)) {
+        return NULL;
+    }
+    if (len == 0 || offset + len > fs->image_size) {
+        return NULL;
+    }
+    /* The image has to be patched with journal copies or writes, that is BytesRead's job */
+    if (JournalOverlayCovers(fs, offset, len) || DeltaCovers(fs, offset, len)) {
+        return NULL;
+    }
+    if (fs->map != NULL) {
+        return fs->map + offset;
+    }
+    if (fs->windows == NULL) {
+        return NULL;
+    }
+
+    index = offset / FS_MMAP_WINDOW_SIZE;
+    pthread_mutex_lock(&fs->map_lock);
+    w = WindowGet(fs, index);
+    if (w == NULL || offset + len > index * FS_MMAP_WINDOW_SIZE + w->len) {
+        pthread_mutex_unlock(&fs->map_lock);
+        return NULL;
+    }
+    w->refs++;
+    pthread_mutex_unlock(&fs->map_lock);
+
+    return w->addr + (offset - index * FS_MMAP_WINDOW_SIZE);
+}
+
+void BytesUnmap(struct FileSystem *fs, uint64_t offset)
+{
+    struct MapWindow *w = NULL;
+
+    if (fs == NULL || fs->windows == NULL) {
+        return;
+    }
+    w = &(fs->windows[offset / FS_MMAP_WINDOW_SIZE]);
+    pthread_mutex_lock(&fs->map_lock);
+    if (w->refs > 0) {
+        w->refs--;
+    }
+    pthread_mutex_unlock(&fs->map_lock);
+}
+
+/*
+ * Map blocks, zero-copy, see BytesMap
+ */
+char *BlockMap(struct FileSystem *fs, uint64_t start, uint64_t num)
+{
+    return BytesMap(fs, fs->block_size * start, fs->block_size * num);
+}
+
+void BlockUnmap(struct FileSystem *fs, uint64_t start)
+{
+    BytesUnmap(fs, fs->block_size * start);
+}
+
+/*
+ * Copy bytes out of the mapping, window by window
+ * Return len on success, 0 if any part is not mappable
+ */
+static uint64_t BytesCopy(struct FileSystem *fs, uint64_t offset, uint64_t len, char *buf)
+{
+    uint64_t done = 0, piece = 0;
+    char *p = NULL;
+
+    if (len == 0 || offset + len > fs->image_size) {
+        return 0;
+    }
+    if (fs->map != NULL) {
+        memcpy(buf, fs->map + offset, len);
+        return len;
+    }
+
+    while (done < len) {
+        piece = FS_MMAP_WINDOW_SIZE - (offset + done) % FS_MMAP_WINDOW_SIZE;
+        if (piece > len - done) {
+            piece = len - done;
+        }
+        p = BytesMap(fs, offset + done, piece);
+        if (p == NULL) {
+            return 0;
+        }
+        memcpy(buf + done, p, piece);
+        BytesUnmap(fs, offset + done);
+        done += piece;
+    }
+
+    return len;
+}
+
+/*
+ * Put the overlays over bytes read from the image: the journal copies,
+ * then the writes held by the delta
+ * Return 0 on success, -1 if the delta cannot be read
+ */
+static int OverlaysApply(struct FileSystem *fs, uint64_t offset, uint64_t len, char *buf)
+{
+    JournalOverlayApply(fs, offset, len, buf);
+    return DeltaApply(fs, offset, len, buf);
 }
 
 /*
@@ -303,19 +828,21 @@ uint64_t BytesRead(struct FileSystem *fs, uint64_t offset, uint64_t len, char *b
         goto fail;
     }
 
-    if (lseek(fs->fd, offset, SEEK_SET) < 0) {
-        printf("BytesRead: Seek failed\n");
-	ret = 0;
-	goto fail;
+    if ((fs->flags & FS_OPEN_MMAP) && BytesCopy(fs, offset, len, buf) == len) {
+        count = len;
+    } else {
+        count = PositionalRead(fs->fd, buf, len, offset);
     }
-
-    count = read(fs->fd, buf, len);
     if (count != len) {
         printf("read fail: actual=%llu, size=%llu\n", count, len);
-        ret = len;
+        ret = 0;
         goto fail;
     }
 
+    if (OverlaysApply(fs, offset, len, buf) < 0) {
+        ret = 0;
+        goto fail;
+    }
     return count;
 fail:
     return ret;
@@ -343,16 +870,15 @@ uint64_t BytesWrite(struct FileSystem *fs, uint64_t offset, uint64_t len, char *
         goto fail;
     }
 
-    if (lseek(fs->fd, offset, SEEK_SET) < 0) {
-        printf("BytesWrite: Seek failed\n");
-	ret = 0;
-	goto fail;
+    /* Whatever the index says about the image may not hold any more */
+    MetaIndexInvalidate(fs);
+    if (fs->delta != NULL) {
+        return DeltaWrite(fs, offset, len, buf);
     }
-
-    count = write(fs->fd, buf, len);
+    count = PositionalWrite(fs->fd, buf, len, offset);
     if (count != len) {
         printf("write fail: actual=%llu, size=%llu\n", count, len);
-        ret = len;
+        ret = 0;
         goto fail;
     }
 
@@ -383,19 +909,21 @@ uint64_t BlockRead(struct FileSystem *fs, uint64_t start, uint64_t num, char *bu
         goto fail;
     }
 
-    if (lseek(fs->fd, fs->block_size * start, SEEK_SET) < 0) {
-        printf("BlockRead: Seek failed\n");
-	ret = 0;
-	goto fail;
+    if ((fs->flags & FS_OPEN_MMAP) && BytesCopy(fs, fs->block_size * start, fs->block_size * num, buf) == fs->block_size * num) {
+        count = fs->block_size * num;
+    } else {
+        count = PositionalRead(fs->fd, buf, fs->block_size * num, fs->block_size * start);
     }
-
-    count = read(fs->fd, buf, fs->block_size * num);
     if (count != fs->block_size * num) {
         printf("read fail: actual=%ld, size=%d\n", count, fs->block_size * num);
         ret = 0;
         goto fail;
     }
 
+    if (OverlaysApply(fs, fs->block_size * start, fs->block_size * num, buf) < 0) {
+        ret = 0;
+        goto fail;
+    }
     return count;
 fail:
     return ret;
@@ -421,6 +949,7 @@ void FileSystemPrint(struct FileSystem *fs)
     printf("\tdescriptor per block = %llu\n", fs->descriptor_per_block);
     printf("\titable block per group = %llu\n", fs->itable_block_per_group);
     printf("\tdescriptor used block count = %llu\n", fs->descriptor_used_block_count);
+    printf("\tdescriptor loaded block count = %llu\n", fs->descriptor_loaded);
 }
 
 /*
@@ -434,6 +963,7 @@ void GroupDescriptorsPrint(struct FileSystem *fs)
         return;
     }
 
+    GroupDescriptorsFetch(fs);
     for (i = 0; i < fs->group_count; i++) {
         GroupDescriptorsPrintBynum(fs, i);
     }
@@ -454,9 +984,14 @@ void GroupDescriptorsPrintBynum(struct FileSystem *fs, uint64_t num)
         return;
     }
 
-    pdesc = &(fs->group_descriptors[num]);
+    pdesc = GroupDescriptorGet(fs, num);
+
+    if (pdesc == NULL) {
+        printf("Read descriptor of group %llu failed\n", num);
+        return;
+    }
 
-    Hexdump((char *)pdesc, sizeof(struct ext4_group_desc));
+    Hexdump((char *)pdesc, fs->descriptor_size);
     printf("Group %llu:", num);
     printf(" block bitmap at %llu", BlockBitmapLocationGet(fs, pdesc));
     printf(", inode bitmap at %llu", InodeBitmapLocationGet(fs, pdesc));
@@ -468,6 +1003,12 @@ void GroupDescriptorsPrintBynum(struct FileSystem *fs, uint64_t num)
     printf("\t[Checksum 0x%x]\n", pdesc->bg_checksum);
 }
 
+static int InodePrintScan(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode, void *arg)
+{
+    InodePrint(fs, num, pinode);
+    return 0;
+}
+
 /*
  * givin an inode number, print the inode table
  */
@@ -479,11 +1020,15 @@ void InodePrintTableBynum(struct FileSystem *fs, uint64_t num)
     }
 
     uint64_t group = INODE_TO_GROUP(num, fs->inodes_per_group);
-    uint64_t i = 0;
+    char *buf = (char *) malloc(InodeScanBufferSizeGet(fs));
 
-    for (i = 0; i < fs->inodes_per_group; i++) {
-        InodePrintBynum(fs, i + group * fs->inodes_per_group + 1);
+    if (buf == NULL) {
+        return;
+    }
+    if (InodeScanGroup(fs, group, 0, buf, InodePrintScan, NULL) != 0) {
+        printf("Scan inode table of group %llu failed\n", group);
     }
+    free(buf);
 }
 
 /*
@@ -496,30 +1041,80 @@ void InodePrintBynum(struct FileSystem *fs, uint64_t num)
         return;
     }
 
-    struct ext4_inode inode;
+    struct ext4_inode buf;
+    struct ext4_inode *pinode = NULL;
     uint64_t count = 0;
-    count = InodeGetBynum(fs, num, &inode);
-    if (count == 0) {
-        printf("Try to get inode: read failed\n");
-        return;
+
+    pinode = InodeMapBynum(fs, num);
+    if (pinode == NULL) {
+        count = InodeGetBynum(fs, num, &buf);
+        if (count == 0) {
+            printf("Try to get inode: read failed\n");
+            return;
+        }
+        pinode = &buf;
     }
 
-    Hexdump((char *)&inode, sizeof(struct ext4_inode));
+    InodePrint(fs, num, pinode);
+
+    if (pinode != &buf) {
+        InodeUnmapBynum(fs, num);
+    }
+}
+
+/*
+ * print an inode already in memory
+ * Only s_inode_size bytes of it belong to the inode, with 128 byte inodes
+ * a mapped one is followed by the next inode, so the fields past them
+ * are printed as zero
+ */
+void InodePrint(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode)
+{
+    struct ext4_inode inode;
+    uint64_t size = le16toh(fs->super.s_inode_size);
+
+    if (size > sizeof(struct ext4_inode)) {
+        size = sizeof(struct ext4_inode);
+    }
+    memset(&inode, 0, sizeof(struct ext4_inode));
+    memcpy(&inode, pinode, size);
+    pinode = &inode;
+
+    Hexdump((char *)pinode, size);
     printf("Inode: %llu\t", num);
-    printf("Type: %x\t", inode.i_mode);
-    printf("Mode: %x\t", inode.i_mode);
-    printf("Flag: %x\n", inode.i_flags);
-    printf("Generation: %lu\t", inode.i_generation);
-    printf("Version: 0x%x:%x\n", inode.i_version_hi, inode.osd1);
+    printf("Type: %x\t", pinode->i_mode);
+    printf("Mode: %x\t", pinode->i_mode);
+    printf("Flag: %x\n", pinode->i_flags);
+    printf("Generation: %lu\t", pinode->i_generation);
+    printf("Version: 0x%x:%x\n", pinode->i_version_hi, pinode->osd1);
     printf("User: %u\tGroup: %u\tSize: %llu\n", 
-            inode.i_uid, inode.i_gid, ((uint64_t)inode.i_size_lo | (uint64_t)inode.i_size_high << 32));
+            pinode->i_uid, pinode->i_gid, ((uint64_t)pinode->i_size_lo | (uint64_t)pinode->i_size_high << 32));
     printf("Links: %u\tBlockcount: %lu\n", 
-            inode.i_links_count, inode.i_blocks_lo);
-    printf("ctime: 0x%x:%x\n", inode.i_ctime_extra, inode.i_ctime);
-    printf("atime: 0x%x:%x\n", inode.i_atime_extra, inode.i_atime);
-    printf("mtime: 0x%x:%x\n", inode.i_mtime_extra, inode.i_mtime);
-    printf("crtime: 0x%x:%x\n", inode.i_crtime_extra, inode.i_crtime);
-    printf("Size of extra inode fields: %u\n", inode.i_extra_isize);
+            pinode->i_links_count, pinode->i_blocks_lo);
+    printf("ctime: 0x%x:%x\n", pinode->i_ctime_extra, pinode->i_ctime);
+    printf("atime: 0x%x:%x\n", pinode->i_atime_extra, pinode->i_atime);
+    printf("mtime: 0x%x:%x\n", pinode->i_mtime_extra, pinode->i_mtime);
+    printf("crtime: 0x%x:%x\n", pinode->i_crtime_extra, pinode->i_crtime);
+    printf("Size of extra inode fields: %u\n", pinode->i_extra_isize);
+}
+
+/*
+ * givin an inode number, get the byte offset of the inode in the image
+ * Return 0 if the group descriptor cannot be read
+ */
+uint64_t InodeOffsetGet(struct FileSystem *fs, uint64_t num)
+{
+    uint64_t group = INODE_TO_GROUP(num, fs->inodes_per_group);
+    uint64_t index = (num - 1) % fs->inodes_per_group;
+    struct ext4_group_desc *pdesc = GroupDescriptorGet(fs, group);
+    uint64_t location = 0;
+
+    if (pdesc == NULL) {
+        return 0;
+    }
+    location = InodeTableLocationGet(fs, pdesc);
+
+    return location * fs->block_size + index * le16toh(fs->super.s_inode_size);
 }
 
 /*
@@ -527,18 +1122,18 @@ void InodePrintBynum(struct FileSystem *fs, uint64_t num)
  */
 uint64_t InodeGetBynum(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode)
 {
-    if (num <= 0) {
+    if (num <= 0 || num > fs->inode_count) {
         printf("Invalid inode number\n");
         return 0;
     }
 
-    // TODO: use macro to handler
-    uint64_t group = INODE_TO_GROUP(num, fs->inodes_per_group);
-    struct ext4_group_desc *pdesc = &(fs->group_descriptors[group]);
-    uint64_t location = InodeTableLocationGet(fs, pdesc);
-    uint64_t offset = location * fs->block_size + (num - 1) * le16toh(fs->super.s_inode_size);
+    uint64_t offset = InodeOffsetGet(fs, num);
     uint64_t count = 0;
 
+    if (offset == 0) {
+        printf("Try to get inode: read group descriptor failed\n");
+        return 0;
+    }
     count = BytesRead(fs, offset, sizeof(struct ext4_inode), (char *)pinode);
     if (count == 0) {
         printf("Try to get inode: read failed\n");
@@ -546,6 +1141,31 @@ uint64_t InodeGetBynum(struct FileSystem *fs, uint64_t num, struct ext4_inode *p
     return count;
 }
 
+/*
+ * givin an inode number, map the on-disk inode, zero-copy
+ * Return NULL if the inode cannot be mapped, see BytesMap
+ * The pointer must be released by InodeUnmapBynum
+ */
+struct ext4_inode *InodeMapBynum(struct FileSystem *fs, uint64_t num)
+{
+    uint64_t offset = 0;
+
+    if (num <= 0 || num > fs->inode_count) {
+        return NULL;
+    }
+
+    offset = InodeOffsetGet(fs, num);
+    if (offset == 0) {
+        return NULL;
+    }
+    return (struct ext4_inode *)BytesMap(fs, offset, le16toh(fs->super.s_inode_size));
+}
+
+void InodeUnmapBynum(struct FileSystem *fs, uint64_t num)
+{
+    BytesUnmap(fs, InodeOffsetGet(fs, num));
+}
+
 /*
  * givin an inode number, get the inode bitmap
  */
@@ -560,10 +1180,15 @@ uint64_t InodeBitmapGetBynum(struct FileSystem *fs, uint64_t num, char *buf)
     }
 
     uint64_t group = INODE_TO_GROUP(num, fs->inodes_per_group);
-    struct ext4_group_desc *pdesc = &(fs->group_descriptors[group]);
-    uint64_t location = InodeBitmapLocationGet(fs, pdesc);
+    struct ext4_group_desc *pdesc = GroupDescriptorGet(fs, group);
+    uint64_t location = 0;
     uint64_t count = 0;
 
+    if (pdesc == NULL) {
+        printf("Try to get inode: read failed\n");
+        goto fail;
+    }
+    location = InodeBitmapLocationGet(fs, pdesc);
     count = BytesRead(fs, location * fs->block_size, fs->block_size, buf);
     if (count == 0) {
         printf("Try to get inode: read failed\n");
@@ -575,37 +1200,40 @@ fail:
     return 0;
 }
 
+/*
+ * givin an inode number, get its state in the inode bitmap
+ * Return 1 in use, 0 not in use, 2 bitmap uninitialized, -1 on failure
+ */
 int InodeStatusGetBynum(struct FileSystem *fs, uint64_t num)
 {
     if (fs == NULL) {
         return -1;
     }
-    if (num <= 0) {
+    if (num <= 0 || num > fs->inode_count) {
         printf("Invalid inode number\n");
         return -1;
     }
 
-    // TODO: macro
     uint64_t group = INODE_TO_GROUP(num, fs->inodes_per_group);
-    struct ext4_group_desc *pdesc = &(fs->group_descriptors[group]);
+    uint64_t bit = (num - 1) % fs->inodes_per_group;
+    struct ext4_group_desc *pdesc = GroupDescriptorGet(fs, group);
+    unsigned char *bitmap = NULL;
     int ret = 0;
-    char buf[fs->block_size];
-    uint64_t count = 0;
-    uint64_t byte = 0, shift = 0;
 
+    if (pdesc == NULL) {
+        return -1;
+    }
     if (le16toh(pdesc->bg_flags) & EXT4_BG_INODE_UNINIT) {
         ret = 2;
         return ret;
     }
 
-    count = InodeBitmapGetBynum(fs, num, buf);
-    if (count == 0) {
+    bitmap = (unsigned char *)BitmapGet(fs, BITMAP_INODE, group);
+    if (bitmap == NULL) {
         return -1;
     }
-
-    byte = (num - 1) / 8;
-    shift = num - 1 - byte * 8;
-    ret = (buf[byte] >> shift) & 0x1;
+    ret = (bitmap[bit / 8] >> (bit % 8)) & 0x1;
+    BitmapPut(fs, BITMAP_INODE, group);
 
     return ret;
 }
@@ -644,16 +1272,21 @@ uint64_t BlockBitmapGetBynum(struct FileSystem *fs, uint64_t num, char *buf)
     if (buf == NULL) {
         goto fail;
     }
-    if (num <= 0) {
+    if (num < fs->super.s_first_data_block || num >= fs->block_count) {
         printf("Invalid block number\n");
         goto fail;
     }
 
-    uint64_t group = num / fs->blocks_per_group;
-    struct ext4_group_desc *pdesc = &(fs->group_descriptors[group]);
-    uint64_t location = BlockBitmapLocationGet(fs, pdesc);
+    uint64_t group = BLOCK_TO_GROUP(num, fs->super.s_first_data_block, fs->blocks_per_group);
+    struct ext4_group_desc *pdesc = GroupDescriptorGet(fs, group);
+    uint64_t location = 0;
     uint64_t count = 0;
 
+    if (pdesc == NULL) {
+        printf("Try to get block bitmap: read failed\n");
+        goto fail;
+    }
+    location = BlockBitmapLocationGet(fs, pdesc);
     count = BytesRead(fs, location * fs->block_size, fs->block_size, buf);
     if (count == 0) {
         printf("Try to get block bitmap: read failed\n");
@@ -665,46 +1298,46 @@ fail:
     return 0;
 }
 
+/*
+ * givin a block number, get its state in the block bitmap
+ * Return 1 in use, 0 not in use, 2 bitmap uninitialized, -1 on failure
+ */
 int BlockStatusGetBynum(struct FileSystem *fs, uint64_t num)
 {
     if (fs == NULL) {
         return -1;
     }
-    if (num <= 0) {
+    if (num < fs->super.s_first_data_block || num >= fs->block_count) {
         printf("Invalid Block number\n");
         return -1;
     }
 
-    // TODO: macro state
-    uint64_t group = (num - 1) / fs->inodes_per_group;
-    struct ext4_group_desc *pdesc = &(fs->group_descriptors[group]);
+    uint64_t group = BLOCK_TO_GROUP(num, fs->super.s_first_data_block, fs->blocks_per_group);
+    uint64_t bit = BLOCK_TO_BIT(num, fs->super.s_first_data_block, fs->blocks_per_group, fs->cluster_block_ratio);
+    struct ext4_group_desc *pdesc = GroupDescriptorGet(fs, group);
+    unsigned char *bitmap = NULL;
     int ret = 0;
-    char buf[fs->block_size];
-    uint64_t count = 0;
-    uint64_t byte = 0, shift = 0;
 
+    if (pdesc == NULL) {
+        return -1;
+    }
     if (le16toh(pdesc->bg_flags) & EXT4_BG_BLOCK_UNINIT) {
         ret = 2;
         return ret;
     }
 
-    count = BlockBitmapGetBynum(fs, num, buf);
-    if (count == 0) {
+    bitmap = (unsigned char *)BitmapGet(fs, BITMAP_BLOCK, group);
+    if (bitmap == NULL) {
         return -1;
     }
-    byte = (uint8_t)num / 8;
-    shift = num - byte * 8;
-    ret = (buf[byte] >> shift) & 0x1;
+    ret = (bitmap[bit / 8] >> (bit % 8)) & 0x1;
+    BitmapPut(fs, BITMAP_BLOCK, group);
 
     return ret;
 }
 
 void BlockStatusPrintBynum(struct FileSystem *fs, uint64_t num)
 {
-    if (num <= 0) {
-        printf("Invalid Block number\n");
-        return;
-    }
     int ret = BlockStatusGetBynum(fs, num);
     switch(ret) {
         case 1:
@@ -726,83 +1359,141 @@ void BlockStatusPrintBynum(struct FileSystem *fs, uint64_t num)
 }
 
 /*
- * givin an inode number, print the Xattr
+ * Hand every entry of an xattr region to func
+ * @region, @size: the in-inode area after its header, or the whole block
+ * @values: where value offsets count from inside region
+ * Return 0 when all entries are done, -1 if one is corrupt, otherwise
+ * what func returned to stop
  */
-void XattrPrintBynum(struct FileSystem *fs, uint64_t num)
+static int XattrRegionWalk(struct FileSystem *fs, char *region, uint64_t size, uint64_t first, uint64_t values,
+        XattrFunc func, void *arg)
 {
-    struct ext4_inode inode;
-    struct ext4_xattr_ibody_header *ihdr;
-    struct ext4_xattr_header *hdr;
-    uint64_t count = 0;
-    uint64_t aclblock = 0;
-    char buf[fs->block_size];
-    uint64_t group = INODE_TO_GROUP(num, fs->inodes_per_group);
-    struct ext4_group_desc *pdesc = &(fs->group_descriptors[group]);
-    uint64_t location = InodeTableLocationGet(fs, pdesc);
-    uint64_t offset = 0;
-    char *newpinode = NULL;
+    struct ext4_xattr_entry *entry = NULL;
+    uint64_t pos = first, offs = 0, value_size = 0;
+    int ret = 0;
 
-    if (num <= 0) {
-        printf("Invalid inode number\n");
-        goto fail;
+    while (pos + sizeof(uint32_t) <= size) {
+        entry = (struct ext4_xattr_entry *)(region + pos);
+        if (IS_LAST_ENTRY(entry)) {
+            return 0;
+        }
+        if (pos + EXT4_XATTR_LEN(entry->e_name_len) > size) {
+            return -1;
+        }
+        offs = le16toh(entry->e_value_offs);
+        value_size = le32toh(entry->e_value_size);
+        /* Values kept in an EA inode are not read, only their size is told */
+        if (entry->e_value_inum == 0 && (value_size > size || values + offs > size - value_size)) {
+            return -1;
+        }
+        ret = func(fs, INDEX_TO_STRING(entry->e_name_index), entry->e_name, entry->e_name_len,
+                entry->e_value_inum ? NULL : region + values + offs, value_size, arg);
+        if (ret != 0) {
+            return ret;
+        }
+        pos += EXT4_XATTR_LEN(entry->e_name_len);
     }
+    return -1;
+}
 
-    memset(&inode, 0, sizeof(struct ext4_inode));
-    count = InodeGetBynum(fs, num, &inode);
-    if (count == 0) {
-        printf("Get Inode failed\n");
-        goto fail;
+/*
+ * Walk the extended attributes of an inode, those in the inode body first
+ * and then those of its xattr block
+ * @fs: FileSystem
+ * @num: inode number
+ * @func: called once per attribute, with the value NULL when it lives in
+ * an EA inode; returning non zero stops the walk
+ * @arg: passed to func
+ * Return 0 on success, -1 if the inode or its attributes cannot be read or
+ * are corrupt, otherwise what func returned
+ */
+int XattrForEach(struct FileSystem *fs, uint64_t num, XattrFunc func, void *arg)
+{
+    struct ext4_xattr_ibody_header *ihdr = NULL;
+    struct ext4_xattr_header *hdr = NULL;
+    uint64_t inode_size = le16toh(fs->super.s_inode_size);
+    uint64_t offset = 0, aclblock = 0, start = 0;
+    uint16_t extra = 0;
+    char *raw = NULL, *block = NULL;
+    int ret = -1;
+
+    if (num == 0 || num > fs->inode_count || func == NULL) {
+        return -1;
+    }
+    offset = InodeOffsetGet(fs, num);
+    raw = (char *) malloc(inode_size > fs->block_size ? inode_size : fs->block_size);
+    if (offset == 0 || raw == NULL || BytesRead(fs, offset, inode_size, raw) == 0) {
+        goto end;
+    }
+
+    if (inode_size > EXT4_GOOD_OLD_INODE_SIZE) {
+        extra = le16toh(((struct ext4_inode *)raw)->i_extra_isize);
+        start = EXT4_GOOD_OLD_INODE_SIZE + extra;
+        if (start + sizeof(struct ext4_xattr_ibody_header) <= inode_size) {
+            ihdr = (struct ext4_xattr_ibody_header *)(raw + start);
+            if (le32toh(ihdr->h_magic) == EXT4_XATTR_MAGIC) {
+                /* In the body values count from the first entry */
+                start += sizeof(struct ext4_xattr_ibody_header);
+                ret = XattrRegionWalk(fs, raw + start, inode_size - start, 0, 0, func, arg);
+                if (ret != 0) {
+                    goto end;
+                }
+            }
+        }
     }
 
-    if (inode.i_extra_isize) {
-        // get ibody header
-        // TODO: see magic number in superblock
-        memset(buf, 0, fs->block_size);
-        offset = location + fs->block_size + (num - 1) * le16toh(fs->super.s_inode_size);
-        count = BytesRead(fs, offset, fs->block_size, buf);
-        if (count == 0) {
-            printf("Try to get inode: read failed\n");
+    aclblock = (uint64_t)le32toh(((struct ext4_inode *)raw)->i_file_acl_lo) |
+        (uint64_t)le16toh(((struct ext4_inode *)raw)->osd2.linux2.l_i_file_acl_high) << 32;
+    ret = 0;
+    if (aclblock != 0) {
+        ret = -1;
+        block = (char *) malloc(fs->block_size);
+        if (block == NULL || aclblock >= fs->block_count || BlockRead(fs, aclblock, 1, block) == 0) {
+            goto end;
         }
-        newpinode = buf;
-        ihdr = IHDR(inode, newpinode);
-        if (le32toh(ihdr->h_magic) == EXT4_XATTR_MAGIC) {
-            XattrentryAllPrint(fs, (struct ext4_xattr_entry *)((void *)ihdr + sizeof(struct ext4_xattr_ibody_header)),
-                    location * fs->block_size);
+        hdr = (struct ext4_xattr_header *)block;
+        if (le32toh(hdr->h_magic) != EXT4_XATTR_MAGIC || le32toh(hdr->h_blocks) != 1) {
+            goto end;
         }
+        ret = XattrRegionWalk(fs, block, fs->block_size, sizeof(struct ext4_xattr_header), 0, func, arg);
     }
-    if ((uint64_t)le32toh(inode.i_file_acl_lo) | (uint64_t)le16toh(inode.osd2.linux2.l_i_file_acl_high) << 32) {
-        // goto other block
-        // TODO: Consider hdr->h_blocks != 1
-        memset(buf, 0, fs->block_size);
-        aclblock = (uint64_t)le32toh(inode.i_file_acl_lo) | (uint64_t)le16toh(inode.osd2.linux2.l_i_file_acl_high) << 32;
-        count = BlockRead(fs, aclblock, 1, buf);
-        hdr = (struct ext4_xattr_header *)buf;
-        if (le32toh(hdr->h_magic) == EXT4_XATTR_MAGIC) {
-            XattrentryAllPrint(fs, (struct ext4_xattr_entry *)((void *)hdr + sizeof(struct ext4_xattr_header)), aclblock * fs->block_size);
-        }
+end:
+    free(raw);
+    free(block);
+    return ret;
+}
+
+static int XattrPrint(struct FileSystem *fs, const char *prefix, const char *name, uint32_t name_len,
+        const char *value, uint32_t value_size, void *arg)
+{
+    uint32_t i = 0;
+
+    printf("%s%.*s (%u) = ", prefix, (int)name_len, name, value_size);
+    if (value == NULL) {
+        printf("<in EA inode>\n");
+        return 0;
     }
-fail:
-    return;
+    /* Text as text, anything else in hex */
+    for (i = 0; i < value_size && (value[i] >= 0x20 && value[i] < 0x7f); i++) {
+    }
+    if (i == value_size || (i == value_size - 1 && value[i] == '\0')) {
+        printf("\"%.*s\"\n", (int)i, value);
+        return 0;
+    }
+    for (i = 0; i < value_size; i++) {
+        printf("%02x", (unsigned char)value[i]);
+    }
+    printf("\n");
+    return 0;
 }
 
 /*
- * Given an entry, traverse all the entries and print it.
- *
+ * givin an inode number, print the Xattr
  */
-void XattrentryAllPrint(struct FileSystem *fs, struct ext4_xattr_entry *entry, uint64_t start)
+void XattrPrintBynum(struct FileSystem *fs, uint64_t num)
 {
-    char prefix[10] = {0};
-    char value[10] = {0};
-    uint64_t count = 0;
-    while (entry->e_name_len != 0 || entry->e_name_index != 0 ||
-            entry->e_value_offs != 0 || entry->e_value_inum != 0) {
-        memset(prefix, 0, 10);
-        memset(value, 0, 10);
-        INDEX_TO_STRING(entry->e_name_index, prefix);
-        // TODO: fix, value
-        BytesRead(fs, start + le16toh(entry->e_value_offs), le32toh(entry->e_value_size), value);
-        printf("%s%s = %s\n", prefix, entry->e_name, value);
-        entry = EXT4_XATTR_NEXT(entry);
+    if (XattrForEach(fs, num, XattrPrint, NULL) != 0) {
+        printf("Read extended attributes of inode %llu failed\n", num);
     }
 }
 
@@ -819,28 +1510,96 @@ int SuperBlockRead(struct FileSystem *fs)
         goto fail;
     }
 
-    if (lseek(fs->fd, 1024, SEEK_SET) < 0) {
-    printf("Seek failed\n");
-    ret = -1;
-    goto fail;
+    if ((fs->flags & FS_OPEN_MMAP) && 
+            BytesCopy(fs, 1024, sizeof(struct ext4_super_block), (char *)&(fs->super)) == sizeof(struct ext4_super_block)) {
+        count = sizeof(struct ext4_super_block);
+    } else {
+        // TODO: see spec, consider 1K
+        count = PositionalRead(fs->fd, (char *)&(fs->super), sizeof(struct ext4_super_block), 1024);
     }
-
-    // TODO: see spec, consider 1K
-    count = read(fs->fd, &(fs->super), sizeof(struct ext4_super_block));
     if (count != sizeof(struct ext4_super_block)) {
         printf("read fail: actual=%ld, size=%d\n", count, sizeof(struct ext4_super_block));
         ret = -1;
         goto fail;
     }
 
+    if (OverlaysApply(fs, 1024, sizeof(struct ext4_super_block), (char *)&(fs->super)) < 0) {
+        ret = -1;
+        goto fail;
+    }
+
 fail:
     return ret;
 }
 
-int FileSystemInit(struct FileSystem *fs, char *path) 
+/*
+ * Attach the sidecar index of the image at path, a missing or stale one
+ * is only reported
+ */
+static void IndexOpen(struct FileSystem *fs, char *path)
+{
+    char *index = (char *) malloc(strlen(path) + sizeof(META_INDEX_SUFFIX));
+
+    if (index == NULL) {
+        return;
+    }
+    sprintf(index, "%s%s", path, META_INDEX_SUFFIX);
+    if (DeltaCovers(fs, 0, fs->image_size)) {
+        printf("Index %s not used, the image has writes in its delta\n", index);
+    } else if (MetaIndexOpen(fs, index) < 0) {
+        printf("Index %s not used, the image is read\n", index);
+    }
+    free(index);
+}
+
+/*
+ * Work out the journal replay and put it over all further reads. The
+ * superblock and descriptor blocks read so far are read again through it.
+ */
+static int JournalOpen(struct FileSystem *fs)
+{
+    struct JournalOverlay *ov = (struct JournalOverlay *) calloc(1, sizeof(struct JournalOverlay));
+
+    if (ov == NULL) {
+        return 0;
+    }
+    if (JournalOverlayBuild(fs, ov) < 0) {
+        printf("Journal not replayed, the image is read as it is\n");
+        free(ov);
+        return 0;
+    }
+    if (ov->count == 0) {
+        JournalOverlayRelease(ov);
+        free(ov);
+        return 0;
+    }
+    fs->journal = ov;
+    if (SuperBlockRead(fs) < 0) {
+        return -1;
+    }
+    MetaIndexInvalidate(fs);
+    GroupDescriptorsRelease(fs);
+    return GroupDescriptorsInit(fs);
+}
+
+static void JournalClose(struct FileSystem *fs)
+{
+    JournalOverlayRelease(fs->journal);
+    free(fs->journal);
+    fs->journal = NULL;
+}
+
+/*
+ * Open the image and load the metadata
+ * @fs: FileSystem
+ * @path: path to the image or the device
+ * @flags: FS_OPEN_* flags
+ */
+int FileSystemInit(struct FileSystem *fs, char *path, int flags)
 {
     int ret = 1;
     int fd = -1;
+    int replayed = 0;
 
     if (fs == NULL) {
         printf("NULL pointer\n");
@@ -849,13 +1608,24 @@ int FileSystemInit(struct FileSystem *fs, char *path)
     }
     memset(fs, 0, sizeof(struct FileSystem));
 
-    fd = open(path, O_RDWR);
+    /* With a write overlay the image is only ever read */
+    fd = open(path, (flags & FS_OPEN_OVERLAY) ? O_RDONLY : O_RDWR);
     if (fd < 0) {
         printf("Open file failed\n");
         ret = -1;
         goto fail;
     }
     fs->fd = fd;
+    fs->flags = flags;
+    fs->image_size = ImageSizeGet(fd);
+    pthread_mutex_init(&fs->map_lock, NULL);
+    pthread_mutex_init(&fs->ring_lock, NULL);
+
+    if ((fs->flags & FS_OPEN_MMAP) && ImageMapInit(fs) < 0) {
+        printf("Map image failed\n");
+        ret = -1;
+        goto fail;
+    }
 
     ret = SuperBlockRead(fs);
     if (ret < 0) {
@@ -863,6 +1633,23 @@ int FileSystemInit(struct FileSystem *fs, char *path)
         goto fail;
     }
 
+    /* Finish a MutationCommit cut short before anything else is read */
+    if (!(fs->flags & FS_OPEN_OVERLAY)) {
+        replayed = MutationLogOpen(fs, path);
+        if (replayed < 0 || (replayed > 0 && SuperBlockRead(fs) < 0)) {
+            printf("Finish the logged mutation failed\n");
+            ret = -1;
+            goto fail;
+        }
+    }
+
+    /* The delta may hold the superblock too */
+    if ((fs->flags & FS_OPEN_OVERLAY) && (DeltaOpen(fs, path) < 0 || SuperBlockRead(fs) < 0)) {
+        printf("Attach the write overlay failed\n");
+        ret = -1;
+        goto fail;
+    }
+
     fs->block_size = (EXT4_MIN_BLOCK_SIZE << fs->super.s_log_block_size);
     fs->inode_count = fs->super.s_inodes_count;
     fs->block_count = TotalBlockCountGet(fs);
@@ -876,17 +1663,104 @@ int FileSystemInit(struct FileSystem *fs, char *path)
     fs->descriptor_used_block_count = div_ceil(fs->group_count, fs->descriptor_per_block);
     fs->itable_block_per_group = div_ceil(fs->super.s_inodes_per_group * fs->super.s_inode_size,  fs->block_size); // Did not checkt s_rev_level
 
-    if (GroupDescriptorsFetch(fs) < 0) {
+    /* Seed of every metadata checksum but the superblock's own */
+    if (HAS_RO_COMPAT_FEATURE(fs->super, EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) {
+        fs->csum_seed = HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_CSUM_SEED) ?
+            le32toh(fs->super.s_checksum_seed) : Crc32c(~0U, fs->super.s_uuid, sizeof(fs->super.s_uuid));
+    }
+
+    if (fs->flags & FS_OPEN_INDEX) {
+        IndexOpen(fs, path);
+    }
+
+    if (GroupDescriptorsInit(fs) < 0) {
+        printf("Load group descriptors failed\n");
+        ret = -1;
+        goto fail;
+    }
+
+    if (BitmapCacheInit(fs, BITMAP_CACHE_ENTRIES) < 0) {
+        printf("Initialize bitmap cache failed\n");
+        ret = -1;
+        goto fail;
+    }
+
+    if (ExtentCacheInit(fs, EXTENT_CACHE_ENTRIES) < 0) {
+        printf("Initialize extent cache failed\n");
+        ret = -1;
+        goto fail;
+    }
+
+    if (DentryCacheInit(fs, DENTRY_CACHE_ENTRIES) < 0) {
+        printf("Initialize dentry cache failed\n");
+        ret = -1;
+        goto fail;
+    }
+
+    if ((fs->flags & FS_OPEN_JOURNAL) && JournalOpen(fs) < 0) {
+        printf("Load group descriptors through the journal failed\n");
         ret = -1;
         goto fail;
     }
 
     return ret;
 fail:
+    if (fs != NULL) {
+        JournalClose(fs);
+        DeltaClose(fs);
+        DentryCacheRelease(fs);
+        ExtentCacheRelease(fs);
+        BitmapCacheRelease(fs);
+        GroupDescriptorsRelease(fs);
+        MetaIndexRelease(fs);
+        ImageMapRelease(fs);
+        ReadBatchRelease(fs);
+        free(fs->log_path);
+    }
+    if (fd >= 0) {
+        close(fd);
+        pthread_mutex_destroy(&fs->map_lock);
+        pthread_mutex_destroy(&fs->ring_lock);
+    }
     free(fs);
     return ret;
 }
 
+/*
+ * Make what BytesWrite wrote durable, in the delta when there is one
+ */
+int FileSystemSync(struct FileSystem *fs)
+{
+    if (fsync(fs->delta != NULL ? fs->delta->fd : fs->fd) < 0) {
+        printf("FileSystemSync: fsync failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the superblock and the descriptors again and drop every cache, for
+ * callers that changed what reads return as a whole, e.g. DeltaDiscard.
+ * Must not run concurrently with any other call on fs.
+ */
+int FileSystemReload(struct FileSystem *fs)
+{
+    if (SuperBlockRead(fs) < 0) {
+        return -1;
+    }
+    MetaIndexInvalidate(fs);
+    DentryCacheInvalidate(fs);
+    ExtentCacheRelease(fs);
+    BitmapCacheRelease(fs);
+    GroupDescriptorsRelease(fs);
+    if (GroupDescriptorsInit(fs) < 0 || BitmapCacheInit(fs, BITMAP_CACHE_ENTRIES) < 0 ||
+            ExtentCacheInit(fs, EXTENT_CACHE_ENTRIES) < 0) {
+        printf("FileSystemReload: load the metadata again failed\n");
+        return -1;
+    }
+    return 0;
+}
+
 int FileSystemRelease(struct FileSystem *fs)
 {
     int ret = 1;
@@ -894,6 +1768,18 @@ int FileSystemRelease(struct FileSystem *fs)
         return -1;
     }
 
+    JournalClose(fs);
+    DeltaClose(fs);
+    DentryCacheRelease(fs);
+    ExtentCacheRelease(fs);
+    BitmapCacheRelease(fs);
+    GroupDescriptorsRelease(fs);
+    MetaIndexRelease(fs);
+    ImageMapRelease(fs);
+    ReadBatchRelease(fs);
+    free(fs->log_path);
+    pthread_mutex_destroy(&fs->map_lock);
+    pthread_mutex_destroy(&fs->ring_lock);
     ret = close(fs->fd);
     if (ret < 0) {
         printf("Close failed\n");
@@ -908,22 +1794,24 @@ fail:
     return ret;
 }
 
+/*
+ * Point the block map of source at the blocks of dest
+ * Return how many bytes are written, 0 on failure
+ */
 uint64_t Redirect(struct FileSystem *fs, uint64_t source, uint64_t dest)
 {
-    struct ext4_inode inodesrc, inodedst;
-    uint64_t group = INODE_TO_GROUP(source, fs->inodes_per_group);
-    struct ext4_group_desc *pdesc = &(fs->group_descriptors[group]);
-    uint64_t location = InodeTableLocationGet(fs, pdesc);
-    uint64_t offset = location * fs->block_size + (source - 1) * le16toh(fs->super.s_inode_size);
+    struct ext4_inode inodedst;
+    struct Mutation tx;
     uint64_t count = 0;
-    InodeGetBynum(fs, source, &inodesrc);
-    InodeGetBynum(fs, dest, &inodedst);
-    memcpy((void *)&(inodesrc.i_block[0]), (void *)&(inodedst.i_block[0]), sizeof(__le32) * EXT4_N_BLOCKS);
-    count = BytesWrite(fs, offset, fs->super.s_inode_size, (char *)&inodesrc);
-    if (count == 0) {
-        goto fail;
-    }
 
-fail:
+    if (InodeGetBynum(fs, dest, &inodedst) == 0) {
+        return 0;
+    }
+    MutationInit(fs, &tx);
+    if (MutationInodeStage(&tx, source, offsetof(struct ext4_inode, i_block), sizeof(inodedst.i_block),
+                inodedst.i_block) == 0 && MutationCommit(&tx) == 0) {
+        count = tx.bytes;
+    }
+    MutationRelease(&tx);
     return count;
 }
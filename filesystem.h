@@ -1,9 +1,88 @@
+#ifndef FILESYSTEM_H
+#define FILESYSTEM_H
+
 #include <stdbool.h>
+#include <pthread.h>
 #include "ext4.h"
 #include "xattr.h"
 
+/* Flags for FileSystemInit */
+#define FS_OPEN_MMAP        0x0001  /* Serve reads from a memory mapping of the image */
+#define FS_OPEN_NO_URING    0x0002  /* Batched reads use a pool of preads, not io_uring */
+#define FS_OPEN_INDEX       0x0004  /* Start from the sidecar index of the image when it is current */
+#define FS_OPEN_JOURNAL     0x0008  /* Reads see the blocks a replay of the journal would write */
+#define FS_OPEN_OVERLAY     0x0010  /* Open the image read-only, writes go to a delta file next to it */
+
+/*
+ * Images up to FS_MMAP_BUDGET bytes are mapped whole. Larger images are mapped
+ * in windows of FS_MMAP_WINDOW_SIZE bytes, each extended by FS_MMAP_WINDOW_SLACK
+ * so that any range up to the slack which starts inside a window is contiguous.
+ */
+#ifndef FS_MMAP_BUDGET
+#define FS_MMAP_BUDGET  (sizeof(void *) >= 8 ? (16ULL << 40) : (1ULL << 30))
+#endif
+#ifndef FS_MMAP_WINDOW_SIZE
+#define FS_MMAP_WINDOW_SIZE     (256ULL << 20)
+#endif
+#ifndef FS_MMAP_WINDOW_SLACK
+#define FS_MMAP_WINDOW_SLACK    (8ULL << 20)
+#endif
+
+/* Most descriptor blocks read at once by GroupDescriptorsFetch */
+#define DESCRIPTOR_READ_BLOCKS  64
+
+struct MapWindow {
+    char *addr;         /* NULL when not mapped */
+    uint64_t len;
+    uint32_t refs;      /* pointers handed out and not yet released */
+    uint64_t last_use;
+};
+
+/*
+ * Thread-safety contract of struct FileSystem
+ *
+ * All I/O is positional (pread/pwrite), no accessor depends on the file
+ * offset of fd. Once FileSystemInit returned, any number of threads may
+ * share one FileSystem and call the read accessors concurrently: BytesRead,
+ * BlockRead, BytesMap/BytesUnmap and the Map/Get/Status functions built on
+ * top of them. Mapping windows are guarded by map_lock.
+ *
+ * Group descriptor blocks are read on first touch by GroupDescriptorGet
+ * under descriptor_lock, and published with a release store so readers of
+ * an already loaded block take no lock. A loaded block stays until
+ * FileSystemRelease.
+ *
+ * With FS_OPEN_JOURNAL the journal copies are put over every read of the
+ * blocks they replace, and BytesMap refuses ranges holding any of them. The
+ * overlay does not change after FileSystemInit, so it takes no lock, and
+ * BytesWrite does not update it.
+ *
+ * With FS_OPEN_OVERLAY BytesWrite lands in the delta, which is put over
+ * the journal copies. A block is marked in the delta with a release store
+ * once its data is written, so reads take no lock; writers serialize on
+ * the lock of the delta. DeltaCommit, DeltaDiscard, MutationCommit and
+ * FileSystemReload must not run concurrently with any other call.
+ *
+ * BytesWrite may run concurrently with reads of other ranges. Writers of
+ * overlapping ranges must serialize themselves, and a read racing with a
+ * write of the same range may see a torn result.
+ *
+ * FileSystemInit and FileSystemRelease must not run concurrently with any
+ * other call on the same FileSystem. The Print functions are safe to call
+ * but their output may interleave.
+ */
 struct FileSystem {
     int fd;
+    int flags;
+    uint64_t image_size;
+    char *map;                  /* whole-image mapping */
+    struct MapWindow *windows;  /* windowed mapping, indexed by offset / FS_MMAP_WINDOW_SIZE */
+    uint64_t window_count;
+    uint64_t *window_mapped;    /* indexes of the windows currently mapped */
+    uint64_t window_mapped_count;
+    uint64_t window_max;
+    uint64_t map_clock;
+    pthread_mutex_t map_lock;
     uint64_t block_size;
     uint64_t inode_count;
     uint64_t block_count;
@@ -18,29 +97,52 @@ struct FileSystem {
     uint64_t descriptor_used_block_count;
     uint32_t csum_seed;
     struct ext4_super_block super;
-    struct ext4_group_desc *group_descriptors;
+    char **descriptor_blocks;       /* descriptor_used_block_count entries, NULL until loaded */
+    uint64_t descriptor_loaded;     /* descriptor blocks loaded */
+    pthread_mutex_t descriptor_lock;
+    struct BitmapCache *bitmap_cache;
+    struct ExtentCache *extent_cache;
+    struct DentryCache *dentry_cache;
+    struct MetaIndex *meta_index;   /* NULL without FS_OPEN_INDEX or a current index */
+    struct JournalOverlay *journal; /* NULL without FS_OPEN_JOURNAL or nothing to replay */
+    struct Delta *delta;            /* NULL without FS_OPEN_OVERLAY */
+    char *log_path;                 /* redo log of MutationCommit, NULL with FS_OPEN_OVERLAY */
+    struct Uring *rings;            /* idle io_uring instances of ReadBatch */
+    pthread_mutex_t ring_lock;
 };
 
 /* Given an inode number return the group number which the inode is belonged to */
 #define INODE_TO_GROUP(num, inodes_per_group) (num-1)/inodes_per_group
 
+/* Given a block number return the group number, and the bit in the group's block bitmap */
+#define BLOCK_TO_GROUP(num, first_data_block, blocks_per_group) (((num) - (first_data_block)) / (blocks_per_group))
+#define BLOCK_TO_BIT(num, first_data_block, blocks_per_group, cluster_ratio) \
+    ((((num) - (first_data_block)) % (blocks_per_group)) / (cluster_ratio))
+
 bool HasRoot(uint32_t, uint32_t);
 bool GroupHasSuperblock(uint32_t, struct FileSystem *);
 
 int SuperBlockRead(struct FileSystem *);
 int SuperBlockParse(struct FileSystem *);
-int FileSystemInit(struct FileSystem *, char *);
+int FileSystemInit(struct FileSystem *, char *, int);
 int FileSystemRelease(struct FileSystem *);
+int FileSystemReload(struct FileSystem *);
+int FileSystemSync(struct FileSystem *);
 void FileSystemPrint();
 uint64_t GroupLocationGet(struct FileSystem *, uint32_t);
 uint64_t GroupDescriptorLocationGet(struct FileSystem *, uint32_t);
 void GroupsPrint(struct FileSystem *);
 uint64_t GroupDescriptorsFetch(struct FileSystem *);
+struct ext4_group_desc *GroupDescriptorGet(struct FileSystem *, uint64_t);
 void GroupDescriptorsPrint(struct FileSystem *);
 void GroupDescriptorsPrintBynum(struct FileSystem *, uint64_t);
-void InodeTablePrintBynum(struct FileSystem *, uint64_t);
+void InodePrintTableBynum(struct FileSystem *, uint64_t);
 void InodePrintBynum(struct FileSystem *, uint64_t);
+void InodePrint(struct FileSystem *, uint64_t, struct ext4_inode *);
 uint64_t InodeGetBynum(struct FileSystem *, uint64_t, struct ext4_inode *);
+uint64_t InodeOffsetGet(struct FileSystem *, uint64_t);
+struct ext4_inode *InodeMapBynum(struct FileSystem *, uint64_t);
+void InodeUnmapBynum(struct FileSystem *, uint64_t);
 
 uint64_t InodeBitmapGetBynum(struct FileSystem *, uint64_t, char *);
 int InodeStatusGetBynum(struct FileSystem *, uint64_t);
@@ -49,12 +151,28 @@ uint64_t BlockBitmapGetBynum(struct FileSystem *, uint64_t, char *);
 int BlockStatusGetBynum(struct FileSystem *, uint64_t);
 void BlockStatusPrintBynum(struct FileSystem *, uint64_t);
 
+/*
+ * Called by XattrForEach for one attribute, name is not NUL terminated
+ * Return 0 to go on, anything else stops the walk
+ */
+typedef int (*XattrFunc)(struct FileSystem *, const char *, const char *, uint32_t, const char *, uint32_t, void *);
+
+int XattrForEach(struct FileSystem *, uint64_t, XattrFunc, void *);
 void XattrPrintBynum(struct FileSystem *, uint64_t);
-void XattrentryAllPrint(struct FileSystem *, struct ext4_xattr_entry *, uint64_t start);
 
 uint64_t BlockRead(struct FileSystem *, uint64_t, uint64_t, char *);
 uint64_t BytesRead(struct FileSystem *, uint64_t, uint64_t, char *);
 uint64_t BytesWrite(struct FileSystem *, uint64_t, uint64_t, char *);
+uint64_t PositionalRead(int, char *, uint64_t, uint64_t);
+uint64_t PositionalWrite(int, char *, uint64_t, uint64_t);
+int ArrayReserve(void **, uint64_t *, uint64_t, uint64_t, uint64_t);
+
+int ImageMapInit(struct FileSystem *);
+void ImageMapRelease(struct FileSystem *);
+char *BytesMap(struct FileSystem *, uint64_t, uint64_t);
+void BytesUnmap(struct FileSystem *, uint64_t);
+char *BlockMap(struct FileSystem *, uint64_t, uint64_t);
+void BlockUnmap(struct FileSystem *, uint64_t);
 
 uint64_t BlockBitmapLocationGet(struct FileSystem *, struct ext4_group_desc *);
 uint64_t InodeBitmapLocationGet(struct FileSystem *, struct ext4_group_desc *);
@@ -63,7 +181,12 @@ uint32_t FreeBlocksCountGet(struct FileSystem *, struct ext4_group_desc *);
 uint32_t FreeInodesCountGet(struct FileSystem *, struct ext4_group_desc *);
 uint32_t UsedDirsCountGet(struct FileSystem *, struct ext4_group_desc *);
 uint32_t UnusedInodesCountGet(struct FileSystem *, struct ext4_group_desc *);
+void FreeBlocksCountSet(struct FileSystem *, struct ext4_group_desc *, uint32_t);
+void FreeInodesCountSet(struct FileSystem *, struct ext4_group_desc *, uint32_t);
+void UnusedInodesCountSet(struct FileSystem *, struct ext4_group_desc *, uint32_t);
 
 void Hexdump(char *, uint64_t len);
 
 uint64_t Redirect(struct FileSystem *, uint64_t, uint64_t);
+
+#endif /* FILESYSTEM_H */
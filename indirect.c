@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "indirect.h"
+#include "readbatch.h"
+
+/*
+ * A pointer block still to be read
+ */
+struct IndirectBlock {
+    uint64_t block;
+    uint64_t logical;   /* first logical block it covers */
+    uint32_t level;     /* 1 holds data block pointers, 2 and 3 pointer block pointers */
+};
+
+struct IndirectLevel {
+    struct IndirectBlock *blocks;
+    uint64_t count;
+    uint64_t capacity;
+};
+
+static int IndirectLevelPush(struct IndirectLevel *level, uint64_t block, uint64_t logical, uint32_t depth)
+{
+    if (ArrayReserve((void **)&level->blocks, &level->capacity, level->count, sizeof(struct IndirectBlock), 1) < 0) {
+        return -1;
+    }
+    level->blocks[level->count].block = block;
+    level->blocks[level->count].logical = logical;
+    level->blocks[level->count].level = depth;
+    level->count++;
+    return 0;
+}
+
+static bool IndirectPointerValid(struct FileSystem *fs, uint64_t block)
+{
+    return block >= le32toh(fs->super.s_first_data_block) && block < fs->block_count;
+}
+
+/*
+ * Read blocks [first, last) of cur with one ReadBatch and decode them,
+ * data pointers go to map and pointer block pointers to next
+ */
+static int IndirectBatchDecode(struct FileSystem *fs, struct IndirectLevel *cur, uint64_t first, uint64_t last,
+        char *buf, struct ReadRequest *reqs, struct IndirectLevel *next, struct ExtentMap *map)
+{
+    struct IndirectBlock *ib = NULL;
+    uint64_t per_block = fs->block_size / sizeof(uint32_t);
+    uint64_t span = 0, logical = 0, ptr = 0, nreqs = 0, i = 0, j = 0;
+    uint32_t *ptrs = NULL;
+
+    /* Pointer blocks are often allocated next to each other, read those together */
+    for (i = first; i < last; i++) {
+        ib = &(cur->blocks[i]);
+        if (ExtentMapMetaAdd(map, ib->block) < 0) {
+            return -1;
+        }
+        if (nreqs > 0 && reqs[nreqs - 1].offset + reqs[nreqs - 1].len == ib->block * fs->block_size) {
+            reqs[nreqs - 1].len += fs->block_size;
+            continue;
+        }
+        reqs[nreqs].offset = ib->block * fs->block_size;
+        reqs[nreqs].len = fs->block_size;
+        reqs[nreqs].buf = buf + (i - first) * fs->block_size;
+        nreqs++;
+    }
+    if (ReadBatch(fs, reqs, nreqs, NULL, NULL) < 0) {
+        printf("IndirectMapBuild: inode %llu read pointer blocks failed\n", map->inode);
+        return -1;
+    }
+
+    for (i = first; i < last; i++) {
+        ib = &(cur->blocks[i]);
+        ptrs = (uint32_t *)(buf + (i - first) * fs->block_size);
+        span = 1;
+        for (j = 1; j < ib->level; j++) {
+            span *= per_block;
+        }
+        for (j = 0; j < per_block; j++) {
+            ptr = le32toh(ptrs[j]);
+            if (ptr == 0) {
+                continue;
+            }
+            logical = ib->logical + j * span;
+            if (!IndirectPointerValid(fs, ptr) || logical > UINT32_MAX) {
+                printf("IndirectMapBuild: inode %llu pointer %u of block %llu is invalid\n",
+                        map->inode, (uint32_t)j, ib->block);
+                return -1;
+            }
+            if (ib->level == 1) {
+                if (ExtentMapAppend(map, logical, ptr, 1) < 0) {
+                    return -1;
+                }
+            } else if (IndirectLevelPush(next, ptr, logical, ib->level - 1) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Resolve the block map of an inode using direct and indirect blocks into
+ * the same run map as ExtentMapBuild.
+ * The pointer blocks are read a level at a time, all blocks of a level in
+ * batches of INDIRECT_BATCH_BLOCKS with one ReadBatch each, instead of
+ * chasing one pointer at a time. A level covers higher logical blocks than
+ * the one before, so the runs come out sorted and are merged as they come.
+ * @fs: FileSystem
+ * @num: inode number, kept in the map and used in messages
+ * @pinode: the inode
+ * @map: filled in, released by ExtentMapRelease
+ * Return 0 on success, -1 if the inode has no block pointers or they are corrupt
+ */
+int IndirectMapBuild(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode, struct ExtentMap *map)
+{
+    struct IndirectLevel cur, next;
+    struct ReadRequest *reqs = NULL;
+    char *buf = NULL;
+    uint64_t per_block = 0, logical = 0, ptr = 0, first = 0, last = 0, i = 0;
+    uint64_t size = 0;
+    uint16_t mode = 0;
+    int ret = -1;
+
+    if (fs == NULL || pinode == NULL || map == NULL) {
+        return -1;
+    }
+    memset(map, 0, sizeof(struct ExtentMap));
+    map->inode = num;
+    memset(&cur, 0, sizeof(struct IndirectLevel));
+    memset(&next, 0, sizeof(struct IndirectLevel));
+
+    if (le32toh(pinode->i_flags) & (EXT4_EXTENTS_FL | EXT4_INLINE_DATA_FL)) {
+        return -1;
+    }
+    /* Devices keep their numbers in i_block, fast symlinks their target */
+    mode = le16toh(pinode->i_mode) & 0xF000;
+    size = (uint64_t)le32toh(pinode->i_size_lo) | (uint64_t)le32toh(pinode->i_size_high) << 32;
+    if (mode != 0x8000 && mode != 0x4000 && mode != 0xA000) {
+        return -1;
+    }
+    if (mode == 0xA000 && size < sizeof(pinode->i_block)) {
+        return -1;
+    }
+
+    per_block = fs->block_size / sizeof(uint32_t);
+    for (i = 0; i < EXT4_N_BLOCKS; i++) {
+        ptr = le32toh(pinode->i_block[i]);
+        if (i == EXT4_IND_BLOCK) {
+            logical = EXT4_NDIR_BLOCKS;
+        } else if (i == EXT4_DIND_BLOCK) {
+            logical = EXT4_NDIR_BLOCKS + per_block;
+        } else if (i == EXT4_TIND_BLOCK) {
+            logical = EXT4_NDIR_BLOCKS + per_block + per_block * per_block;
+        } else {
+            logical = i;
+        }
+        if (ptr == 0 || logical > UINT32_MAX) {
+            continue;
+        }
+        if (!IndirectPointerValid(fs, ptr)) {
+            printf("IndirectMapBuild: inode %llu block pointer %llu is invalid\n", num, i);
+            goto end;
+        }
+        if (i < EXT4_NDIR_BLOCKS) {
+            if (ExtentMapAppend(map, logical, ptr, 1) < 0) {
+                goto end;
+            }
+        } else if (IndirectLevelPush(&cur, ptr, logical, i - EXT4_NDIR_BLOCKS + 1) < 0) {
+            goto end;
+        }
+    }
+
+    buf = (char *) malloc(fs->block_size * INDIRECT_BATCH_BLOCKS);
+    reqs = (struct ReadRequest *) calloc(INDIRECT_BATCH_BLOCKS, sizeof(struct ReadRequest));
+    if (buf == NULL || reqs == NULL) {
+        printf("IndirectMapBuild: allocate memory failed\n");
+        goto end;
+    }
+
+    while (cur.count > 0) {
+        for (first = 0; first < cur.count; first = last) {
+            last = (cur.count - first > INDIRECT_BATCH_BLOCKS) ? first + INDIRECT_BATCH_BLOCKS : cur.count;
+            if (IndirectBatchDecode(fs, &cur, first, last, buf, reqs, &next, map) < 0) {
+                goto end;
+            }
+        }
+        free(cur.blocks);
+        cur = next;
+        memset(&next, 0, sizeof(struct IndirectLevel));
+    }
+    ret = 0;
+end:
+    free(cur.blocks);
+    free(next.blocks);
+    free(buf);
+    free(reqs);
+    if (ret < 0) {
+        ExtentMapRelease(map);
+    }
+    return ret;
+}
@@ -0,0 +1,12 @@
+#ifndef INDIRECT_H
+#define INDIRECT_H
+
+#include "filesystem.h"
+#include "extent.h"
+
+/* Most pointer blocks read in one batch, bounds the memory of a level */
+#define INDIRECT_BATCH_BLOCKS   1024
+
+int IndirectMapBuild(struct FileSystem *, uint64_t, struct ext4_inode *, struct ExtentMap *);
+
+#endif /* INDIRECT_H */
@@ -0,0 +1,741 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+
+#include "journal.h"
+#include "indirect.h"
+#include "crc32c.h"
+
+/*
+ * Reads journal blocks through the block map of the journal inode, a
+ * window of JOURNAL_READ_BLOCKS at a time since the log is walked in order
+ */
+struct JournalReader {
+    struct FileSystem *fs;
+    struct ExtentMap map;
+    uint64_t maxlen;    /* journal blocks */
+    char *buf;
+    uint64_t start;     /* first journal block in buf */
+    uint64_t count;
+    uint64_t bytes;
+};
+
+/* A block copy found in the log, in log order */
+struct JournalTag {
+    uint64_t block;
+    uint64_t log;
+    uint64_t slot;      /* overlay block it goes to, or JOURNAL_TAG_DROPPED */
+    uint32_t sequence;
+    uint32_t checksum;
+    uint32_t flags;     /* JBD2_FLAG_* */
+};
+
+#define JOURNAL_TAG_DROPPED     UINT64_MAX
+
+struct JournalRevoke {
+    uint64_t block;
+    uint32_t sequence;
+};
+
+struct JournalScan {
+    struct FileSystem *fs;
+    struct JournalReader reader;
+    struct journal_superblock sb;
+    uint32_t incompat;
+    uint32_t seed;
+    uint64_t tag_bytes;
+    bool csum;          /* CSUM_V2 or CSUM_V3 */
+    struct JournalTag *tags;
+    uint64_t tag_count;
+    uint64_t tag_capacity;
+    struct JournalRevoke *revokes;
+    uint64_t revoke_count;
+    uint64_t revoke_capacity;
+};
+
+/*
+ * Return journal block pos, NULL if it is not mapped or cannot be read.
+ * The pointer is valid until the next call.
+ */
+static char *JournalBlockRead(struct JournalReader *r, uint64_t pos)
+{
+    struct FileSystem *fs = r->fs;
+    struct ExtentRecord *rec = NULL;
+    uint64_t n = 0, i = 0, run = 0, physical = 0;
+    int64_t index = 0;
+
+    if (pos >= r->start && pos < r->start + r->count) {
+        return r->buf + (pos - r->start) * fs->block_size;
+    }
+    if (pos >= r->maxlen) {
+        return NULL;
+    }
+    n = r->maxlen - pos;
+    if (n > JOURNAL_READ_BLOCKS) {
+        n = JOURNAL_READ_BLOCKS;
+    }
+    r->count = 0;
+    for (i = 0; i < n; i += run) {
+        index = ExtentLookup(&r->map, pos + i);
+        if (index < 0) {
+            break;
+        }
+        rec = &(r->map.records[index]);
+        physical = rec->physical + (pos + i - rec->logical);
+        run = rec->logical + EXTENT_RECORD_LEN(rec) - (pos + i);
+        if (run > n - i) {
+            run = n - i;
+        }
+        if (physical + run > fs->block_count || BlockRead(fs, physical, run, r->buf + i * fs->block_size) == 0) {
+            break;
+        }
+        r->bytes += run * fs->block_size;
+    }
+    if (i == 0) {
+        return NULL;
+    }
+    r->start = pos;
+    r->count = i;
+    return r->buf;
+}
+
+/*
+ * Block map of the journal inode. When the inode is unreadable the copy of
+ * its i_block and size that the superblock keeps in s_jnl_blocks is used.
+ */
+static int JournalMapBuild(struct FileSystem *fs, struct ExtentMap *map)
+{
+    struct ext4_inode inode;
+    uint64_t num = le32toh(fs->super.s_journal_inum);
+    int ret = -1;
+
+    if (InodeGetBynum(fs, num, &inode) != 0 && le16toh(inode.i_mode) != 0) {
+        if (le32toh(inode.i_flags) & EXT4_EXTENTS_FL) {
+            ret = ExtentMapBuild(fs, num, &inode, map);
+        } else {
+            ret = IndirectMapBuild(fs, num, &inode, map);
+        }
+    }
+    if (ret == 0 || fs->super.s_jnl_backup_type != EXT3_JNL_BACKUP_BLOCKS) {
+        return ret;
+    }
+
+    memset(&inode, 0, sizeof(struct ext4_inode));
+    memcpy(inode.i_block, fs->super.s_jnl_blocks, sizeof(inode.i_block));
+    inode.i_size_high = fs->super.s_jnl_blocks[EXT4_N_BLOCKS];
+    inode.i_size_lo = fs->super.s_jnl_blocks[EXT4_N_BLOCKS + 1];
+    inode.i_mode = htole16(0x8000);
+    if (le16toh(((struct ext4_extent_header *)inode.i_block)->eh_magic) == EXT4_EXT_MAGIC) {
+        inode.i_flags = htole32(EXT4_EXTENTS_FL);
+        ret = ExtentMapBuild(fs, num, &inode, map);
+    } else {
+        ret = IndirectMapBuild(fs, num, &inode, map);
+    }
+    if (ret == 0) {
+        printf("JournalMapBuild: journal inode %llu is unreadable, its backup in the superblock is used\n", num);
+    }
+    return ret;
+}
+
+/*
+ * Bytes of a descriptor block tag, journal_tag_bytes of the kernel
+ */
+static uint64_t JournalTagBytes(uint32_t incompat)
+{
+    uint64_t size = 0;
+
+    if (incompat & JBD2_FEATURE_INCOMPAT_CSUM_V3) {
+        return sizeof(struct journal_block_tag3);
+    }
+    size = sizeof(struct journal_block_tag);
+    if (incompat & JBD2_FEATURE_INCOMPAT_CSUM_V2) {
+        size += sizeof(uint16_t);
+    }
+    if (incompat & JBD2_FEATURE_INCOMPAT_64BIT) {
+        return size;
+    }
+    return size - sizeof(uint32_t);
+}
+
+/*
+ * Check a checksum kept in a block at offset, computed with the field as zero
+ */
+static bool JournalBlockCsumVerify(struct JournalScan *scan, char *block, uint64_t offset)
+{
+    __be32 *field = (__be32 *)(block + offset);
+    uint32_t stored = be32toh(*field);
+    uint32_t computed = 0;
+
+    *field = 0;
+    computed = Crc32c(scan->seed, block, scan->fs->block_size);
+    *field = htobe32(stored);
+    return stored == computed;
+}
+
+static bool JournalTagCsumVerify(struct JournalScan *scan, struct JournalTag *tag, char *data)
+{
+    __be32 sequence = htobe32(tag->sequence);
+    uint32_t computed = 0;
+
+    computed = Crc32c(scan->seed, &sequence, sizeof(sequence));
+    computed = Crc32c(computed, data, scan->fs->block_size);
+    if (scan->incompat & JBD2_FEATURE_INCOMPAT_CSUM_V3) {
+        return tag->checksum == computed;
+    }
+    return tag->checksum == (computed & 0xFFFF);
+}
+
+static int JournalTagAdd(struct JournalScan *scan, uint64_t block, uint64_t log, uint32_t sequence,
+        uint32_t checksum, uint32_t flags)
+{
+    struct JournalTag *tag = NULL;
+
+    if (ArrayReserve((void **)&scan->tags, &scan->tag_capacity, scan->tag_count, sizeof(struct JournalTag), 1) < 0) {
+        return -1;
+    }
+    tag = &(scan->tags[scan->tag_count++]);
+    tag->block = block;
+    tag->log = log;
+    tag->slot = JOURNAL_TAG_DROPPED;
+    tag->sequence = sequence;
+    tag->checksum = checksum;
+    tag->flags = flags;
+    return 0;
+}
+
+static int JournalRevokeAdd(struct JournalScan *scan, uint64_t block, uint32_t sequence)
+{
+    if (ArrayReserve((void **)&scan->revokes, &scan->revoke_capacity, scan->revoke_count, sizeof(struct JournalRevoke),
+                1) < 0) {
+        return -1;
+    }
+    scan->revokes[scan->revoke_count].block = block;
+    scan->revokes[scan->revoke_count].sequence = sequence;
+    scan->revoke_count++;
+    return 0;
+}
+
+/*
+ * Collect the tags of a descriptor block, the data blocks follow it in the log
+ * Return the log position after the last data block
+ */
+static int64_t JournalDescriptorParse(struct JournalScan *scan, struct JournalOverlay *ov, char *block,
+        uint64_t pos, uint32_t sequence)
+{
+    uint64_t end = scan->fs->block_size - (scan->csum ? sizeof(struct jbd2_journal_block_tail) : 0);
+    uint64_t offset = sizeof(struct journal_header);
+    uint64_t nr = 0;
+    uint32_t flags = 0, checksum = 0;
+    struct journal_block_tag3 *tag3 = NULL;
+    struct journal_block_tag *tag = NULL;
+
+    while (offset + scan->tag_bytes <= end) {
+        if (scan->incompat & JBD2_FEATURE_INCOMPAT_CSUM_V3) {
+            tag3 = (struct journal_block_tag3 *)(block + offset);
+            nr = be32toh(tag3->t_blocknr);
+            flags = be32toh(tag3->t_flags);
+            checksum = be32toh(tag3->t_checksum);
+            if (scan->incompat & JBD2_FEATURE_INCOMPAT_64BIT) {
+                nr |= (uint64_t)be32toh(tag3->t_blocknr_high) << 32;
+            }
+        } else {
+            tag = (struct journal_block_tag *)(block + offset);
+            nr = be32toh(tag->t_blocknr);
+            flags = be16toh(tag->t_flags);
+            checksum = be16toh(tag->t_checksum);
+            if (scan->incompat & JBD2_FEATURE_INCOMPAT_64BIT) {
+                nr |= (uint64_t)be32toh(tag->t_blocknr_high) << 32;
+            }
+        }
+        pos = (pos + 1 >= ov->last) ? ov->first : pos + 1;
+        if (JournalTagAdd(scan, nr, pos, sequence, checksum, flags) < 0) {
+            return -1;
+        }
+        ov->log_blocks++;
+        offset += scan->tag_bytes;
+        if (!(flags & JBD2_FLAG_SAME_UUID)) {
+            offset += 16;
+        }
+        if (flags & JBD2_FLAG_LAST_TAG) {
+            break;
+        }
+    }
+    return (pos + 1 >= ov->last) ? ov->first : pos + 1;
+}
+
+static int JournalRevokeParse(struct JournalScan *scan, char *block, uint32_t sequence)
+{
+    struct jbd2_journal_revoke_header *hdr = (struct jbd2_journal_revoke_header *)block;
+    uint64_t size = (scan->incompat & JBD2_FEATURE_INCOMPAT_64BIT) ? sizeof(uint64_t) : sizeof(uint32_t);
+    uint64_t offset = sizeof(struct jbd2_journal_revoke_header);
+    uint64_t max = be32toh(hdr->r_count);
+    uint64_t nr = 0;
+    __be64 nr64 = 0;
+    __be32 nr32 = 0;
+
+    if (max > scan->fs->block_size - (scan->csum ? sizeof(struct jbd2_journal_block_tail) : 0)) {
+        return -1;
+    }
+    for (; offset + size <= max; offset += size) {
+        if (size == sizeof(uint64_t)) {
+            memcpy(&nr64, block + offset, size);
+            nr = be64toh(nr64);
+        } else {
+            memcpy(&nr32, block + offset, size);
+            nr = be32toh(nr32);
+        }
+        if (JournalRevokeAdd(scan, nr, sequence) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Walk the log from s_start the way the kernel's scan pass does: it ends at
+ * the first block that is not the next expected one of the current
+ * transaction, and only transactions with a commit block count
+ */
+static int JournalLogScan(struct JournalScan *scan, struct JournalOverlay *ov)
+{
+    struct journal_header *hdr = NULL;
+    struct commit_header *commit = NULL;
+    char *block = NULL;
+    uint64_t pos = ov->start, area = ov->last - ov->first;
+    uint64_t committed_tags = 0, committed_revokes = 0;
+    uint32_t sequence = ov->first_sequence;
+    int64_t next = 0;
+    bool end = false;
+
+    while (!end && ov->log_blocks < area) {
+        block = JournalBlockRead(&scan->reader, pos);
+        if (block == NULL) {
+            printf("JournalLogScan: read journal block %llu failed\n", pos);
+            break;
+        }
+        hdr = (struct journal_header *)block;
+        if (be32toh(hdr->h_magic) != JBD2_MAGIC_NUMBER || be32toh(hdr->h_sequence) != sequence) {
+            break;
+        }
+        ov->log_blocks++;
+
+        switch (be32toh(hdr->h_blocktype)) {
+            case JBD2_DESCRIPTOR_BLOCK:
+                if (scan->csum && !JournalBlockCsumVerify(scan, block,
+                            scan->fs->block_size - sizeof(struct jbd2_journal_block_tail))) {
+                    printf("JournalLogScan: descriptor block %llu of transaction %u has a bad checksum\n", pos, sequence);
+                    end = true;
+                    break;
+                }
+                next = JournalDescriptorParse(scan, ov, block, pos, sequence);
+                if (next < 0) {
+                    return -1;
+                }
+                pos = next;
+                break;
+            case JBD2_COMMIT_BLOCK:
+                commit = (struct commit_header *)block;
+                if (scan->csum && !JournalBlockCsumVerify(scan, block, (char *)&commit->h_chksum[0] - block)) {
+                    printf("JournalLogScan: commit block %llu of transaction %u has a bad checksum\n", pos, sequence);
+                    end = true;
+                    break;
+                }
+                committed_tags = scan->tag_count;
+                committed_revokes = scan->revoke_count;
+                ov->transactions++;
+                sequence++;
+                pos = (pos + 1 >= ov->last) ? ov->first : pos + 1;
+                break;
+            case JBD2_REVOKE_BLOCK:
+                if (scan->csum && !JournalBlockCsumVerify(scan, block,
+                            scan->fs->block_size - sizeof(struct jbd2_journal_block_tail))) {
+                    printf("JournalLogScan: revoke block %llu of transaction %u has a bad checksum\n", pos, sequence);
+                    end = true;
+                    break;
+                }
+                if (JournalRevokeParse(scan, block, sequence) < 0) {
+                    printf("JournalLogScan: revoke block %llu of transaction %u is corrupted\n", pos, sequence);
+                    end = true;
+                    break;
+                }
+                pos = (pos + 1 >= ov->last) ? ov->first : pos + 1;
+                break;
+            default:
+                end = true;
+                break;
+        }
+    }
+
+    /* What follows the last commit is a transaction that never finished */
+    scan->tag_count = committed_tags;
+    scan->revoke_count = committed_revokes;
+    ov->end_sequence = sequence;
+    return 0;
+}
+
+static int JournalRevokeCompare(const void *a, const void *b)
+{
+    const struct JournalRevoke *x = (const struct JournalRevoke *)a;
+    const struct JournalRevoke *y = (const struct JournalRevoke *)b;
+
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+    return 0;
+}
+
+static int JournalTagIndexCompare(const void *a, const void *b)
+{
+    const struct JournalTag *const *x = (const struct JournalTag *const *)a;
+    const struct JournalTag *const *y = (const struct JournalTag *const *)b;
+
+    if ((*x)->block != (*y)->block) {
+        return (*x)->block < (*y)->block ? -1 : 1;
+    }
+    return (*x < *y) ? -1 : (*x > *y);
+}
+
+/*
+ * Latest revoke of a block, sequences compared from first_sequence so they may wrap
+ * Return false if the block has no revoke record
+ */
+static bool JournalRevokeGet(struct JournalScan *scan, uint64_t block, uint32_t *sequence)
+{
+    struct JournalRevoke key;
+    struct JournalRevoke *found = NULL;
+
+    if (scan->revoke_count == 0) {
+        return false;
+    }
+    key.block = block;
+    found = (struct JournalRevoke *) bsearch(&key, scan->revokes, scan->revoke_count,
+            sizeof(struct JournalRevoke), JournalRevokeCompare);
+    if (found == NULL) {
+        return false;
+    }
+    *sequence = found->sequence;
+    return true;
+}
+
+/*
+ * Give each block that survives the revokes an overlay slot, then replay the
+ * copies in log order into their slots, so the last valid copy of a block wins
+ */
+static int JournalReplay(struct JournalScan *scan, struct JournalOverlay *ov)
+{
+    struct FileSystem *fs = scan->fs;
+    struct JournalTag **order = NULL;
+    struct JournalTag *tag = NULL;
+    struct JournalBlock *jb = NULL;
+    uint64_t i = 0, j = 0, n = 0, kept = 0;
+    uint32_t revoke = 0;
+    char *data = NULL;
+    __be32 magic = htobe32(JBD2_MAGIC_NUMBER);
+    int ret = -1;
+
+    /* Only the latest revoke of a block matters, keep the highest sequence */
+    if (scan->revoke_count > 0) {
+        qsort(scan->revokes, scan->revoke_count, sizeof(struct JournalRevoke), JournalRevokeCompare);
+    }
+    for (i = 0, j = 0; i < scan->revoke_count; i++) {
+        if (j > 0 && scan->revokes[j - 1].block == scan->revokes[i].block) {
+            if ((int32_t)(scan->revokes[i].sequence - scan->revokes[j - 1].sequence) > 0) {
+                scan->revokes[j - 1].sequence = scan->revokes[i].sequence;
+            }
+            continue;
+        }
+        scan->revokes[j++] = scan->revokes[i];
+    }
+    scan->revoke_count = j;
+
+    order = (struct JournalTag **) malloc(sizeof(struct JournalTag *) * (scan->tag_count ? scan->tag_count : 1));
+    if (order == NULL) {
+        goto end;
+    }
+    for (i = 0; i < scan->tag_count; i++) {
+        tag = &(scan->tags[i]);
+        if (tag->block >= fs->block_count) {
+            ov->bad++;
+            continue;
+        }
+        if (JournalRevokeGet(scan, tag->block, &revoke) &&
+                (int32_t)(tag->sequence - ov->first_sequence) <= (int32_t)(revoke - ov->first_sequence)) {
+            ov->revoked++;
+            continue;
+        }
+        order[kept++] = tag;
+    }
+    qsort(order, kept, sizeof(struct JournalTag *), JournalTagIndexCompare);
+    for (i = 0; i < kept; i++) {
+        if (i == 0 || order[i]->block != order[i - 1]->block) {
+            n++;
+        }
+        order[i]->slot = n - 1;
+    }
+
+    ov->blocks = (struct JournalBlock *) calloc(n ? n : 1, sizeof(struct JournalBlock));
+    ov->data = (char *) malloc(fs->block_size * (n ? n : 1));
+    if (ov->blocks == NULL || ov->data == NULL) {
+        goto end;
+    }
+    for (i = 0; i < kept; i++) {
+        jb = &(ov->blocks[order[i]->slot]);
+        jb->block = order[i]->block;
+    }
+
+    for (i = 0; i < scan->tag_count; i++) {
+        tag = &(scan->tags[i]);
+        if (tag->slot == JOURNAL_TAG_DROPPED) {
+            continue;
+        }
+        data = JournalBlockRead(&scan->reader, tag->log);
+        if (data == NULL) {
+            printf("JournalReplay: read journal block %llu failed\n", tag->log);
+            goto end;
+        }
+        if (scan->csum && !JournalTagCsumVerify(scan, tag, data)) {
+            ov->bad++;
+            continue;
+        }
+        jb = &(ov->blocks[tag->slot]);
+        jb->log = tag->log;
+        jb->sequence = tag->sequence;
+        jb->data = ov->data + tag->slot * fs->block_size;
+        memcpy(jb->data, data, fs->block_size);
+        if (tag->flags & JBD2_FLAG_ESCAPE) {
+            memcpy(jb->data, &magic, sizeof(magic));
+        }
+    }
+
+    /* Blocks whose every copy was bad are left as they are on disk */
+    for (i = 0, j = 0; i < n; i++) {
+        if (ov->blocks[i].data != NULL) {
+            ov->blocks[j++] = ov->blocks[i];
+        }
+    }
+    ov->count = j;
+    ret = 0;
+end:
+    free(order);
+    return ret;
+}
+
+/*
+ * Work out what replaying the journal would write, reading the log only
+ * @fs: FileSystem with an internal journal
+ * @ov: filled in, release with JournalOverlayRelease
+ * Return 0 on success, -1 when there is no journal or it cannot be read
+ */
+int JournalOverlayBuild(struct FileSystem *fs, struct JournalOverlay *ov)
+{
+    struct JournalScan scan;
+    struct timespec begin, end;
+    char *block = NULL;
+    uint32_t blocktype = 0;
+    int ret = -1;
+
+    if (fs == NULL || ov == NULL) {
+        return -1;
+    }
+    memset(ov, 0, sizeof(struct JournalOverlay));
+    memset(&scan, 0, sizeof(struct JournalScan));
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    if (!HAS_COMPAT_FEATURE(fs->super, EXT4_FEATURE_COMPAT_HAS_JOURNAL) || fs->super.s_journal_inum == 0) {
+        printf("JournalOverlayBuild: the filesystem has no internal journal\n");
+        return -1;
+    }
+    scan.fs = fs;
+    scan.reader.fs = fs;
+    if (JournalMapBuild(fs, &scan.reader.map) < 0) {
+        printf("JournalOverlayBuild: block map of the journal inode is unreadable\n");
+        return -1;
+    }
+    scan.reader.maxlen = scan.reader.map.count > 0 ?
+        scan.reader.map.records[scan.reader.map.count - 1].logical + EXTENT_RECORD_LEN(&scan.reader.map.records[scan.reader.map.count - 1]) : 0;
+    scan.reader.buf = (char *) malloc(JOURNAL_READ_BLOCKS * fs->block_size);
+    if (scan.reader.buf == NULL) {
+        printf("JournalOverlayBuild: allocate memory failed\n");
+        goto end;
+    }
+
+    block = JournalBlockRead(&scan.reader, 0);
+    if (block == NULL) {
+        printf("JournalOverlayBuild: read journal superblock failed\n");
+        goto end;
+    }
+    memcpy(&scan.sb, block, sizeof(struct journal_superblock));
+    blocktype = be32toh(scan.sb.s_header.h_blocktype);
+    if (be32toh(scan.sb.s_header.h_magic) != JBD2_MAGIC_NUMBER ||
+            (blocktype != JBD2_SUPERBLOCK_V1 && blocktype != JBD2_SUPERBLOCK_V2)) {
+        printf("JournalOverlayBuild: bad journal superblock\n");
+        goto end;
+    }
+    if (be32toh(scan.sb.s_blocksize) != fs->block_size || be32toh(scan.sb.s_maxlen) > scan.reader.maxlen ||
+            be32toh(scan.sb.s_first) == 0 || be32toh(scan.sb.s_first) >= be32toh(scan.sb.s_maxlen)) {
+        printf("JournalOverlayBuild: journal geometry does not match its inode\n");
+        goto end;
+    }
+    if (blocktype == JBD2_SUPERBLOCK_V2) {
+        scan.incompat = be32toh(scan.sb.s_feature_incompat);
+    }
+    if (scan.incompat & ~JBD2_KNOWN_INCOMPAT_FEATURES) {
+        printf("JournalOverlayBuild: unknown journal features 0x%x\n", scan.incompat & ~JBD2_KNOWN_INCOMPAT_FEATURES);
+        goto end;
+    }
+    scan.csum = (scan.incompat & (JBD2_FEATURE_INCOMPAT_CSUM_V2 | JBD2_FEATURE_INCOMPAT_CSUM_V3)) != 0;
+    scan.seed = Crc32c(~0U, scan.sb.s_uuid, sizeof(scan.sb.s_uuid));
+    scan.tag_bytes = JournalTagBytes(scan.incompat);
+
+    /* Fast commit blocks sit behind the log and are not replayed here */
+    ov->first = be32toh(scan.sb.s_first);
+    ov->last = be32toh(scan.sb.s_maxlen);
+    if (scan.incompat & JBD2_FEATURE_INCOMPAT_FAST_COMMIT) {
+        ov->last -= be32toh(scan.sb.s_num_fc_blks) ? be32toh(scan.sb.s_num_fc_blks) : JBD2_DEFAULT_FAST_COMMIT_BLOCKS;
+    }
+    ov->start = be32toh(scan.sb.s_start);
+    ov->first_sequence = be32toh(scan.sb.s_sequence);
+    ov->end_sequence = ov->first_sequence;
+    ov->clean = (ov->start == 0);
+    if (ov->clean) {
+        ret = 0;
+        goto end;
+    }
+    if (ov->start < ov->first || ov->start >= ov->last) {
+        printf("JournalOverlayBuild: log start %llu is outside the journal\n", ov->start);
+        goto end;
+    }
+
+    if (JournalLogScan(&scan, ov) < 0 || JournalReplay(&scan, ov) < 0) {
+        printf("JournalOverlayBuild: allocate memory failed\n");
+        goto end;
+    }
+    ov->tags = scan.tag_count;
+    ov->revokes = scan.revoke_count;
+    ret = 0;
+end:
+    ov->bytes = scan.reader.bytes;
+    ExtentMapRelease(&scan.reader.map);
+    free(scan.reader.buf);
+    free(scan.tags);
+    free(scan.revokes);
+    if (ret < 0) {
+        JournalOverlayRelease(ov);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ov->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return ret;
+}
+
+void JournalOverlayRelease(struct JournalOverlay *ov)
+{
+    if (ov == NULL) {
+        return;
+    }
+    free(ov->blocks);
+    free(ov->data);
+    ov->blocks = NULL;
+    ov->data = NULL;
+    ov->count = 0;
+}
+
+/*
+ * Index of the first overlay block at or after block
+ */
+static uint64_t JournalOverlayLowerBound(struct JournalOverlay *ov, uint64_t block)
+{
+    uint64_t lo = 0, hi = ov->count, mid = 0;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ov->blocks[mid].block < block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Return the journal copy of a filesystem block, NULL if the replay leaves it alone
+ */
+struct JournalBlock *JournalOverlayLookup(struct JournalOverlay *ov, uint64_t block)
+{
+    uint64_t i = 0;
+
+    if (ov == NULL) {
+        return NULL;
+    }
+    i = JournalOverlayLowerBound(ov, block);
+    if (i < ov->count && ov->blocks[i].block == block) {
+        return &(ov->blocks[i]);
+    }
+    return NULL;
+}
+
+/*
+ * Whether a replay would change any byte of [offset, offset + len)
+ */
+bool JournalOverlayCovers(struct FileSystem *fs, uint64_t offset, uint64_t len)
+{
+    struct JournalOverlay *ov = fs->journal;
+    uint64_t i = 0;
+
+    if (ov == NULL || ov->count == 0 || len == 0) {
+        return false;
+    }
+    i = JournalOverlayLowerBound(ov, offset / fs->block_size);
+    return i < ov->count && ov->blocks[i].block <= (offset + len - 1) / fs->block_size;
+}
+
+/*
+ * Put the journal copies over the bytes read from [offset, offset + len)
+ */
+void JournalOverlayApply(struct FileSystem *fs, uint64_t offset, uint64_t len, char *buf)
+{
+    struct JournalOverlay *ov = fs->journal;
+    struct JournalBlock *jb = NULL;
+    uint64_t i = 0, start = 0, stop = 0;
+
+    if (ov == NULL || ov->count == 0 || len == 0) {
+        return;
+    }
+    for (i = JournalOverlayLowerBound(ov, offset / fs->block_size); i < ov->count; i++) {
+        jb = &(ov->blocks[i]);
+        start = jb->block * fs->block_size;
+        if (start >= offset + len) {
+            break;
+        }
+        stop = start + fs->block_size;
+        if (start < offset) {
+            start = offset;
+        }
+        if (stop > offset + len) {
+            stop = offset + len;
+        }
+        memcpy(buf + (start - offset), jb->data + (start - jb->block * fs->block_size), stop - start);
+    }
+}
+
+void JournalOverlayPrint(struct FileSystem *fs, struct JournalOverlay *ov, bool verbose)
+{
+    uint64_t i = 0;
+
+    if (ov->clean) {
+        printf("Journal is clean, sequence %u, nothing to replay\n", ov->first_sequence);
+        return;
+    }
+    printf("Journal log from block %llu, transactions %u ~ %u, %llu committed\n",
+            ov->start, ov->first_sequence, ov->end_sequence, ov->transactions);
+    printf("%llu log blocks, %llu block copies, %llu revoke records, %llu copies revoked, %llu bad copies\n",
+            ov->log_blocks, ov->tags, ov->revokes, ov->revoked, ov->bad);
+    printf("%llu blocks would be written, %llu KiB of journal read in %.3f seconds\n",
+            ov->count, ov->bytes / 1024, ov->seconds);
+    for (i = 0; verbose && i < ov->count; i++) {
+        printf("block %llu <- journal block %llu, transaction %u\n",
+                ov->blocks[i].block, ov->blocks[i].log, ov->blocks[i].sequence);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "filesystem.h"
+#include "extent.h"
+#include "jbd2.h"
+
+/* Journal blocks read at once while walking the log */
+#define JOURNAL_READ_BLOCKS     256
+
+/*
+ * The copy of filesystem block that a replay would write. Copies of
+ * escaped blocks already have their magic number put back.
+ */
+struct JournalBlock {
+    uint64_t block;     /* filesystem block */
+    uint64_t log;       /* journal block the copy is read from */
+    uint32_t sequence;  /* of the transaction that wrote it last */
+    uint32_t reserved;
+    char *data;         /* block_size bytes */
+};
+
+/*
+ * What replaying the journal would do, without writing anything.
+ * Blocks are sorted by block number, their copies are kept in memory.
+ */
+struct JournalOverlay {
+    uint64_t count;
+    struct JournalBlock *blocks;
+    char *data;
+    bool clean;                 /* s_start is 0, nothing to replay */
+    uint32_t first_sequence;    /* s_sequence */
+    uint32_t end_sequence;      /* first transaction not committed */
+    uint64_t first;             /* log area of the journal, in journal blocks */
+    uint64_t last;
+    uint64_t start;             /* s_start */
+    uint64_t transactions;      /* committed */
+    uint64_t log_blocks;        /* scanned */
+    uint64_t tags;              /* block copies in committed transactions */
+    uint64_t revokes;           /* revoke records in committed transactions */
+    uint64_t revoked;           /* copies a revoke cancelled */
+    uint64_t bad;               /* copies with a wrong checksum, not replayed */
+    uint64_t bytes;             /* read from the journal */
+    double seconds;
+};
+
+int JournalOverlayBuild(struct FileSystem *, struct JournalOverlay *);
+void JournalOverlayRelease(struct JournalOverlay *);
+struct JournalBlock *JournalOverlayLookup(struct JournalOverlay *, uint64_t);
+bool JournalOverlayCovers(struct FileSystem *, uint64_t, uint64_t);
+void JournalOverlayApply(struct FileSystem *, uint64_t, uint64_t, char *);
+void JournalOverlayPrint(struct FileSystem *, struct JournalOverlay *, bool);
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,67 @@
+#include "lru.h"
+
+void LruRemove(struct LruList *lru, struct LruNode *node)
+{
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        lru->head = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        lru->tail = node->prev;
+    }
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+void LruPushFront(struct LruList *lru, struct LruNode *node)
+{
+    node->prev = NULL;
+    node->next = lru->head;
+    if (lru->head != NULL) {
+        lru->head->prev = node;
+    }
+    lru->head = node;
+    if (lru->tail == NULL) {
+        lru->tail = node;
+    }
+}
+
+/*
+ * Mark an entry as the most recently used
+ */
+void LruTouch(struct LruList *lru, struct LruNode *node)
+{
+    if (lru->head == node) {
+        return;
+    }
+    LruRemove(lru, node);
+    LruPushFront(lru, node);
+}
+
+/*
+ * Drop least recently used entries until there is room for one more,
+ * entries drop refuses are skipped
+ * @lru: the list
+ * @count: entries of the cache, drop decrements it
+ * @capacity: most entries of the cache
+ * @drop: takes an entry out of the cache and frees it
+ * @arg: argument given to drop
+ * Return the number of entries dropped
+ */
+uint64_t LruEvict(struct LruList *lru, uint64_t *count, uint64_t capacity, LruDropFunc drop, void *arg)
+{
+    struct LruNode *node = lru->tail, *prev = NULL;
+    uint64_t dropped = 0;
+
+    while (*count >= capacity && node != NULL) {
+        prev = node->prev;
+        if (drop(node, arg)) {
+            dropped++;
+        }
+        node = prev;
+    }
+    return dropped;
+}
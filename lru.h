@@ -0,0 +1,38 @@
+#ifndef LRU_H
+#define LRU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Intrusive LRU list shared by the caches. Entries embed a struct LruNode
+ * and are found back from it with LRU_ENTRY, nothing is allocated by the
+ * list. It has no lock of its own, callers hold the lock of their cache.
+ */
+struct LruNode {
+    struct LruNode *prev;   /* more recently used */
+    struct LruNode *next;   /* less recently used */
+};
+
+struct LruList {
+    struct LruNode *head;   /* most recently used */
+    struct LruNode *tail;
+};
+
+/* Given a node return the entry it is embedded in */
+#define LRU_ENTRY(node, type, member) ((type *)((char *)(node) - offsetof(type, member)))
+
+/*
+ * Called by LruEvict with an entry to drop
+ * Return true if the entry was taken out of the list and freed, false if
+ * it is still in use and has to stay
+ */
+typedef bool (*LruDropFunc)(struct LruNode *, void *);
+
+void LruRemove(struct LruList *, struct LruNode *);
+void LruPushFront(struct LruList *, struct LruNode *);
+void LruTouch(struct LruList *, struct LruNode *);
+uint64_t LruEvict(struct LruList *, uint64_t *, uint64_t, LruDropFunc, void *);
+
+#endif /* LRU_H */
@@ -1,30 +1,725 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
 #include <endian.h>
+#include <time.h>
 
 #include "filesystem.h"
+#include "scan.h"
+#include "bitmap.h"
+#include "space.h"
+#include "extent.h"
+#include "extract.h"
+#include "dir.h"
+#include "path.h"
+#include "walk.h"
+#include "owner.h"
+#include "metaindex.h"
+#include "daemon.h"
+#include "csum.h"
+#include "journal.h"
+#include "delta.h"
+#include "mutate.h"
+#include "summary.h"
+
+struct InodeInventory {
+    uint64_t inodes;
+    uint64_t dirs;
+    uint64_t files;
+    uint64_t bytes;
+};
+
+static int InodeInventoryAdd(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode, void *arg)
+{
+    struct InodeInventory *inv = (struct InodeInventory *)arg;
+    uint16_t mode = le16toh(pinode->i_mode);
+
+    __atomic_fetch_add(&inv->inodes, 1, __ATOMIC_RELAXED);
+    if ((mode & 0xF000) == 0x4000) {
+        __atomic_fetch_add(&inv->dirs, 1, __ATOMIC_RELAXED);
+    } else if ((mode & 0xF000) == 0x8000) {
+        __atomic_fetch_add(&inv->files, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&inv->bytes, (uint64_t)le32toh(pinode->i_size_lo) | (uint64_t)le32toh(pinode->i_size_high) << 32,
+            __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Read whitespace separated numbers from a stream
+ * Return how many numbers are read, *nums must be freed by the caller,
+ * (uint64_t)-1 if memory runs out
+ */
+static uint64_t NumbersRead(FILE *stream, uint64_t **nums)
+{
+    uint64_t count = 0, capacity = 0;
+    unsigned long long num = 0;
+    uint64_t *buf = NULL;
+
+    while (fscanf(stream, "%llu", &num) == 1) {
+        if (ArrayReserve((void **)&buf, &capacity, count, sizeof(uint64_t), 1) < 0) {
+            printf("NumbersRead: allocate memory failed\n");
+            free(buf);
+            *nums = NULL;
+            return (uint64_t)-1;
+        }
+        buf[count++] = num;
+    }
+
+    *nums = buf;
+    return count;
+}
+
+static const char *StatusString(int status)
+{
+    switch (status) {
+        case 1:
+            return "used";
+        case 0:
+            return "free";
+        case 2:
+            return "uninit";
+        default:
+            return "error";
+    }
+}
+
+/*
+ * Feature 4 with "-": read inode numbers from stdin, print "<inode> <status>" per line
+ */
+static int InodeStatusPrintBatch(struct FileSystem *fs)
+{
+    uint64_t *nums = NULL;
+    int *status = NULL;
+    uint64_t count = 0, i = 0;
+    int ret = 0;
+
+    count = NumbersRead(stdin, &nums);
+    if (count == (uint64_t)-1) {
+        return -1;
+    }
+    status = (int *) malloc(sizeof(int) * (count ? count : 1));
+    if (status == NULL) {
+        free(nums);
+        return -1;
+    }
+
+    ret = InodeStatusGetBatch(fs, nums, count, status);
+    if (ret == 0) {
+        for (i = 0; i < count; i++) {
+            printf("%llu %s\n", nums[i], StatusString(status[i]));
+        }
+    }
+
+    free(nums);
+    free(status);
+    return ret;
+}
+
+/*
+ * Feature 5 with a length: print the allocation summary of a block range
+ */
+static int BlockRangeStatusPrint(struct FileSystem *fs, char *start, char *len)
+{
+    struct BlockRange range;
+    struct BlockRangeStatus status;
+    static const char *summaries[] = {"free", "used", "uninit", "mixed"};
+
+    range.start = strtoull(start, NULL, 0);
+    range.len = strtoull(len, NULL, 0);
+    if (BlockRangeStatusGet(fs, &range, 1, &status) < 0) {
+        printf("Get block range status failed\n");
+        return -1;
+    }
+
+    printf("Blocks %llu-%llu: %s, %llu used, %llu free, %llu uninitialized, %llu invalid\n",
+            range.start, range.start + range.len - 1,
+            status.summary == RANGE_ERROR ? "error" : summaries[status.summary],
+            status.used, status.free, status.uninit, status.invalid);
+    return 0;
+}
+
+/*
+ * An inode argument is either a number or a path from the root
+ * Return the inode number, 0 if it is not a number or the path does not resolve
+ */
+static uint64_t InodeArgGet(struct FileSystem *fs, const char *arg)
+{
+    unsigned long long num = 0;
+
+    if (arg[0] == '/') {
+        num = PathResolve(fs, arg);
+        if (num == 0) {
+            printf("%s: no such file or directory\n", arg);
+        }
+        return num;
+    }
+    if (sscanf(arg, "%llu", &num) != 1 || num == 0) {
+        printf("%s: not an inode number\n", arg);
+        return 0;
+    }
+    return num;
+}
+
+/*
+ * Resolve paths given as arguments, or one per line from stdin
+ */
+static int PathsPrint(struct FileSystem *fs, int count, char **paths)
+{
+    char line[4096];
+    uint64_t num = 0;
+    size_t len = 0;
+    int i = 0;
+
+    if (count == 0 || strcmp(paths[0], "-") == 0) {
+        while (fgets(line, sizeof(line), stdin) != NULL) {
+            len = strlen(line);
+            if (len > 0 && line[len - 1] == '\n') {
+                line[len - 1] = '\0';
+            }
+            num = PathResolve(fs, line);
+            printf("%s\t%llu\n", line, num);
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            num = PathResolve(fs, paths[i]);
+            printf("%s\t%llu\n", paths[i], num);
+        }
+    }
+    DentryCachePrint(fs);
+    return 0;
+}
+
+/*
+ * Index the whole namespace, or take it from the sidecar index, then print
+ * the paths of the inodes or paths given, or every path with its inode
+ */
+static int NamespacePrint(struct FileSystem *fs, int threads, int count, char **args)
+{
+    struct NamespaceIndex index;
+    char path[4096];
+    uint64_t i = 0, n = 0, first = 0;
+    int64_t entry = 0;
+    uint32_t num = 0;
+    int k = 0;
+
+    if (MetaIndexNamespaceGet(fs, &index) < 0 && NamespaceWalk(fs, threads, &index) != 0) {
+        printf("Namespace walk failed\n");
+        return -1;
+    }
+    NamespaceIndexPrint(&index);
+
+    if (count == 0) {
+        for (i = 0; i < index.count; i++) {
+            if (NamespacePathGet(&index, i, path, sizeof(path)) != 0) {
+                printf("%s\t%u\n", path, index.entries[i].inode);
+            }
+        }
+    }
+    for (k = 0; k < count; k++) {
+        if (args[k][0] == '/') {
+            entry = NamespaceLookup(&index, args[k]);
+            printf("%s\t%u\n", args[k], entry < 0 ? 0 : index.entries[entry].inode);
+            continue;
+        }
+        sscanf(args[k], "%u", &num);
+        n = NamespaceInodeFind(&index, num, &first);
+        if (n == 0) {
+            printf("%u: no name\n", num);
+        }
+        for (i = first; i < first + n; i++) {
+            if (NamespacePathGet(&index, index.by_inode[i], path, sizeof(path)) != 0) {
+                printf("%u\t%s\n", num, path);
+            }
+        }
+    }
+    NamespaceIndexRelease(&index);
+    return 0;
+}
+
+/*
+ * Print the inodes owning blocks given as block or block+count. The owner
+ * map is loaded from file, or built and saved there when it is missing or
+ * stale, "-" builds it without saving.
+ */
+static int OwnersPrint(struct FileSystem *fs, char *file, int count, char **args)
+{
+    struct BlockOwnerMap map;
+    struct BlockOwnerRun *run = NULL;
+    uint64_t runs[64];
+    uint64_t start = 0, len = 0, found = 0, i = 0;
+    char *end = NULL;
+    bool save = strcmp(file, "-") != 0;
+    int k = 0;
+
+    if (!save || BlockOwnerMapLoad(fs, file, &map) != 0) {
+        if (BlockOwnerMapBuild(fs, 0, &map) != 0) {
+            printf("Build owner map failed\n");
+            return -1;
+        }
+        if (save && BlockOwnerMapSave(fs, &map, file) != 0) {
+            printf("Save owner map to %s failed\n", file);
+        }
+    }
+    BlockOwnerMapPrint(&map);
+
+    for (k = 0; k < count; k++) {
+        start = strtoull(args[k], &end, 0);
+        len = (*end == '+') ? strtoull(end + 1, NULL, 0) : 1;
+        found = BlockOwnerRangeGet(&map, start, start + len, runs, sizeof(runs) / sizeof(runs[0]));
+        if (found == 0) {
+            printf("%s: no owner\n", args[k]);
+        }
+        for (i = 0; i < found && i < sizeof(runs) / sizeof(runs[0]); i++) {
+            run = &(map.runs[runs[i]]);
+            printf("%s: inode %u, blocks %llu-%llu", args[k], run->inode, run->start, run->start + run->len - 1);
+            if (run->flags & OWNER_RUN_XATTR) {
+                printf(" xattr\n");
+            } else if (run->flags & OWNER_RUN_METADATA) {
+                printf(" block map\n");
+            } else {
+                printf(" logical %u%s\n", run->logical, (run->flags & OWNER_RUN_UNWRITTEN) ? " unwritten" : "");
+            }
+        }
+        if (found > i) {
+            printf("%s: %llu more runs\n", args[k], found - i);
+        }
+    }
+    BlockOwnerMapRelease(&map);
+    return 0;
+}
+
+/*
+ * Print what a replay of the journal would write, the overlay attached with
+ * -j or one built for the purpose
+ */
+static int JournalPrint(struct FileSystem *fs, int count, char **args)
+{
+    struct JournalOverlay ov;
+    bool verbose = (count > 0 && strcmp(args[0], "list") == 0);
+
+    if (fs->journal != NULL) {
+        JournalOverlayPrint(fs, fs->journal, verbose);
+        return 0;
+    }
+    if (JournalOverlayBuild(fs, &ov) != 0) {
+        printf("Journal overlay failed\n");
+        return -1;
+    }
+    JournalOverlayPrint(fs, &ov, verbose);
+    JournalOverlayRelease(&ov);
+    return 0;
+}
+
+/*
+ * Print the delta attached with -o, write it to the image or drop it
+ */
+static int DeltaCommand(struct FileSystem *fs, int count, char **args)
+{
+    uint64_t blocks = 0;
+
+    if (fs->delta == NULL) {
+        printf("No delta, open the image with -o\n");
+        return -1;
+    }
+    blocks = fs->delta->count;
+    if (count > 0 && strcmp(args[0], "commit") == 0) {
+        if (DeltaCommit(fs) < 0) {
+            printf("Commit failed, the delta is kept\n");
+            return -1;
+        }
+        printf("%llu blocks written to the image\n", blocks);
+        return 0;
+    }
+    if (count > 0 && strcmp(args[0], "discard") == 0) {
+        if (DeltaDiscard(fs) < 0) {
+            printf("Discard failed\n");
+            return -1;
+        }
+        printf("%llu blocks dropped\n", blocks);
+        return 0;
+    }
+    DeltaPrint(fs, count > 0 && strcmp(args[0], "list") == 0);
+    return 0;
+}
+
+/*
+ * Stage the edits read from stdin, one per line, and commit them at once:
+ * "redirect source dest", "inode num used|free" or "block num used|free".
+ * Redirect takes the block map of dest as it was before the batch.
+ */
+static int MutationBatch(struct FileSystem *fs)
+{
+    struct Mutation tx;
+    struct ext4_inode inode;
+    char line[256], op[16], arg[24];
+    unsigned long long num = 0;
+    uint64_t lines = 0;
+    int ret = 0;
+
+    MutationInit(fs, &tx);
+    while (ret == 0 && fgets(line, sizeof(line), stdin) != NULL) {
+        lines++;
+        if (sscanf(line, "%15s %llu %23s", op, &num, arg) != 3) {
+            if (sscanf(line, "%15s", op) == 1) {
+                printf("Line %llu: expected op, number and argument\n", lines);
+                ret = -1;
+            }
+            continue;
+        }
+        if (strcmp(op, "redirect") == 0) {
+            ret = -1;
+            if (InodeGetBynum(fs, strtoull(arg, NULL, 0), &inode) != 0) {
+                ret = MutationInodeStage(&tx, num, offsetof(struct ext4_inode, i_block), sizeof(inode.i_block),
+                        inode.i_block);
+            }
+        } else if ((strcmp(op, "inode") == 0 || strcmp(op, "block") == 0) &&
+                (strcmp(arg, "used") == 0 || strcmp(arg, "free") == 0)) {
+            ret = (op[0] == 'i') ? MutationInodeBitmapStage(&tx, num, arg[0] == 'u') :
+                MutationBlockBitmapStage(&tx, num, arg[0] == 'u');
+        } else {
+            printf("Line %llu: unknown edit %s %s\n", lines, op, arg);
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        ret = MutationCommit(&tx);
+        MutationPrint(&tx);
+    } else {
+        printf("Nothing written\n");
+    }
+    MutationRelease(&tx);
+    return ret;
+}
+
+/*
+ * Print the inode summary, and totals per owner or the regular files not
+ * modified for some days. The summary is loaded from file, or built and
+ * saved there when it is missing or stale, "-" builds it without saving.
+ */
+static int SummaryQuery(struct FileSystem *fs, char *file, int count, char **args)
+{
+    struct InodeSummary s;
+    struct SummaryUidTotal *totals = NULL;
+    bool save = strcmp(file, "-") != 0;
+    int64_t owners = 0, before = 0;
+    uint64_t i = 0, found = 0, bytes = 0;
+    double days = 0;
+    int ret = 0;
+
+    if (!save || InodeSummaryLoad(fs, file, &s) != 0) {
+        if (InodeSummaryBuild(fs, 0, &s) != 0) {
+            printf("Build inode summary failed\n");
+            return -1;
+        }
+        if (save && InodeSummarySave(fs, &s, file) != 0) {
+            printf("Save inode summary to %s failed\n", file);
+        }
+    }
+    InodeSummaryPrint(&s);
+
+    if (count > 0 && strcmp(args[0], "uid") == 0) {
+        owners = InodeSummaryUidTotalsGet(&s, &totals);
+        if (owners < 0) {
+            printf("Sum per owner failed\n");
+            ret = -1;
+        }
+        for (i = 0; owners > 0 && i < (uint64_t)owners; i++) {
+            printf("uid %u: %llu inodes, %llu files, %llu bytes, %llu bytes allocated\n", totals[i].uid,
+                    totals[i].inodes, totals[i].files, totals[i].bytes, totals[i].allocated);
+        }
+        free(totals);
+    } else if (count > 1 && strcmp(args[0], "older") == 0) {
+        sscanf(args[1], "%lf", &days);
+        before = (int64_t)time(NULL) - (int64_t)(days * 86400);
+        found = InodeSummaryOlderCount(&s, before, &bytes);
+        printf("%llu files older than %s days, %llu bytes\n", found, args[1], bytes);
+        for (i = 0; count > 2 && strcmp(args[2], "list") == 0 && i < s.count; i++) {
+            if (s.mtime[i] < before && (s.mode[i] & 0xF000) == 0x8000) {
+                printf("%u %llu %lld\n", s.inode[i], s.size[i], s.mtime[i]);
+            }
+        }
+    }
+    InodeSummaryRelease(&s);
+    return ret;
+}
+
+/*
+ * Build the sidecar index of the image, verify the image against the
+ * index attached with -i, or describe it
+ */
+static int IndexCommand(struct FileSystem *fs, char *filename, int count, char **args)
+{
+    char path[4096];
+    int threads = 0;
+    int64_t differ = 0;
+
+    if (count > 1) {
+        sscanf(args[1], "%d", &threads);
+    }
+    if (count > 0 && strcmp(args[0], "build") == 0) {
+        snprintf(path, sizeof(path), "%s%s", filename, META_INDEX_SUFFIX);
+        return MetaIndexBuild(fs, threads, path);
+    }
+    if (count > 0 && strcmp(args[0], "verify") == 0) {
+        differ = MetaIndexVerify(fs, threads);
+        if (differ == 0) {
+            printf("Inode tables match the index\n");
+        }
+        return differ == 0 ? 0 : -1;
+    }
+    MetaIndexPrint(fs);
+    return 0;
+}
+
+static const char *daemon_ops[] = {NULL, "super", "desc", "inode", "istatus", "bstatus", "xattr", "map", "path"};
+
+static void DaemonResponsePrint(struct DaemonRequest *req, const char *arg, struct DaemonResponse *resp, char *payload)
+{
+    struct ext4_super_block *sb = (struct ext4_super_block *)payload;
+    struct ext4_group_desc *desc = (struct ext4_group_desc *)payload;
+    struct ext4_inode *inode = (struct ext4_inode *)payload;
+    struct ExtentRecord *rec = NULL;
+    struct DaemonXattr x;
+    uint64_t pos = 0;
+
+    if (resp->status != 0) {
+        printf("%s: %s\n", arg, strerror(-resp->status));
+        return;
+    }
+    switch (req->op) {
+        case DAEMON_OP_SUPER:
+            printf("%u inodes, %u blocks, %u free blocks\n",
+                    le32toh(sb->s_inodes_count), le32toh(sb->s_blocks_count_lo), le32toh(sb->s_free_blocks_count_lo));
+            break;
+        case DAEMON_OP_DESCRIPTOR:
+            printf("%s: inode table %u, %u free blocks, %u free inodes\n", arg, le32toh(desc->bg_inode_table_lo),
+                    le16toh(desc->bg_free_blocks_count_lo), le16toh(desc->bg_free_inodes_count_lo));
+            break;
+        case DAEMON_OP_INODE:
+            printf("%s: mode %o, links %u, size %llu\n", arg, le16toh(inode->i_mode), le16toh(inode->i_links_count),
+                    (uint64_t)le32toh(inode->i_size_lo) | (uint64_t)le32toh(inode->i_size_high) << 32);
+            break;
+        case DAEMON_OP_INODE_STATUS:
+        case DAEMON_OP_BLOCK_STATUS:
+            printf("%s %s\n", arg, StatusString(*(int32_t *)payload));
+            break;
+        case DAEMON_OP_XATTR:
+            while (pos + sizeof(x) <= resp->len) {
+                memcpy(&x, payload + pos, sizeof(x));
+                printf("%s: %.*s (%u)\n", arg, (int)x.name_len, payload + pos + sizeof(x), x.value_len);
+                pos += sizeof(x) + x.name_len + ((x.flags & DAEMON_XATTR_EA_INODE) ? 0 : x.value_len);
+            }
+            break;
+        case DAEMON_OP_BLOCK_MAP:
+            for (pos = 0; pos + sizeof(*rec) <= resp->len; pos += sizeof(*rec)) {
+                rec = (struct ExtentRecord *)(payload + pos);
+                printf("%s: %u-%llu -> %llu%s\n", arg, rec->logical, (uint64_t)rec->logical + EXTENT_RECORD_LEN(rec) - 1,
+                        rec->physical, (rec->len & EXTENT_RECORD_UNWRITTEN) ? " unwritten" : "");
+            }
+            break;
+        case DAEMON_OP_PATH:
+            printf("%s\t%llu\n", arg, *(uint64_t *)payload);
+            break;
+    }
+}
+
+/*
+ * Query a daemon with the arguments, or the lines of stdin, keeping up to
+ * DAEMON_PIPELINE requests in flight
+ */
+static int DaemonQuery(char *path, char *op, int count, char **args)
+{
+    struct DaemonRequest reqs[DAEMON_PIPELINE];
+    struct DaemonResponse resp;
+    const char *payloads[DAEMON_PIPELINE];
+    char *lines[DAEMON_PIPELINE];
+    char line[4096];
+    char *payload = NULL;
+    uint64_t capacity = 0, n = 0, i = 0;
+    uint16_t code = 0;
+    size_t len = 0;
+    int fd = -1, k = 0;
+    int ret = 0;
+    bool more = true;
+
+    for (code = 1; code < sizeof(daemon_ops) / sizeof(daemon_ops[0]) && strcmp(op, daemon_ops[code]) != 0; code++) {
+    }
+    if (code == sizeof(daemon_ops) / sizeof(daemon_ops[0])) {
+        printf("Unknown op %s\n", op);
+        return -1;
+    }
+    /* The superblock takes no argument */
+    if (code == DAEMON_OP_SUPER) {
+        count = 1;
+        args = &op;
+    }
+    fd = DaemonConnect(path);
+    if (fd < 0) {
+        printf("Connect to %s failed\n", path);
+        return -1;
+    }
+
+    memset(lines, 0, sizeof(lines));
+    while (more && ret == 0) {
+        /* Fill a window from the arguments or stdin */
+        for (n = 0; n < DAEMON_PIPELINE; n++) {
+            if (count > 0) {
+                if (k == count) {
+                    more = false;
+                    break;
+                }
+                snprintf(line, sizeof(line), "%s", args[k++]);
+            } else if (fgets(line, sizeof(line), stdin) != NULL) {
+                len = strlen(line);
+                if (len > 0 && line[len - 1] == '\n') {
+                    line[len - 1] = '\0';
+                }
+            } else {
+                more = false;
+                break;
+            }
+            free(lines[n]);
+            lines[n] = strdup(line);
+            memset(&reqs[n], 0, sizeof(reqs[n]));
+            reqs[n].op = code;
+            reqs[n].id = n;
+            payloads[n] = NULL;
+            if (code == DAEMON_OP_PATH) {
+                payloads[n] = lines[n];
+                reqs[n].len = strlen(lines[n]);
+            } else {
+                reqs[n].arg = strtoull(lines[n], NULL, 0);
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+        if (DaemonRequestsSend(fd, reqs, payloads, n) < 0) {
+            printf("Send requests failed\n");
+            ret = -1;
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (DaemonResponseRead(fd, &resp, &payload, &capacity) < 0 || resp.id != i) {
+                printf("Read response failed\n");
+                ret = -1;
+                break;
+            }
+            DaemonResponsePrint(&reqs[i], lines[i], &resp, payload);
+        }
+    }
+
+    for (i = 0; i < DAEMON_PIPELINE; i++) {
+        free(lines[i]);
+    }
+    free(payload);
+    close(fd);
+    return ret;
+}
 
 int main(int argc, char **argv)
 {
     int ret = 0;
     int feature = 0;
     int num = 0;
-    int src = 0, dst = 0;
+    uint64_t inode = 0, src = 0, dst = 0;
+    int threads = 0;
+    int opt = 0;
+    int flags = 0;
     char *filename = NULL;
     struct FileSystem *fs = NULL;
+    struct InodeInventory inv = {0};
+    struct SpaceReport space;
+    struct FreeExtentMap extents;
+    struct ExtentMap *map = NULL;
+    uint32_t logical = 0;
+    int64_t index = 0;
+    uint64_t readahead = 0;
+    struct ExtractStats extract;
+    uint64_t child = 0;
+    uint8_t file_type = 0;
+    struct DaemonStats daemon;
+    struct ChecksumReport csum;
 
-    if (argc < 2) {
+    while ((opt = getopt(argc, argv, "ijmno")) != -1) {
+        switch (opt) {
+            case 'i':
+                flags |= FS_OPEN_INDEX;
+                break;
+            case 'j':
+                flags |= FS_OPEN_JOURNAL;
+                break;
+            case 'm':
+                flags |= FS_OPEN_MMAP;
+                break;
+            case 'n':
+                flags |= FS_OPEN_NO_URING;
+                break;
+            case 'o':
+                flags |= FS_OPEN_OVERLAY;
+                break;
+            default:
+                argc = 0;
+                break;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 3) {
         printf("Usage:\n");
-        printf("lsfs file\n");
+        printf("lsfs [-i] [-j] [-m] [-n] [-o] file feature [args]\n");
+        printf("\tfeature 4 with \"-\" or no inode reads inode numbers from stdin\n");
+        printf("\tfeature 5 with a block and a length prints the status of the range\n");
+        printf("\tfeature 9 [threads] compares the free counts of the bitmaps and the descriptors\n");
+        printf("\tfeature 10 [threads] prints the free extents per flex group and their histogram\n");
+        printf("\tfeature 11 inode [logical] prints the block map of an inode or where a logical block is\n");
+        printf("\tfeature 12 inode [readahead KiB] writes the content of an inode to stdout\n");
+        printf("\tfeature 13 inode [name] lists a directory or looks a name up in it\n");
+        printf("\tfeature 14 [path ...] resolves paths, or the paths read from stdin, to inode numbers\n");
+        printf("\tfeature 15 [threads] [inode|path ...] walks the whole tree and prints every path or the paths of inodes,\n");
+        printf("\t\twith -i the tree is taken from the sidecar index\n");
+        printf("\tfeature 16 file|- [block[+count] ...] prints the inodes owning blocks, the owner map is kept in file\n");
+        printf("\tfeature 17 [build|verify] [threads] builds the sidecar index file%s, checks the image against it or describes it\n",
+                META_INDEX_SUFFIX);
+        printf("\tinodes can be given as absolute paths, e.g. lsfs image 3 /etc/passwd\n");
+        printf("\tfeature 18 socket serves queries on the image over a Unix socket until interrupted\n");
+        printf("\tfeature 19 op [arg ...] with the socket as file queries a daemon, args or stdin lines are pipelined,\n");
+        printf("\t\top is super, desc, inode, istatus, bstatus, xattr, map or path\n");
+        printf("\tfeature 20 [threads] verifies the checksums of the superblock, descriptors, bitmaps, inodes,\n");
+        printf("\t\textent tree, directory and xattr blocks\n");
+        printf("\tfeature 21 [list] prints what a replay of the journal would write, list prints every block\n");
+        printf("\tfeature 22 [list|commit|discard] with -o prints the delta, writes it to the image or drops it\n");
+        printf("\tfeature 23 applies the edits read from stdin in one transaction, one per line:\n");
+        printf("\t\tredirect source dest, inode num used|free, block num used|free\n");
+        printf("\t\twithout -o the image is written through a redo log and must not be mounted\n");
+        printf("\tfeature 24 file|- [uid | older days [list]] prints the columnar inode summary kept in file,\n");
+        printf("\t\tthe totals per owner or the regular files not modified for days\n");
+        printf("\t-i: start from the sidecar index when it matches the image\n");
+        printf("\t-j: read the image as a replay of the journal would leave it, without writing it\n");
+        printf("\t-m: read the image through a memory mapping\n");
+        printf("\t-n: batched reads use pread instead of io_uring\n");
+        printf("\t-o: never write the image, writes go to the delta file%s next to it\n", DELTA_SUFFIX);
         ret = -1;
         goto end;
     }
     filename = argv[1];
+    /* A client of a daemon, file is its socket and no image is opened */
+    sscanf(argv[2], "%d", &feature);
+    if (feature == 19) {
+        ret = (argc < 4) ? -1 : DaemonQuery(filename, argv[3], argc - 4, argv + 4);
+        goto end;
+    }
     fs = malloc(sizeof(struct FileSystem));
 
-    ret = FileSystemInit(fs, filename);
+    ret = FileSystemInit(fs, filename, flags);
     if (ret < 0) {
         printf("Initialize FileSystem failed\n");
+        /* FileSystemInit releases fs on failure */
+        fs = NULL;
         goto end;
     }
     // FileSystemPrint(fs);
@@ -39,26 +734,222 @@ int main(int argc, char **argv)
             GroupDescriptorsPrintBynum(fs, num);
             break;
         case 3:
-            sscanf(argv[3], "%d", &num);
-            InodePrintBynum(fs, num);
+            inode = InodeArgGet(fs, argv[3]);
+            if (inode == 0) {
+                ret = -1;
+                break;
+            }
+            InodePrintBynum(fs, inode);
             break;
         case 4:
-            sscanf(argv[3], "%d", &num);
-            InodeStatusPrintBynum(fs, num);
+            if (argc < 4 || strcmp(argv[3], "-") == 0) {
+                ret = InodeStatusPrintBatch(fs);
+                break;
+            }
+            inode = InodeArgGet(fs, argv[3]);
+            if (inode == 0) {
+                ret = -1;
+                break;
+            }
+            InodeStatusPrintBynum(fs, inode);
             break;
         case 5:
+            if (argc > 4) {
+                ret = BlockRangeStatusPrint(fs, argv[3], argv[4]);
+                break;
+            }
             sscanf(argv[3], "%d", &num);
             BlockStatusPrintBynum(fs, num);
             break;
         case 6:
-            sscanf(argv[3], "%d", &num);
-            XattrPrintBynum(fs, num);
+            inode = InodeArgGet(fs, argv[3]);
+            if (inode == 0) {
+                ret = -1;
+                break;
+            }
+            XattrPrintBynum(fs, inode);
             break;
         case 7:
-            sscanf(argv[3], "%d", &src);
-            sscanf(argv[4], "%d", &dst);
+            src = InodeArgGet(fs, argv[3]);
+            dst = InodeArgGet(fs, argv[4]);
+            if (src == 0 || dst == 0) {
+                ret = -1;
+                break;
+            }
             Redirect(fs, src, dst);
             break;
+        case 8:
+            if (argc > 3) {
+                sscanf(argv[3], "%d", &threads);
+            }
+            if (InodeScan(fs, threads, SCAN_INUSE_ONLY, InodeInventoryAdd, &inv) != 0) {
+                printf("Inode scan failed\n");
+                ret = -1;
+                break;
+            }
+            printf("%llu inodes in use, %llu directories, %llu regular files, %llu bytes\n",
+                    inv.inodes, inv.dirs, inv.files, inv.bytes);
+            break;
+        case 9:
+            if (argc > 3) {
+                sscanf(argv[3], "%d", &threads);
+            }
+            if (SpaceReportBuild(fs, threads, &space) != 0) {
+                printf("Space report failed\n");
+                ret = -1;
+                break;
+            }
+            SpaceReportPrint(fs, &space);
+            SpaceReportRelease(&space);
+            break;
+        case 10:
+            if (argc > 3) {
+                sscanf(argv[3], "%d", &threads);
+            }
+            if (FreeExtentMapBuild(fs, threads, &extents) != 0) {
+                printf("Free extent map failed\n");
+                ret = -1;
+                break;
+            }
+            FreeExtentMapPrint(fs, &extents);
+            FreeExtentMapRelease(&extents);
+            break;
+        case 11:
+            if (argc < 4) {
+                printf("Missing inode number\n");
+                ret = -1;
+                break;
+            }
+            inode = InodeArgGet(fs, argv[3]);
+            if (inode == 0) {
+                ret = -1;
+                break;
+            }
+            map = ExtentMapGet(fs, inode);
+            if (map == NULL) {
+                printf("Inode %llu has no readable block map\n", inode);
+                ret = -1;
+                break;
+            }
+            if (argc > 4) {
+                sscanf(argv[4], "%u", &logical);
+                index = ExtentLookup(map, logical);
+                if (index < 0) {
+                    printf("Logical block %u is a hole\n", logical);
+                } else {
+                    printf("Logical block %u -> %llu%s\n", logical, ExtentPhysicalGet(map, logical),
+                            (map->records[index].len & EXTENT_RECORD_UNWRITTEN) ? " unwritten" : "");
+                }
+            } else {
+                ExtentMapPrint(map);
+            }
+            ExtentMapPut(fs, inode);
+            break;
+        case 12:
+            if (argc < 4) {
+                printf("Missing inode number\n");
+                ret = -1;
+                break;
+            }
+            inode = InodeArgGet(fs, argv[3]);
+            if (inode == 0) {
+                ret = -1;
+                break;
+            }
+            if (argc > 4) {
+                sscanf(argv[4], "%llu", &readahead);
+            }
+            /* The data goes to stdout, whatever printf buffered must go first */
+            fflush(stdout);
+            ret = FileExtract(fs, inode, STDOUT_FILENO, readahead * 1024, &extract);
+            ExtractStatsPrint(&extract);
+            break;
+        case 13:
+            if (argc < 4) {
+                printf("Missing inode number\n");
+                ret = -1;
+                break;
+            }
+            inode = InodeArgGet(fs, argv[3]);
+            if (inode == 0) {
+                ret = -1;
+                break;
+            }
+            if (argc < 5) {
+                DirPrintBynum(fs, inode);
+                break;
+            }
+            child = DirLookup(fs, inode, argv[4], strlen(argv[4]), &file_type);
+            if (child == (uint64_t)-1) {
+                printf("Look up %s failed\n", argv[4]);
+                ret = -1;
+                break;
+            }
+            if (child == 0) {
+                printf("%s not found\n", argv[4]);
+                ret = -1;
+                break;
+            }
+            printf("%s -> %llu, type %u\n", argv[4], child, file_type);
+            break;
+        case 14:
+            ret = PathsPrint(fs, argc - 3, argv + 3);
+            break;
+        case 15:
+            if (argc > 3) {
+                sscanf(argv[3], "%d", &threads);
+            }
+            ret = NamespacePrint(fs, threads, argc > 4 ? argc - 4 : 0, argv + 4);
+            break;
+        case 16:
+            if (argc < 4) {
+                printf("Missing owner map file\n");
+                ret = -1;
+                break;
+            }
+            ret = OwnersPrint(fs, argv[3], argc - 4, argv + 4);
+            break;
+        case 17:
+            ret = IndexCommand(fs, filename, argc - 3, argv + 3);
+            break;
+        case 18:
+            if (argc < 4) {
+                printf("Missing socket path\n");
+                ret = -1;
+                break;
+            }
+            ret = DaemonRun(fs, argv[3], &daemon);
+            printf("%llu connections, %llu requests, %llu failed\n", daemon.connections, daemon.requests, daemon.errors);
+            break;
+        case 20:
+            if (argc > 3) {
+                sscanf(argv[3], "%d", &threads);
+            }
+            if (ChecksumAudit(fs, threads, &csum) != 0) {
+                printf("Checksum audit failed\n");
+                ret = -1;
+                break;
+            }
+            ChecksumReportPrint(fs, &csum);
+            ChecksumReportRelease(&csum);
+            break;
+        case 21:
+            ret = JournalPrint(fs, argc - 3, argv + 3);
+            break;
+        case 22:
+            ret = DeltaCommand(fs, argc - 3, argv + 3);
+            break;
+        case 23:
+            ret = MutationBatch(fs);
+            break;
+        case 24:
+            if (argc < 4) {
+                printf("Missing inode summary file\n");
+                ret = -1;
+                break;
+            }
+            ret = SummaryQuery(fs, argv[3], argc - 4, argv + 4);
+            break;
         default:
             printf("Unknown feature\n");
             break;
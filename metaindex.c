@@ -0,0 +1,711 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metaindex.h"
+#include "scan.h"
+#include "indirect.h"
+#include "workpool.h"
+#include "delta.h"
+
+/*
+ * Block maps read by one worker, only it appends so no lock is needed.
+ * first and meta_first of its inodes index its own arrays until merged.
+ */
+struct MetaWorker {
+    struct MetaInodeMap *inodes;
+    uint64_t inode_count;
+    uint64_t inode_capacity;
+    struct ExtentRecord *records;
+    uint64_t record_count;
+    uint64_t record_capacity;
+    uint64_t *meta;
+    uint64_t meta_count;
+    uint64_t meta_capacity;
+    uint64_t errors;
+};
+
+struct MetaContext {
+    struct FileSystem *fs;
+    char **bufs;
+    struct MetaWorker *workers;     /* NULL when only the digests are wanted */
+    uint64_t *digests;
+};
+
+/* State of one group being scanned */
+struct MetaScan {
+    struct MetaWorker *w;
+    uint64_t digest;
+};
+
+/*
+ * Mix an inode into a group digest, a word at a time
+ */
+static uint64_t DigestUpdate(uint64_t digest, uint64_t num, const char *data, uint64_t len)
+{
+    uint64_t word = 0, i = 0;
+
+    digest = (digest ^ num) * 0x100000001b3ULL;
+    for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, data + i, sizeof(word));
+        digest = (digest ^ word) * 0x100000001b3ULL;
+        digest ^= digest >> 31;
+    }
+    for (; i < len; i++) {
+        digest = (digest ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+    return digest;
+}
+
+/*
+ * InodeScanFunc adding an inode to the digest of its group and its block
+ * map to the worker
+ */
+static int MetaInodeAdd(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode, void *arg)
+{
+    struct MetaScan *scan = (struct MetaScan *)arg;
+    struct MetaWorker *w = scan->w;
+    struct MetaInodeMap *im = NULL;
+    struct ExtentMap map;
+    uint64_t size = 0;
+    uint32_t flags = le32toh(pinode->i_flags);
+    uint16_t mode = le16toh(pinode->i_mode) & 0xF000;
+    int ret = 0;
+
+    scan->digest = DigestUpdate(scan->digest, num, (const char *)pinode, le16toh(fs->super.s_inode_size));
+    if (w == NULL) {
+        return 0;
+    }
+
+    /* Same inodes as ExtentMapGet would map */
+    size = (uint64_t)le32toh(pinode->i_size_lo) | (uint64_t)le32toh(pinode->i_size_high) << 32;
+    if ((mode != 0x8000 && mode != 0x4000 && mode != 0xA000) || (flags & EXT4_INLINE_DATA_FL) ||
+            (mode == 0xA000 && !(flags & EXT4_EXTENTS_FL) && size < sizeof(pinode->i_block))) {
+        return 0;
+    }
+    if (flags & EXT4_EXTENTS_FL) {
+        ret = ExtentMapBuild(fs, num, pinode, &map);
+    } else {
+        ret = IndirectMapBuild(fs, num, pinode, &map);
+    }
+    if (ret < 0) {
+        w->errors++;
+        return 0;
+    }
+
+    if (ArrayReserve((void **)&w->inodes, &w->inode_capacity, w->inode_count, sizeof(struct MetaInodeMap), 1) < 0 ||
+            ArrayReserve((void **)&w->records, &w->record_capacity, w->record_count,
+                sizeof(struct ExtentRecord), map.count) < 0 ||
+            ArrayReserve((void **)&w->meta, &w->meta_capacity, w->meta_count, sizeof(uint64_t), map.meta_count) < 0) {
+        ExtentMapRelease(&map);
+        return -1;
+    }
+    im = &(w->inodes[w->inode_count++]);
+    memset(im, 0, sizeof(struct MetaInodeMap));
+    im->inode = num;
+    im->first = w->record_count;
+    im->count = map.count;
+    im->meta_first = w->meta_count;
+    im->meta_count = map.meta_count;
+    im->blocks = map.blocks;
+    if (map.count) {
+        memcpy(w->records + w->record_count, map.records, sizeof(struct ExtentRecord) * map.count);
+    }
+    if (map.meta_count) {
+        memcpy(w->meta + w->meta_count, map.meta, sizeof(uint64_t) * map.meta_count);
+    }
+    w->record_count += map.count;
+    w->meta_count += map.meta_count;
+    ExtentMapRelease(&map);
+    return 0;
+}
+
+static int MetaWork(struct WorkPool *pool, int worker, uint64_t group, void *data)
+{
+    struct MetaContext *ctx = (struct MetaContext *)data;
+    struct MetaScan scan;
+    int ret = 0;
+
+    scan.w = ctx->workers ? &ctx->workers[worker] : NULL;
+    scan.digest = 0xcbf29ce484222325ULL ^ group;
+    ret = InodeScanGroup(ctx->fs, group, SCAN_INUSE_ONLY, ctx->bufs[worker], MetaInodeAdd, &scan);
+    ctx->digests[group] = scan.digest;
+    return ret;
+}
+
+/*
+ * Scan the inode tables of all groups into ctx->digests, and into the
+ * workers if there are any
+ */
+static int MetaScanRun(struct MetaContext *ctx, int nr_workers)
+{
+    uint64_t *groups = NULL;
+    uint64_t i = 0;
+    int w = 0;
+    int ret = -1;
+
+    ctx->bufs = (char **) calloc(nr_workers, sizeof(char *));
+    groups = (uint64_t *) malloc(sizeof(uint64_t) * ctx->fs->group_count);
+    if (ctx->bufs == NULL || groups == NULL) {
+        goto end;
+    }
+    for (w = 0; w < nr_workers; w++) {
+        ctx->bufs[w] = (char *) malloc(InodeScanBufferSizeGet(ctx->fs));
+        if (ctx->bufs[w] == NULL) {
+            goto end;
+        }
+    }
+    for (i = 0; i < ctx->fs->group_count; i++) {
+        groups[i] = i;
+    }
+    ret = WorkPoolRun(nr_workers, groups, ctx->fs->group_count, MetaWork, ctx);
+end:
+    if (ctx->bufs != NULL) {
+        for (w = 0; w < nr_workers; w++) {
+            free(ctx->bufs[w]);
+        }
+    }
+    free(ctx->bufs);
+    ctx->bufs = NULL;
+    free(groups);
+    return ret;
+}
+
+static int MetaInodeMapCompare(const void *a, const void *b)
+{
+    const struct MetaInodeMap *x = (const struct MetaInodeMap *)a;
+    const struct MetaInodeMap *y = (const struct MetaInodeMap *)b;
+
+    if (x->inode != y->inode) {
+        return x->inode < y->inode ? -1 : 1;
+    }
+    return 0;
+}
+
+static int MetaHeaderFill(struct FileSystem *fs, struct MetaIndexHeader *hdr)
+{
+    memset(hdr, 0, sizeof(struct MetaIndexHeader));
+    if (SidecarStampFill(fs, META_INDEX_MAGIC, META_INDEX_VERSION, sizeof(struct MetaIndexHeader), &(hdr->stamp)) < 0) {
+        return -1;
+    }
+    hdr->block_size = fs->block_size;
+    hdr->block_count = fs->block_count;
+    hdr->inode_count = fs->inode_count;
+    hdr->group_count = fs->group_count;
+    hdr->descriptor_size = fs->descriptor_size;
+    return 0;
+}
+
+/*
+ * Lay the sections out one after the other from the end of the header
+ */
+static uint64_t MetaSectionsPlace(struct MetaIndexHeader *hdr, uint64_t *sizes)
+{
+    uint64_t offset = sizeof(struct MetaIndexHeader);
+    int i = 0;
+
+    for (i = 0; i < META_SECTIONS; i++) {
+        offset = (offset + 7) & ~7ULL;
+        hdr->sections[i].offset = offset;
+        hdr->sections[i].size = sizes[i];
+        offset += sizes[i];
+    }
+    return offset;
+}
+
+static int MetaSectionWrite(FILE *file, struct MetaIndexHeader *hdr, int section, const void *data)
+{
+    if (fseeko(file, hdr->sections[section].offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    if (hdr->sections[section].size > 0 && fwrite(data, hdr->sections[section].size, 1, file) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Build the sidecar index of the image: the descriptor blocks, the free
+ * counts of the bitmaps, a digest of the inodes in use per group, the
+ * block maps of all inodes and the namespace as NamespaceWalk indexes it.
+ * Groups are scanned and directories walked by a pool of workers. The
+ * file is written next to path and renamed over it once complete.
+ * @fs: FileSystem
+ * @nr_workers: threads, 0 for one per CPU
+ * @path: where the index goes, usually the image path with META_INDEX_SUFFIX
+ * Return 0 on success, -1 on failure
+ */
+int MetaIndexBuild(struct FileSystem *fs, int nr_workers, const char *path)
+{
+    struct MetaContext ctx;
+    struct MetaIndexHeader hdr;
+    struct SpaceReport space;
+    struct NamespaceIndex ns;
+    struct MetaWorker *w = NULL;
+    struct MetaInodeMap *inodes = NULL;
+    struct ExtentRecord *records = NULL;
+    uint64_t *meta = NULL;
+    char *descriptors = NULL, *tmp = NULL;
+    uint64_t sizes[META_SECTIONS];
+    uint64_t i = 0, n = 0, count = 0, record_count = 0, meta_count = 0, errors = 0;
+    FILE *file = NULL;
+    int k = 0;
+    int ret = -1;
+
+    if (fs == NULL || path == NULL) {
+        return -1;
+    }
+    memset(&ctx, 0, sizeof(struct MetaContext));
+    memset(&space, 0, sizeof(struct SpaceReport));
+    memset(&ns, 0, sizeof(struct NamespaceIndex));
+    nr_workers = WorkPoolWorkersGet(nr_workers);
+    if ((uint64_t)nr_workers > fs->group_count) {
+        nr_workers = fs->group_count;
+    }
+    /* The index is stamped with the image, it must describe the image alone */
+    if (DeltaCovers(fs, 0, fs->image_size)) {
+        printf("MetaIndexBuild: the image has writes in its delta, commit or discard them first\n");
+        return -1;
+    }
+    if (MetaHeaderFill(fs, &hdr) < 0 || GroupDescriptorsFetch(fs) == (uint64_t)-1) {
+        printf("MetaIndexBuild: read descriptors failed\n");
+        return -1;
+    }
+
+    descriptors = (char *) malloc(fs->descriptor_used_block_count * fs->block_size);
+    if (descriptors == NULL) {
+        printf("MetaIndexBuild: allocate memory failed\n");
+        goto end;
+    }
+    for (i = 0; i < fs->descriptor_used_block_count; i++) {
+        memcpy(descriptors + i * fs->block_size, fs->descriptor_blocks[i], fs->block_size);
+    }
+    if (SpaceReportBuild(fs, nr_workers, &space) != 0) {
+        printf("MetaIndexBuild: read bitmaps failed\n");
+        goto end;
+    }
+
+    ctx.fs = fs;
+    ctx.workers = (struct MetaWorker *) calloc(nr_workers, sizeof(struct MetaWorker));
+    ctx.digests = (uint64_t *) calloc(fs->group_count, sizeof(uint64_t));
+    if (ctx.workers == NULL || ctx.digests == NULL) {
+        printf("MetaIndexBuild: allocate memory failed\n");
+        goto end;
+    }
+    if (MetaScanRun(&ctx, nr_workers) != 0) {
+        printf("MetaIndexBuild: inode scan failed\n");
+        goto end;
+    }
+
+    /* Join the workers, rebasing their slices on the joined arrays */
+    for (k = 0; k < nr_workers; k++) {
+        count += ctx.workers[k].inode_count;
+        record_count += ctx.workers[k].record_count;
+        meta_count += ctx.workers[k].meta_count;
+    }
+    inodes = (struct MetaInodeMap *) malloc(sizeof(struct MetaInodeMap) * (count ? count : 1));
+    records = (struct ExtentRecord *) malloc(sizeof(struct ExtentRecord) * (record_count ? record_count : 1));
+    meta = (uint64_t *) malloc(sizeof(uint64_t) * (meta_count ? meta_count : 1));
+    if (inodes == NULL || records == NULL || meta == NULL) {
+        printf("MetaIndexBuild: allocate memory failed\n");
+        goto end;
+    }
+    count = 0;
+    record_count = 0;
+    meta_count = 0;
+    for (k = 0; k < nr_workers; k++) {
+        w = &(ctx.workers[k]);
+        for (i = 0; i < w->inode_count; i++) {
+            inodes[count + i] = w->inodes[i];
+            inodes[count + i].first += record_count;
+            inodes[count + i].meta_first += meta_count;
+        }
+        if (w->record_count) {
+            memcpy(records + record_count, w->records, sizeof(struct ExtentRecord) * w->record_count);
+        }
+        if (w->meta_count) {
+            memcpy(meta + meta_count, w->meta, sizeof(uint64_t) * w->meta_count);
+        }
+        count += w->inode_count;
+        record_count += w->record_count;
+        meta_count += w->meta_count;
+        errors += w->errors;
+    }
+    qsort(inodes, count, sizeof(struct MetaInodeMap), MetaInodeMapCompare);
+
+    if (NamespaceWalk(fs, nr_workers, &ns) != 0) {
+        printf("MetaIndexBuild: namespace walk failed\n");
+        goto end;
+    }
+
+    hdr.inode_map_count = count;
+    hdr.record_count = record_count;
+    hdr.meta_count = meta_count;
+    hdr.name_count = ns.count;
+    hdr.names_size = ns.names_size;
+    hdr.name_dirs = ns.dirs;
+    hdr.name_errors = ns.errors;
+    sizes[META_SECTION_DESCRIPTORS] = fs->descriptor_used_block_count * fs->block_size;
+    sizes[META_SECTION_GROUPS] = sizeof(struct GroupSpace) * fs->group_count;
+    sizes[META_SECTION_DIGESTS] = sizeof(uint64_t) * fs->group_count;
+    sizes[META_SECTION_INODES] = sizeof(struct MetaInodeMap) * count;
+    sizes[META_SECTION_RECORDS] = sizeof(struct ExtentRecord) * record_count;
+    sizes[META_SECTION_META] = sizeof(uint64_t) * meta_count;
+    sizes[META_SECTION_NAMES] = sizeof(struct NamespaceEntry) * ns.count;
+    sizes[META_SECTION_NAME_BYTES] = ns.names_size;
+    sizes[META_SECTION_NAME_INODES] = sizeof(uint32_t) * ns.count;
+    n = MetaSectionsPlace(&hdr, sizes);
+
+    tmp = (char *) malloc(strlen(path) + 5);
+    if (tmp == NULL) {
+        goto end;
+    }
+    sprintf(tmp, "%s.tmp", path);
+    file = fopen(tmp, "w");
+    if (file == NULL) {
+        perror("MetaIndexBuild: open");
+        goto end;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+            MetaSectionWrite(file, &hdr, META_SECTION_DESCRIPTORS, descriptors) < 0 ||
+            MetaSectionWrite(file, &hdr, META_SECTION_GROUPS, space.groups) < 0 ||
+            MetaSectionWrite(file, &hdr, META_SECTION_DIGESTS, ctx.digests) < 0 ||
+            MetaSectionWrite(file, &hdr, META_SECTION_INODES, inodes) < 0 ||
+            MetaSectionWrite(file, &hdr, META_SECTION_RECORDS, records) < 0 ||
+            MetaSectionWrite(file, &hdr, META_SECTION_META, meta) < 0 ||
+            MetaSectionWrite(file, &hdr, META_SECTION_NAMES, ns.entries) < 0 ||
+            MetaSectionWrite(file, &hdr, META_SECTION_NAME_BYTES, ns.names) < 0 ||
+            MetaSectionWrite(file, &hdr, META_SECTION_NAME_INODES, ns.by_inode) < 0 ||
+            ftruncate(fileno(file), n) < 0 || fflush(file) != 0 || fsync(fileno(file)) < 0) {
+        perror("MetaIndexBuild: write");
+        goto end;
+    }
+    fclose(file);
+    file = NULL;
+    if (rename(tmp, path) < 0) {
+        perror("MetaIndexBuild: rename");
+        goto end;
+    }
+    printf("Index %s: %llu groups, %llu inode maps, %llu records, %llu names, %llu bytes, "
+            "%llu unreadable maps, %llu unreadable directories\n",
+            path, fs->group_count, count, record_count, ns.count, n, errors, ns.errors);
+    ret = 0;
+end:
+    if (file != NULL) {
+        fclose(file);
+    }
+    if (ret < 0 && tmp != NULL) {
+        unlink(tmp);
+    }
+    if (ctx.workers != NULL) {
+        for (k = 0; k < nr_workers; k++) {
+            free(ctx.workers[k].inodes);
+            free(ctx.workers[k].records);
+            free(ctx.workers[k].meta);
+        }
+    }
+    free(ctx.workers);
+    free(ctx.digests);
+    free(inodes);
+    free(records);
+    free(meta);
+    free(descriptors);
+    free(tmp);
+    SpaceReportRelease(&space);
+    NamespaceIndexRelease(&ns);
+    return ret;
+}
+
+/*
+ * Map the sidecar index and attach it to the FileSystem, descriptors,
+ * bitmap summaries and block maps are then served from it
+ * Return 0 on success, -1 if there is no index or it does not match the
+ * image any more
+ */
+int MetaIndexOpen(struct FileSystem *fs, const char *path)
+{
+    struct MetaIndex *index = NULL;
+    struct MetaIndexHeader expect, *hdr = NULL;
+    struct stat st;
+    uint64_t sizes[META_SECTIONS];
+    int fd = -1;
+    int i = 0;
+    int status = 0;
+
+    if (fs == NULL || path == NULL) {
+        return -1;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < sizeof(struct MetaIndexHeader) ||
+            MetaHeaderFill(fs, &expect) < 0) {
+        close(fd);
+        return -1;
+    }
+    index = (struct MetaIndex *) calloc(1, sizeof(struct MetaIndex));
+    if (index == NULL) {
+        close(fd);
+        return -1;
+    }
+    index->size = st.st_size;
+    index->map = (char *) mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index->map == MAP_FAILED) {
+        free(index);
+        return -1;
+    }
+    hdr = (struct MetaIndexHeader *)index->map;
+    index->header = hdr;
+
+    status = SidecarStampCheck(fs, &(hdr->stamp), META_INDEX_MAGIC, META_INDEX_VERSION, sizeof(struct MetaIndexHeader),
+            SIDECAR_CHECK_SUPER | SIDECAR_CHECK_IMAGE);
+    if (status == SIDECAR_FOREIGN) {
+        printf("MetaIndexOpen: %s is not an index of this version\n", path);
+        goto fail;
+    }
+    if (status != SIDECAR_CURRENT || hdr->block_size != expect.block_size || hdr->block_count != expect.block_count ||
+            hdr->inode_count != expect.inode_count || hdr->group_count != expect.group_count ||
+            hdr->descriptor_size != expect.descriptor_size) {
+        printf("MetaIndexOpen: %s is stale\n", path);
+        goto fail;
+    }
+
+    sizes[META_SECTION_DESCRIPTORS] = fs->descriptor_used_block_count * fs->block_size;
+    sizes[META_SECTION_GROUPS] = sizeof(struct GroupSpace) * fs->group_count;
+    sizes[META_SECTION_DIGESTS] = sizeof(uint64_t) * fs->group_count;
+    sizes[META_SECTION_INODES] = sizeof(struct MetaInodeMap) * hdr->inode_map_count;
+    sizes[META_SECTION_RECORDS] = sizeof(struct ExtentRecord) * hdr->record_count;
+    sizes[META_SECTION_META] = sizeof(uint64_t) * hdr->meta_count;
+    sizes[META_SECTION_NAMES] = sizeof(struct NamespaceEntry) * hdr->name_count;
+    sizes[META_SECTION_NAME_BYTES] = hdr->names_size;
+    sizes[META_SECTION_NAME_INODES] = sizeof(uint32_t) * hdr->name_count;
+    for (i = 0; i < META_SECTIONS; i++) {
+        if (hdr->sections[i].size != sizes[i] || (hdr->sections[i].offset & 7) != 0 ||
+                hdr->sections[i].offset > index->size || hdr->sections[i].size > index->size - hdr->sections[i].offset) {
+            printf("MetaIndexOpen: %s is truncated or corrupt\n", path);
+            goto fail;
+        }
+    }
+    index->descriptors = index->map + hdr->sections[META_SECTION_DESCRIPTORS].offset;
+    index->groups = (struct GroupSpace *)(index->map + hdr->sections[META_SECTION_GROUPS].offset);
+    index->digests = (uint64_t *)(index->map + hdr->sections[META_SECTION_DIGESTS].offset);
+    index->inodes = (struct MetaInodeMap *)(index->map + hdr->sections[META_SECTION_INODES].offset);
+    index->records = (struct ExtentRecord *)(index->map + hdr->sections[META_SECTION_RECORDS].offset);
+    index->meta = (uint64_t *)(index->map + hdr->sections[META_SECTION_META].offset);
+    index->names = (struct NamespaceEntry *)(index->map + hdr->sections[META_SECTION_NAMES].offset);
+    index->name_bytes = index->map + hdr->sections[META_SECTION_NAME_BYTES].offset;
+    index->name_inodes = (uint32_t *)(index->map + hdr->sections[META_SECTION_NAME_INODES].offset);
+
+    fs->meta_index = index;
+    return 0;
+fail:
+    munmap(index->map, index->size);
+    free(index);
+    return -1;
+}
+
+void MetaIndexRelease(struct FileSystem *fs)
+{
+    if (fs == NULL || fs->meta_index == NULL) {
+        return;
+    }
+    munmap(fs->meta_index->map, fs->meta_index->size);
+    free(fs->meta_index);
+    fs->meta_index = NULL;
+}
+
+/*
+ * Stop serving from the index, for writers to the image. The file is left
+ * alone, the changed modification time of the image keeps it from being
+ * used again.
+ */
+void MetaIndexInvalidate(struct FileSystem *fs)
+{
+    if (fs == NULL || fs->meta_index == NULL) {
+        return;
+    }
+    __atomic_store_n(&fs->meta_index->stale, true, __ATOMIC_RELEASE);
+}
+
+static struct MetaIndex *MetaIndexGet(struct FileSystem *fs)
+{
+    if (fs == NULL || fs->meta_index == NULL || __atomic_load_n(&fs->meta_index->stale, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return fs->meta_index;
+}
+
+/*
+ * Return descriptor block index as it was on disk, NULL without an index
+ */
+char *MetaIndexDescriptorBlockGet(struct FileSystem *fs, uint64_t index)
+{
+    struct MetaIndex *mi = MetaIndexGet(fs);
+
+    if (mi == NULL || index >= fs->descriptor_used_block_count) {
+        return NULL;
+    }
+    return mi->descriptors + index * fs->block_size;
+}
+
+/*
+ * Return the GroupSpace of every group, NULL without an index
+ */
+struct GroupSpace *MetaIndexGroupSpaceGet(struct FileSystem *fs)
+{
+    struct MetaIndex *mi = MetaIndexGet(fs);
+
+    return mi ? mi->groups : NULL;
+}
+
+/*
+ * Copy the block map of an inode out of the index
+ * @map: filled in, released by ExtentMapRelease
+ * Return 0 on success, -1 without an index or if the inode is not in it
+ */
+int MetaIndexExtentMapGet(struct FileSystem *fs, uint64_t num, struct ExtentMap *map)
+{
+    struct MetaIndex *mi = MetaIndexGet(fs);
+    struct MetaInodeMap *im = NULL;
+    uint64_t low = 0, high = 0, mid = 0;
+
+    if (mi == NULL || map == NULL) {
+        return -1;
+    }
+    high = mi->header->inode_map_count;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (mi->inodes[mid].inode < num) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == mi->header->inode_map_count || mi->inodes[low].inode != num) {
+        __atomic_fetch_add(&mi->misses, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    im = &(mi->inodes[low]);
+    if (im->first + im->count > mi->header->record_count || im->meta_first + im->meta_count > mi->header->meta_count) {
+        return -1;
+    }
+
+    memset(map, 0, sizeof(struct ExtentMap));
+    map->inode = num;
+    map->records = (struct ExtentRecord *) malloc(sizeof(struct ExtentRecord) * (im->count ? im->count : 1));
+    map->meta = (uint64_t *) malloc(sizeof(uint64_t) * (im->meta_count ? im->meta_count : 1));
+    if (map->records == NULL || map->meta == NULL) {
+        ExtentMapRelease(map);
+        return -1;
+    }
+    memcpy(map->records, mi->records + im->first, sizeof(struct ExtentRecord) * im->count);
+    memcpy(map->meta, mi->meta + im->meta_first, sizeof(uint64_t) * im->meta_count);
+    map->count = im->count;
+    map->capacity = im->count ? im->count : 1;
+    map->meta_count = im->meta_count;
+    map->meta_capacity = im->meta_count ? im->meta_count : 1;
+    map->blocks = im->blocks;
+    __atomic_fetch_add(&mi->hits, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Digest the inode tables again and compare with the index, for images
+ * that may have been changed without their modification time
+ * Return how many groups differ, -1 on failure
+ */
+int64_t MetaIndexVerify(struct FileSystem *fs, int nr_workers)
+{
+    struct MetaIndex *mi = MetaIndexGet(fs);
+    struct MetaContext ctx;
+    int64_t differ = 0;
+    uint64_t i = 0;
+
+    if (mi == NULL) {
+        printf("MetaIndexVerify: no index\n");
+        return -1;
+    }
+    memset(&ctx, 0, sizeof(struct MetaContext));
+    nr_workers = WorkPoolWorkersGet(nr_workers);
+    if ((uint64_t)nr_workers > fs->group_count) {
+        nr_workers = fs->group_count;
+    }
+    ctx.fs = fs;
+    ctx.digests = (uint64_t *) calloc(fs->group_count, sizeof(uint64_t));
+    if (ctx.digests == NULL || MetaScanRun(&ctx, nr_workers) != 0) {
+        printf("MetaIndexVerify: inode scan failed\n");
+        free(ctx.digests);
+        return -1;
+    }
+    for (i = 0; i < fs->group_count; i++) {
+        if (ctx.digests[i] != mi->digests[i]) {
+            printf("Group %llu: inodes changed since the index was built\n", i);
+            differ++;
+        }
+    }
+    free(ctx.digests);
+    return differ;
+}
+
+/*
+ * Fill index with the namespace kept in the sidecar index, in place of a
+ * NamespaceWalk. The arrays point into the mapping, NamespaceIndexRelease
+ * leaves them alone and they stay valid until MetaIndexRelease.
+ * Return 0 on success, -1 without a current index or if its namespace is
+ * corrupt
+ */
+int MetaIndexNamespaceGet(struct FileSystem *fs, struct NamespaceIndex *index)
+{
+    struct MetaIndex *mi = MetaIndexGet(fs);
+    struct NamespaceEntry *e = NULL;
+    struct timespec begin, end;
+    uint64_t i = 0, count = 0;
+
+    if (mi == NULL || index == NULL) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    count = mi->header->name_count;
+    /* Parents come before their children, so path walks up always end at the root */
+    for (i = 0; i < count; i++) {
+        e = &(mi->names[i]);
+        if ((e->parent >= i && i > 0) || e->name > mi->header->names_size ||
+                e->name_len > mi->header->names_size - e->name || mi->name_inodes[i] >= count) {
+            printf("MetaIndexNamespaceGet: entry %llu of the index is corrupt\n", i);
+            return -1;
+        }
+    }
+    memset(index, 0, sizeof(struct NamespaceIndex));
+    index->count = count;
+    index->entries = mi->names;
+    index->names = mi->name_bytes;
+    index->names_size = mi->header->names_size;
+    index->by_inode = mi->name_inodes;
+    index->dirs = mi->header->name_dirs;
+    index->errors = mi->header->name_errors;
+    index->mapped = true;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    index->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return 0;
+}
+
+void MetaIndexPrint(struct FileSystem *fs)
+{
+    struct MetaIndex *mi = fs->meta_index;
+
+    if (mi == NULL) {
+        printf("No index\n");
+        return;
+    }
+    printf("Index: %llu bytes, %llu groups, %llu inode maps, %llu records, %llu names, %llu hits, %llu misses%s\n",
+            mi->size, mi->header->group_count, mi->header->inode_map_count, mi->header->record_count,
+            mi->header->name_count, mi->hits, mi->misses, mi->stale ? ", stale" : "");
+}
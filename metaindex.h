@@ -0,0 +1,101 @@
+#ifndef METAINDEX_H
+#define METAINDEX_H
+
+#include "filesystem.h"
+#include "sidecar.h"
+#include "space.h"
+#include "extent.h"
+#include "walk.h"
+
+/* The sidecar index of an image is the image path with this appended */
+#define META_INDEX_SUFFIX       ".lsfsidx"
+
+#define META_INDEX_MAGIC        "LSFSMIDX"
+#define META_INDEX_VERSION      2
+
+/* Sections of the index, in file order */
+#define META_SECTION_DESCRIPTORS    0   /* descriptor blocks as on disk */
+#define META_SECTION_GROUPS         1   /* struct GroupSpace per group, from the bitmaps */
+#define META_SECTION_DIGESTS        2   /* uint64_t digest of the inodes in use per group */
+#define META_SECTION_INODES         3   /* struct MetaInodeMap sorted by inode */
+#define META_SECTION_RECORDS        4   /* struct ExtentRecord of all inodes */
+#define META_SECTION_META           5   /* uint64_t tree node and pointer blocks of all inodes */
+#define META_SECTION_NAMES          6   /* struct NamespaceEntry as numbered by NamespaceWalk */
+#define META_SECTION_NAME_BYTES     7   /* the names the entries point into */
+#define META_SECTION_NAME_INODES    8   /* uint32_t entries sorted by inode */
+#define META_SECTIONS               9
+
+struct MetaIndexSection {
+    uint64_t offset;    /* from the start of the file, 8 byte aligned */
+    uint64_t size;
+};
+
+/*
+ * The index is only used while everything it was built from is unchanged:
+ * the superblock fields, the geometry and the size and modification time
+ * of the image file, which catches tools that write without mounting.
+ */
+struct MetaIndexHeader {
+    struct SidecarStamp stamp;
+    uint64_t block_size;
+    uint64_t block_count;
+    uint64_t inode_count;
+    uint64_t group_count;
+    uint64_t descriptor_size;
+    uint64_t inode_map_count;
+    uint64_t record_count;
+    uint64_t meta_count;
+    uint64_t name_count;
+    uint64_t names_size;
+    uint64_t name_dirs;
+    uint64_t name_errors;   /* directories that could not be read */
+    struct MetaIndexSection sections[META_SECTIONS];
+};
+
+/*
+ * Block map of one inode, as slices of the records and meta sections
+ */
+struct MetaInodeMap {
+    uint32_t inode;
+    uint32_t reserved;
+    uint64_t first;         /* first record */
+    uint64_t count;
+    uint64_t meta_first;    /* first meta block */
+    uint64_t meta_count;
+    uint64_t blocks;
+};
+
+/*
+ * An index mapped read only. Pointers point into the mapping, which is kept
+ * until MetaIndexRelease even once the index went stale.
+ */
+struct MetaIndex {
+    char *map;
+    uint64_t size;
+    struct MetaIndexHeader *header;
+    char *descriptors;
+    struct GroupSpace *groups;
+    uint64_t *digests;
+    struct MetaInodeMap *inodes;
+    struct ExtentRecord *records;
+    uint64_t *meta;
+    struct NamespaceEntry *names;
+    char *name_bytes;
+    uint32_t *name_inodes;
+    bool stale;             /* the image was written through this FileSystem */
+    uint64_t hits;          /* extent maps served */
+    uint64_t misses;
+};
+
+int MetaIndexBuild(struct FileSystem *, int, const char *);
+int MetaIndexOpen(struct FileSystem *, const char *);
+void MetaIndexRelease(struct FileSystem *);
+void MetaIndexInvalidate(struct FileSystem *);
+char *MetaIndexDescriptorBlockGet(struct FileSystem *, uint64_t);
+struct GroupSpace *MetaIndexGroupSpaceGet(struct FileSystem *);
+int MetaIndexExtentMapGet(struct FileSystem *, uint64_t, struct ExtentMap *);
+int MetaIndexNamespaceGet(struct FileSystem *, struct NamespaceIndex *);
+int64_t MetaIndexVerify(struct FileSystem *, int);
+void MetaIndexPrint(struct FileSystem *);
+
+#endif /* METAINDEX_H */
@@ -0,0 +1,839 @@
+/*
+ * Write a synthetic ext4 image as a sparse file: the superblock and its
+ * backups, the descriptors, the bitmaps, the used part of the inode tables,
+ * a root directory holding lost+found and a number of regular files. File
+ * data is never written, it reads as zeros from the holes.
+ *
+ * Needs neither root, loop devices nor LVM, so the benchmarks can make the
+ * geometries the scripts directory makes by hand.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include "filesystem.h"
+#include "ext4_extents.h"
+
+#define IMAGE_64BIT             0x0001
+#define IMAGE_META_BG           0x0002
+#define IMAGE_FLEX_BG           0x0004
+#define IMAGE_SPARSE_SUPER2     0x0008
+#define IMAGE_NO_SPARSE_SUPER   0x0010
+
+#define IMAGE_INODE_SIZE        256
+#define IMAGE_EXTRA_ISIZE       32
+#define IMAGE_BYTES_PER_INODE   16384
+#define IMAGE_FIRST_INO         11      /* lost+found, files follow */
+#define IMAGE_INODE_EXTENTS     4       /* extents kept in i_block */
+#define IMAGE_MAX_EXTENT_LEN    32768
+#define IMAGE_SUPER_MAGIC       0xEF53
+
+struct ImageSpec {
+    uint64_t block_size;
+    uint64_t size;          /* bytes, rounded down to whole groups if the last is too small */
+    uint64_t inodes;        /* 0 for one per IMAGE_BYTES_PER_INODE */
+    uint64_t files;
+    uint64_t file_blocks;
+    uint32_t features;      /* IMAGE_* */
+    uint32_t flex_log;      /* groups per flex group, as a power of 2 */
+    uint32_t first_meta_bg;
+};
+
+struct ImageExtent {
+    uint64_t start;
+    uint64_t len;
+};
+
+struct Image {
+    struct ImageSpec spec;
+    struct FileSystem fs;   /* geometry and super only, for GroupHasSuperblock */
+    int fd;
+    uint64_t block_count;
+    uint64_t first_data_block;
+    uint64_t group_count;
+    uint64_t blocks_per_group;
+    uint64_t inodes_per_group;
+    uint64_t itable_blocks;
+    uint64_t desc_size;
+    uint64_t desc_per_block;
+    uint64_t desc_blocks;
+    uint64_t last_inode;    /* inodes 1 to last_inode are in use */
+    uint8_t *used;          /* one bit per block */
+    char *descs;            /* desc_blocks blocks */
+    char *root;             /* blocks of the root directory */
+    uint64_t root_blocks;
+    struct ImageExtent root_extents[IMAGE_INODE_EXTENTS];
+    uint64_t root_extent_count;
+    uint64_t lost_found;    /* the block of lost+found */
+    uint64_t data_goal;     /* where the next file is allocated from */
+    time_t now;
+};
+
+#define IMAGE_BIT_TEST(map, bit) ((map)[(bit) >> 3] & (1 << ((bit) & 7)))
+#define IMAGE_BIT_SET(map, bit) ((map)[(bit) >> 3] |= (1 << ((bit) & 7)))
+
+static uint64_t ImageGroupFirst(struct Image *img, uint64_t group)
+{
+    return img->first_data_block + group * img->blocks_per_group;
+}
+
+static uint64_t ImageGroupBlocks(struct Image *img, uint64_t group)
+{
+    uint64_t first = ImageGroupFirst(img, group);
+
+    return (first + img->blocks_per_group > img->block_count) ? img->block_count - first : img->blocks_per_group;
+}
+
+static struct ext4_group_desc *ImageDescGet(struct Image *img, uint64_t group)
+{
+    return (struct ext4_group_desc *)(img->descs + group * img->desc_size);
+}
+
+/*
+ * Set the block bitmap (which 0), inode bitmap (1) or inode table (2) of a
+ * descriptor, the high halves only exist with 64bit
+ */
+static void ImageDescLocationSet(struct Image *img, struct ext4_group_desc *desc, int which, uint64_t block)
+{
+    bool wide = img->desc_size >= EXT4_MIN_DESC_SIZE_64BIT;
+
+    if (which == 0) {
+        desc->bg_block_bitmap_lo = htole32(block);
+        if (wide) {
+            desc->bg_block_bitmap_hi = htole32(block >> 32);
+        }
+    } else if (which == 1) {
+        desc->bg_inode_bitmap_lo = htole32(block);
+        if (wide) {
+            desc->bg_inode_bitmap_hi = htole32(block >> 32);
+        }
+    } else {
+        desc->bg_inode_table_lo = htole32(block);
+        if (wide) {
+            desc->bg_inode_table_hi = htole32(block >> 32);
+        }
+    }
+}
+
+/*
+ * Descriptor blocks kept in the old layout, behind each superblock
+ */
+static uint64_t ImageOldDescBlocks(struct Image *img)
+{
+    return (img->spec.features & IMAGE_META_BG) ? img->spec.first_meta_bg : img->desc_blocks;
+}
+
+/*
+ * Where the superblock and descriptor copies of a group are, the way
+ * libext2fs places them
+ * @super: set to the superblock block, 0 if none
+ * @old_desc: set to the first block of the old layout descriptors, 0 if none
+ * @new_desc: set to the meta_bg descriptor block, 0 if none
+ */
+static void ImageGroupMetaGet(struct Image *img, uint64_t group, uint64_t *super, uint64_t *old_desc,
+        uint64_t *new_desc)
+{
+    uint64_t first = ImageGroupFirst(img, group);
+    uint64_t pos = group % img->desc_per_block;
+    bool has_super = GroupHasSuperblock(group, &img->fs);
+
+    *super = has_super ? first : 0;
+    *old_desc = 0;
+    *new_desc = 0;
+    if (!(img->spec.features & IMAGE_META_BG) || group / img->desc_per_block < img->spec.first_meta_bg) {
+        if (has_super) {
+            *old_desc = first + 1;
+        }
+    } else if (pos == 0 || pos == 1 || pos == img->desc_per_block - 1) {
+        *new_desc = first + (has_super ? 1 : 0);
+    }
+}
+
+/*
+ * Find the first run of at least min free blocks from goal on, take up
+ * to max blocks of it
+ * @len: set to the blocks taken
+ * Return the first block taken, (uint64_t)-1 if there is no such run
+ */
+static uint64_t ImageAlloc(struct Image *img, uint64_t goal, uint64_t min, uint64_t max, uint64_t *len)
+{
+    uint64_t start = goal, end = 0, i = 0;
+
+    while (start + min <= img->block_count) {
+        if (IMAGE_BIT_TEST(img->used, start)) {
+            start++;
+            continue;
+        }
+        for (end = start; end < img->block_count && end - start < max && !IMAGE_BIT_TEST(img->used, end); end++) {
+        }
+        if (end - start >= min) {
+            for (i = start; i < end; i++) {
+                IMAGE_BIT_SET(img->used, i);
+            }
+            *len = end - start;
+            return start;
+        }
+        start = end;
+    }
+    return (uint64_t)-1;
+}
+
+/*
+ * Allocate blocks for an inode in at most IMAGE_INODE_EXTENTS extents
+ * Return the number of extents, -1 if the blocks do not fit
+ */
+static int ImageExtentsAlloc(struct Image *img, uint64_t blocks, struct ImageExtent *extents)
+{
+    uint64_t start = 0, len = 0, max = 0;
+    int count = 0;
+
+    while (blocks > 0) {
+        max = blocks < IMAGE_MAX_EXTENT_LEN ? blocks : IMAGE_MAX_EXTENT_LEN;
+        if (count == IMAGE_INODE_EXTENTS ||
+                (start = ImageAlloc(img, img->data_goal, 1, max, &len)) == (uint64_t)-1) {
+            return -1;
+        }
+        extents[count].start = start;
+        extents[count].len = len;
+        count++;
+        blocks -= len;
+        img->data_goal = start + len;
+    }
+    return count;
+}
+
+static int ImageGeometrySet(struct Image *img)
+{
+    struct ImageSpec *spec = &img->spec;
+    uint64_t multiple = 0, last = 0, reserved = 0;
+
+    if (spec->block_size != 1024 && spec->block_size != 2048 && spec->block_size != 4096) {
+        printf("ImageGeometrySet: block size must be 1024, 2048 or 4096\n");
+        return -1;
+    }
+    img->first_data_block = spec->block_size == 1024 ? 1 : 0;
+    img->blocks_per_group = spec->block_size * 8;
+    img->block_count = spec->size / spec->block_size;
+    if (!(spec->features & IMAGE_64BIT) && img->block_count > UINT32_MAX) {
+        printf("ImageGeometrySet: more than 2^32 blocks need 64bit\n");
+        return -1;
+    }
+    if (img->block_count <= img->first_data_block + 64) {
+        printf("ImageGeometrySet: image too small\n");
+        return -1;
+    }
+    img->group_count = (img->block_count - img->first_data_block + img->blocks_per_group - 1) / img->blocks_per_group;
+    img->desc_size = (spec->features & IMAGE_64BIT) ? EXT4_MIN_DESC_SIZE_64BIT : EXT4_MIN_DESC_SIZE;
+    img->desc_per_block = spec->block_size / img->desc_size;
+
+    /* Whole inode table blocks, at least enough for the reserved inodes */
+    multiple = spec->block_size / IMAGE_INODE_SIZE > 8 ? spec->block_size / IMAGE_INODE_SIZE : 8;
+    if (spec->inodes != 0) {
+        img->inodes_per_group = (spec->inodes + img->group_count - 1) / img->group_count;
+    } else {
+        img->inodes_per_group = img->blocks_per_group * spec->block_size / IMAGE_BYTES_PER_INODE;
+    }
+    img->inodes_per_group = (img->inodes_per_group + multiple - 1) / multiple * multiple;
+    if (img->inodes_per_group < 16) {
+        img->inodes_per_group = 16;
+    }
+    if (img->inodes_per_group > img->blocks_per_group) {
+        img->inodes_per_group = img->blocks_per_group;
+    }
+    img->itable_blocks = img->inodes_per_group * IMAGE_INODE_SIZE / spec->block_size;
+
+    /* Like mke2fs, drop a last group too small for its own metadata */
+    last = img->block_count - ImageGroupFirst(img, img->group_count - 1);
+    if (img->group_count > 1 && last < img->itable_blocks + 2 + 64) {
+        img->group_count--;
+        img->block_count = ImageGroupFirst(img, img->group_count);
+    }
+    if (img->group_count * img->inodes_per_group > UINT32_MAX) {
+        printf("ImageGeometrySet: too many inodes\n");
+        return -1;
+    }
+    img->desc_blocks = (img->group_count + img->desc_per_block - 1) / img->desc_per_block;
+    if ((spec->features & IMAGE_META_BG) && spec->first_meta_bg > img->desc_blocks) {
+        printf("ImageGeometrySet: first_meta_bg is past the %llu descriptor blocks\n", img->desc_blocks);
+        return -1;
+    }
+    reserved = 1 + ImageOldDescBlocks(img) + ((spec->features & IMAGE_FLEX_BG) ? 0 : 2 + img->itable_blocks);
+    if (reserved >= img->blocks_per_group - 64) {
+        printf("ImageGeometrySet: the descriptors do not fit in a group, use meta_bg\n");
+        return -1;
+    }
+    img->last_inode = IMAGE_FIRST_INO + spec->files;
+    if (img->last_inode > img->group_count * img->inodes_per_group) {
+        printf("ImageGeometrySet: %llu inodes cannot hold %llu files\n",
+                img->group_count * img->inodes_per_group, spec->files);
+        return -1;
+    }
+    return 0;
+}
+
+static void ImageSuperFill(struct Image *img, struct ext4_super_block *sb)
+{
+    struct ImageSpec *spec = &img->spec;
+    uint64_t seed = img->block_count * 0x9E3779B97F4A7C15ULL ^ img->inodes_per_group ^ spec->features;
+    uint64_t x = 0;
+    int i = 0;
+
+    memset(sb, 0, sizeof(struct ext4_super_block));
+    sb->s_inodes_count = htole32(img->group_count * img->inodes_per_group);
+    sb->s_blocks_count_lo = htole32(img->block_count);
+    sb->s_blocks_count_hi = htole32(img->block_count >> 32);
+    sb->s_first_data_block = htole32(img->first_data_block);
+    sb->s_log_block_size = htole32(spec->block_size == 1024 ? 0 : (spec->block_size == 2048 ? 1 : 2));
+    sb->s_log_cluster_size = sb->s_log_block_size;
+    sb->s_blocks_per_group = htole32(img->blocks_per_group);
+    sb->s_clusters_per_group = htole32(img->blocks_per_group);
+    sb->s_inodes_per_group = htole32(img->inodes_per_group);
+    sb->s_wtime = htole32(img->now);
+    sb->s_max_mnt_count = htole16(0xFFFF);
+    sb->s_magic = htole16(IMAGE_SUPER_MAGIC);
+    sb->s_state = htole16(1);
+    sb->s_errors = htole16(1);
+    sb->s_lastcheck = htole32(img->now);
+    sb->s_rev_level = htole32(1);
+    sb->s_first_ino = htole32(IMAGE_FIRST_INO);
+    sb->s_inode_size = htole16(IMAGE_INODE_SIZE);
+    sb->s_min_extra_isize = htole16(IMAGE_EXTRA_ISIZE);
+    sb->s_want_extra_isize = htole16(IMAGE_EXTRA_ISIZE);
+    sb->s_mkfs_time = htole32(img->now);
+    sb->s_flags = htole32(1);   /* signed directory hash, as on x86 */
+
+    sb->s_feature_incompat = htole32(EXT4_FEATURE_INCOMPAT_FILETYPE | EXT4_FEATURE_INCOMPAT_EXTENTS |
+            ((spec->features & IMAGE_64BIT) ? EXT4_FEATURE_INCOMPAT_64BIT : 0) |
+            ((spec->features & IMAGE_META_BG) ? EXT4_FEATURE_INCOMPAT_META_BG : 0) |
+            ((spec->features & IMAGE_FLEX_BG) ? EXT4_FEATURE_INCOMPAT_FLEX_BG : 0));
+    sb->s_feature_ro_compat = htole32(EXT4_FEATURE_RO_COMPAT_LARGE_FILE | EXT4_FEATURE_RO_COMPAT_HUGE_FILE |
+            EXT4_FEATURE_RO_COMPAT_DIR_NLINK | EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE |
+            ((spec->features & IMAGE_NO_SPARSE_SUPER) ? 0 : EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER));
+    if (spec->features & IMAGE_SPARSE_SUPER2) {
+        sb->s_feature_compat = htole32(EXT4_FEATURE_COMPAT_SPARSE_SUPER2);
+        sb->s_backup_bgs[0] = htole32(img->group_count > 1 ? 1 : 0);
+        sb->s_backup_bgs[1] = htole32(img->group_count > 2 ? img->group_count - 1 : 0);
+    }
+    if (spec->features & IMAGE_64BIT) {
+        sb->s_desc_size = htole16(EXT4_MIN_DESC_SIZE_64BIT);
+    }
+    if (spec->features & IMAGE_META_BG) {
+        sb->s_first_meta_bg = htole32(spec->first_meta_bg);
+    }
+    if (spec->features & IMAGE_FLEX_BG) {
+        sb->s_log_groups_per_flex = spec->flex_log;
+    }
+
+    /* The same geometry gives the same uuid, so runs can be compared */
+    for (i = 0; i < 16; i += 8) {
+        seed += 0x9E3779B97F4A7C15ULL;
+        x = seed;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        x ^= x >> 31;
+        memcpy(sb->s_uuid + i, &x, 8);
+    }
+    sb->s_uuid[6] = (sb->s_uuid[6] & 0x0F) | 0x40;
+    sb->s_uuid[8] = (sb->s_uuid[8] & 0x3F) | 0x80;
+    memcpy(sb->s_volume_name, "lsfs-mkimage", 12);
+}
+
+/*
+ * Reserve the superblock and descriptor copies, then place the bitmaps
+ * and inode tables: in their own group, or packed at the start of each
+ * flex group with flex_bg
+ */
+static int ImageMetadataPlace(struct Image *img)
+{
+    struct ext4_group_desc *desc = NULL;
+    uint64_t super = 0, old_desc = 0, new_desc = 0, old_count = ImageOldDescBlocks(img);
+    uint64_t g = 0, i = 0, goal = 0, len = 0, flex = 1, block = 0;
+    int pass = 0;
+
+    for (g = 0; g < img->group_count; g++) {
+        ImageGroupMetaGet(img, g, &super, &old_desc, &new_desc);
+        if (super != 0 || g == 0) {
+            IMAGE_BIT_SET(img->used, super);
+        }
+        for (i = 0; old_desc != 0 && i < old_count && old_desc + i < img->block_count; i++) {
+            IMAGE_BIT_SET(img->used, old_desc + i);
+        }
+        if (new_desc != 0) {
+            IMAGE_BIT_SET(img->used, new_desc);
+        }
+    }
+
+    if (img->spec.features & IMAGE_FLEX_BG) {
+        flex = 1ULL << img->spec.flex_log;
+    }
+    for (g = 0; g < img->group_count; g += flex) {
+        /* Block bitmaps of the flex group, then inode bitmaps, then inode tables */
+        goal = ImageGroupFirst(img, g);
+        for (pass = 0; pass < 3; pass++) {
+            for (i = g; i < g + flex && i < img->group_count; i++) {
+                desc = ImageDescGet(img, i);
+                block = ImageAlloc(img, goal, pass == 2 ? img->itable_blocks : 1,
+                        pass == 2 ? img->itable_blocks : 1, &len);
+                if (block == (uint64_t)-1 || (flex == 1 && block + len > ImageGroupFirst(img, i) + ImageGroupBlocks(img, i))) {
+                    printf("ImageMetadataPlace: no room for the metadata of group %llu\n", i);
+                    return -1;
+                }
+                ImageDescLocationSet(img, desc, pass, block);
+                goal = block + len;
+            }
+        }
+    }
+    return 0;
+}
+
+static void ImageDirEntryAdd(char *block, uint64_t *pos, uint64_t *last, uint32_t inode, const char *name,
+        uint8_t file_type)
+{
+    struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)(block + *pos);
+    uint64_t len = strlen(name);
+
+    de->inode = htole32(inode);
+    de->name_len = len;
+    de->file_type = file_type;
+    memcpy(de->name, name, len);
+    de->rec_len = htole16((8 + len + 3) & ~3ULL);
+    *last = *pos;
+    *pos += le16toh(de->rec_len);
+}
+
+/*
+ * Fill the root directory with ., .., lost+found and one entry per file,
+ * in as many blocks as they take
+ */
+static int ImageRootBuild(struct Image *img)
+{
+    struct ext4_dir_entry_2 *de = NULL;
+    uint64_t bs = img->spec.block_size, n = 0, pos = 0, last = 0, len = 0;
+    char name[32];
+    int count = 0;
+
+    /* Entries of files are 8 bytes plus a name of up to 20 characters */
+    img->root_blocks = 1 + (img->spec.files * 28 + bs - 1) / (bs - bs % 28);
+    img->root = (char *) calloc(img->root_blocks, bs);
+    if (img->root == NULL) {
+        printf("ImageRootBuild: allocate memory failed\n");
+        return -1;
+    }
+    ImageDirEntryAdd(img->root, &pos, &last, EXT4_ROOT_INO, ".", EXT4_FT_DIR);
+    ImageDirEntryAdd(img->root, &pos, &last, EXT4_ROOT_INO, "..", EXT4_FT_DIR);
+    ImageDirEntryAdd(img->root, &pos, &last, IMAGE_FIRST_INO, "lost+found", EXT4_FT_DIR);
+    for (n = 0; n < img->spec.files; n++) {
+        sprintf(name, "f%llu", n);
+        /* An entry does not cross a block, the last one of a block takes its tail */
+        if ((pos % bs) + ((8 + strlen(name) + 3) & ~3ULL) > bs) {
+            de = (struct ext4_dir_entry_2 *)(img->root + last);
+            de->rec_len = htole16(bs - last % bs);
+            pos = (pos / bs + 1) * bs;
+        }
+        ImageDirEntryAdd(img->root, &pos, &last, IMAGE_FIRST_INO + 1 + n, name, EXT4_FT_REG_FILE);
+    }
+    de = (struct ext4_dir_entry_2 *)(img->root + last);
+    de->rec_len = htole16(bs - last % bs);
+    img->root_blocks = (pos + bs - 1) / bs;
+
+    img->data_goal = ImageGroupFirst(img, 0);
+    count = ImageExtentsAlloc(img, img->root_blocks, img->root_extents);
+    img->lost_found = (count < 0) ? (uint64_t)-1 : ImageAlloc(img, img->data_goal, 1, 1, &len);
+    if (img->lost_found == (uint64_t)-1) {
+        printf("ImageRootBuild: no room for the root directory\n");
+        return -1;
+    }
+    img->root_extent_count = count;
+    img->data_goal = img->lost_found + 1;
+    return 0;
+}
+
+static void ImageInodeFill(struct Image *img, struct ext4_inode *inode, uint16_t mode, uint16_t links,
+        uint64_t blocks, struct ImageExtent *extents, int count)
+{
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)inode->i_block;
+    struct ext4_extent *ee = (struct ext4_extent *)(eh + 1);
+    uint64_t size = blocks * img->spec.block_size;
+    uint64_t sectors = size / 512;
+    uint64_t logical = 0;
+    int i = 0;
+
+    inode->i_mode = htole16(mode);
+    inode->i_links_count = htole16(links);
+    inode->i_size_lo = htole32(size);
+    inode->i_size_high = htole32(size >> 32);
+    inode->i_blocks_lo = htole32(sectors);
+    inode->osd2.linux2.l_i_blocks_high = htole16(sectors >> 32);
+    inode->i_atime = htole32(img->now);
+    inode->i_ctime = htole32(img->now);
+    inode->i_mtime = htole32(img->now);
+    inode->i_flags = htole32(EXT4_EXTENTS_FL);
+    inode->i_extra_isize = htole16(IMAGE_EXTRA_ISIZE);
+    eh->eh_magic = htole16(EXT4_EXT_MAGIC);
+    eh->eh_entries = htole16(count);
+    eh->eh_max = htole16(IMAGE_INODE_EXTENTS);
+    for (i = 0; i < count; i++) {
+        ee[i].ee_block = htole32(logical);
+        ee[i].ee_len = htole16(extents[i].len);
+        ee[i].ee_start_hi = htole16(extents[i].start >> 32);
+        ee[i].ee_start_lo = htole32(extents[i].start);
+        logical += extents[i].len;
+    }
+}
+
+/*
+ * Write the inodes in use block by block, with the blocks of the files
+ * allocated on the way
+ */
+static int ImageInodesWrite(struct Image *img)
+{
+    struct ImageExtent extents[IMAGE_INODE_EXTENTS];
+    struct ext4_inode *inode = NULL;
+    uint64_t bs = img->spec.block_size, per_block = bs / IMAGE_INODE_SIZE;
+    uint64_t num = 0, index = 0, block = 0, filled = (uint64_t)-1;
+    char *buf = NULL;
+    int count = 0;
+    int ret = -1;
+
+    buf = (char *) malloc(bs);
+    if (buf == NULL) {
+        return -1;
+    }
+    for (num = 1; num <= img->last_inode; num++) {
+        index = (num - 1) % img->inodes_per_group;
+        block = InodeTableLocationGet(&img->fs, ImageDescGet(img, (num - 1) / img->inodes_per_group)) +
+            index / per_block;
+        if (block != filled) {
+            memset(buf, 0, bs);
+            filled = block;
+        }
+        inode = (struct ext4_inode *)(buf + (index % per_block) * IMAGE_INODE_SIZE);
+        if (num == EXT4_ROOT_INO) {
+            /* ., .. and the .. of lost+found */
+            ImageInodeFill(img, inode, 040755, 3, img->root_blocks, img->root_extents, img->root_extent_count);
+        } else if (num == IMAGE_FIRST_INO) {
+            extents[0].start = img->lost_found;
+            extents[0].len = 1;
+            ImageInodeFill(img, inode, 040700, 2, 1, extents, 1);
+        } else if (num > IMAGE_FIRST_INO) {
+            count = ImageExtentsAlloc(img, img->spec.file_blocks, extents);
+            if (count < 0) {
+                printf("ImageInodesWrite: no room for the blocks of inode %llu\n", num);
+                goto end;
+            }
+            ImageInodeFill(img, inode, 0100644, 1, img->spec.file_blocks, extents, count);
+            /* A spread of owners and ages for the summary queries */
+            inode->i_uid = htole16(1000 + num % 4);
+            inode->i_gid = htole16(1000 + num % 4);
+            inode->i_mtime = htole32(img->now - (num % 730) * 86400);
+        }
+        if (index % per_block == per_block - 1 || num == img->last_inode ||
+                index == img->inodes_per_group - 1) {
+            if (PositionalWrite(img->fd, buf, bs, block * bs) != bs) {
+                perror("ImageInodesWrite: write");
+                goto end;
+            }
+        }
+    }
+    ret = 0;
+end:
+    free(buf);
+    return ret;
+}
+
+static int ImageDirsWrite(struct Image *img)
+{
+    struct ext4_dir_entry_2 *de = NULL;
+    uint64_t bs = img->spec.block_size, i = 0, done = 0;
+    char *block = NULL;
+    uint64_t pos = 0, last = 0;
+    int ret = -1;
+
+    for (i = 0; i < img->root_extent_count; i++) {
+        if (PositionalWrite(img->fd, img->root + done * bs, img->root_extents[i].len * bs,
+                    img->root_extents[i].start * bs) != img->root_extents[i].len * bs) {
+            perror("ImageDirsWrite: write");
+            return -1;
+        }
+        done += img->root_extents[i].len;
+    }
+    block = (char *) calloc(1, bs);
+    if (block == NULL) {
+        return -1;
+    }
+    ImageDirEntryAdd(block, &pos, &last, IMAGE_FIRST_INO, ".", EXT4_FT_DIR);
+    ImageDirEntryAdd(block, &pos, &last, EXT4_ROOT_INO, "..", EXT4_FT_DIR);
+    de = (struct ext4_dir_entry_2 *)(block + last);
+    de->rec_len = htole16(bs - last);
+    if (PositionalWrite(img->fd, block, bs, img->lost_found * bs) != bs) {
+        perror("ImageDirsWrite: write");
+        goto end;
+    }
+    ret = 0;
+end:
+    free(block);
+    return ret;
+}
+
+/*
+ * Write both bitmaps of every group, with the padding past the end of the
+ * group set, and fill the free counts of the descriptors and superblock
+ */
+static int ImageBitmapsWrite(struct Image *img, struct ext4_super_block *sb)
+{
+    struct ext4_group_desc *desc = NULL;
+    uint64_t bs = img->spec.block_size, g = 0, i = 0, first = 0, blocks = 0, used = 0, inodes = 0;
+    uint64_t free_blocks = 0, free_inodes = 0;
+    uint8_t *bitmap = NULL;
+    int ret = -1;
+
+    bitmap = (uint8_t *) malloc(bs);
+    if (bitmap == NULL) {
+        return -1;
+    }
+    for (g = 0; g < img->group_count; g++) {
+        desc = ImageDescGet(img, g);
+        first = ImageGroupFirst(img, g);
+        blocks = ImageGroupBlocks(img, g);
+        memset(bitmap, 0, bs);
+        for (i = 0, used = 0; i < bs * 8; i++) {
+            if (i >= blocks || IMAGE_BIT_TEST(img->used, first + i)) {
+                IMAGE_BIT_SET(bitmap, i);
+                used += i < blocks;
+            }
+        }
+        if (PositionalWrite(img->fd, (char *)bitmap, bs, BlockBitmapLocationGet(&img->fs, desc) * bs) != bs) {
+            perror("ImageBitmapsWrite: write");
+            goto end;
+        }
+
+        inodes = img->last_inode > g * img->inodes_per_group ? img->last_inode - g * img->inodes_per_group : 0;
+        inodes = inodes < img->inodes_per_group ? inodes : img->inodes_per_group;
+        memset(bitmap, 0, bs);
+        for (i = 0; i < bs * 8; i++) {
+            if (i < inodes || i >= img->inodes_per_group) {
+                IMAGE_BIT_SET(bitmap, i);
+            }
+        }
+        if (PositionalWrite(img->fd, (char *)bitmap, bs, InodeBitmapLocationGet(&img->fs, desc) * bs) != bs) {
+            perror("ImageBitmapsWrite: write");
+            goto end;
+        }
+
+        FreeBlocksCountSet(&img->fs, desc, blocks - used);
+        FreeInodesCountSet(&img->fs, desc, img->inodes_per_group - inodes);
+        desc->bg_used_dirs_count_lo = htole16(g == 0 ? 2 : 0);
+        free_blocks += blocks - used;
+        free_inodes += img->inodes_per_group - inodes;
+    }
+    sb->s_free_blocks_count_lo = htole32(free_blocks);
+    sb->s_free_blocks_count_hi = htole32(free_blocks >> 32);
+    sb->s_free_inodes_count = htole32(free_inodes);
+    ret = 0;
+end:
+    free(bitmap);
+    return ret;
+}
+
+/*
+ * Write the superblock and descriptor copies of every group
+ */
+static int ImageSupersWrite(struct Image *img, struct ext4_super_block *sb)
+{
+    uint64_t bs = img->spec.block_size, g = 0, super = 0, old_desc = 0, new_desc = 0, count = 0, offset = 0;
+
+    for (g = 0; g < img->group_count; g++) {
+        ImageGroupMetaGet(img, g, &super, &old_desc, &new_desc);
+        if (super != 0 || g == 0) {
+            sb->s_block_group_nr = htole16(g);
+            offset = (g == 0) ? EXT4_MIN_BLOCK_SIZE : super * bs;
+            if (PositionalWrite(img->fd, (char *)sb, sizeof(struct ext4_super_block), offset) !=
+                    sizeof(struct ext4_super_block)) {
+                perror("ImageSupersWrite: write");
+                return -1;
+            }
+        }
+        count = ImageOldDescBlocks(img);
+        if (old_desc != 0 && count > 0 && PositionalWrite(img->fd, img->descs, count * bs, old_desc * bs) != count * bs) {
+            perror("ImageSupersWrite: write");
+            return -1;
+        }
+        if (new_desc != 0 && PositionalWrite(img->fd, img->descs + g / img->desc_per_block * bs, bs,
+                    new_desc * bs) != bs) {
+            perror("ImageSupersWrite: write");
+            return -1;
+        }
+    }
+    sb->s_block_group_nr = 0;
+    return 0;
+}
+
+/*
+ * Make the image described by spec at path, replacing any file there
+ * Return 0 on success, -1 on failure
+ */
+static int ImageMake(struct ImageSpec *spec, const char *path)
+{
+    struct Image img;
+    struct ext4_super_block sb;
+    int ret = -1;
+
+    memset(&img, 0, sizeof(struct Image));
+    img.spec = *spec;
+    img.fd = -1;
+    img.now = time(NULL);
+    if (ImageGeometrySet(&img) < 0) {
+        return -1;
+    }
+    ImageSuperFill(&img, &sb);
+    img.fs.super = sb;
+    img.fs.block_size = spec->block_size;
+    img.fs.descriptor_size = img.desc_size;
+
+    img.used = (uint8_t *) calloc(img.block_count / 8 + 1, 1);
+    img.descs = (char *) calloc(img.desc_blocks, spec->block_size);
+    if (img.used == NULL || img.descs == NULL) {
+        printf("ImageMake: allocate memory failed\n");
+        goto end;
+    }
+    if (ImageMetadataPlace(&img) < 0 || ImageRootBuild(&img) < 0) {
+        goto end;
+    }
+
+    img.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (img.fd < 0) {
+        perror("ImageMake: open");
+        goto end;
+    }
+    if (ftruncate(img.fd, img.block_count * spec->block_size) < 0) {
+        perror("ImageMake: truncate");
+        goto end;
+    }
+    /* Inodes first, they allocate the blocks the bitmaps then show */
+    if (ImageInodesWrite(&img) < 0 || ImageDirsWrite(&img) < 0 || ImageBitmapsWrite(&img, &sb) < 0 ||
+            ImageSupersWrite(&img, &sb) < 0) {
+        goto end;
+    }
+    if (fsync(img.fd) < 0) {
+        perror("ImageMake: fsync");
+        goto end;
+    }
+    printf("%s: %llu blocks of %llu bytes, %llu groups, %llu inodes per group, %llu files of %llu blocks\n",
+            path, img.block_count, spec->block_size, img.group_count, img.inodes_per_group, spec->files,
+            spec->file_blocks);
+    ret = 0;
+end:
+    if (img.fd >= 0) {
+        close(img.fd);
+    }
+    free(img.used);
+    free(img.descs);
+    free(img.root);
+    return ret;
+}
+
+static uint64_t SizeParse(const char *arg)
+{
+    char *end = NULL;
+    uint64_t size = strtoull(arg, &end, 0);
+
+    switch (*end) {
+        case 'T': case 't':
+            size <<= 10;
+            /* fall through */
+        case 'G': case 'g':
+            size <<= 10;
+            /* fall through */
+        case 'M': case 'm':
+            size <<= 10;
+            /* fall through */
+        case 'K': case 'k':
+            size <<= 10;
+            /* fall through */
+        default:
+            break;
+    }
+    return size;
+}
+
+static int FeaturesParse(char *arg, uint32_t *features)
+{
+    char *name = NULL, *save = NULL;
+
+    for (name = strtok_r(arg, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        if (strcmp(name, "64bit") == 0) {
+            *features |= IMAGE_64BIT;
+        } else if (strcmp(name, "meta_bg") == 0) {
+            *features |= IMAGE_META_BG;
+        } else if (strcmp(name, "flex_bg") == 0) {
+            *features |= IMAGE_FLEX_BG;
+        } else if (strcmp(name, "sparse_super2") == 0) {
+            *features |= IMAGE_SPARSE_SUPER2;
+        } else if (strcmp(name, "^sparse_super") == 0) {
+            *features |= IMAGE_NO_SPARSE_SUPER;
+        } else {
+            printf("Unknown feature %s\n", name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct ImageSpec spec;
+    int opt = 0;
+
+    memset(&spec, 0, sizeof(struct ImageSpec));
+    spec.block_size = 4096;
+    spec.size = 1ULL << 30;
+    spec.flex_log = 4;
+
+    while ((opt = getopt(argc, argv, "b:s:N:f:B:O:G:m:")) != -1) {
+        switch (opt) {
+            case 'b':
+                spec.block_size = strtoull(optarg, NULL, 0);
+                break;
+            case 's':
+                spec.size = SizeParse(optarg);
+                break;
+            case 'N':
+                spec.inodes = strtoull(optarg, NULL, 0);
+                break;
+            case 'f':
+                spec.files = strtoull(optarg, NULL, 0);
+                break;
+            case 'B':
+                spec.file_blocks = strtoull(optarg, NULL, 0);
+                break;
+            case 'O':
+                if (FeaturesParse(optarg, &spec.features) < 0) {
+                    return 1;
+                }
+                break;
+            case 'G':
+                spec.flex_log = strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                spec.first_meta_bg = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                argc = 0;
+                break;
+        }
+    }
+    if (argc == 0 || optind != argc - 1 || spec.flex_log > 16) {
+        printf("Usage:\n");
+        printf("mkimage [-b block size] [-s size] [-N inodes] [-f files] [-B blocks per file]\n");
+        printf("\t[-O feature,...] [-G log2 groups per flex] [-m first meta_bg] image\n");
+        printf("\t-s takes a K, M, G or T suffix, 1G by default, the image is a sparse file\n");
+        printf("\t-N is the total of inodes, one per %d bytes by default\n", IMAGE_BYTES_PER_INODE);
+        printf("\tfeatures are 64bit, meta_bg, flex_bg, sparse_super2 and ^sparse_super\n");
+        return 1;
+    }
+    return ImageMake(&spec, argv[optind]) == 0 ? 0 : 1;
+}
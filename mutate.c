@@ -0,0 +1,727 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mutate.h"
+#include "csum.h"
+#include "crc32c.h"
+#include "journal.h"
+
+/* A dirty block and its new content */
+struct MutationBlock {
+    uint64_t block;
+    char *data;
+};
+
+/* What the edits of one bitmap block did to its group */
+struct MutationGroup {
+    uint64_t group;
+    uint8_t kind;
+    int64_t delta;          /* change of the free count */
+    uint64_t last_used;     /* highest inode index put in use plus one, 0 for none */
+    char *bitmap;
+};
+
+void MutationInit(struct FileSystem *fs, struct Mutation *tx)
+{
+    memset(tx, 0, sizeof(struct Mutation));
+    tx->fs = fs;
+}
+
+void MutationRelease(struct Mutation *tx)
+{
+    free(tx->edits);
+    free(tx->data);
+    MutationInit(tx->fs, tx);
+}
+
+static struct MutationEdit *MutationEditAdd(struct Mutation *tx, uint8_t kind, uint64_t num, uint64_t block)
+{
+    struct MutationEdit *e = NULL;
+
+    if (ArrayReserve((void **)&tx->edits, &tx->capacity, tx->count, sizeof(struct MutationEdit), 1) < 0) {
+        return NULL;
+    }
+    e = &(tx->edits[tx->count]);
+    memset(e, 0, sizeof(struct MutationEdit));
+    e->kind = kind;
+    e->num = num;
+    e->block = block;
+    e->seq = tx->count++;
+    return e;
+}
+
+/*
+ * Stage new bytes for part of an inode, its checksum is recomputed on commit
+ * @tx: Mutation
+ * @num: inode number
+ * @offset: first byte within the inode
+ * @len: bytes, up to s_inode_size - offset
+ * @data: the new bytes, copied
+ * Return 0 on success, -1 on failure
+ */
+int MutationInodeStage(struct Mutation *tx, uint64_t num, uint64_t offset, uint64_t len, const void *data)
+{
+    struct FileSystem *fs = tx->fs;
+    struct MutationEdit *e = NULL;
+    uint64_t location = 0;
+
+    if (num == 0 || num > fs->inode_count || len == 0 || offset + len > le16toh(fs->super.s_inode_size)) {
+        printf("MutationInodeStage: %llu bytes at %llu of inode %llu are out of range\n", len, offset, num);
+        return -1;
+    }
+    location = InodeOffsetGet(fs, num);
+    if (location == 0) {
+        printf("MutationInodeStage: locate inode %llu failed\n", num);
+        return -1;
+    }
+    if (ArrayReserve((void **)&tx->data, &tx->data_capacity, tx->data_len, 1, len) < 0) {
+        return -1;
+    }
+    e = MutationEditAdd(tx, MUTATION_INODE, num, location / fs->block_size);
+    if (e == NULL) {
+        return -1;
+    }
+    e->start = location % fs->block_size;
+    e->offset = e->start + offset;
+    e->len = len;
+    e->group = INODE_TO_GROUP(num, fs->inodes_per_group);
+    e->data = tx->data_len;
+    memcpy(tx->data + tx->data_len, data, len);
+    tx->data_len += len;
+    return 0;
+}
+
+static int MutationBitStage(struct Mutation *tx, uint8_t kind, uint64_t num, uint64_t group, uint64_t bit, bool used)
+{
+    struct FileSystem *fs = tx->fs;
+    struct ext4_group_desc *pdesc = GroupDescriptorGet(fs, group);
+    struct MutationEdit *e = NULL;
+    uint16_t uninit = (kind == MUTATION_INODE_BITMAP) ? EXT4_BG_INODE_UNINIT : EXT4_BG_BLOCK_UNINIT;
+
+    if (pdesc == NULL) {
+        printf("MutationBitStage: read the descriptor of group %llu failed\n", group);
+        return -1;
+    }
+    /* The bitmap on disk means nothing until it is initialized */
+    if (le16toh(pdesc->bg_flags) & uninit) {
+        printf("MutationBitStage: the %s bitmap of group %llu is not initialized\n",
+                (kind == MUTATION_INODE_BITMAP) ? "inode" : "block", group);
+        return -1;
+    }
+    e = MutationEditAdd(tx, kind, num,
+            (kind == MUTATION_INODE_BITMAP) ? InodeBitmapLocationGet(fs, pdesc) : BlockBitmapLocationGet(fs, pdesc));
+    if (e == NULL) {
+        return -1;
+    }
+    e->offset = bit;
+    e->group = group;
+    e->value = used;
+    return 0;
+}
+
+/*
+ * Stage marking an inode in use or free, the free counts and checksums of
+ * its group and of the superblock follow on commit
+ * Return 0 on success, -1 on failure
+ */
+int MutationInodeBitmapStage(struct Mutation *tx, uint64_t num, bool used)
+{
+    struct FileSystem *fs = tx->fs;
+
+    if (num == 0 || num > fs->inode_count) {
+        printf("MutationInodeBitmapStage: inode %llu is out of range\n", num);
+        return -1;
+    }
+    return MutationBitStage(tx, MUTATION_INODE_BITMAP, num, INODE_TO_GROUP(num, fs->inodes_per_group),
+            (num - 1) % fs->inodes_per_group, used);
+}
+
+/*
+ * Stage marking a block in use or free, see MutationInodeBitmapStage.
+ * With bigalloc the bit is the one of the cluster of the block.
+ */
+int MutationBlockBitmapStage(struct Mutation *tx, uint64_t block, bool used)
+{
+    struct FileSystem *fs = tx->fs;
+    uint64_t first = le32toh(fs->super.s_first_data_block);
+
+    if (block < first || block >= fs->block_count) {
+        printf("MutationBlockBitmapStage: block %llu is out of range\n", block);
+        return -1;
+    }
+    return MutationBitStage(tx, MUTATION_BLOCK_BITMAP, block, BLOCK_TO_GROUP(block, first, fs->blocks_per_group),
+            BLOCK_TO_BIT(block, first, fs->blocks_per_group, fs->cluster_block_ratio), used);
+}
+
+/*
+ * Edits of a block together, those of an inode or of a bit together, in
+ * staging order. Bits are compared rather than numbers, with bigalloc the
+ * blocks of a cluster share one bit and the last edit of any must win.
+ */
+static int MutationEditCompare(const void *a, const void *b)
+{
+    const struct MutationEdit *x = (const struct MutationEdit *)a;
+    const struct MutationEdit *y = (const struct MutationEdit *)b;
+
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+    if (x->kind != y->kind) {
+        return (int)x->kind - (int)y->kind;
+    }
+    if (x->kind == MUTATION_INODE && x->num != y->num) {
+        return x->num < y->num ? -1 : 1;
+    }
+    if (x->kind != MUTATION_INODE && x->offset != y->offset) {
+        return x->offset < y->offset ? -1 : 1;
+    }
+    if (x->seq != y->seq) {
+        return x->seq < y->seq ? -1 : 1;
+    }
+    return 0;
+}
+
+static int MutationBlockCompare(const void *a, const void *b)
+{
+    const struct MutationBlock *x = (const struct MutationBlock *)a;
+    const struct MutationBlock *y = (const struct MutationBlock *)b;
+
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+    return 0;
+}
+
+static int MutationGroupCompare(const void *a, const void *b)
+{
+    const struct MutationGroup *x = (const struct MutationGroup *)a;
+    const struct MutationGroup *y = (const struct MutationGroup *)b;
+
+    if (x->group != y->group) {
+        return x->group < y->group ? -1 : 1;
+    }
+    return (int)x->kind - (int)y->kind;
+}
+
+/*
+ * Count of the run of consecutive blocks starting at dirty[i], up to
+ * MUTATION_IO_BLOCKS
+ */
+static uint64_t MutationRunGet(struct MutationBlock *dirty, uint64_t count, uint64_t i)
+{
+    uint64_t run = 1;
+
+    while (i + run < count && run < MUTATION_IO_BLOCKS && dirty[i + run].block == dirty[i].block + run) {
+        run++;
+    }
+    return run;
+}
+
+/*
+ * The data of the run of dirty blocks starting at dirty[i], copied to io
+ * when the blocks are not consecutive in memory
+ */
+static char *MutationRunData(struct FileSystem *fs, struct MutationBlock *dirty, uint64_t i, uint64_t run, char *io)
+{
+    uint64_t k = 0;
+
+    for (k = 1; k < run && dirty[i + k].data == dirty[i].data + k * fs->block_size; k++) {
+    }
+    if (k == run) {
+        return dirty[i].data;
+    }
+    for (k = 0; k < run; k++) {
+        memcpy(io + k * fs->block_size, dirty[i + k].data, fs->block_size);
+    }
+    return io;
+}
+
+/*
+ * Sync the directory holding path, so a file created there is found
+ * after a crash
+ */
+static int MutationLogDirSync(const char *path)
+{
+    char *copy = strdup(path);
+    int fd = -1, ret = -1;
+
+    if (copy == NULL) {
+        return -1;
+    }
+    fd = open(dirname(copy), O_RDONLY);
+    if (fd >= 0 && fsync(fd) == 0) {
+        ret = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(copy);
+    return ret;
+}
+
+/*
+ * Write the redo log of a commit and make it durable: the runs of dirty
+ * blocks and the superblock when sb is not NULL, the header last with the
+ * checksum over them
+ */
+static int MutationLogWrite(struct FileSystem *fs, struct MutationBlock *dirty, uint64_t ndirty,
+        struct ext4_super_block *sb, char *io)
+{
+    struct MutationLogHeader hdr;
+    struct MutationLogRecord *records = NULL;
+    uint64_t i = 0, n = 0, run = 0, pos = 0;
+    uint32_t crc = ~0U;
+    char *src = NULL;
+    int fd = -1, ret = -1;
+
+    memset(&hdr, 0, sizeof(struct MutationLogHeader));
+    if (SidecarStampFill(fs, MUTATION_LOG_MAGIC, MUTATION_LOG_VERSION, sizeof(struct MutationLogHeader),
+                &(hdr.stamp)) < 0) {
+        return -1;
+    }
+    /* Times of the superblock as written, the copy in fs may be older */
+    if (sb != NULL) {
+        hdr.stamp.wtime = le32toh(sb->s_wtime);
+        hdr.stamp.mtime = le32toh(sb->s_mtime);
+    }
+    for (i = 0; i < ndirty; i += MutationRunGet(dirty, ndirty, i)) {
+        hdr.count++;
+    }
+    hdr.count += (sb != NULL);
+
+    records = (struct MutationLogRecord *) malloc(hdr.count * sizeof(struct MutationLogRecord));
+    if (records == NULL) {
+        return -1;
+    }
+    for (i = 0; i < ndirty; i += run, n++) {
+        run = MutationRunGet(dirty, ndirty, i);
+        records[n].offset = dirty[i].block * fs->block_size;
+        records[n].len = run * fs->block_size;
+        hdr.data_len += records[n].len;
+    }
+    if (sb != NULL) {
+        records[n].offset = 1024;
+        records[n].len = sizeof(struct ext4_super_block);
+        hdr.data_len += records[n].len;
+    }
+
+    fd = open(fs->log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        goto end;
+    }
+    pos = sizeof(struct MutationLogHeader);
+    if (PositionalWrite(fd, (char *)records, hdr.count * sizeof(struct MutationLogRecord), pos) !=
+            hdr.count * sizeof(struct MutationLogRecord)) {
+        goto end;
+    }
+    crc = Crc32c(crc, records, hdr.count * sizeof(struct MutationLogRecord));
+    pos += hdr.count * sizeof(struct MutationLogRecord);
+    for (i = 0; i < ndirty; i += run) {
+        run = MutationRunGet(dirty, ndirty, i);
+        src = MutationRunData(fs, dirty, i, run, io);
+        if (PositionalWrite(fd, src, run * fs->block_size, pos) != run * fs->block_size) {
+            goto end;
+        }
+        crc = Crc32c(crc, src, run * fs->block_size);
+        pos += run * fs->block_size;
+    }
+    if (sb != NULL) {
+        if (PositionalWrite(fd, (char *)sb, sizeof(struct ext4_super_block), pos) != sizeof(struct ext4_super_block)) {
+            goto end;
+        }
+        crc = Crc32c(crc, sb, sizeof(struct ext4_super_block));
+    }
+    hdr.checksum = crc;
+    if (PositionalWrite(fd, (char *)&hdr, sizeof(struct MutationLogHeader), 0) != sizeof(struct MutationLogHeader) ||
+            fsync(fd) < 0 || MutationLogDirSync(fs->log_path) < 0) {
+        goto end;
+    }
+    ret = 0;
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(records);
+    return ret;
+}
+
+/*
+ * Remember where the redo log of fs is kept and finish the commit it
+ * holds, if any: a complete log is written over the image, synced and
+ * removed. A log cut short, of another filesystem or older than the last
+ * mount is removed without touching the image.
+ * @fs: FileSystem, opened without FS_OPEN_OVERLAY, its superblock read
+ * @image: path of the image
+ * Return 1 when the image was written, 0 when not, -1 on failure
+ */
+int MutationLogOpen(struct FileSystem *fs, const char *image)
+{
+    struct MutationLogHeader hdr;
+    struct MutationLogRecord *records = NULL;
+    struct stat st;
+    const char *stale = NULL;
+    char *body = NULL, *data = NULL;
+    uint64_t i = 0, size = 0, len = 0;
+    int fd = -1, ret = -1;
+
+    fs->log_path = (char *) malloc(strlen(image) + sizeof(MUTATION_LOG_SUFFIX));
+    if (fs->log_path == NULL) {
+        return -1;
+    }
+    sprintf(fs->log_path, "%s%s", image, MUTATION_LOG_SUFFIX);
+
+    fd = open(fs->log_path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        printf("MutationLogOpen: open %s failed\n", fs->log_path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        goto end;
+    }
+
+    /* Only a log synced whole was followed by writes to the image */
+    stale = "is cut short";
+    if ((uint64_t)st.st_size < sizeof(struct MutationLogHeader) ||
+            PositionalRead(fd, (char *)&hdr, sizeof(struct MutationLogHeader), 0) != sizeof(struct MutationLogHeader) ||
+            SidecarStampCheck(fs, &(hdr.stamp), MUTATION_LOG_MAGIC, MUTATION_LOG_VERSION,
+                sizeof(struct MutationLogHeader), 0) == SIDECAR_FOREIGN) {
+        goto drop;
+    }
+    size = st.st_size - sizeof(struct MutationLogHeader);
+    if (hdr.count > size / sizeof(struct MutationLogRecord) ||
+            hdr.data_len != size - hdr.count * sizeof(struct MutationLogRecord)) {
+        goto drop;
+    }
+    body = (char *) malloc(size ? size : 1);
+    if (body == NULL) {
+        goto end;
+    }
+    if (PositionalRead(fd, body, size, sizeof(struct MutationLogHeader)) != size ||
+            Crc32c(~0U, body, size) != hdr.checksum) {
+        goto drop;
+    }
+    records = (struct MutationLogRecord *)body;
+    data = body + hdr.count * sizeof(struct MutationLogRecord);
+    for (i = 0, len = 0; i < hdr.count; i++) {
+        if (records[i].len > hdr.data_len - len || records[i].offset > fs->image_size ||
+                records[i].len > fs->image_size - records[i].offset) {
+            goto drop;
+        }
+        len += records[i].len;
+    }
+    if (len != hdr.data_len) {
+        goto drop;
+    }
+    /* The image file itself changed with the writes */
+    stale = "is of another filesystem or older than the last mount";
+    if (SidecarStampCheck(fs, &(hdr.stamp), MUTATION_LOG_MAGIC, MUTATION_LOG_VERSION, sizeof(struct MutationLogHeader),
+                SIDECAR_CHECK_SUPER) != SIDECAR_CURRENT || hdr.stamp.image_size != fs->image_size) {
+        goto drop;
+    }
+
+    for (i = 0; i < hdr.count; i++) {
+        if (PositionalWrite(fs->fd, data, records[i].len, records[i].offset) != records[i].len) {
+            printf("MutationLogOpen: write %llu bytes at %llu failed\n", records[i].len, records[i].offset);
+            goto end;
+        }
+        data += records[i].len;
+    }
+    if (fsync(fs->fd) < 0) {
+        printf("MutationLogOpen: sync failed\n");
+        goto end;
+    }
+    printf("MutationLogOpen: finished the commit logged in %s\n", fs->log_path);
+    stale = NULL;
+drop:
+    if (stale != NULL) {
+        printf("MutationLogOpen: %s %s, dropped\n", fs->log_path, stale);
+    }
+    if (unlink(fs->log_path) < 0) {
+        perror("MutationLogOpen: unlink");
+        goto end;
+    }
+    ret = (stale == NULL);
+end:
+    close(fd);
+    free(body);
+    return ret;
+}
+
+/*
+ * Apply the edits of one bitmap block, flipping bits and counting the
+ * change of the free count of its group
+ */
+static void MutationBitApply(struct MutationGroup *g, struct MutationEdit *e)
+{
+    uint8_t *byte = (uint8_t *)g->bitmap + e->offset / 8;
+    uint8_t bit = 1 << (e->offset % 8);
+
+    if (((*byte & bit) != 0) != (e->value != 0)) {
+        *byte ^= bit;
+        g->delta += e->value ? -1 : 1;
+    }
+    if (e->kind == MUTATION_INODE_BITMAP && e->value && e->offset + 1 > g->last_used) {
+        g->last_used = e->offset + 1;
+    }
+}
+
+/*
+ * Update the descriptors of the groups whose bitmaps changed, reading
+ * their descriptor blocks into descs and adding them to dirty
+ * Return how many descriptor blocks, -1 on failure
+ */
+static int64_t MutationDescriptorsUpdate(struct FileSystem *fs, struct MutationGroup *groups, uint64_t count,
+        char *descs, struct MutationBlock *dirty, int64_t *free_blocks, int64_t *free_inodes, uint64_t *checksums)
+{
+    struct ext4_group_desc *pdesc = NULL;
+    struct MutationGroup *g = NULL;
+    uint64_t i = 0, n = 0, index = 0, location = 0;
+    char *desc = NULL;
+
+    for (i = 0; i < count; i++) {
+        g = &groups[i];
+        if (n == 0 || g->group / fs->descriptor_per_block != index) {
+            index = g->group / fs->descriptor_per_block;
+            location = GroupDescriptorLocationGet(fs, index);
+            desc = descs + n * fs->block_size;
+            if (JournalOverlayCovers(fs, location * fs->block_size, fs->block_size) ||
+                    BlockRead(fs, location, 1, desc) == 0) {
+                printf("MutationDescriptorsUpdate: read descriptor block %llu at %llu failed\n", index, location);
+                return -1;
+            }
+            dirty[n].block = location;
+            dirty[n].data = desc;
+            n++;
+        }
+        pdesc = (struct ext4_group_desc *)(desc + (g->group % fs->descriptor_per_block) * fs->descriptor_size);
+        if (g->kind == MUTATION_BLOCK_BITMAP) {
+            FreeBlocksCountSet(fs, pdesc, FreeBlocksCountGet(fs, pdesc) + g->delta);
+            if (BlockBitmapChecksumSet(fs, pdesc, g->bitmap)) {
+                (*checksums)++;
+            }
+            *free_blocks += g->delta;
+        } else {
+            FreeInodesCountSet(fs, pdesc, FreeInodesCountGet(fs, pdesc) + g->delta);
+            /* Inodes in use must stay below the unused tail of the table */
+            if (g->last_used > fs->inodes_per_group - UnusedInodesCountGet(fs, pdesc)) {
+                UnusedInodesCountSet(fs, pdesc, fs->inodes_per_group - g->last_used);
+            }
+            if (InodeBitmapChecksumSet(fs, pdesc, g->bitmap)) {
+                (*checksums)++;
+            }
+            *free_inodes += g->delta;
+        }
+        if ((i + 1 == count || groups[i + 1].group != g->group) && DescriptorChecksumSet(fs, g->group, pdesc)) {
+            (*checksums)++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Write every staged edit. Edits are sorted and grouped by block, each
+ * dirty block is read once, edited, and its checksums recomputed once: one
+ * per inode, bitmap and descriptor. The free counts of the descriptors and
+ * the superblock follow the bits flipped. Runs of consecutive dirty blocks
+ * go out in one BytesWrite each, then one FileSystemSync, and everything
+ * cached is read again.
+ * A failed write may leave part of the edits written, use FS_OPEN_OVERLAY
+ * to rehearse.
+ * Must not run concurrently with any other call on fs.
+ * Return 0 on success, -1 on failure
+ */
+int MutationCommit(struct Mutation *tx)
+{
+    struct FileSystem *fs = tx->fs;
+    struct MutationBlock *dirty = NULL;
+    struct MutationGroup *groups = NULL, *g = NULL;
+    struct MutationEdit *e = NULL;
+    struct ext4_super_block sb;
+    struct timespec begin, end;
+    char *blocks = NULL, *descs = NULL, *io = NULL, *src = NULL;
+    uint64_t nblocks = 0, ngroups = 0, ndirty = 0;
+    uint64_t i = 0, n = 0, run = 0, count = 0;
+    int64_t ndescs = 0, free_blocks = 0, free_inodes = 0;
+    int ret = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    tx->blocks = 0;
+    tx->writes = 0;
+    tx->bytes = 0;
+    tx->checksums = 0;
+    if (tx->count == 0) {
+        return 0;
+    }
+    qsort(tx->edits, tx->count, sizeof(struct MutationEdit), MutationEditCompare);
+    for (i = 0; i < tx->count; i++) {
+        if (i == 0 || tx->edits[i].block != tx->edits[i - 1].block) {
+            nblocks++;
+        }
+    }
+    /* A descriptor block at most for each bitmap block */
+    blocks = (char *) malloc(nblocks * fs->block_size);
+    dirty = (struct MutationBlock *) calloc(nblocks * 2, sizeof(struct MutationBlock));
+    groups = (struct MutationGroup *) calloc(nblocks, sizeof(struct MutationGroup));
+    io = (char *) malloc(MUTATION_IO_BLOCKS * fs->block_size);
+    if (blocks == NULL || dirty == NULL || groups == NULL || io == NULL) {
+        printf("MutationCommit: out of memory for %llu blocks\n", nblocks);
+        goto end;
+    }
+
+    /* Read the dirty blocks, runs of consecutive blocks at once */
+    for (i = 0, n = 0; i < tx->count; i++) {
+        if (i == 0 || tx->edits[i].block != tx->edits[i - 1].block) {
+            dirty[n].block = tx->edits[i].block;
+            dirty[n].data = blocks + n * fs->block_size;
+            n++;
+        }
+    }
+    for (i = 0; i < nblocks; i += run) {
+        run = MutationRunGet(dirty, nblocks, i);
+        /* The journal copies would hide what is written */
+        if (JournalOverlayCovers(fs, dirty[i].block * fs->block_size, run * fs->block_size)) {
+            printf("MutationCommit: blocks %llu ~ %llu have journal copies over them\n",
+                    dirty[i].block, dirty[i].block + run - 1);
+            goto end;
+        }
+        if (BlockRead(fs, dirty[i].block, run, dirty[i].data) == 0) {
+            printf("MutationCommit: read blocks %llu ~ %llu failed\n", dirty[i].block, dirty[i].block + run - 1);
+            goto end;
+        }
+    }
+
+    /* Edit them, the checksum of an inode once after its last edit */
+    for (i = 0, n = 0; i < tx->count; i++) {
+        e = &(tx->edits[i]);
+        if (i > 0 && e->block != tx->edits[i - 1].block) {
+            n++;
+        }
+        if (e->kind == MUTATION_INODE) {
+            memcpy(dirty[n].data + e->offset, tx->data + e->data, e->len);
+            if ((i + 1 == tx->count || tx->edits[i + 1].block != e->block || tx->edits[i + 1].num != e->num) &&
+                    InodeChecksumSet(fs, e->num, (struct ext4_inode *)(dirty[n].data + e->start))) {
+                tx->checksums++;
+            }
+            continue;
+        }
+        if (ngroups == 0 || groups[ngroups - 1].bitmap != dirty[n].data) {
+            g = &groups[ngroups++];
+            g->group = e->group;
+            g->kind = e->kind;
+            g->bitmap = dirty[n].data;
+        }
+        MutationBitApply(g, e);
+    }
+
+    if (ngroups > 0) {
+        qsort(groups, ngroups, sizeof(struct MutationGroup), MutationGroupCompare);
+        descs = (char *) malloc(ngroups * fs->block_size);
+        if (descs == NULL) {
+            goto end;
+        }
+        ndescs = MutationDescriptorsUpdate(fs, groups, ngroups, descs, dirty + nblocks,
+                &free_blocks, &free_inodes, &tx->checksums);
+        if (ndescs < 0) {
+            goto end;
+        }
+    }
+    ndirty = nblocks + ndescs;
+    qsort(dirty, ndirty, sizeof(struct MutationBlock), MutationBlockCompare);
+
+    /*
+     * Only the free counts of the superblock change, on the superblock as
+     * it is now rather than the copy read at open
+     */
+    if (free_blocks != 0 || free_inodes != 0) {
+        if (JournalOverlayCovers(fs, 1024, sizeof(struct ext4_super_block))) {
+            printf("MutationCommit: the superblock has a journal copy over it\n");
+            goto end;
+        }
+        if (BytesRead(fs, 1024, sizeof(struct ext4_super_block), (char *)&sb) != sizeof(struct ext4_super_block)) {
+            printf("MutationCommit: read the superblock failed\n");
+            goto end;
+        }
+        count = le32toh(sb.s_free_blocks_count_lo);
+        if (HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_64BIT)) {
+            count |= (uint64_t)le32toh(sb.s_free_blocks_count_hi) << 32;
+        }
+        count += free_blocks * (int64_t)fs->cluster_block_ratio;
+        sb.s_free_blocks_count_lo = htole32(count & 0xFFFFFFFF);
+        if (HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_64BIT)) {
+            sb.s_free_blocks_count_hi = htole32(count >> 32);
+        }
+        sb.s_free_inodes_count = htole32(le32toh(sb.s_free_inodes_count) + free_inodes);
+        if (SuperBlockChecksumSet(fs, &sb)) {
+            tx->checksums++;
+        }
+    }
+
+    /* Without a delta the image itself is written, after the redo log */
+    if (fs->log_path != NULL &&
+            MutationLogWrite(fs, dirty, ndirty, (free_blocks != 0 || free_inodes != 0) ? &sb : NULL, io) < 0) {
+        printf("MutationCommit: write the log %s failed\n", fs->log_path);
+        goto end;
+    }
+
+    for (i = 0; i < ndirty; i += run) {
+        run = MutationRunGet(dirty, ndirty, i);
+        src = MutationRunData(fs, dirty, i, run, io);
+        if (BytesWrite(fs, dirty[i].block * fs->block_size, run * fs->block_size, src) != run * fs->block_size) {
+            printf("MutationCommit: write blocks %llu ~ %llu failed\n", dirty[i].block, dirty[i].block + run - 1);
+            goto end;
+        }
+        tx->writes++;
+        tx->bytes += run * fs->block_size;
+    }
+
+    if (free_blocks != 0 || free_inodes != 0) {
+        if (BytesWrite(fs, 1024, sizeof(struct ext4_super_block), (char *)&sb) != sizeof(struct ext4_super_block)) {
+            printf("MutationCommit: write the superblock failed\n");
+            goto end;
+        }
+        tx->writes++;
+        tx->bytes += sizeof(struct ext4_super_block);
+    }
+
+    if (FileSystemSync(fs) < 0) {
+        printf("MutationCommit: sync failed\n");
+        goto end;
+    }
+    /* A crash before this finishes the commit again on the next open */
+    if (fs->log_path != NULL && unlink(fs->log_path) < 0) {
+        perror("MutationCommit: unlink");
+        goto end;
+    }
+    tx->blocks = ndirty;
+    ret = 0;
+end:
+    /* What is cached is stale now, even after a partial write */
+    if (tx->writes > 0 && FileSystemReload(fs) < 0) {
+        ret = -1;
+    }
+    free(blocks);
+    free(descs);
+    free(dirty);
+    free(groups);
+    free(io);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    tx->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return ret;
+}
+
+void MutationPrint(struct Mutation *tx)
+{
+    printf("%llu edits, %llu dirty blocks in %llu writes, %llu bytes, %llu checksums, %.3f seconds\n",
+            tx->count, tx->blocks, tx->writes, tx->bytes, tx->checksums, tx->seconds);
+}
@@ -0,0 +1,89 @@
+#ifndef MUTATE_H
+#define MUTATE_H
+
+#include "filesystem.h"
+#include "sidecar.h"
+
+/* Kinds of staged edits */
+#define MUTATION_INODE          0   /* bytes of an inode */
+#define MUTATION_INODE_BITMAP   1   /* the bit of an inode */
+#define MUTATION_BLOCK_BITMAP   2   /* the bit of a block, or of its cluster */
+
+/* Most dirty blocks read or written at once */
+#define MUTATION_IO_BLOCKS      256
+
+/* The redo log of MutationCommit is kept next to the image */
+#define MUTATION_LOG_SUFFIX     ".lsfslog"
+#define MUTATION_LOG_MAGIC      "LSFSMLOG"
+#define MUTATION_LOG_VERSION    1
+
+struct MutationEdit {
+    uint64_t block;     /* filesystem block edited */
+    uint64_t num;       /* inode or block number */
+    uint64_t seq;       /* staging order, a later edit of the same bytes wins */
+    uint64_t data;      /* offset of the new bytes in the data of the transaction */
+    uint32_t offset;    /* first byte edited within the block, or the bit */
+    uint32_t len;       /* bytes, 0 for bits */
+    uint32_t start;     /* of the inode within the block */
+    uint32_t group;
+    uint8_t kind;       /* MUTATION_* */
+    uint8_t value;      /* of the bit */
+};
+
+/*
+ * Header of the redo log, the records follow and then their data in
+ * record order. The superblock times of the stamp are those at commit, a
+ * mount since changes them and the log is stale then.
+ */
+struct MutationLogHeader {
+    struct SidecarStamp stamp;
+    uint64_t count;         /* records */
+    uint64_t data_len;
+    uint32_t checksum;      /* crc32c of the records and the data */
+    uint32_t reserved;
+};
+
+struct MutationLogRecord {
+    uint64_t offset;        /* in the image */
+    uint64_t len;
+};
+
+/*
+ * Edits staged by one caller and written together by MutationCommit. The
+ * staging functions only record, nothing is read or written until then.
+ * A transaction is not shared between threads.
+ *
+ * Without a delta every block of a commit is first written to the redo
+ * log and synced, then written in place, and the log removed once the
+ * image is synced. A commit cut short by a crash is finished by
+ * FileSystemInit on the next open, a log cut short itself is dropped and
+ * the image was not touched. The kernel does not know the log: the image
+ * must not be mounted while lsfs writes it, nor between a crash and the
+ * next open by lsfs, which drops a log older than the last mount.
+ */
+struct Mutation {
+    struct FileSystem *fs;
+    struct MutationEdit *edits;
+    uint64_t count;
+    uint64_t capacity;
+    char *data;
+    uint64_t data_len;
+    uint64_t data_capacity;
+    /* What MutationCommit did */
+    uint64_t blocks;        /* dirty blocks, descriptor blocks included */
+    uint64_t writes;        /* BytesWrite calls */
+    uint64_t bytes;         /* written */
+    uint64_t checksums;     /* recomputed, one per dirty inode, bitmap and descriptor */
+    double seconds;
+};
+
+void MutationInit(struct FileSystem *, struct Mutation *);
+void MutationRelease(struct Mutation *);
+int MutationInodeStage(struct Mutation *, uint64_t, uint64_t, uint64_t, const void *);
+int MutationInodeBitmapStage(struct Mutation *, uint64_t, bool);
+int MutationBlockBitmapStage(struct Mutation *, uint64_t, bool);
+int MutationCommit(struct Mutation *);
+int MutationLogOpen(struct FileSystem *, const char *);
+void MutationPrint(struct Mutation *);
+
+#endif /* MUTATE_H */
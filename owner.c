@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#include "owner.h"
+#include "scan.h"
+#include "extent.h"
+#include "indirect.h"
+#include "workpool.h"
+
+/*
+ * Runs found by one worker, only it appends so no lock is needed
+ */
+struct OwnerWorker {
+    struct BlockOwnerRun *runs;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t inodes;
+    uint64_t blocks;
+    uint64_t errors;
+};
+
+struct OwnerContext {
+    struct FileSystem *fs;
+    char **bufs;
+    struct OwnerWorker *workers;
+};
+
+static int OwnerRunAdd(struct OwnerWorker *w, uint64_t start, uint32_t len, uint32_t inode,
+        uint32_t logical, uint32_t flags)
+{
+    struct BlockOwnerRun *run = NULL;
+
+    if (ArrayReserve((void **)&w->runs, &w->capacity, w->count, sizeof(struct BlockOwnerRun), 1) < 0) {
+        return -1;
+    }
+    run = &(w->runs[w->count++]);
+    run->start = start;
+    run->len = len;
+    run->inode = inode;
+    run->logical = logical;
+    run->flags = flags;
+    w->blocks += len;
+    return 0;
+}
+
+/*
+ * InodeScanFunc adding the data, tree and xattr blocks of an inode
+ */
+static int OwnerInodeAdd(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode, void *arg)
+{
+    struct OwnerWorker *w = (struct OwnerWorker *)arg;
+    struct ExtentMap map;
+    struct ExtentRecord *rec = NULL;
+    uint64_t acl = 0, size = 0, i = 0, j = 0, before = w->count;
+    uint32_t flags = le32toh(pinode->i_flags);
+    uint16_t mode = le16toh(pinode->i_mode) & 0xF000;
+    int ret = 0;
+
+    acl = (uint64_t)le32toh(pinode->i_file_acl_lo) | (uint64_t)le16toh(pinode->osd2.linux2.l_i_file_acl_high) << 32;
+    if (acl != 0 && acl < fs->block_count && OwnerRunAdd(w, acl, 1, num, 0, OWNER_RUN_XATTR) < 0) {
+        return -1;
+    }
+
+    /* Only regular files, directories and slow symlinks have data blocks */
+    size = (uint64_t)le32toh(pinode->i_size_lo) | (uint64_t)le32toh(pinode->i_size_high) << 32;
+    if ((mode != 0x8000 && mode != 0x4000 && mode != 0xA000) || (flags & EXT4_INLINE_DATA_FL) ||
+            (mode == 0xA000 && !(flags & EXT4_EXTENTS_FL) && size < sizeof(pinode->i_block))) {
+        goto end;
+    }
+
+    if (flags & EXT4_EXTENTS_FL) {
+        ret = ExtentMapBuild(fs, num, pinode, &map);
+    } else {
+        ret = IndirectMapBuild(fs, num, pinode, &map);
+    }
+    if (ret < 0) {
+        w->errors++;
+        goto end;
+    }
+    for (i = 0; i < map.count; i++) {
+        rec = &(map.records[i]);
+        if (OwnerRunAdd(w, rec->physical, EXTENT_RECORD_LEN(rec), num, rec->logical,
+                    (rec->len & EXTENT_RECORD_UNWRITTEN) ? OWNER_RUN_UNWRITTEN : 0) < 0) {
+            ExtentMapRelease(&map);
+            return -1;
+        }
+    }
+    /* Pointer blocks sit next to each other often enough to be worth joining */
+    for (i = 0; i < map.meta_count; i = j) {
+        for (j = i + 1; j < map.meta_count && map.meta[j] == map.meta[j - 1] + 1 && j - i < UINT32_MAX; j++) {
+        }
+        if (OwnerRunAdd(w, map.meta[i], j - i, num, 0, OWNER_RUN_METADATA) < 0) {
+            ExtentMapRelease(&map);
+            return -1;
+        }
+    }
+    ExtentMapRelease(&map);
+end:
+    if (w->count > before) {
+        w->inodes++;
+    }
+    return 0;
+}
+
+static int OwnerWork(struct WorkPool *pool, int worker, uint64_t group, void *data)
+{
+    struct OwnerContext *ctx = (struct OwnerContext *)data;
+
+    return InodeScanGroup(ctx->fs, group, SCAN_INUSE_ONLY, ctx->bufs[worker], OwnerInodeAdd, &ctx->workers[worker]);
+}
+
+static int OwnerRunCompare(const void *a, const void *b)
+{
+    const struct BlockOwnerRun *x = (const struct BlockOwnerRun *)a;
+    const struct BlockOwnerRun *y = (const struct BlockOwnerRun *)b;
+
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    if (x->inode != y->inode) {
+        return x->inode < y->inode ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Fill max_end from the sorted runs
+ */
+static int OwnerMapIndex(struct BlockOwnerMap *map)
+{
+    uint64_t i = 0, end = 0;
+
+    map->max_end = (uint64_t *) malloc(sizeof(uint64_t) * (map->count ? map->count : 1));
+    if (map->max_end == NULL) {
+        return -1;
+    }
+    for (i = 0; i < map->count; i++) {
+        if (map->runs[i].start + map->runs[i].len > end) {
+            end = map->runs[i].start + map->runs[i].len;
+        }
+        map->max_end[i] = end;
+    }
+    return 0;
+}
+
+/*
+ * Build the map of which inode owns which block from the block maps of
+ * all inodes in use. Groups are spread over a pool of workers, each
+ * scanning the inode tables of its groups into its own run array; the
+ * arrays are joined and sorted by physical block once all are done.
+ * @fs: FileSystem
+ * @nr_workers: threads, 0 for one per CPU
+ * @map: filled in, released by BlockOwnerMapRelease
+ * Return 0 on success, -1 on failure. Inodes whose block map is corrupt
+ * are counted in map->errors and left out.
+ */
+int BlockOwnerMapBuild(struct FileSystem *fs, int nr_workers, struct BlockOwnerMap *map)
+{
+    struct OwnerContext ctx;
+    struct timespec begin, end;
+    uint64_t *groups = NULL;
+    uint64_t i = 0, count = 0;
+    int w = 0;
+    int ret = -1;
+
+    if (fs == NULL || map == NULL) {
+        return -1;
+    }
+    memset(map, 0, sizeof(struct BlockOwnerMap));
+    memset(&ctx, 0, sizeof(struct OwnerContext));
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    nr_workers = WorkPoolWorkersGet(nr_workers);
+    if ((uint64_t)nr_workers > fs->group_count) {
+        nr_workers = fs->group_count;
+    }
+    if (GroupDescriptorsFetch(fs) == (uint64_t)-1) {
+        return -1;
+    }
+    ctx.fs = fs;
+    ctx.bufs = (char **) calloc(nr_workers, sizeof(char *));
+    ctx.workers = (struct OwnerWorker *) calloc(nr_workers, sizeof(struct OwnerWorker));
+    groups = (uint64_t *) malloc(sizeof(uint64_t) * fs->group_count);
+    if (ctx.bufs == NULL || ctx.workers == NULL || groups == NULL) {
+        printf("BlockOwnerMapBuild: allocate memory failed\n");
+        goto end;
+    }
+    for (w = 0; w < nr_workers; w++) {
+        ctx.bufs[w] = (char *) malloc(InodeScanBufferSizeGet(fs));
+        if (ctx.bufs[w] == NULL) {
+            printf("BlockOwnerMapBuild: allocate memory failed\n");
+            goto end;
+        }
+    }
+    for (i = 0; i < fs->group_count; i++) {
+        groups[i] = i;
+    }
+
+    if (WorkPoolRun(nr_workers, groups, fs->group_count, OwnerWork, &ctx) != 0) {
+        printf("BlockOwnerMapBuild: inode scan failed\n");
+        goto end;
+    }
+
+    for (w = 0; w < nr_workers; w++) {
+        count += ctx.workers[w].count;
+    }
+    map->runs = (struct BlockOwnerRun *) malloc(sizeof(struct BlockOwnerRun) * (count ? count : 1));
+    if (map->runs == NULL) {
+        printf("BlockOwnerMapBuild: allocate memory failed\n");
+        goto end;
+    }
+    for (w = 0; w < nr_workers; w++) {
+        memcpy(map->runs + map->count, ctx.workers[w].runs, sizeof(struct BlockOwnerRun) * ctx.workers[w].count);
+        map->count += ctx.workers[w].count;
+        map->inodes += ctx.workers[w].inodes;
+        map->blocks += ctx.workers[w].blocks;
+        map->errors += ctx.workers[w].errors;
+    }
+    qsort(map->runs, map->count, sizeof(struct BlockOwnerRun), OwnerRunCompare);
+    if (OwnerMapIndex(map) < 0) {
+        printf("BlockOwnerMapBuild: allocate memory failed\n");
+        goto end;
+    }
+    ret = 0;
+end:
+    if (ctx.bufs != NULL) {
+        for (w = 0; w < nr_workers; w++) {
+            free(ctx.bufs[w]);
+        }
+    }
+    if (ctx.workers != NULL) {
+        for (w = 0; w < nr_workers; w++) {
+            free(ctx.workers[w].runs);
+        }
+    }
+    free(ctx.bufs);
+    free(ctx.workers);
+    free(groups);
+    if (ret < 0) {
+        BlockOwnerMapRelease(map);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    map->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return ret;
+}
+
+void BlockOwnerMapRelease(struct BlockOwnerMap *map)
+{
+    if (map == NULL) {
+        return;
+    }
+    free(map->runs);
+    free(map->max_end);
+    map->runs = NULL;
+    map->max_end = NULL;
+    map->count = 0;
+}
+
+/*
+ * Find the runs touching blocks [start, end)
+ * @runs: filled with indexes into map->runs in ascending order, at most max
+ * Return how many runs touch the range, which may be more than max
+ */
+uint64_t BlockOwnerRangeGet(struct BlockOwnerMap *map, uint64_t start, uint64_t end, uint64_t *runs, uint64_t max)
+{
+    uint64_t low = 0, high = 0, mid = 0, found = 0, i = 0, tmp = 0;
+
+    if (map == NULL || map->count == 0 || start >= end) {
+        return 0;
+    }
+    /* low is the first run starting at or after end, runs before it may touch */
+    high = map->count;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (map->runs[mid].start < end) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (i = low; i > 0 && map->max_end[i - 1] > start; i--) {
+        if (map->runs[i - 1].start + map->runs[i - 1].len > start) {
+            if (found < max) {
+                runs[found] = i - 1;
+            }
+            found++;
+        }
+    }
+
+    max = found < max ? found : max;
+    for (i = 0; i < max / 2; i++) {
+        tmp = runs[i];
+        runs[i] = runs[max - 1 - i];
+        runs[max - 1 - i] = tmp;
+    }
+    return found;
+}
+
+static int FileWrite(int fd, const void *buf, uint64_t len)
+{
+    const char *p = (const char *)buf;
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int FileRead(int fd, void *buf, uint64_t len)
+{
+    char *p = (char *)buf;
+    ssize_t n = 0;
+
+    while (len > 0) {
+        n = read(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int OwnerMapHeaderFill(struct FileSystem *fs, struct BlockOwnerMapHeader *hdr)
+{
+    memset(hdr, 0, sizeof(struct BlockOwnerMapHeader));
+    if (SidecarStampFill(fs, OWNER_MAP_MAGIC, OWNER_MAP_VERSION, sizeof(struct BlockOwnerMapHeader),
+                &(hdr->stamp)) < 0) {
+        return -1;
+    }
+    hdr->run_size = sizeof(struct BlockOwnerRun);
+    hdr->block_count = fs->block_count;
+    return 0;
+}
+
+/*
+ * Save the map next to the image, written to a temporary file renamed
+ * over path so a reader never sees half of it
+ * Return 0 on success, -1 on failure
+ */
+int BlockOwnerMapSave(struct FileSystem *fs, struct BlockOwnerMap *map, const char *path)
+{
+    struct BlockOwnerMapHeader hdr;
+    char *tmp = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (fs == NULL || map == NULL || path == NULL) {
+        return -1;
+    }
+    if (OwnerMapHeaderFill(fs, &hdr) < 0) {
+        return -1;
+    }
+    hdr.count = map->count;
+    hdr.inodes = map->inodes;
+    hdr.blocks = map->blocks;
+    hdr.errors = map->errors;
+
+    tmp = (char *) malloc(strlen(path) + 5);
+    if (tmp == NULL) {
+        return -1;
+    }
+    sprintf(tmp, "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("BlockOwnerMapSave: open");
+        goto end;
+    }
+    if (FileWrite(fd, &hdr, sizeof(hdr)) < 0 ||
+            FileWrite(fd, map->runs, sizeof(struct BlockOwnerRun) * map->count) < 0 || fsync(fd) < 0) {
+        perror("BlockOwnerMapSave: write");
+        goto end;
+    }
+    close(fd);
+    fd = -1;
+    if (rename(tmp, path) < 0) {
+        perror("BlockOwnerMapSave: rename");
+        goto end;
+    }
+    ret = 0;
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (ret < 0) {
+        unlink(tmp);
+    }
+    free(tmp);
+    return ret;
+}
+
+/*
+ * Load a map saved by BlockOwnerMapSave
+ * Return 0 on success, -1 if the file cannot be read or was saved for
+ * another filesystem or before the filesystem was last written
+ */
+int BlockOwnerMapLoad(struct FileSystem *fs, const char *path, struct BlockOwnerMap *map)
+{
+    struct BlockOwnerMapHeader hdr;
+    struct timespec begin, end;
+    struct stat st;
+    int fd = -1;
+    int ret = -1;
+    int status = 0;
+
+    if (fs == NULL || path == NULL || map == NULL) {
+        return -1;
+    }
+    memset(map, 0, sizeof(struct BlockOwnerMap));
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (FileRead(fd, &hdr, sizeof(hdr)) < 0) {
+        goto end;
+    }
+    status = SidecarStampCheck(fs, &(hdr.stamp), OWNER_MAP_MAGIC, OWNER_MAP_VERSION, sizeof(struct BlockOwnerMapHeader),
+            SIDECAR_CHECK_SUPER);
+    if (status == SIDECAR_FOREIGN || hdr.run_size != sizeof(struct BlockOwnerRun)) {
+        printf("BlockOwnerMapLoad: %s is not an owner map of this version\n", path);
+        goto end;
+    }
+    if (status != SIDECAR_CURRENT || hdr.block_count != fs->block_count) {
+        printf("BlockOwnerMapLoad: %s is stale\n", path);
+        goto end;
+    }
+    /* The runs must fill the rest of the file exactly before they are allocated */
+    if (fstat(fd, &st) < 0 || hdr.count > ((uint64_t)-1 - sizeof(hdr)) / sizeof(struct BlockOwnerRun) ||
+            sizeof(hdr) + hdr.count * sizeof(struct BlockOwnerRun) != (uint64_t)st.st_size) {
+        printf("BlockOwnerMapLoad: %s is truncated or corrupt\n", path);
+        goto end;
+    }
+
+    map->runs = (struct BlockOwnerRun *) malloc(sizeof(struct BlockOwnerRun) * (hdr.count ? hdr.count : 1));
+    if (map->runs == NULL || FileRead(fd, map->runs, sizeof(struct BlockOwnerRun) * hdr.count) < 0) {
+        printf("BlockOwnerMapLoad: read %s failed\n", path);
+        goto end;
+    }
+    map->count = hdr.count;
+    map->inodes = hdr.inodes;
+    map->blocks = hdr.blocks;
+    map->errors = hdr.errors;
+    if (OwnerMapIndex(map) < 0) {
+        goto end;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    map->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    ret = 0;
+end:
+    close(fd);
+    if (ret < 0) {
+        BlockOwnerMapRelease(map);
+    }
+    return ret;
+}
+
+void BlockOwnerMapPrint(struct BlockOwnerMap *map)
+{
+    printf("%llu runs, %llu inodes, %llu blocks, %llu unreadable, %.3f s\n",
+            map->count, map->inodes, map->blocks, map->errors, map->seconds);
+}
@@ -0,0 +1,62 @@
+#ifndef OWNER_H
+#define OWNER_H
+
+#include "filesystem.h"
+#include "sidecar.h"
+
+/* BlockOwnerRun flags */
+#define OWNER_RUN_UNWRITTEN     0x0001  /* preallocated, reads as zeros */
+#define OWNER_RUN_XATTR         0x0002  /* extended attribute block, may be shared */
+#define OWNER_RUN_METADATA      0x0004  /* extent tree node or indirect pointer blocks */
+
+/* Saved owner maps start with this and are refused by other versions */
+#define OWNER_MAP_MAGIC         "LSFSOWNR"
+#define OWNER_MAP_VERSION       2
+
+/*
+ * Physical blocks [start, start + len) hold logical blocks from logical of
+ * inode. Runs of different inodes only overlap on shared xattr blocks or
+ * a corrupted filesystem.
+ */
+struct BlockOwnerRun {
+    uint64_t start;
+    uint32_t len;
+    uint32_t inode;
+    uint32_t logical;
+    uint32_t flags;     /* OWNER_RUN_* */
+};
+
+/*
+ * Runs sorted by start. max_end[i] is the largest end of runs 0 ~ i, which
+ * bounds how far back a search for runs covering a block has to go.
+ */
+struct BlockOwnerMap {
+    uint64_t count;
+    struct BlockOwnerRun *runs;
+    uint64_t *max_end;
+    uint64_t inodes;    /* inodes with at least one block */
+    uint64_t blocks;    /* blocks in all runs */
+    uint64_t errors;    /* inodes whose block map could not be read */
+    double seconds;
+};
+
+/* Header of a saved owner map, the runs follow */
+struct BlockOwnerMapHeader {
+    struct SidecarStamp stamp;  /* its superblock times tell a stale map */
+    uint32_t run_size;
+    uint32_t reserved;
+    uint64_t block_count;
+    uint64_t count;
+    uint64_t inodes;
+    uint64_t blocks;
+    uint64_t errors;
+};
+
+int BlockOwnerMapBuild(struct FileSystem *, int, struct BlockOwnerMap *);
+void BlockOwnerMapRelease(struct BlockOwnerMap *);
+uint64_t BlockOwnerRangeGet(struct BlockOwnerMap *, uint64_t, uint64_t, uint64_t *, uint64_t);
+int BlockOwnerMapSave(struct FileSystem *, struct BlockOwnerMap *, const char *);
+int BlockOwnerMapLoad(struct FileSystem *, const char *, struct BlockOwnerMap *);
+void BlockOwnerMapPrint(struct BlockOwnerMap *);
+
+#endif /* OWNER_H */
@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "path.h"
+#include "dir.h"
+#include "extent.h"
+
+/*
+ * Set up the dentry cache of the FileSystem
+ * @fs: FileSystem
+ * @capacity: how many names are kept at most, 0 for DENTRY_CACHE_ENTRIES
+ */
+int DentryCacheInit(struct FileSystem *fs, uint64_t capacity)
+{
+    struct DentryCache *cache = NULL;
+
+    if (fs == NULL) {
+        return -1;
+    }
+    if (capacity == 0) {
+        capacity = DENTRY_CACHE_ENTRIES;
+    }
+
+    cache = (struct DentryCache *) calloc(1, sizeof(struct DentryCache));
+    if (cache == NULL) {
+        return -1;
+    }
+    cache->capacity = capacity;
+    cache->bucket_count = capacity * 2;
+    cache->buckets = (struct DentryCacheEntry **) calloc(cache->bucket_count, sizeof(struct DentryCacheEntry *));
+    if (cache->buckets == NULL) {
+        free(cache);
+        return -1;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+
+    fs->dentry_cache = cache;
+    return 0;
+}
+
+static void DentryCacheClear(struct DentryCache *cache)
+{
+    struct LruNode *node = NULL, *next = NULL;
+
+    for (node = cache->lru.head; node != NULL; node = next) {
+        next = node->next;
+        free(LRU_ENTRY(node, struct DentryCacheEntry, lru));
+    }
+    memset(cache->buckets, 0, sizeof(struct DentryCacheEntry *) * cache->bucket_count);
+    cache->lru.head = NULL;
+    cache->lru.tail = NULL;
+    cache->count = 0;
+}
+
+void DentryCacheRelease(struct FileSystem *fs)
+{
+    struct DentryCache *cache = NULL;
+
+    if (fs == NULL || fs->dentry_cache == NULL) {
+        return;
+    }
+    cache = fs->dentry_cache;
+    DentryCacheClear(cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+    fs->dentry_cache = NULL;
+}
+
+/*
+ * Forget every name, for callers that changed directories
+ */
+void DentryCacheInvalidate(struct FileSystem *fs)
+{
+    if (fs == NULL || fs->dentry_cache == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&fs->dentry_cache->lock);
+    DentryCacheClear(fs->dentry_cache);
+    pthread_mutex_unlock(&fs->dentry_cache->lock);
+}
+
+void DentryCachePrint(struct FileSystem *fs)
+{
+    struct DentryCache *cache = fs->dentry_cache;
+
+    if (cache == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    printf("Dentry cache: %llu/%llu entries, %llu hits (%llu negative), %llu misses, %llu evictions\n",
+            cache->count, cache->capacity, cache->hits, cache->negative_hits, cache->misses, cache->evictions);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * FNV-1a of the name, mixed with the parent
+ */
+static uint64_t DentryHash(struct DentryCache *cache, uint64_t parent, const char *name, uint32_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (parent * 0x9E3779B97F4A7C15ULL);
+    uint32_t i = 0;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return (hash ^ (hash >> 29)) % cache->bucket_count;
+}
+
+static struct DentryCacheEntry *EntryLookup(struct DentryCache *cache, uint64_t parent, const char *name, uint32_t len)
+{
+    struct DentryCacheEntry *entry = cache->buckets[DentryHash(cache, parent, name, len)];
+
+    while (entry != NULL &&
+            (entry->parent != parent || entry->name_len != len || memcmp(entry->name, name, len) != 0)) {
+        entry = entry->hnext;
+    }
+    return entry;
+}
+
+static bool EntryDrop(struct LruNode *node, void *arg)
+{
+    struct DentryCache *cache = (struct DentryCache *)arg;
+    struct DentryCacheEntry *entry = LRU_ENTRY(node, struct DentryCacheEntry, lru);
+    struct DentryCacheEntry **pp = NULL;
+
+    pp = &(cache->buckets[DentryHash(cache, entry->parent, entry->name, entry->name_len)]);
+    while (*pp != NULL && *pp != entry) {
+        pp = &((*pp)->hnext);
+    }
+    if (*pp != NULL) {
+        *pp = entry->hnext;
+    }
+    LruRemove(&cache->lru, &entry->lru);
+    cache->count--;
+    free(entry);
+    return true;
+}
+
+/*
+ * Drop the least recently used names until there is room for one more,
+ * caller holds cache->lock
+ */
+static void CacheEvict(struct DentryCache *cache)
+{
+    cache->evictions += LruEvict(&cache->lru, &cache->count, cache->capacity, EntryDrop, cache);
+}
+
+/*
+ * Look a name up in a directory through the dentry cache, names that do
+ * not exist are remembered too
+ * @fs: FileSystem
+ * @parent: inode number of the directory
+ * @name, @len: the name, not NUL terminated
+ * @file_type: EXT4_FT_* of the entry, may be NULL
+ * Return the inode number, 0 if the name does not exist, (uint64_t)-1 if
+ * the directory cannot be read, which is not cached
+ */
+uint64_t DentryLookup(struct FileSystem *fs, uint64_t parent, const char *name, uint32_t len, uint8_t *file_type)
+{
+    struct DentryCache *cache = NULL;
+    struct DentryCacheEntry *entry = NULL;
+    uint64_t child = 0, bucket = 0;
+    uint8_t type = EXT4_FT_UNKNOWN;
+
+    if (fs == NULL || name == NULL || len == 0 || len > EXT4_NAME_LEN) {
+        return 0;
+    }
+    cache = fs->dentry_cache;
+    if (cache == NULL) {
+        return DirLookup(fs, parent, name, len, file_type);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    entry = EntryLookup(cache, parent, name, len);
+    if (entry != NULL) {
+        cache->hits++;
+        if (entry->child == 0) {
+            cache->negative_hits++;
+        }
+        LruTouch(&cache->lru, &entry->lru);
+        child = entry->child;
+        if (file_type != NULL) {
+            *file_type = entry->file_type;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return child;
+    }
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    /* Look up without the lock, a racing lookup of the same name inserts first */
+    child = DirLookup(fs, parent, name, len, &type);
+    if (file_type != NULL) {
+        *file_type = type;
+    }
+    if (child == (uint64_t)-1) {
+        return child;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if (EntryLookup(cache, parent, name, len) == NULL) {
+        CacheEvict(cache);
+        entry = (struct DentryCacheEntry *) malloc(sizeof(struct DentryCacheEntry) + len);
+        if (entry != NULL) {
+            memset(entry, 0, sizeof(struct DentryCacheEntry));
+            entry->parent = parent;
+            entry->child = child;
+            entry->file_type = type;
+            entry->name_len = len;
+            memcpy(entry->name, name, len);
+            bucket = DentryHash(cache, parent, name, len);
+            entry->hnext = cache->buckets[bucket];
+            cache->buckets[bucket] = entry;
+            LruPushFront(&cache->lru, &entry->lru);
+            cache->count++;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return child;
+}
+
+/*
+ * Read the target of a symbolic link, NUL terminated
+ * Return its length, -1 on failure
+ */
+static int64_t SymlinkRead(struct FileSystem *fs, uint64_t num, char *buf, uint64_t size)
+{
+    struct ext4_inode inode;
+    struct ExtentMap *map = NULL;
+    char *block = NULL;
+    uint64_t len = 0, physical = 0;
+
+    if (InodeGetBynum(fs, num, &inode) == 0 || (le16toh(inode.i_mode) & 0xF000) != 0xA000) {
+        return -1;
+    }
+    len = (uint64_t)le32toh(inode.i_size_lo) | (uint64_t)le32toh(inode.i_size_high) << 32;
+    if (len == 0 || len >= size || len > fs->block_size) {
+        return -1;
+    }
+
+    /* Fast symlinks and inline data keep the target in i_block */
+    if ((len < sizeof(inode.i_block) && !(le32toh(inode.i_flags) & EXT4_EXTENTS_FL)) ||
+            (le32toh(inode.i_flags) & EXT4_INLINE_DATA_FL)) {
+        if (len > sizeof(inode.i_block)) {
+            return -1;
+        }
+        memcpy(buf, inode.i_block, len);
+        buf[len] = '\0';
+        return len;
+    }
+
+    map = ExtentMapGet(fs, num);
+    if (map == NULL) {
+        return -1;
+    }
+    physical = ExtentPhysicalGet(map, 0);
+    ExtentMapPut(fs, num);
+    block = (char *) malloc(fs->block_size);
+    if (physical == 0 || block == NULL || BlockRead(fs, physical, 1, block) == 0) {
+        free(block);
+        return -1;
+    }
+    memcpy(buf, block, len);
+    buf[len] = '\0';
+    free(block);
+    return len;
+}
+
+/*
+ * Resolve an absolute path to an inode number, starting at EXT4_ROOT_INO.
+ * Names are looked up through the dentry cache, so resolving paths under
+ * a prefix already walked costs no I/O. Symbolic links are followed in
+ * the middle of the path but not at its end, like lstat.
+ * @fs: FileSystem
+ * @path: the path, relative paths are taken from the root too
+ * Return the inode number, 0 if the path does not resolve
+ */
+uint64_t PathResolve(struct FileSystem *fs, const char *path)
+{
+    char *work = NULL, *next = NULL, *name = NULL, *rest = NULL;
+    char target[EXT4_NAME_LEN * 16 + 1];
+    uint64_t cur = EXT4_ROOT_INO, child = 0, len = 0;
+    uint32_t name_len = 0, links = 0;
+    uint8_t type = EXT4_FT_UNKNOWN;
+    struct ext4_inode inode;
+    int64_t target_len = 0;
+
+    if (fs == NULL || path == NULL) {
+        return 0;
+    }
+    work = strdup(path);
+    if (work == NULL) {
+        return 0;
+    }
+
+    rest = work;
+    while (true) {
+        while (*rest == '/') {
+            rest++;
+        }
+        if (*rest == '\0') {
+            break;
+        }
+        name = rest;
+        while (*rest != '/' && *rest != '\0') {
+            rest++;
+        }
+        name_len = rest - name;
+        while (*rest == '/') {
+            rest++;
+        }
+        if (name_len == 1 && name[0] == '.') {
+            continue;
+        }
+
+        child = DentryLookup(fs, cur, name, name_len, &type);
+        if (child == 0 || child == (uint64_t)-1) {
+            cur = 0;
+            break;
+        }
+        if (*rest == '\0') {
+            cur = child;
+            break;
+        }
+
+        if (type == EXT4_FT_UNKNOWN && InodeGetBynum(fs, child, &inode) != 0 &&
+                (le16toh(inode.i_mode) & 0xF000) == 0xA000) {
+            type = EXT4_FT_SYMLINK;
+        }
+        if (type != EXT4_FT_SYMLINK) {
+            cur = child;
+            continue;
+        }
+
+        /* Go on with the target followed by the rest of the path */
+        if (++links > PATH_MAX_SYMLINKS) {
+            cur = 0;
+            break;
+        }
+        target_len = SymlinkRead(fs, child, target, sizeof(target));
+        if (target_len < 0) {
+            cur = 0;
+            break;
+        }
+        len = strlen(rest);
+        next = (char *) malloc(target_len + 1 + len + 1);
+        if (next == NULL) {
+            cur = 0;
+            break;
+        }
+        memcpy(next, target, target_len);
+        next[target_len] = '/';
+        memcpy(next + target_len + 1, rest, len + 1);
+        free(work);
+        work = next;
+        rest = work;
+        if (target[0] == '/') {
+            cur = EXT4_ROOT_INO;
+        }
+    }
+
+    free(work);
+    return cur;
+}
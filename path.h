@@ -0,0 +1,47 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include "filesystem.h"
+#include "lru.h"
+
+/* Default number of names kept by the dentry cache */
+#define DENTRY_CACHE_ENTRIES    65536
+
+/* Most symbolic links followed while resolving one path, as the kernel */
+#define PATH_MAX_SYMLINKS       40
+
+/*
+ * A name in a directory, child is 0 for a name known not to exist
+ */
+struct DentryCacheEntry {
+    uint64_t parent;
+    uint64_t child;
+    uint8_t file_type;
+    uint8_t name_len;
+    struct LruNode lru;             /* most recently used first */
+    struct DentryCacheEntry *hnext; /* hash chain */
+    char name[];
+};
+
+struct DentryCache {
+    pthread_mutex_t lock;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t bucket_count;
+    struct DentryCacheEntry **buckets;
+    struct LruList lru;
+    uint64_t hits;
+    uint64_t negative_hits;     /* hits on names known not to exist */
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+int DentryCacheInit(struct FileSystem *, uint64_t);
+void DentryCacheRelease(struct FileSystem *);
+void DentryCachePrint(struct FileSystem *);
+void DentryCacheInvalidate(struct FileSystem *);
+uint64_t DentryLookup(struct FileSystem *, uint64_t, const char *, uint32_t, uint8_t *);
+
+uint64_t PathResolve(struct FileSystem *, const char *);
+
+#endif /* PATH_H */
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "readbatch.h"
+#include "journal.h"
+#include "delta.h"
+
+/*
+ * A minimal io_uring, set up with the raw system calls. Rings are kept on
+ * fs->rings between batches, one per thread reading at the same time.
+ */
+struct Uring {
+    struct Uring *next;     /* on fs->rings */
+    uint64_t *again;        /* requests to submit again, at most one per read in flight */
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+struct ReadBatchContext {
+    struct FileSystem *fs;
+    struct ReadRequest *reqs;
+    ReadDoneFunc done;
+    void *arg;
+};
+
+static bool uring_supported = false;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+
+static void UringRelease(struct Uring *ring)
+{
+    free(ring->again);
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(struct Uring));
+    ring->fd = -1;
+}
+
+/*
+ * Return 0 on success, -1 if io_uring cannot be set up
+ */
+static int UringInit(struct Uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(struct Uring));
+    memset(&p, 0, sizeof(struct io_uring_params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return -1;
+    }
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    ring->entries = p.sq_entries;
+    ring->again = (uint64_t *) malloc(sizeof(uint64_t) * ring->entries);
+    if (ring->again == NULL) {
+        goto fail;
+    }
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+    return 0;
+fail:
+    UringRelease(ring);
+    return -1;
+}
+
+static void UringProbe(void)
+{
+    struct Uring ring;
+
+    if (UringInit(&ring, 1) == 0) {
+        uring_supported = true;
+        UringRelease(&ring);
+    }
+}
+
+/*
+ * Take an idle ring of fs, or set a new one up
+ * Return NULL if io_uring cannot be set up
+ */
+static struct Uring *UringGet(struct FileSystem *fs)
+{
+    struct Uring *ring = NULL;
+
+    pthread_mutex_lock(&fs->ring_lock);
+    ring = fs->rings;
+    if (ring != NULL) {
+        fs->rings = ring->next;
+    }
+    pthread_mutex_unlock(&fs->ring_lock);
+    if (ring != NULL) {
+        return ring;
+    }
+
+    ring = (struct Uring *) malloc(sizeof(struct Uring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    if (UringInit(ring, READ_BATCH_DEPTH) < 0) {
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+/*
+ * Give a ring with nothing in flight back to fs
+ */
+static void UringPut(struct FileSystem *fs, struct Uring *ring)
+{
+    pthread_mutex_lock(&fs->ring_lock);
+    ring->next = fs->rings;
+    fs->rings = ring;
+    pthread_mutex_unlock(&fs->ring_lock);
+}
+
+/*
+ * Close the rings kept by fs, no batch may be running
+ */
+void ReadBatchRelease(struct FileSystem *fs)
+{
+    struct Uring *ring = NULL;
+
+    while (fs->rings != NULL) {
+        ring = fs->rings;
+        fs->rings = ring->next;
+        UringRelease(ring);
+        free(ring);
+    }
+}
+
+static bool ReadBatchMapped(struct FileSystem *fs)
+{
+    return fs->map != NULL || fs->windows != NULL;
+}
+
+/*
+ * Name of the backend ReadBatch uses for fs
+ */
+const char *ReadBatchBackendGet(struct FileSystem *fs)
+{
+    if (ReadBatchMapped(fs)) {
+        return "mmap";
+    }
+    pthread_once(&uring_once, UringProbe);
+    if (uring_supported && !(fs->flags & FS_OPEN_NO_URING)) {
+        return "io_uring";
+    }
+    return "pread";
+}
+
+/*
+ * Finish a request synchronously, for mappings, pread and the requests
+ * io_uring refused
+ */
+static void ReadRequestFinish(struct FileSystem *fs, struct ReadRequest *req)
+{
+    errno = 0;
+    if (req->done < req->len &&
+            BytesRead(fs, req->offset + req->done, req->len - req->done, req->buf + req->done) == 0) {
+        req->error = errno ? errno : EIO;
+        return;
+    }
+    req->done = req->len;
+    req->error = 0;
+}
+
+static void ReadBatchOne(struct ReadBatchContext *ctx, uint64_t index)
+{
+    struct ReadRequest *req = &(ctx->reqs[index]);
+
+    ReadRequestFinish(ctx->fs, req);
+    if (ctx->done != NULL) {
+        ctx->done(ctx->fs, req, ctx->arg);
+    }
+}
+
+/*
+ * Keep up to ring->entries reads in flight, reap completions in whatever
+ * order the device finishes them. Short reads are queued again for the rest.
+ */
+static int ReadBatchUring(struct ReadBatchContext *ctx, struct Uring *ring, uint64_t count)
+{
+    struct FileSystem *fs = ctx->fs;
+    struct ReadRequest *req = NULL;
+    struct io_uring_sqe *sqe = NULL;
+    struct io_uring_cqe *cqe = NULL;
+    uint64_t *again = ring->again;
+    uint64_t next = 0, completed = 0, nagain = 0, index = 0;
+    unsigned inflight = 0, submit = 0, tail = 0, head = 0;
+    int ret = 0;
+    int res = 0;
+
+    while (completed < count) {
+        tail = *ring->sq_tail;
+        while (inflight < ring->entries && (nagain > 0 || next < count)) {
+            index = (nagain > 0) ? again[--nagain] : next++;
+            req = &(ctx->reqs[index]);
+            sqe = &(ring->sqes[tail & *ring->sq_mask]);
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fs->fd;
+            sqe->off = req->offset + req->done;
+            sqe->addr = (uint64_t)(uintptr_t)(req->buf + req->done);
+            /* Longer reads simply come back short and go again */
+            sqe->len = (req->len - req->done > READ_BATCH_MAX_LEN) ? READ_BATCH_MAX_LEN : req->len - req->done;
+            sqe->user_data = index;
+            ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+            tail++;
+            inflight++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        /* Entries left over by an interrupted enter are submitted too */
+        submit = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+        res = syscall(__NR_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            printf("ReadBatch: io_uring_enter failed, errno %d\n", errno);
+            ret = -1;
+            break;
+        }
+
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &(ring->cqes[head & *ring->cq_mask]);
+            index = cqe->user_data;
+            res = cqe->res;
+            head++;
+            inflight--;
+            req = &(ctx->reqs[index]);
+
+            if (res == -EINTR || res == -EAGAIN) {
+                again[nagain++] = index;
+                continue;
+            }
+            if (res > 0) {
+                req->done += res;
+                if (req->done < req->len) {
+                    again[nagain++] = index;
+                    continue;
+                }
+            } else {
+                /* Refused, e.g. no IORING_OP_READ before 5.6, or end of image */
+                ReadRequestFinish(fs, req);
+            }
+            /* BytesRead did this for the synchronous paths already */
+            if (res > 0) {
+                JournalOverlayApply(fs, req->offset, req->len, req->buf);
+                if (DeltaApply(fs, req->offset, req->len, req->buf) < 0) {
+                    req->error = EIO;
+                }
+            }
+            completed++;
+            if (ctx->done != NULL) {
+                ctx->done(fs, req, ctx->arg);
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return ret;
+}
+
+/*
+ * Read many ranges of the image at once
+ * With io_uring up to READ_BATCH_DEPTH reads are kept in flight on a ring
+ * fs keeps for the next batch, otherwise they are read one after the
+ * other with pread, which costs no more than io_uring when the image is
+ * in the page cache. A mapped image is just copied from.
+ * Callers that want more reads in flight without io_uring run batches
+ * from several workers.
+ * @fs: FileSystem
+ * @reqs: the reads, done and error are filled in
+ * @count: number of reads
+ * @done: called as each read completes, may be NULL
+ * @arg: passed to done
+ * Return 0 when all reads succeeded, -1 otherwise
+ */
+int ReadBatch(struct FileSystem *fs, struct ReadRequest *reqs, uint64_t count, ReadDoneFunc done, void *arg)
+{
+    struct ReadBatchContext ctx;
+    struct Uring *ring = NULL;
+    uint64_t i = 0;
+    int ret = 0;
+
+    if (fs == NULL || reqs == NULL) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        reqs[i].done = 0;
+        reqs[i].error = 0;
+    }
+
+    memset(&ctx, 0, sizeof(struct ReadBatchContext));
+    ctx.fs = fs;
+    ctx.reqs = reqs;
+    ctx.done = done;
+    ctx.arg = arg;
+
+    if (count > 1 && strcmp(ReadBatchBackendGet(fs), "io_uring") == 0) {
+        ring = UringGet(fs);
+    }
+    if (ring != NULL) {
+        ret = ReadBatchUring(&ctx, ring, count);
+        /* A ring that failed may still have reads in flight into reqs */
+        if (ret == 0) {
+            UringPut(fs, ring);
+        } else {
+            UringRelease(ring);
+            free(ring);
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            ReadBatchOne(&ctx, i);
+        }
+    }
+    if (ret != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (reqs[i].error != 0 || reqs[i].done != reqs[i].len) {
+            return -1;
+        }
+    }
+    return 0;
+}
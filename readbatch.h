@@ -0,0 +1,30 @@
+#ifndef READBATCH_H
+#define READBATCH_H
+
+#include "filesystem.h"
+
+/* Most reads in flight at once on an io_uring */
+#define READ_BATCH_DEPTH    256
+
+/* Longest single read handed to io_uring */
+#define READ_BATCH_MAX_LEN  (1U << 30)
+
+struct ReadRequest {
+    uint64_t offset;    /* byte offset in the image */
+    uint64_t len;
+    char *buf;
+    uint64_t done;      /* bytes read, len on success */
+    int error;          /* errno of the failure, 0 on success */
+};
+
+/*
+ * Called once per request as soon as it completes, in completion order,
+ * from the thread that called ReadBatch
+ */
+typedef void (*ReadDoneFunc)(struct FileSystem *, struct ReadRequest *, void *);
+
+int ReadBatch(struct FileSystem *, struct ReadRequest *, uint64_t, ReadDoneFunc, void *);
+const char *ReadBatchBackendGet(struct FileSystem *);
+void ReadBatchRelease(struct FileSystem *);
+
+#endif /* READBATCH_H */
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "scan.h"
+#include "workpool.h"
+
+struct InodeScanContext {
+    struct FileSystem *fs;
+    int flags;
+    InodeScanFunc func;
+    void *arg;
+    char **bufs;
+};
+
+/*
+ * givin a group number, get how many inodes of its table have ever been
+ * initialized. bg_itable_unused is only maintained with group checksums.
+ */
+uint64_t InodeScanCountGet(struct FileSystem *fs, uint64_t group)
+{
+    struct ext4_group_desc *pdesc = GroupDescriptorGet(fs, group);
+    uint64_t unused = 0;
+
+    if (pdesc == NULL || (le16toh(pdesc->bg_flags) & EXT4_BG_INODE_UNINIT)) {
+        return 0;
+    }
+    if (!HAS_RO_COMPAT_FEATURE(fs->super, EXT4_FEATURE_RO_COMPAT_GDT_CSUM | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) {
+        return fs->inodes_per_group;
+    }
+
+    unused = UnusedInodesCountGet(fs, pdesc);
+    if (unused > fs->inodes_per_group) {
+        return fs->inodes_per_group;
+    }
+    return fs->inodes_per_group - unused;
+}
+
+/*
+ * Size of the buffer InodeScanGroup needs: one chunk of inode table and one bitmap block
+ */
+uint64_t InodeScanBufferSizeGet(struct FileSystem *fs)
+{
+    return SCAN_CHUNK_SIZE + fs->block_size;
+}
+
+static bool BitmapRangeEmpty(unsigned char *bitmap, uint64_t start, uint64_t count)
+{
+    uint64_t i = start;
+
+    while (i < start + count && (i & 7)) {
+        if (bitmap[i / 8] & (1 << (i & 7))) {
+            return false;
+        }
+        i++;
+    }
+    while (i + 8 <= start + count) {
+        if (bitmap[i / 8]) {
+            return false;
+        }
+        i += 8;
+    }
+    while (i < start + count) {
+        if (bitmap[i / 8] & (1 << (i & 7))) {
+            return false;
+        }
+        i++;
+    }
+    return true;
+}
+
+/*
+ * Scan the inode table of one group with large sequential reads
+ * @fs: FileSystem
+ * @group: group number
+ * @flags: SCAN_* flags
+ * @buf: scratch buffer of InodeScanBufferSizeGet bytes
+ * @func: called for every inode, in inode number order
+ * @arg: passed to func
+ * Return 0 on success, -1 on read failure, otherwise what func returned
+ */
+int InodeScanGroup(struct FileSystem *fs, uint64_t group, int flags, char *buf, InodeScanFunc func, void *arg)
+{
+    struct ext4_group_desc *pdesc = NULL;
+    struct ext4_inode small;
+    struct ext4_inode *pinode = NULL;
+    unsigned char *bitmap = (unsigned char *)buf + SCAN_CHUNK_SIZE;
+    uint64_t inode_size = le16toh(fs->super.s_inode_size);
+    uint64_t per_read = SCAN_CHUNK_SIZE / inode_size;
+    uint64_t count = 0, table = 0;
+    uint64_t i = 0, j = 0, n = 0;
+    char *chunk = NULL;
+    bool mapped = false;
+    int ret = 0;
+
+    if (group >= fs->group_count) {
+        return -1;
+    }
+    pdesc = GroupDescriptorGet(fs, group);
+    if (pdesc == NULL) {
+        printf("InodeScanGroup: read descriptor of group %llu failed\n", group);
+        return -1;
+    }
+    count = InodeScanCountGet(fs, group);
+    if (count == 0) {
+        return 0;
+    }
+
+    if (flags & SCAN_INUSE_ONLY) {
+        if (BlockRead(fs, InodeBitmapLocationGet(fs, pdesc), 1, (char *)bitmap) == 0) {
+            printf("InodeScanGroup: read inode bitmap of group %llu failed\n", group);
+            return -1;
+        }
+    }
+
+    table = InodeTableLocationGet(fs, pdesc) * fs->block_size;
+    for (i = 0; i < count; i += n) {
+        n = count - i;
+        if (n > per_read) {
+            n = per_read;
+        }
+        if ((flags & SCAN_INUSE_ONLY) && BitmapRangeEmpty(bitmap, i, n)) {
+            continue;
+        }
+
+        chunk = BytesMap(fs, table + i * inode_size, n * inode_size);
+        mapped = (chunk != NULL);
+        if (!mapped) {
+            if (BytesRead(fs, table + i * inode_size, n * inode_size, buf) == 0) {
+                printf("InodeScanGroup: read inode table of group %llu failed\n", group);
+                return -1;
+            }
+            chunk = buf;
+        }
+
+        for (j = 0; j < n && ret == 0; j++) {
+            if ((flags & SCAN_INUSE_ONLY) && !(bitmap[(i + j) / 8] & (1 << ((i + j) & 7)))) {
+                continue;
+            }
+            pinode = (struct ext4_inode *)(chunk + j * inode_size);
+            if (inode_size < sizeof(struct ext4_inode)) {
+                memset(&small, 0, sizeof(struct ext4_inode));
+                memcpy(&small, pinode, inode_size);
+                pinode = &small;
+            }
+            ret = func(fs, group * fs->inodes_per_group + i + j + 1, pinode, arg);
+        }
+
+        if (mapped) {
+            BytesUnmap(fs, table + i * inode_size);
+        }
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int InodeScanWork(struct WorkPool *pool, int worker, uint64_t group, void *data)
+{
+    struct InodeScanContext *ctx = (struct InodeScanContext *)data;
+
+    return InodeScanGroup(ctx->fs, group, ctx->flags, ctx->bufs[worker], ctx->func, ctx->arg);
+}
+
+/*
+ * Scan the inode tables of all groups, groups are spread over a pool of
+ * workers which steal from each other when they run dry
+ * @fs: FileSystem
+ * @nr_workers: number of threads, 0 means one per online CPU
+ * @flags: SCAN_* flags
+ * @func: called for every inode, concurrently from the workers
+ * @arg: passed to func
+ * Return 0 on success, otherwise the first error
+ */
+int InodeScan(struct FileSystem *fs, int nr_workers, int flags, InodeScanFunc func, void *arg)
+{
+    struct InodeScanContext ctx;
+    uint64_t *groups = NULL;
+    uint64_t i = 0;
+    int w = 0;
+    int ret = 0;
+
+    if (fs == NULL || func == NULL) {
+        return -1;
+    }
+
+    memset(&ctx, 0, sizeof(struct InodeScanContext));
+    nr_workers = WorkPoolWorkersGet(nr_workers);
+    if ((uint64_t)nr_workers > fs->group_count) {
+        nr_workers = fs->group_count;
+    }
+    ctx.fs = fs;
+    ctx.flags = flags;
+    ctx.func = func;
+    ctx.arg = arg;
+    if (GroupDescriptorsFetch(fs) == (uint64_t)-1) {
+        return -1;
+    }
+    ctx.bufs = (char **) calloc(nr_workers, sizeof(char *));
+    groups = (uint64_t *) malloc(sizeof(uint64_t) * fs->group_count);
+    if (ctx.bufs == NULL || groups == NULL) {
+        ret = -1;
+        goto end;
+    }
+    for (w = 0; w < nr_workers; w++) {
+        ctx.bufs[w] = (char *) malloc(InodeScanBufferSizeGet(fs));
+        if (ctx.bufs[w] == NULL) {
+            ret = -1;
+            goto end;
+        }
+    }
+    for (i = 0; i < fs->group_count; i++) {
+        groups[i] = i;
+    }
+
+    ret = WorkPoolRun(nr_workers, groups, fs->group_count, InodeScanWork, &ctx);
+
+end:
+    if (ctx.bufs != NULL) {
+        for (w = 0; w < nr_workers; w++) {
+            free(ctx.bufs[w]);
+        }
+    }
+    free(ctx.bufs);
+    free(groups);
+    return ret;
+}
@@ -0,0 +1,25 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include "filesystem.h"
+
+/* Flags for InodeScan */
+#define SCAN_INUSE_ONLY     0x0001  /* Deliver only inodes marked in the inode bitmap */
+
+/* Bytes of inode table fetched per read */
+#define SCAN_CHUNK_SIZE     (1ULL << 20)
+
+/*
+ * Called for every inode delivered by the scanner, possibly from many threads
+ * at once. The inode points into a buffer or the mapping owned by the scanner
+ * and is only valid during the call.
+ * Return 0 to go on, anything else stops the scan.
+ */
+typedef int (*InodeScanFunc)(struct FileSystem *, uint64_t, struct ext4_inode *, void *);
+
+uint64_t InodeScanCountGet(struct FileSystem *, uint64_t);
+uint64_t InodeScanBufferSizeGet(struct FileSystem *);
+int InodeScanGroup(struct FileSystem *, uint64_t, int, char *, InodeScanFunc, void *);
+int InodeScan(struct FileSystem *, int, int, InodeScanFunc, void *);
+
+#endif /* SCAN_H */
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#include "sidecar.h"
+
+/*
+ * Stamp the header of a file kept next to the image of fs
+ * @fs: FileSystem
+ * @magic: 8 bytes telling the kind of file
+ * @version: of the layout of the file
+ * @header_size: of the whole header the stamp starts
+ * @stamp: filled
+ * Return 0 on success, -1 if the image cannot be stat'ed
+ */
+int SidecarStampFill(struct FileSystem *fs, const char *magic, uint32_t version, uint32_t header_size,
+        struct SidecarStamp *stamp)
+{
+    struct stat st;
+
+    if (fstat(fs->fd, &st) < 0) {
+        return -1;
+    }
+    memset(stamp, 0, sizeof(struct SidecarStamp));
+    memcpy(stamp->magic, magic, sizeof(stamp->magic));
+    stamp->version = version;
+    stamp->header_size = header_size;
+    memcpy(stamp->uuid, fs->super.s_uuid, sizeof(stamp->uuid));
+    stamp->wtime = le32toh(fs->super.s_wtime);
+    stamp->mtime = le32toh(fs->super.s_mtime);
+    stamp->image_size = fs->image_size;
+    stamp->image_mtime_sec = st.st_mtim.tv_sec;
+    stamp->image_mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/*
+ * Tell whether a stamp read from a file holds for the image of fs
+ * @checks: SIDECAR_CHECK_* flags, the uuid is always compared
+ * Return SIDECAR_CURRENT, SIDECAR_FOREIGN or SIDECAR_STALE, -1 if the
+ * image cannot be stat'ed
+ */
+int SidecarStampCheck(struct FileSystem *fs, const struct SidecarStamp *stamp, const char *magic, uint32_t version,
+        uint32_t header_size, int checks)
+{
+    struct SidecarStamp expect;
+
+    if (SidecarStampFill(fs, magic, version, header_size, &expect) < 0) {
+        return -1;
+    }
+    if (memcmp(stamp->magic, expect.magic, sizeof(expect.magic)) != 0 || stamp->version != expect.version ||
+            stamp->header_size != expect.header_size) {
+        return SIDECAR_FOREIGN;
+    }
+    if (memcmp(stamp->uuid, expect.uuid, sizeof(expect.uuid)) != 0) {
+        return SIDECAR_STALE;
+    }
+    if ((checks & SIDECAR_CHECK_SUPER) && (stamp->wtime != expect.wtime || stamp->mtime != expect.mtime)) {
+        return SIDECAR_STALE;
+    }
+    if ((checks & SIDECAR_CHECK_IMAGE) && (stamp->image_size != expect.image_size ||
+                stamp->image_mtime_sec != expect.image_mtime_sec || stamp->image_mtime_nsec != expect.image_mtime_nsec)) {
+        return SIDECAR_STALE;
+    }
+    return SIDECAR_CURRENT;
+}
@@ -0,0 +1,35 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include "filesystem.h"
+
+/* What SidecarStampCheck compares beyond the kind and the filesystem */
+#define SIDECAR_CHECK_SUPER     0x1 /* wtime and mtime of the superblock, changed by a mount */
+#define SIDECAR_CHECK_IMAGE     0x2 /* size and mtime of the image file */
+
+/* SidecarStampCheck results */
+#define SIDECAR_CURRENT         0
+#define SIDECAR_FOREIGN         1   /* another kind of file, or another version */
+#define SIDECAR_STALE           2   /* of another filesystem, or it changed since */
+
+/*
+ * Start of the header of every file lsfs keeps next to an image, telling
+ * what the file is and which image it was made from. The files are in
+ * host byte order, they are caches of one machine and not meant to move.
+ */
+struct SidecarStamp {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint8_t uuid[16];
+    uint32_t wtime;
+    uint32_t mtime;
+    uint64_t image_size;
+    int64_t image_mtime_sec;
+    int64_t image_mtime_nsec;
+};
+
+int SidecarStampFill(struct FileSystem *, const char *, uint32_t, uint32_t, struct SidecarStamp *);
+int SidecarStampCheck(struct FileSystem *, const struct SidecarStamp *, const char *, uint32_t, uint32_t, int);
+
+#endif /* SIDECAR_H */
@@ -0,0 +1,754 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "space.h"
+#include "bitmap.h"
+#include "workpool.h"
+#include "readbatch.h"
+#include "metaindex.h"
+
+struct SpaceLocation {
+    uint64_t block;
+    uint64_t group;
+};
+
+struct SpaceContext;
+
+/*
+ * Called for every bitmap read by SpaceChunkWalk, bitmap is NULL when the read failed
+ */
+typedef void (*SpaceBitmapFunc)(struct SpaceContext *, uint64_t, unsigned char *, uint64_t);
+
+struct SpaceContext {
+    struct FileSystem *fs;
+    struct SpaceReport *report;
+    struct FreeExtentMap *extents;
+    char **bufs;
+    struct SpaceLocation **locs;
+    struct ReadRequest **reqs;
+    uint64_t *bytes;    /* per worker, summed at the end */
+    uint64_t bytes_scanned;
+};
+
+static int SpaceLocationCompare(const void *a, const void *b)
+{
+    const struct SpaceLocation *x = (const struct SpaceLocation *)a;
+    const struct SpaceLocation *y = (const struct SpaceLocation *)b;
+
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Number of meaningful bits in a group's bitmap, the last group may be short
+ */
+static uint64_t SpaceBitsGet(struct FileSystem *fs, int type, uint64_t group)
+{
+    uint64_t first = fs->super.s_first_data_block;
+    uint64_t blocks = fs->blocks_per_group;
+
+    if (type == BITMAP_INODE) {
+        return fs->inodes_per_group;
+    }
+    if (first + (group + 1) * fs->blocks_per_group > fs->block_count) {
+        blocks = fs->block_count - first - group * fs->blocks_per_group;
+    }
+    return (blocks + fs->cluster_block_ratio - 1) / fs->cluster_block_ratio;
+}
+
+/*
+ * Hand every initialized bitmap of one type in a chunk of groups to func.
+ * Bitmaps are sorted by location and adjacent ones read together, the
+ * runs are mapped or all queued at once with ReadBatch.
+ */
+static void SpaceChunkWalk(struct SpaceContext *ctx, int worker, int type, uint64_t first, uint64_t last, SpaceBitmapFunc func)
+{
+    struct FileSystem *fs = ctx->fs;
+    struct SpaceLocation *locs = ctx->locs[worker];
+    struct ReadRequest *reqs = ctx->reqs[worker];
+    struct ext4_group_desc *pdesc = NULL;
+    uint64_t uninit = (type == BITMAP_INODE) ? EXT4_BG_INODE_UNINIT : EXT4_BG_BLOCK_UNINIT;
+    uint64_t n = 0, i = 0, j = 0, r = 0, run = 0, nreqs = 0;
+    char *data = NULL;
+    bool mapped = (fs->map != NULL || fs->windows != NULL);
+
+    for (i = first; i < last; i++) {
+        pdesc = GroupDescriptorGet(fs, i);
+        if (pdesc == NULL) {
+            func(ctx, i, NULL, 0);
+            continue;
+        }
+        if (le16toh(pdesc->bg_flags) & uninit) {
+            continue;
+        }
+        locs[n].block = (type == BITMAP_INODE) ? InodeBitmapLocationGet(fs, pdesc) : BlockBitmapLocationGet(fs, pdesc);
+        locs[n].group = i;
+        n++;
+    }
+    qsort(locs, n, sizeof(struct SpaceLocation), SpaceLocationCompare);
+
+    /* All runs of a chunk fit the worker's buffer, read them in one batch */
+    for (i = 0; i < n; i += run) {
+        run = 1;
+        while (i + run < n && locs[i + run].block == locs[i].block + run) {
+            run++;
+        }
+        reqs[nreqs].offset = locs[i].block * fs->block_size;
+        reqs[nreqs].len = run * fs->block_size;
+        reqs[nreqs].buf = ctx->bufs[worker] + i * fs->block_size;
+        reqs[nreqs].error = 0;
+        nreqs++;
+    }
+    if (!mapped) {
+        ReadBatch(fs, reqs, nreqs, NULL, NULL);
+    }
+
+    for (i = 0, r = 0; r < nreqs; r++, i += run) {
+        run = reqs[r].len / fs->block_size;
+        data = mapped ? BlockMap(fs, locs[i].block, run) : NULL;
+        if (data == NULL) {
+            if (mapped && BlockRead(fs, locs[i].block, run, reqs[r].buf) == 0) {
+                reqs[r].error = EIO;
+            }
+            if (reqs[r].error != 0) {
+                for (j = 0; j < run; j++) {
+                    func(ctx, locs[i + j].group, NULL, 0);
+                }
+                continue;
+            }
+        }
+        ctx->bytes[worker] += reqs[r].len;
+
+        for (j = 0; j < run; j++) {
+            func(ctx, locs[i + j].group, (unsigned char *)(data ? data : reqs[r].buf) + j * fs->block_size,
+                    SpaceBitsGet(fs, type, locs[i + j].group));
+        }
+
+        if (data != NULL) {
+            BlockUnmap(fs, locs[i].block);
+        }
+    }
+}
+
+static void SpaceBlockCount(struct SpaceContext *ctx, uint64_t group, unsigned char *bitmap, uint64_t bits)
+{
+    struct GroupSpace *space = &(ctx->report->groups[group]);
+
+    if (bitmap == NULL) {
+        space->flags |= SPACE_ERROR;
+        return;
+    }
+    space->free_blocks = bits - BitmapRangeCount(bitmap, 0, bits);
+}
+
+static void SpaceInodeCount(struct SpaceContext *ctx, uint64_t group, unsigned char *bitmap, uint64_t bits)
+{
+    struct GroupSpace *space = &(ctx->report->groups[group]);
+
+    if (bitmap == NULL) {
+        space->flags |= SPACE_ERROR;
+        return;
+    }
+    space->free_inodes = bits - BitmapRangeCount(bitmap, 0, bits);
+}
+
+static int SpaceWork(struct WorkPool *pool, int worker, uint64_t chunk, void *data)
+{
+    struct SpaceContext *ctx = (struct SpaceContext *)data;
+    struct FileSystem *fs = ctx->fs;
+    struct GroupSpace *space = NULL;
+    struct ext4_group_desc *pdesc = NULL;
+    uint64_t first = chunk * SPACE_CHUNK_GROUPS;
+    uint64_t last = first + SPACE_CHUNK_GROUPS;
+    uint64_t i = 0;
+
+    if (last > fs->group_count) {
+        last = fs->group_count;
+    }
+
+    for (i = first; i < last; i++) {
+        space = &(ctx->report->groups[i]);
+        pdesc = GroupDescriptorGet(fs, i);
+        if (pdesc == NULL) {
+            space->flags |= SPACE_ERROR;
+            continue;
+        }
+        space->desc_free_blocks = FreeBlocksCountGet(fs, pdesc);
+        space->desc_free_inodes = FreeInodesCountGet(fs, pdesc);
+        if (le16toh(pdesc->bg_flags) & EXT4_BG_BLOCK_UNINIT) {
+            space->flags |= SPACE_BLOCK_UNINIT;
+            space->free_blocks = space->desc_free_blocks;
+        }
+        if (le16toh(pdesc->bg_flags) & EXT4_BG_INODE_UNINIT) {
+            space->flags |= SPACE_INODE_UNINIT;
+            space->free_inodes = fs->inodes_per_group;
+        }
+    }
+
+    SpaceChunkWalk(ctx, worker, BITMAP_BLOCK, first, last, SpaceBlockCount);
+    SpaceChunkWalk(ctx, worker, BITMAP_INODE, first, last, SpaceInodeCount);
+
+    return 0;
+}
+
+/*
+ * Run work over all chunks of groups with a pool of workers, each worker
+ * gets its own read buffer and location array
+ * Return 0 on success, -1 or the first error of work on failure
+ */
+static int SpaceRun(struct SpaceContext *ctx, int nr_workers, WorkFunc work)
+{
+    struct FileSystem *fs = ctx->fs;
+    uint64_t *chunks = NULL;
+    uint64_t nr_chunks = 0, i = 0;
+    int w = 0;
+    int ret = 0;
+
+    if (GroupDescriptorsFetch(fs) == (uint64_t)-1) {
+        return -1;
+    }
+    nr_chunks = (fs->group_count + SPACE_CHUNK_GROUPS - 1) / SPACE_CHUNK_GROUPS;
+    nr_workers = WorkPoolWorkersGet(nr_workers);
+    if ((uint64_t)nr_workers > nr_chunks) {
+        nr_workers = nr_chunks;
+    }
+
+    chunks = (uint64_t *) malloc(sizeof(uint64_t) * nr_chunks);
+    ctx->bufs = (char **) calloc(nr_workers, sizeof(char *));
+    ctx->locs = (struct SpaceLocation **) calloc(nr_workers, sizeof(struct SpaceLocation *));
+    ctx->reqs = (struct ReadRequest **) calloc(nr_workers, sizeof(struct ReadRequest *));
+    ctx->bytes = (uint64_t *) calloc(nr_workers, sizeof(uint64_t));
+    if (chunks == NULL || ctx->bufs == NULL || ctx->locs == NULL || ctx->reqs == NULL || ctx->bytes == NULL) {
+        ret = -1;
+        goto end;
+    }
+    for (w = 0; w < nr_workers; w++) {
+        ctx->bufs[w] = (char *) malloc(fs->block_size * SPACE_READ_BLOCKS);
+        ctx->locs[w] = (struct SpaceLocation *) malloc(sizeof(struct SpaceLocation) * SPACE_CHUNK_GROUPS);
+        ctx->reqs[w] = (struct ReadRequest *) malloc(sizeof(struct ReadRequest) * SPACE_CHUNK_GROUPS);
+        if (ctx->bufs[w] == NULL || ctx->locs[w] == NULL || ctx->reqs[w] == NULL) {
+            ret = -1;
+            goto end;
+        }
+    }
+    for (i = 0; i < nr_chunks; i++) {
+        chunks[i] = i;
+    }
+
+    ret = WorkPoolRun(nr_workers, chunks, nr_chunks, work, ctx);
+    for (w = 0; w < nr_workers; w++) {
+        ctx->bytes_scanned += ctx->bytes[w];
+    }
+
+end:
+    for (w = 0; w < nr_workers; w++) {
+        if (ctx->bufs != NULL) {
+            free(ctx->bufs[w]);
+        }
+        if (ctx->locs != NULL) {
+            free(ctx->locs[w]);
+        }
+        if (ctx->reqs != NULL) {
+            free(ctx->reqs[w]);
+        }
+    }
+    free(ctx->bufs);
+    free(ctx->locs);
+    free(ctx->reqs);
+    free(ctx->bytes);
+    free(chunks);
+    return ret;
+}
+
+static double SpaceSecondsGet(struct timespec *begin)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+/*
+ * Count the real free blocks and inodes of every group from the bitmaps
+ * and compare them with the group descriptors.
+ * Chunks of SPACE_CHUNK_GROUPS groups are spread over a pool of workers.
+ * @fs: FileSystem
+ * @nr_workers: number of threads, 0 means one per online CPU
+ * @report: filled, release with SpaceReportRelease
+ * Return 0 on success, -1 on failure
+ */
+int SpaceReportBuild(struct FileSystem *fs, int nr_workers, struct SpaceReport *report)
+{
+    struct SpaceContext ctx;
+    struct GroupSpace *space = NULL, *indexed = NULL;
+    struct timespec begin;
+    uint64_t i = 0;
+
+    if (fs == NULL || report == NULL) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    memset(report, 0, sizeof(struct SpaceReport));
+    memset(&ctx, 0, sizeof(struct SpaceContext));
+    report->group_count = fs->group_count;
+    report->groups = (struct GroupSpace *) calloc(fs->group_count, sizeof(struct GroupSpace));
+    if (report->groups == NULL) {
+        return -1;
+    }
+    ctx.fs = fs;
+    ctx.report = report;
+    /* The bitmaps are unchanged since the index summarized them */
+    indexed = MetaIndexGroupSpaceGet(fs);
+    if (indexed != NULL) {
+        memcpy(report->groups, indexed, sizeof(struct GroupSpace) * fs->group_count);
+    } else if (SpaceRun(&ctx, nr_workers, SpaceWork) != 0) {
+        SpaceReportRelease(report);
+        return -1;
+    }
+
+    for (i = 0; i < fs->group_count; i++) {
+        space = &(report->groups[i]);
+        report->free_blocks += space->free_blocks;
+        report->free_inodes += space->free_inodes;
+        report->desc_free_blocks += space->desc_free_blocks;
+        report->desc_free_inodes += space->desc_free_inodes;
+        if (space->flags & SPACE_ERROR) {
+            report->errors++;
+            continue;
+        }
+        if (space->free_blocks != space->desc_free_blocks) {
+            report->block_mismatches++;
+        }
+        if (space->free_inodes != space->desc_free_inodes) {
+            report->inode_mismatches++;
+        }
+    }
+    report->bytes_scanned = ctx.bytes_scanned;
+    report->seconds = SpaceSecondsGet(&begin);
+
+    return 0;
+}
+
+void SpaceReportRelease(struct SpaceReport *report)
+{
+    if (report == NULL) {
+        return;
+    }
+    free(report->groups);
+    report->groups = NULL;
+    report->group_count = 0;
+}
+
+/*
+ * Print the groups where bitmaps and descriptors disagree, then the totals
+ */
+void SpaceReportPrint(struct FileSystem *fs, struct SpaceReport *report)
+{
+    struct GroupSpace *space = NULL;
+    uint64_t sb_free_blocks = 0;
+    uint64_t i = 0;
+
+    if (fs == NULL || report == NULL || report->groups == NULL) {
+        printf("SpaceReportPrint cannot take a null pointer\n");
+        return;
+    }
+
+    for (i = 0; i < report->group_count; i++) {
+        space = &(report->groups[i]);
+        if (space->flags & SPACE_ERROR) {
+            printf("Group %llu: bitmap read failed\n", i);
+            continue;
+        }
+        if (space->free_blocks != space->desc_free_blocks) {
+            printf("Group %llu: %u free blocks in bitmap, descriptor says %u\n",
+                    i, space->free_blocks, space->desc_free_blocks);
+        }
+        if (space->free_inodes != space->desc_free_inodes) {
+            printf("Group %llu: %u free inodes in bitmap, descriptor says %u\n",
+                    i, space->free_inodes, space->desc_free_inodes);
+        }
+    }
+
+    sb_free_blocks = (uint64_t)le32toh(fs->super.s_free_blocks_count_lo) |
+            (HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_64BIT) ?
+            (uint64_t)le32toh(fs->super.s_free_blocks_count_hi) << 32 : 0);
+    /* Bitmaps and descriptors count clusters, the super block counts blocks */
+    printf("Free %s: %llu in bitmaps, %llu in descriptors, %llu in super block\n",
+            fs->cluster_block_ratio > 1 ? "clusters" : "blocks",
+            report->free_blocks, report->desc_free_blocks, sb_free_blocks / fs->cluster_block_ratio);
+    printf("Free inodes: %llu in bitmaps, %llu in descriptors, %u in super block\n",
+            report->free_inodes, report->desc_free_inodes, le32toh(fs->super.s_free_inodes_count));
+    printf("%llu groups, %llu block mismatches, %llu inode mismatches, %llu read errors\n",
+            report->group_count, report->block_mismatches, report->inode_mismatches, report->errors);
+    printf("Scanned %llu bytes of bitmaps by %s in %.3f s with %s popcount\n",
+            report->bytes_scanned, ReadBatchBackendGet(fs), report->seconds, BitmapPopcountImplGet());
+}
+
+static int ExtentBucketGet(uint64_t len)
+{
+    int bucket = 63 - __builtin_clzll(len);
+
+    return bucket < EXTENT_HIST_BUCKETS ? bucket : EXTENT_HIST_BUCKETS - 1;
+}
+
+/*
+ * Keep run if it is one of the EXTENT_TOP_RUNS largest, largest first
+ */
+static void ExtentTopInsert(struct FreeExtentStats *stats, struct FreeRun run)
+{
+    uint64_t i = stats->top_count;
+
+    if (i == EXTENT_TOP_RUNS) {
+        if (stats->top[i - 1].len >= run.len) {
+            return;
+        }
+        i--;
+    } else {
+        stats->top_count++;
+    }
+    while (i > 0 && stats->top[i - 1].len < run.len) {
+        stats->top[i] = stats->top[i - 1];
+        i--;
+    }
+    stats->top[i] = run;
+}
+
+static void ExtentStatsAdd(struct FreeExtentStats *stats, struct FreeRun run)
+{
+    stats->free += run.len;
+    stats->runs++;
+    stats->hist[ExtentBucketGet(run.len)]++;
+    ExtentTopInsert(stats, run);
+}
+
+/*
+ * Bitmap of a EXT4_BG_BLOCK_UNINIT group as the kernel builds it: only the
+ * super block backup, descriptors and the group's own metadata are in use
+ */
+static void ExtentUninitBitmapBuild(struct FileSystem *fs, uint64_t group, unsigned char *bitmap, uint64_t bits)
+{
+    struct ext4_group_desc *pdesc = GroupDescriptorGet(fs, group);
+    uint64_t first = fs->super.s_first_data_block + group * fs->blocks_per_group;
+    uint64_t last = first + fs->blocks_per_group;
+    uint64_t meta[3];
+    uint64_t metagroup = group / fs->descriptor_per_block;
+    uint64_t base = 0, block = 0, bit = 0, i = 0;
+
+    memset(bitmap, 0, (bits + 7) / 8);
+
+    if (!HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_META_BG) ||
+            metagroup < le32toh(fs->super.s_first_meta_bg)) {
+        if (GroupHasSuperblock(group, fs)) {
+            base = 1 + le16toh(fs->super.s_reserved_gdt_blocks);
+            if (HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_META_BG)) {
+                base += le32toh(fs->super.s_first_meta_bg);
+            } else {
+                base += fs->descriptor_used_block_count;
+            }
+        }
+    } else {
+        base = GroupHasSuperblock(group, fs) ? 1 : 0;
+        i = group % fs->descriptor_per_block;
+        if (i == 0 || i == 1 || i == fs->descriptor_per_block - 1) {
+            base++;
+        }
+    }
+    for (block = first; block < first + base; block++) {
+        bit = BLOCK_TO_BIT(block, fs->super.s_first_data_block, fs->blocks_per_group, fs->cluster_block_ratio);
+        bitmap[bit / 8] |= 1 << (bit & 7);
+    }
+
+    meta[0] = BlockBitmapLocationGet(fs, pdesc);
+    meta[1] = InodeBitmapLocationGet(fs, pdesc);
+    meta[2] = InodeTableLocationGet(fs, pdesc);
+    for (i = 0; i < 3; i++) {
+        for (block = meta[i]; block < meta[i] + (i == 2 ? fs->itable_block_per_group : 1); block++) {
+            if (block < first || block >= last) {
+                continue;
+            }
+            bit = BLOCK_TO_BIT(block, fs->super.s_first_data_block, fs->blocks_per_group, fs->cluster_block_ratio);
+            if (bit < bits) {
+                bitmap[bit / 8] |= 1 << (bit & 7);
+            }
+        }
+    }
+}
+
+/*
+ * Collect the free runs of one block bitmap, skipping whole words of used
+ * or free clusters at once
+ */
+static void ExtentGroupScan(struct SpaceContext *ctx, uint64_t group, unsigned char *bitmap, uint64_t bits)
+{
+    struct FileSystem *fs = ctx->fs;
+    struct GroupExtents *ge = &(ctx->extents->groups[group]);
+    uint64_t first = fs->super.s_first_data_block + group * fs->blocks_per_group;
+    uint64_t ratio = fs->cluster_block_ratio;
+    uint64_t zero = 0, set = 0;
+    struct FreeRun run;
+
+    if (bitmap == NULL) {
+        ge->flags |= SPACE_ERROR;
+        return;
+    }
+
+    for (set = 0; set < bits; ) {
+        zero = BitmapFindZero(bitmap, set, bits);
+        if (zero >= bits) {
+            break;
+        }
+        set = BitmapFindSet(bitmap, zero, bits);
+        run.start = first + zero * ratio;
+        run.len = (set - zero) * ratio;
+        if (zero * ratio + run.len > ge->blocks) {
+            run.len = ge->blocks - zero * ratio;
+        }
+        ExtentStatsAdd(&ge->stats, run);
+        if (zero == 0) {
+            ge->head = run;
+        }
+        if (set == bits) {
+            ge->tail = run;
+        }
+    }
+}
+
+static int ExtentWork(struct WorkPool *pool, int worker, uint64_t chunk, void *data)
+{
+    struct SpaceContext *ctx = (struct SpaceContext *)data;
+    struct FileSystem *fs = ctx->fs;
+    struct GroupExtents *ge = NULL;
+    struct ext4_group_desc *pdesc = NULL;
+    uint64_t first = chunk * SPACE_CHUNK_GROUPS;
+    uint64_t last = first + SPACE_CHUNK_GROUPS;
+    uint64_t bits = 0, i = 0;
+
+    if (last > fs->group_count) {
+        last = fs->group_count;
+    }
+
+    for (i = first; i < last; i++) {
+        ge = &(ctx->extents->groups[i]);
+        bits = SpaceBitsGet(fs, BITMAP_BLOCK, i);
+        ge->blocks = fs->blocks_per_group;
+        if (fs->super.s_first_data_block + (i + 1) * fs->blocks_per_group > fs->block_count) {
+            ge->blocks = fs->block_count - fs->super.s_first_data_block - i * fs->blocks_per_group;
+        }
+        pdesc = GroupDescriptorGet(fs, i);
+        if (pdesc == NULL) {
+            ge->flags |= SPACE_ERROR;
+            continue;
+        }
+        if (le16toh(pdesc->bg_flags) & EXT4_BG_BLOCK_UNINIT) {
+            ge->flags |= SPACE_BLOCK_UNINIT;
+            ExtentUninitBitmapBuild(fs, i, (unsigned char *)ctx->bufs[worker], bits);
+            ExtentGroupScan(ctx, i, (unsigned char *)ctx->bufs[worker], bits);
+        }
+    }
+
+    SpaceChunkWalk(ctx, worker, BITMAP_BLOCK, first, last, ExtentGroupScan);
+
+    return 0;
+}
+
+/*
+ * Sum the statistics of groups [first, last), joining the free runs which
+ * cross group boundaries
+ */
+static int ExtentStatsAggregate(struct FreeExtentMap *map, uint64_t first, uint64_t last, struct FreeExtentStats *out)
+{
+    struct GroupExtents *ge = NULL;
+    struct FreeRun carry = {0, 0};
+    struct FreeRun *t = NULL;
+    bool carry_joined = false;
+    uint8_t *joined = NULL;     /* per group, 1: head joined to the previous group, 2: tail joined to the next */
+    uint64_t g = 0, i = 0, b = 0;
+
+    memset(out, 0, sizeof(struct FreeExtentStats));
+    joined = (uint8_t *) calloc(last - first, sizeof(uint8_t));
+    if (joined == NULL) {
+        return -1;
+    }
+
+    for (g = first; g < last; g++) {
+        ge = &(map->groups[g]);
+        out->free += ge->stats.free;
+        out->runs += ge->stats.runs;
+        for (b = 0; b < EXTENT_HIST_BUCKETS; b++) {
+            out->hist[b] += ge->stats.hist[b];
+        }
+
+        if (carry.len && ge->head.len && carry.start + carry.len == ge->head.start) {
+            out->hist[ExtentBucketGet(carry.len)]--;
+            out->hist[ExtentBucketGet(ge->head.len)]--;
+            carry.len += ge->head.len;
+            out->hist[ExtentBucketGet(carry.len)]++;
+            out->runs--;
+            joined[g - first] |= 1;
+            joined[g - 1 - first] |= 2;
+            carry_joined = true;
+            if (ge->head.len == ge->blocks) {
+                /* The whole group is free, the run goes on */
+                joined[g - first] |= 2;
+                continue;
+            }
+        }
+        if (carry_joined) {
+            ExtentTopInsert(out, carry);
+        }
+        carry = ge->tail;
+        carry_joined = false;
+    }
+    if (carry_joined) {
+        ExtentTopInsert(out, carry);
+    }
+
+    /* A run which is not among the largest of its group cannot be among the largest here */
+    for (g = first; g < last; g++) {
+        ge = &(map->groups[g]);
+        for (i = 0; i < ge->stats.top_count; i++) {
+            t = &(ge->stats.top[i]);
+            if ((joined[g - first] & 1) && t->start == ge->head.start && t->len == ge->head.len) {
+                continue;
+            }
+            if ((joined[g - first] & 2) && t->start == ge->tail.start && t->len == ge->tail.len) {
+                continue;
+            }
+            ExtentTopInsert(out, *t);
+        }
+    }
+
+    free(joined);
+    return 0;
+}
+
+/*
+ * Build the histogram of free extent sizes and the largest free runs of
+ * every group, every flex group and the whole filesystem
+ * @fs: FileSystem
+ * @nr_workers: number of threads, 0 means one per online CPU
+ * @map: filled, release with FreeExtentMapRelease
+ * Return 0 on success, -1 on failure
+ */
+int FreeExtentMapBuild(struct FileSystem *fs, int nr_workers, struct FreeExtentMap *map)
+{
+    struct SpaceContext ctx;
+    struct timespec begin;
+    uint64_t i = 0, last = 0;
+
+    if (fs == NULL || map == NULL) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    memset(map, 0, sizeof(struct FreeExtentMap));
+    memset(&ctx, 0, sizeof(struct SpaceContext));
+    map->flex_size = 1;
+    if (HAS_INCOMPAT_FEATURE(fs->super, EXT4_FEATURE_INCOMPAT_FLEX_BG) && fs->super.s_log_groups_per_flex < 32) {
+        map->flex_size = 1ULL << fs->super.s_log_groups_per_flex;
+    }
+    map->flex_count = (fs->group_count + map->flex_size - 1) / map->flex_size;
+    map->group_count = fs->group_count;
+    map->groups = (struct GroupExtents *) calloc(fs->group_count, sizeof(struct GroupExtents));
+    map->flexes = (struct FreeExtentStats *) calloc(map->flex_count, sizeof(struct FreeExtentStats));
+    if (map->groups == NULL || map->flexes == NULL) {
+        goto fail;
+    }
+    ctx.fs = fs;
+    ctx.extents = map;
+    if (SpaceRun(&ctx, nr_workers, ExtentWork) != 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < fs->group_count; i++) {
+        if (map->groups[i].flags & SPACE_ERROR) {
+            map->errors++;
+        }
+    }
+    for (i = 0; i < map->flex_count; i++) {
+        last = (i + 1) * map->flex_size;
+        if (last > fs->group_count) {
+            last = fs->group_count;
+        }
+        if (ExtentStatsAggregate(map, i * map->flex_size, last, &(map->flexes[i])) != 0) {
+            goto fail;
+        }
+    }
+    if (ExtentStatsAggregate(map, 0, fs->group_count, &(map->total)) != 0) {
+        goto fail;
+    }
+    map->bytes_scanned = ctx.bytes_scanned;
+    map->seconds = SpaceSecondsGet(&begin);
+
+    return 0;
+
+fail:
+    FreeExtentMapRelease(map);
+    return -1;
+}
+
+void FreeExtentMapRelease(struct FreeExtentMap *map)
+{
+    if (map == NULL) {
+        return;
+    }
+    free(map->groups);
+    free(map->flexes);
+    map->groups = NULL;
+    map->flexes = NULL;
+    map->group_count = 0;
+    map->flex_count = 0;
+}
+
+/*
+ * Print a histogram in the style of e2freefrag, then the largest runs
+ */
+void FreeExtentStatsPrint(struct FreeExtentStats *stats)
+{
+    uint64_t i = 0;
+    int b = 0;
+
+    printf("\tfree blocks: %llu, free extents: %llu, average: %llu blocks\n",
+            stats->free, stats->runs, stats->runs ? stats->free / stats->runs : 0);
+    for (b = 0; b < EXTENT_HIST_BUCKETS; b++) {
+        if (stats->hist[b] == 0) {
+            continue;
+        }
+        printf("\t%10llu ~ %-10llu: %llu\n", 1ULL << b, (2ULL << b) - 1, stats->hist[b]);
+    }
+    for (i = 0; i < stats->top_count; i++) {
+        printf("\tlargest %llu: %llu blocks at %llu\n", i + 1, stats->top[i].len, stats->top[i].start);
+    }
+}
+
+/*
+ * Print one line per flex group, then the whole filesystem in detail
+ */
+void FreeExtentMapPrint(struct FileSystem *fs, struct FreeExtentMap *map)
+{
+    struct FreeExtentStats *stats = NULL;
+    uint64_t i = 0;
+
+    if (fs == NULL || map == NULL || map->groups == NULL) {
+        printf("FreeExtentMapPrint cannot take a null pointer\n");
+        return;
+    }
+
+    for (i = 0; i < map->flex_count; i++) {
+        stats = &(map->flexes[i]);
+        printf("Flex group %llu (groups %llu ~ %llu): %llu free blocks in %llu extents, largest %llu\n",
+                i, i * map->flex_size, (i + 1) * map->flex_size - 1, stats->free, stats->runs,
+                stats->top_count ? stats->top[0].len : 0);
+    }
+    printf("Filesystem:\n");
+    FreeExtentStatsPrint(&(map->total));
+    printf("%llu groups, %llu per flex group, %llu read errors\n", map->group_count, map->flex_size, map->errors);
+    printf("Scanned %llu bytes of bitmaps by %s in %.3f s\n", map->bytes_scanned, ReadBatchBackendGet(fs), map->seconds);
+}
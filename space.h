@@ -0,0 +1,91 @@
+#ifndef SPACE_H
+#define SPACE_H
+
+#include "filesystem.h"
+
+/*
+ * Groups handed to a worker at once, and the size in blocks of the worker's
+ * buffer which holds all their bitmaps of one type
+ */
+#define SPACE_CHUNK_GROUPS  256
+#define SPACE_READ_BLOCKS   SPACE_CHUNK_GROUPS
+
+/* GroupSpace flags */
+#define SPACE_BLOCK_UNINIT  0x0001  /* block bitmap not initialized, count taken from the descriptor */
+#define SPACE_INODE_UNINIT  0x0002  /* inode bitmap not initialized, all inodes free */
+#define SPACE_ERROR         0x0004  /* a bitmap could not be read */
+
+struct GroupSpace {
+    uint32_t free_blocks;       /* clear bits in the block bitmap, clusters with bigalloc */
+    uint32_t free_inodes;       /* clear bits in the inode bitmap */
+    uint32_t desc_free_blocks;  /* what the descriptor says */
+    uint32_t desc_free_inodes;
+    uint32_t flags;
+};
+
+struct SpaceReport {
+    uint64_t group_count;
+    struct GroupSpace *groups;
+    uint64_t free_blocks;
+    uint64_t free_inodes;
+    uint64_t desc_free_blocks;
+    uint64_t desc_free_inodes;
+    uint64_t block_mismatches;  /* groups whose bitmap and descriptor disagree */
+    uint64_t inode_mismatches;
+    uint64_t errors;
+    uint64_t bytes_scanned;
+    double seconds;
+};
+
+/* Free extent histogram, bucket i counts runs of 2^i ~ 2^(i+1)-1 blocks */
+#define EXTENT_HIST_BUCKETS 32
+
+/* Largest free runs kept per group, per flex group and for the filesystem */
+#define EXTENT_TOP_RUNS     8
+
+struct FreeRun {
+    uint64_t start;     /* first block */
+    uint64_t len;       /* blocks */
+};
+
+struct FreeExtentStats {
+    uint64_t free;      /* free blocks */
+    uint64_t runs;      /* free extents */
+    uint64_t hist[EXTENT_HIST_BUCKETS];
+    uint64_t top_count;
+    struct FreeRun top[EXTENT_TOP_RUNS];    /* largest first */
+};
+
+struct GroupExtents {
+    struct FreeExtentStats stats;
+    struct FreeRun head;    /* run starting at the first block of the group, len 0 if none */
+    struct FreeRun tail;    /* run ending at the last block of the group */
+    uint64_t blocks;        /* blocks in the group, the last one may be short */
+    uint32_t flags;         /* SPACE_BLOCK_UNINIT, SPACE_ERROR */
+};
+
+/*
+ * Runs crossing group boundaries are joined in the flex group and
+ * filesystem statistics, not in the per group ones
+ */
+struct FreeExtentMap {
+    uint64_t group_count;
+    struct GroupExtents *groups;
+    uint64_t flex_size;     /* groups per flex group, 1 without flex_bg */
+    uint64_t flex_count;
+    struct FreeExtentStats *flexes;
+    struct FreeExtentStats total;
+    uint64_t errors;
+    uint64_t bytes_scanned;
+    double seconds;
+};
+
+int SpaceReportBuild(struct FileSystem *, int, struct SpaceReport *);
+void SpaceReportPrint(struct FileSystem *, struct SpaceReport *);
+void SpaceReportRelease(struct SpaceReport *);
+int FreeExtentMapBuild(struct FileSystem *, int, struct FreeExtentMap *);
+void FreeExtentStatsPrint(struct FreeExtentStats *);
+void FreeExtentMapPrint(struct FileSystem *, struct FreeExtentMap *);
+void FreeExtentMapRelease(struct FreeExtentMap *);
+
+#endif /* SPACE_H */
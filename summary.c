@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "summary.h"
+#include "scan.h"
+#include "workpool.h"
+#include "delta.h"
+
+#define SUMMARY_ALIGN(x) (((x) + 7) & ~7ULL)
+
+/*
+ * One inode in use as read by a worker, scattered into the columns once
+ * every group is scanned
+ */
+struct SummaryRow {
+    uint64_t size;
+    uint64_t blocks;
+    int64_t mtime;
+    uint32_t inode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t flags;
+    uint16_t mode;
+    uint16_t links;
+};
+
+/*
+ * Rows of one group, only the worker scanning the group appends
+ */
+struct SummaryGroup {
+    struct SummaryRow *rows;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t first;     /* row of the summary the group starts at */
+};
+
+struct SummaryContext {
+    struct FileSystem *fs;
+    char **bufs;
+    struct SummaryGroup *groups;
+    struct InodeSummary *summary;
+};
+
+static const uint64_t summary_widths[SUMMARY_COLUMNS] = {
+    sizeof(uint64_t), sizeof(uint64_t), sizeof(int64_t), sizeof(uint32_t), sizeof(uint32_t),
+    sizeof(uint32_t), sizeof(uint32_t), sizeof(uint16_t), sizeof(uint16_t),
+};
+
+static int SummaryRowAdd(struct SummaryGroup *g, struct SummaryRow *row)
+{
+    if (ArrayReserve((void **)&g->rows, &g->capacity, g->count, sizeof(struct SummaryRow), 1) < 0) {
+        return -1;
+    }
+    g->rows[g->count++] = *row;
+    return 0;
+}
+
+/*
+ * InodeScanFunc reading the hot fields of an inode, with the high halves
+ * the on-disk format keeps apart joined back
+ */
+static int SummaryInodeAdd(struct FileSystem *fs, uint64_t num, struct ext4_inode *pinode, void *arg)
+{
+    struct SummaryGroup *g = (struct SummaryGroup *)arg;
+    struct SummaryRow row;
+    uint64_t extra_end = offsetof(struct ext4_inode, i_mtime_extra) + sizeof(pinode->i_mtime_extra);
+
+    row.inode = num;
+    row.mode = le16toh(pinode->i_mode);
+    row.links = le16toh(pinode->i_links_count);
+    row.uid = (uint32_t)le16toh(pinode->i_uid) | (uint32_t)le16toh(pinode->osd2.linux2.l_i_uid_high) << 16;
+    row.gid = (uint32_t)le16toh(pinode->i_gid) | (uint32_t)le16toh(pinode->osd2.linux2.l_i_gid_high) << 16;
+    row.flags = le32toh(pinode->i_flags);
+    row.size = (uint64_t)le32toh(pinode->i_size_lo) | (uint64_t)le32toh(pinode->i_size_high) << 32;
+
+    row.blocks = le32toh(pinode->i_blocks_lo);
+    if (le32toh(fs->super.s_feature_ro_compat) & EXT4_FEATURE_RO_COMPAT_HUGE_FILE) {
+        row.blocks |= (uint64_t)le16toh(pinode->osd2.linux2.l_i_blocks_high) << 32;
+        if (row.flags & EXT4_HUGE_FILE_FL) {
+            row.blocks *= fs->block_size / 512;
+        }
+    }
+
+    /* The epoch bits extend the signed 32 bit seconds past 2038 */
+    row.mtime = (int32_t)le32toh(pinode->i_mtime);
+    if (le16toh(fs->super.s_inode_size) > EXT4_GOOD_OLD_INODE_SIZE &&
+            EXT4_GOOD_OLD_INODE_SIZE + le16toh(pinode->i_extra_isize) >= extra_end) {
+        row.mtime += (int64_t)(le32toh(pinode->i_mtime_extra) & EXT4_EPOCH_MASK) << 32;
+    }
+    return SummaryRowAdd(g, &row);
+}
+
+static int SummaryScanWork(struct WorkPool *pool, int worker, uint64_t group, void *data)
+{
+    struct SummaryContext *ctx = (struct SummaryContext *)data;
+
+    return InodeScanGroup(ctx->fs, group, SCAN_INUSE_ONLY, ctx->bufs[worker], SummaryInodeAdd, &ctx->groups[group]);
+}
+
+/*
+ * Copy the rows of a group into each column, groups land in disjoint
+ * ranges so the workers need no lock
+ */
+static int SummaryScatterWork(struct WorkPool *pool, int worker, uint64_t group, void *data)
+{
+    struct SummaryContext *ctx = (struct SummaryContext *)data;
+    struct SummaryGroup *g = &ctx->groups[group];
+    struct InodeSummary *s = ctx->summary;
+    struct SummaryRow *row = NULL;
+    uint64_t i = 0, j = 0;
+
+    for (i = 0; i < g->count; i++) {
+        row = &(g->rows[i]);
+        j = g->first + i;
+        s->size[j] = row->size;
+        s->blocks[j] = row->blocks;
+        s->mtime[j] = row->mtime;
+        s->inode[j] = row->inode;
+        s->uid[j] = row->uid;
+        s->gid[j] = row->gid;
+        s->flags[j] = row->flags;
+        s->mode[j] = row->mode;
+        s->links[j] = row->links;
+    }
+    free(g->rows);
+    g->rows = NULL;
+    return 0;
+}
+
+static int SummaryHeaderFill(struct FileSystem *fs, struct InodeSummaryHeader *hdr)
+{
+    memset(hdr, 0, sizeof(struct InodeSummaryHeader));
+    if (SidecarStampFill(fs, SUMMARY_MAGIC, SUMMARY_VERSION, sizeof(struct InodeSummaryHeader), &(hdr->stamp)) < 0) {
+        return -1;
+    }
+    hdr->inode_count = fs->inode_count;
+    return 0;
+}
+
+/*
+ * A saved summary is stamped with the image file, it only holds for reads
+ * of the image alone
+ */
+static bool SummaryImageOnly(struct FileSystem *fs)
+{
+    return fs->journal == NULL && !DeltaCovers(fs, 0, fs->image_size);
+}
+
+/*
+ * Point the column arrays of the summary into base
+ */
+static void SummaryColumnsSet(struct InodeSummary *s, struct InodeSummaryHeader *hdr)
+{
+    s->count = hdr->count;
+    s->size = (uint64_t *)(s->base + hdr->columns[SUMMARY_COLUMN_SIZE].offset);
+    s->blocks = (uint64_t *)(s->base + hdr->columns[SUMMARY_COLUMN_BLOCKS].offset);
+    s->mtime = (int64_t *)(s->base + hdr->columns[SUMMARY_COLUMN_MTIME].offset);
+    s->inode = (uint32_t *)(s->base + hdr->columns[SUMMARY_COLUMN_INODE].offset);
+    s->uid = (uint32_t *)(s->base + hdr->columns[SUMMARY_COLUMN_UID].offset);
+    s->gid = (uint32_t *)(s->base + hdr->columns[SUMMARY_COLUMN_GID].offset);
+    s->flags = (uint32_t *)(s->base + hdr->columns[SUMMARY_COLUMN_FLAGS].offset);
+    s->mode = (uint16_t *)(s->base + hdr->columns[SUMMARY_COLUMN_MODE].offset);
+    s->links = (uint16_t *)(s->base + hdr->columns[SUMMARY_COLUMN_LINKS].offset);
+}
+
+/*
+ * Build the summary of all inodes in use. Groups are spread over a pool
+ * of workers, each reading its groups into rows of their own; once every
+ * group is counted the rows are scattered, group by group, into columns
+ * allocated in the layout of the saved file.
+ * @fs: FileSystem
+ * @nr_workers: threads, 0 for one per CPU
+ * @s: filled in, released by InodeSummaryRelease
+ * Return 0 on success, -1 on failure
+ */
+int InodeSummaryBuild(struct FileSystem *fs, int nr_workers, struct InodeSummary *s)
+{
+    struct SummaryContext ctx;
+    struct InodeSummaryHeader *hdr = NULL;
+    struct timespec begin, end;
+    uint64_t *groups = NULL;
+    uint64_t i = 0, count = 0, offset = 0;
+    int w = 0;
+    int ret = -1;
+
+    if (fs == NULL || s == NULL) {
+        return -1;
+    }
+    memset(s, 0, sizeof(struct InodeSummary));
+    memset(&ctx, 0, sizeof(struct SummaryContext));
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    nr_workers = WorkPoolWorkersGet(nr_workers);
+    if ((uint64_t)nr_workers > fs->group_count) {
+        nr_workers = fs->group_count;
+    }
+    if (GroupDescriptorsFetch(fs) == (uint64_t)-1) {
+        return -1;
+    }
+    ctx.fs = fs;
+    ctx.summary = s;
+    ctx.bufs = (char **) calloc(nr_workers, sizeof(char *));
+    ctx.groups = (struct SummaryGroup *) calloc(fs->group_count, sizeof(struct SummaryGroup));
+    groups = (uint64_t *) malloc(sizeof(uint64_t) * fs->group_count);
+    if (ctx.bufs == NULL || ctx.groups == NULL || groups == NULL) {
+        printf("InodeSummaryBuild: allocate memory failed\n");
+        goto end;
+    }
+    for (w = 0; w < nr_workers; w++) {
+        ctx.bufs[w] = (char *) malloc(InodeScanBufferSizeGet(fs));
+        if (ctx.bufs[w] == NULL) {
+            printf("InodeSummaryBuild: allocate memory failed\n");
+            goto end;
+        }
+    }
+    for (i = 0; i < fs->group_count; i++) {
+        groups[i] = i;
+    }
+
+    if (WorkPoolRun(nr_workers, groups, fs->group_count, SummaryScanWork, &ctx) != 0) {
+        printf("InodeSummaryBuild: inode scan failed\n");
+        goto end;
+    }
+
+    for (i = 0; i < fs->group_count; i++) {
+        ctx.groups[i].first = count;
+        count += ctx.groups[i].count;
+    }
+    s->base_size = SUMMARY_ALIGN(sizeof(struct InodeSummaryHeader));
+    for (i = 0; i < SUMMARY_COLUMNS; i++) {
+        s->base_size += SUMMARY_ALIGN(summary_widths[i] * count);
+    }
+    s->base = (char *) calloc(1, s->base_size);
+    if (s->base == NULL) {
+        printf("InodeSummaryBuild: allocate memory failed\n");
+        goto end;
+    }
+    hdr = (struct InodeSummaryHeader *)s->base;
+    if (SummaryHeaderFill(fs, hdr) < 0) {
+        goto end;
+    }
+    hdr->count = count;
+    offset = SUMMARY_ALIGN(sizeof(struct InodeSummaryHeader));
+    for (i = 0; i < SUMMARY_COLUMNS; i++) {
+        hdr->columns[i].offset = offset;
+        hdr->columns[i].size = summary_widths[i] * count;
+        offset += SUMMARY_ALIGN(hdr->columns[i].size);
+    }
+    SummaryColumnsSet(s, hdr);
+
+    if (WorkPoolRun(nr_workers, groups, fs->group_count, SummaryScatterWork, &ctx) != 0) {
+        printf("InodeSummaryBuild: scatter failed\n");
+        goto end;
+    }
+    ret = 0;
+end:
+    if (ctx.bufs != NULL) {
+        for (w = 0; w < nr_workers; w++) {
+            free(ctx.bufs[w]);
+        }
+    }
+    if (ctx.groups != NULL) {
+        for (i = 0; i < fs->group_count; i++) {
+            free(ctx.groups[i].rows);
+        }
+    }
+    free(ctx.bufs);
+    free(ctx.groups);
+    free(groups);
+    if (ret < 0) {
+        InodeSummaryRelease(s);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    s->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return ret;
+}
+
+void InodeSummaryRelease(struct InodeSummary *s)
+{
+    if (s == NULL) {
+        return;
+    }
+    if (s->mapped) {
+        munmap(s->base, s->base_size);
+    } else {
+        free(s->base);
+    }
+    memset(s, 0, sizeof(struct InodeSummary));
+}
+
+/*
+ * Save the summary of the image alone, written to a temporary file renamed over path so a
+ * reader never sees half of it. The columns are kept as they are in
+ * memory, in host byte order like every sidecar file, any tool reading
+ * arrays of this machine at the offsets of the header can use the file.
+ * Return 0 on success, -1 on failure
+ */
+int InodeSummarySave(struct FileSystem *fs, struct InodeSummary *s, const char *path)
+{
+    char *tmp = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (fs == NULL || s == NULL || s->base == NULL || path == NULL) {
+        return -1;
+    }
+    if (!SummaryImageOnly(fs)) {
+        printf("InodeSummarySave: the summary has writes of the journal or the delta, not saved\n");
+        return -1;
+    }
+    tmp = (char *) malloc(strlen(path) + 5);
+    if (tmp == NULL) {
+        return -1;
+    }
+    sprintf(tmp, "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("InodeSummarySave: open");
+        goto end;
+    }
+    if (PositionalWrite(fd, s->base, s->base_size, 0) != s->base_size || fsync(fd) < 0) {
+        perror("InodeSummarySave: write");
+        goto end;
+    }
+    close(fd);
+    fd = -1;
+    if (rename(tmp, path) < 0) {
+        perror("InodeSummarySave: rename");
+        goto end;
+    }
+    ret = 0;
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (ret < 0) {
+        unlink(tmp);
+    }
+    free(tmp);
+    return ret;
+}
+
+/*
+ * Map a summary saved by InodeSummarySave, the columns are used in place
+ * Return 0 on success, -1 if the file cannot be read, was saved for
+ * another filesystem or before the image was last written, or the
+ * journal or the delta change what the image reads as
+ */
+int InodeSummaryLoad(struct FileSystem *fs, const char *path, struct InodeSummary *s)
+{
+    struct InodeSummaryHeader *hdr = NULL;
+    struct timespec begin, end;
+    struct stat st;
+    int fd = -1;
+    int i = 0;
+    int status = 0;
+
+    if (fs == NULL || path == NULL || s == NULL) {
+        return -1;
+    }
+    memset(s, 0, sizeof(struct InodeSummary));
+    if (!SummaryImageOnly(fs)) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < sizeof(struct InodeSummaryHeader)) {
+        close(fd);
+        return -1;
+    }
+    s->base_size = st.st_size;
+    s->base = (char *) mmap(NULL, s->base_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->base == MAP_FAILED) {
+        s->base = NULL;
+        return -1;
+    }
+    s->mapped = true;
+    hdr = (struct InodeSummaryHeader *)s->base;
+
+    status = SidecarStampCheck(fs, &(hdr->stamp), SUMMARY_MAGIC, SUMMARY_VERSION, sizeof(struct InodeSummaryHeader),
+            SIDECAR_CHECK_SUPER | SIDECAR_CHECK_IMAGE);
+    if (status == SIDECAR_FOREIGN) {
+        printf("InodeSummaryLoad: %s is not an inode summary of this version\n", path);
+        goto fail;
+    }
+    if (status != SIDECAR_CURRENT || hdr->inode_count != fs->inode_count) {
+        printf("InodeSummaryLoad: %s is stale\n", path);
+        goto fail;
+    }
+    for (i = 0; i < SUMMARY_COLUMNS; i++) {
+        if (hdr->count > hdr->inode_count || hdr->columns[i].size != summary_widths[i] * hdr->count ||
+                (hdr->columns[i].offset & 7) != 0 || hdr->columns[i].offset > s->base_size ||
+                hdr->columns[i].size > s->base_size - hdr->columns[i].offset) {
+            printf("InodeSummaryLoad: %s is truncated or corrupt\n", path);
+            goto fail;
+        }
+    }
+    SummaryColumnsSet(s, hdr);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    s->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return 0;
+fail:
+    InodeSummaryRelease(s);
+    return -1;
+}
+
+void InodeSummaryPrint(struct InodeSummary *s)
+{
+    printf("%llu inodes, %llu bytes of columns, %s, %.3f s\n", s->count,
+            s->base_size - SUMMARY_ALIGN(sizeof(struct InodeSummaryHeader)),
+            s->mapped ? "mapped" : "built", s->seconds);
+}
+
+static int SummaryUidTotalCompare(const void *a, const void *b)
+{
+    const struct SummaryUidTotal *x = (const struct SummaryUidTotal *)a;
+    const struct SummaryUidTotal *y = (const struct SummaryUidTotal *)b;
+
+    if (x->uid != y->uid) {
+        return x->uid < y->uid ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Insert uid into an open addressing table of capacity slots, a power of
+ * two; slots with no inodes are free
+ */
+static struct SummaryUidTotal *SummaryUidSlotGet(struct SummaryUidTotal *table, uint64_t capacity, uint32_t uid)
+{
+    uint64_t h = ((uint64_t)uid * 0x9E3779B97F4A7C15ULL) >> 32;
+
+    for (h &= capacity - 1; table[h].inodes != 0 && table[h].uid != uid; h = (h + 1) & (capacity - 1)) {
+    }
+    table[h].uid = uid;
+    return &table[h];
+}
+
+/*
+ * Totals per owner in one pass over the uid, mode, size and blocks columns
+ * @totals: set to an array sorted by uid, freed by the caller
+ * Return the number of owners, -1 on failure
+ */
+int64_t InodeSummaryUidTotalsGet(struct InodeSummary *s, struct SummaryUidTotal **totals)
+{
+    struct SummaryUidTotal *table = NULL, *grown = NULL, *t = NULL;
+    uint64_t capacity = 64, used = 0, i = 0, j = 0;
+    uint64_t file = 0;
+
+    if (s == NULL || totals == NULL) {
+        return -1;
+    }
+    table = (struct SummaryUidTotal *) calloc(capacity, sizeof(struct SummaryUidTotal));
+    if (table == NULL) {
+        return -1;
+    }
+    for (i = 0; i < s->count; i++) {
+        /* Keep the table at most half full so probes stay short */
+        if ((used + 1) * 2 > capacity) {
+            grown = (struct SummaryUidTotal *) calloc(capacity * 2, sizeof(struct SummaryUidTotal));
+            if (grown == NULL) {
+                free(table);
+                return -1;
+            }
+            for (j = 0; j < capacity; j++) {
+                if (table[j].inodes != 0) {
+                    *SummaryUidSlotGet(grown, capacity * 2, table[j].uid) = table[j];
+                }
+            }
+            free(table);
+            table = grown;
+            capacity *= 2;
+        }
+        t = SummaryUidSlotGet(table, capacity, s->uid[i]);
+        used += t->inodes == 0;
+        file = (s->mode[i] & 0xF000) == 0x8000;
+        t->inodes++;
+        t->files += file;
+        t->bytes += s->size[i] & -file;
+        t->allocated += s->blocks[i] * 512;
+    }
+
+    for (i = 0, j = 0; i < capacity; i++) {
+        if (table[i].inodes != 0) {
+            table[j++] = table[i];
+        }
+    }
+    qsort(table, j, sizeof(struct SummaryUidTotal), SummaryUidTotalCompare);
+    *totals = table;
+    return j;
+}
+
+/*
+ * Count the regular files last modified before a time, the loop has no
+ * branch on the data so the compiler can vectorize it
+ * @before: seconds since the epoch
+ * @bytes: if not NULL, set to the sum of their sizes
+ */
+uint64_t InodeSummaryOlderCount(struct InodeSummary *s, int64_t before, uint64_t *bytes)
+{
+    uint64_t i = 0, count = 0, total = 0, hit = 0;
+
+    if (s == NULL) {
+        return 0;
+    }
+    for (i = 0; i < s->count; i++) {
+        hit = (s->mtime[i] < before) & ((s->mode[i] & 0xF000) == 0x8000);
+        count += hit;
+        total += s->size[i] & -hit;
+    }
+    if (bytes != NULL) {
+        *bytes = total;
+    }
+    return count;
+}
@@ -0,0 +1,74 @@
+#ifndef SUMMARY_H
+#define SUMMARY_H
+
+#include "filesystem.h"
+#include "sidecar.h"
+
+/* Saved summaries start with this and are refused by other versions */
+#define SUMMARY_MAGIC           "LSFSSUMM"
+#define SUMMARY_VERSION         1
+
+/* Columns of the summary, in file order, the widest first */
+#define SUMMARY_COLUMN_SIZE     0   /* uint64_t i_size */
+#define SUMMARY_COLUMN_BLOCKS   1   /* uint64_t 512 byte sectors allocated */
+#define SUMMARY_COLUMN_MTIME    2   /* int64_t seconds since the epoch */
+#define SUMMARY_COLUMN_INODE    3   /* uint32_t inode number */
+#define SUMMARY_COLUMN_UID      4   /* uint32_t */
+#define SUMMARY_COLUMN_GID      5   /* uint32_t */
+#define SUMMARY_COLUMN_FLAGS    6   /* uint32_t i_flags */
+#define SUMMARY_COLUMN_MODE     7   /* uint16_t i_mode */
+#define SUMMARY_COLUMN_LINKS    8   /* uint16_t i_links_count */
+#define SUMMARY_COLUMNS         9
+
+struct SummaryColumn {
+    uint64_t offset;    /* from the start of the file, 8 byte aligned */
+    uint64_t size;
+};
+
+/* Header of a saved summary, the columns follow */
+struct InodeSummaryHeader {
+    struct SidecarStamp stamp;
+    uint64_t inode_count;
+    uint64_t count;
+    struct SummaryColumn columns[SUMMARY_COLUMNS];
+};
+
+/*
+ * The hot fields of every inode in use, sorted by inode number, one array
+ * per field. Built in memory or mapped from a saved file, both laid out
+ * the way the file is, so saving is one write and loading one mmap.
+ */
+struct InodeSummary {
+    uint64_t count;
+    uint64_t *size;
+    uint64_t *blocks;
+    int64_t *mtime;
+    uint32_t *inode;
+    uint32_t *uid;
+    uint32_t *gid;
+    uint32_t *flags;
+    uint16_t *mode;
+    uint16_t *links;
+    char *base;         /* the header and the columns */
+    uint64_t base_size;
+    bool mapped;
+    double seconds;
+};
+
+struct SummaryUidTotal {
+    uint32_t uid;
+    uint64_t inodes;
+    uint64_t files;     /* regular files */
+    uint64_t bytes;     /* i_size of the regular files */
+    uint64_t allocated; /* bytes of all blocks of all inodes */
+};
+
+int InodeSummaryBuild(struct FileSystem *, int, struct InodeSummary *);
+int InodeSummarySave(struct FileSystem *, struct InodeSummary *, const char *);
+int InodeSummaryLoad(struct FileSystem *, const char *, struct InodeSummary *);
+void InodeSummaryRelease(struct InodeSummary *);
+void InodeSummaryPrint(struct InodeSummary *);
+int64_t InodeSummaryUidTotalsGet(struct InodeSummary *, struct SummaryUidTotal **);
+uint64_t InodeSummaryOlderCount(struct InodeSummary *, int64_t, uint64_t *);
+
+#endif /* SUMMARY_H */
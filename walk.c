@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+
+#include "walk.h"
+#include "dir.h"
+#include "workpool.h"
+
+/*
+ * Entries found during the walk, each worker appends to its own array and
+ * names a new entry with id worker << WALK_ID_SHIFT | index
+ */
+struct WalkEntry {
+    uint64_t parent;    /* id of the directory entry */
+    uint64_t name;      /* offset in the worker's names */
+    uint32_t inode;
+    uint8_t name_len;
+    uint8_t file_type;
+};
+
+/*
+ * Only the owner appends. Others read the entry of a directory pushed to
+ * them, which was written before the push, and take lock against the
+ * array moving under them.
+ */
+struct WalkWorker {
+    pthread_mutex_t lock;
+    struct WalkEntry *entries;
+    uint64_t count;
+    uint64_t capacity;
+    char *names;
+    uint64_t names_size;
+    uint64_t names_capacity;
+    uint64_t dirs;
+    uint64_t errors;
+};
+
+struct WalkContext {
+    struct FileSystem *fs;
+    int nr_workers;
+    struct WalkWorker *workers;
+    uint8_t *visited;   /* one bit per inode, directories already pushed */
+};
+
+struct InodeKey {
+    uint32_t inode;
+    uint32_t index;
+};
+
+struct NameKey {
+    const char *name;
+    uint32_t index;
+    uint8_t name_len;
+};
+
+static double WalkSecondsGet(struct timespec *begin)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+static uint32_t WalkEntryInodeGet(struct WalkContext *ctx, uint64_t id)
+{
+    struct WalkWorker *w = &(ctx->workers[id >> WALK_ID_SHIFT]);
+    uint32_t inode = 0;
+
+    pthread_mutex_lock(&w->lock);
+    inode = w->entries[id & ((1ULL << WALK_ID_SHIFT) - 1)].inode;
+    pthread_mutex_unlock(&w->lock);
+    return inode;
+}
+
+/*
+ * Return the id of the new entry, -1 if memory runs out
+ */
+static int64_t WalkEntryAdd(struct WalkWorker *w, int worker, uint64_t parent, uint32_t inode,
+        const char *name, uint8_t name_len, uint8_t file_type)
+{
+    struct WalkEntry *e = NULL;
+    int ret = 0;
+
+    if (w->count == w->capacity) {
+        pthread_mutex_lock(&w->lock);
+        ret = ArrayReserve((void **)&w->entries, &w->capacity, w->count, sizeof(struct WalkEntry), 1);
+        pthread_mutex_unlock(&w->lock);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+    if (ArrayReserve((void **)&w->names, &w->names_capacity, w->names_size, 1, name_len) < 0) {
+        return -1;
+    }
+
+    if (name_len > 0) {
+        memcpy(w->names + w->names_size, name, name_len);
+    }
+    e = &(w->entries[w->count]);
+    e->parent = parent;
+    e->name = w->names_size;
+    e->inode = inode;
+    e->name_len = name_len;
+    e->file_type = file_type;
+    w->names_size += name_len;
+    return (uint64_t)worker << WALK_ID_SHIFT | w->count++;
+}
+
+static int WalkWork(struct WorkPool *pool, int worker, uint64_t item, void *data)
+{
+    struct WalkContext *ctx = (struct WalkContext *)data;
+    struct WalkWorker *w = &(ctx->workers[worker]);
+    struct FileSystem *fs = ctx->fs;
+    struct DirIterator it;
+    struct ext4_dir_entry_2 *de = NULL;
+    struct ext4_inode inode;
+    uint32_t num = 0;
+    uint8_t type = 0, bit = 0;
+    int64_t id = 0;
+
+    if (DirOpen(fs, WalkEntryInodeGet(ctx, item), &it) < 0) {
+        w->errors++;
+        return 0;
+    }
+    w->dirs++;
+    while ((de = DirNext(&it)) != NULL) {
+        if ((de->name_len == 1 && de->name[0] == '.') ||
+                (de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.')) {
+            continue;
+        }
+        num = le32toh(de->inode);
+        if (num > fs->inode_count) {
+            continue;
+        }
+        type = de->file_type & 7;
+        /* Without the filetype feature only the inode knows */
+        if (type == EXT4_FT_UNKNOWN && InodeGetBynum(fs, num, &inode) != 0 &&
+                (le16toh(inode.i_mode) & 0xF000) == 0x4000) {
+            type = EXT4_FT_DIR;
+        }
+        id = WalkEntryAdd(w, worker, item, num, de->name, de->name_len, type);
+        if (id < 0) {
+            DirClose(&it);
+            return -1;
+        }
+        if (type != EXT4_FT_DIR) {
+            continue;
+        }
+        /* A directory is walked once even if corruption links it twice */
+        bit = 1 << ((num - 1) % 8);
+        if (__atomic_fetch_or(&ctx->visited[(num - 1) / 8], bit, __ATOMIC_RELAXED) & bit) {
+            continue;
+        }
+        if (WorkPoolPush(pool, worker, id) < 0) {
+            DirClose(&it);
+            return -1;
+        }
+    }
+    if (it.error != 0) {
+        w->errors++;
+    }
+    DirClose(&it);
+    return 0;
+}
+
+static int NameKeyCompare(const void *a, const void *b)
+{
+    const struct NameKey *x = (const struct NameKey *)a;
+    const struct NameKey *y = (const struct NameKey *)b;
+    int ret = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+
+    if (ret != 0) {
+        return ret;
+    }
+    return (int)x->name_len - (int)y->name_len;
+}
+
+static int InodeKeyCompare(const void *a, const void *b)
+{
+    const struct InodeKey *x = (const struct InodeKey *)a;
+    const struct InodeKey *y = (const struct InodeKey *)b;
+
+    if (x->inode != y->inode) {
+        return x->inode < y->inode ? -1 : 1;
+    }
+    if (x->index != y->index) {
+        return x->index < y->index ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Gather the entries of all workers into the index, numbered breadth
+ * first with the names of each directory sorted, which does not depend on
+ * how the walk was scheduled
+ */
+static int WalkIndexBuild(struct WalkContext *ctx, struct NamespaceIndex *index)
+{
+    struct WalkWorker *w = NULL;
+    struct WalkEntry *e = NULL;
+    struct NamespaceEntry *out = NULL;
+    struct NameKey *keys = NULL;
+    struct InodeKey *inodes = NULL;
+    uint64_t *base = NULL, *names_base = NULL, *start = NULL, *parent = NULL;
+    uint32_t *renumber = NULL, *order = NULL;
+    uint64_t count = 0, names_size = 0, id = 0, g = 0, i = 0, n = 0, tail = 0;
+    int k = 0;
+    int ret = -1;
+
+    base = (uint64_t *) calloc(ctx->nr_workers, sizeof(uint64_t));
+    names_base = (uint64_t *) calloc(ctx->nr_workers, sizeof(uint64_t));
+    if (base == NULL || names_base == NULL) {
+        goto end;
+    }
+    for (k = 0; k < ctx->nr_workers; k++) {
+        base[k] = count;
+        names_base[k] = names_size;
+        count += ctx->workers[k].count;
+        names_size += ctx->workers[k].names_size;
+    }
+    if (count > UINT32_MAX) {
+        printf("NamespaceWalk: %llu names do not fit the index\n", count);
+        goto end;
+    }
+
+    /* Group the names of each directory with a counting sort on the parent */
+    start = (uint64_t *) calloc(count + 1, sizeof(uint64_t));
+    parent = (uint64_t *) malloc(sizeof(uint64_t) * count);
+    keys = (struct NameKey *) malloc(sizeof(struct NameKey) * count);
+    index->names = (char *) malloc(names_size ? names_size : 1);
+    if (start == NULL || parent == NULL || keys == NULL || index->names == NULL) {
+        goto end;
+    }
+    for (k = 0; k < ctx->nr_workers; k++) {
+        w = &(ctx->workers[k]);
+        if (w->names_size > 0) {
+            memcpy(index->names + names_base[k], w->names, w->names_size);
+        }
+        for (i = 0; i < w->count; i++) {
+            e = &(w->entries[i]);
+            g = base[k] + i;
+            parent[g] = base[e->parent >> WALK_ID_SHIFT] + (e->parent & ((1ULL << WALK_ID_SHIFT) - 1));
+            if (g != 0) {
+                start[parent[g] + 1]++;
+            }
+        }
+    }
+    for (i = 0; i < count; i++) {
+        start[i + 1] += start[i];
+    }
+    for (k = 0; k < ctx->nr_workers; k++) {
+        w = &(ctx->workers[k]);
+        for (i = 0; i < w->count; i++) {
+            g = base[k] + i;
+            if (g == 0) {
+                continue;
+            }
+            n = start[parent[g]]++;
+            keys[n].name = index->names + names_base[k] + w->entries[i].name;
+            keys[n].name_len = w->entries[i].name_len;
+            keys[n].index = g;
+        }
+    }
+    /* start[p] is now the end of the names of p, which is where p + 1 begins */
+    for (i = count; i > 0; i--) {
+        start[i] = start[i - 1];
+    }
+    start[0] = 0;
+    for (i = 0; i < count; i++) {
+        if (start[i + 1] - start[i] > 1) {
+            qsort(keys + start[i], start[i + 1] - start[i], sizeof(struct NameKey), NameKeyCompare);
+        }
+    }
+
+    /* Breadth first from the root */
+    order = (uint32_t *) malloc(sizeof(uint32_t) * count);
+    renumber = (uint32_t *) malloc(sizeof(uint32_t) * count);
+    if (order == NULL || renumber == NULL) {
+        goto end;
+    }
+    order[0] = 0;
+    tail = 1;
+    for (i = 0; i < tail; i++) {
+        renumber[order[i]] = i;
+        for (n = start[order[i]]; n < start[order[i] + 1]; n++) {
+            order[tail++] = keys[n].index;
+        }
+    }
+
+    out = (struct NamespaceEntry *) malloc(sizeof(struct NamespaceEntry) * count);
+    inodes = (struct InodeKey *) malloc(sizeof(struct InodeKey) * count);
+    index->by_inode = (uint32_t *) malloc(sizeof(uint32_t) * count);
+    if (out == NULL || inodes == NULL || index->by_inode == NULL) {
+        goto end;
+    }
+    for (k = 0; k < ctx->nr_workers; k++) {
+        w = &(ctx->workers[k]);
+        for (i = 0; i < w->count; i++) {
+            g = base[k] + i;
+            id = renumber[g];
+            e = &(w->entries[i]);
+            out[id].inode = e->inode;
+            out[id].parent = renumber[parent[g]];
+            out[id].name = names_base[k] + e->name;
+            out[id].name_len = e->name_len;
+            out[id].file_type = e->file_type;
+            inodes[id].inode = e->inode;
+            inodes[id].index = id;
+        }
+    }
+    qsort(inodes, count, sizeof(struct InodeKey), InodeKeyCompare);
+    for (i = 0; i < count; i++) {
+        index->by_inode[i] = inodes[i].index;
+    }
+
+    index->entries = out;
+    index->count = count;
+    index->names_size = names_size;
+    out = NULL;
+    ret = 0;
+end:
+    free(base);
+    free(names_base);
+    free(start);
+    free(parent);
+    free(keys);
+    free(order);
+    free(renumber);
+    free(out);
+    free(inodes);
+    return ret;
+}
+
+/*
+ * Walk the whole namespace from the root with a pool of threads and
+ * index it. Each directory is a work item, the entries it holds are
+ * kept by the worker that read it and subdirectories are pushed to the
+ * same worker, others steal them when they run dry.
+ * @fs: FileSystem
+ * @nr_workers: threads, 0 for one per CPU
+ * @index: filled in, released by NamespaceIndexRelease
+ * Return 0 on success, -1 on failure. Unreadable directories are counted
+ * in index->errors and skipped.
+ */
+int NamespaceWalk(struct FileSystem *fs, int nr_workers, struct NamespaceIndex *index)
+{
+    struct WalkContext ctx;
+    struct timespec begin;
+    uint64_t root = 0;
+    int k = 0;
+    int ret = -1;
+
+    if (fs == NULL || index == NULL) {
+        return -1;
+    }
+    memset(index, 0, sizeof(struct NamespaceIndex));
+    memset(&ctx, 0, sizeof(struct WalkContext));
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    nr_workers = WorkPoolWorkersGet(nr_workers);
+    ctx.fs = fs;
+    ctx.nr_workers = nr_workers;
+    ctx.workers = (struct WalkWorker *) calloc(nr_workers, sizeof(struct WalkWorker));
+    ctx.visited = (uint8_t *) calloc(fs->inode_count / 8 + 1, 1);
+    if (ctx.workers == NULL || ctx.visited == NULL) {
+        printf("NamespaceWalk: allocate memory failed\n");
+        goto end;
+    }
+    for (k = 0; k < nr_workers; k++) {
+        pthread_mutex_init(&ctx.workers[k].lock, NULL);
+    }
+
+    /* The root is entry 0 of worker 0 and its own parent */
+    if (WalkEntryAdd(&ctx.workers[0], 0, 0, EXT4_ROOT_INO, "", 0, EXT4_FT_DIR) < 0) {
+        goto end;
+    }
+    ctx.visited[(EXT4_ROOT_INO - 1) / 8] |= 1 << ((EXT4_ROOT_INO - 1) % 8);
+    if (WorkPoolRun(nr_workers, &root, 1, WalkWork, &ctx) != 0) {
+        printf("NamespaceWalk: walk failed\n");
+        goto end;
+    }
+
+    if (WalkIndexBuild(&ctx, index) < 0) {
+        printf("NamespaceWalk: build index failed\n");
+        NamespaceIndexRelease(index);
+        goto end;
+    }
+    for (k = 0; k < nr_workers; k++) {
+        index->dirs += ctx.workers[k].dirs;
+        index->errors += ctx.workers[k].errors;
+    }
+    ret = 0;
+end:
+    if (ctx.workers != NULL) {
+        for (k = 0; k < nr_workers; k++) {
+            pthread_mutex_destroy(&ctx.workers[k].lock);
+            free(ctx.workers[k].entries);
+            free(ctx.workers[k].names);
+        }
+    }
+    free(ctx.workers);
+    free(ctx.visited);
+    index->seconds = WalkSecondsGet(&begin);
+    return ret;
+}
+
+void NamespaceIndexRelease(struct NamespaceIndex *index)
+{
+    if (index == NULL) {
+        return;
+    }
+    if (!index->mapped) {
+        free(index->entries);
+        free(index->names);
+        free(index->by_inode);
+    }
+    index->entries = NULL;
+    index->names = NULL;
+    index->by_inode = NULL;
+    index->count = 0;
+}
+
+/*
+ * Compare entry e with a name in the directory parent
+ */
+static int EntryCompare(struct NamespaceIndex *index, uint64_t e, uint32_t parent, const char *name, uint32_t len)
+{
+    struct NamespaceEntry *entry = &(index->entries[e]);
+    int ret = 0;
+
+    if (entry->parent != parent) {
+        return entry->parent < parent ? -1 : 1;
+    }
+    ret = memcmp(index->names + entry->name, name, entry->name_len < len ? entry->name_len : len);
+    if (ret != 0) {
+        return ret;
+    }
+    return (int)entry->name_len - (int)len;
+}
+
+/*
+ * Find the entry of a path, "." and ".." are understood but symbolic
+ * links are not followed
+ * Return the entry, -1 if the path is not in the index
+ */
+int64_t NamespaceLookup(struct NamespaceIndex *index, const char *path)
+{
+    const char *name = NULL;
+    uint64_t low = 0, high = 0, mid = 0;
+    uint32_t cur = 0, len = 0;
+    int cmp = 0;
+
+    if (index == NULL || index->count == 0 || path == NULL) {
+        return -1;
+    }
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        name = path;
+        while (*path != '/' && *path != '\0') {
+            path++;
+        }
+        len = path - name;
+        if (len == 0 || (len == 1 && name[0] == '.')) {
+            continue;
+        }
+        if (len == 2 && name[0] == '.' && name[1] == '.') {
+            cur = index->entries[cur].parent;
+            continue;
+        }
+
+        /* Entry 0 is the root, it is nobody's child */
+        low = 1;
+        high = index->count;
+        while (low < high) {
+            mid = low + (high - low) / 2;
+            cmp = EntryCompare(index, mid, cur, name, len);
+            if (cmp == 0) {
+                break;
+            }
+            if (cmp < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low >= high) {
+            return -1;
+        }
+        cur = mid;
+    }
+    return cur;
+}
+
+/*
+ * Find the entries of an inode
+ * @first: set to the position of the first one in by_inode
+ * Return how many entries name the inode
+ */
+uint64_t NamespaceInodeFind(struct NamespaceIndex *index, uint32_t inode, uint64_t *first)
+{
+    uint64_t low = 0, high = 0, mid = 0, end = 0;
+
+    if (index == NULL || index->count == 0) {
+        return 0;
+    }
+    high = index->count;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (index->entries[index->by_inode[mid]].inode < inode) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (end = low; end < index->count && index->entries[index->by_inode[end]].inode == inode; end++) {
+    }
+    if (first != NULL) {
+        *first = low;
+    }
+    return end - low;
+}
+
+/*
+ * Write the full path of an entry into buf
+ * Return its length, 0 if it does not fit in size bytes with the NUL
+ */
+uint64_t NamespacePathGet(struct NamespaceIndex *index, uint64_t e, char *buf, uint64_t size)
+{
+    struct NamespaceEntry *entry = NULL;
+    uint64_t len = 0, pos = 0, cur = e, depth = 0;
+
+    if (index == NULL || e >= index->count || size < 2) {
+        return 0;
+    }
+    if (e == 0) {
+        strcpy(buf, "/");
+        return 1;
+    }
+    /* Measure first, then fill from the end */
+    for (cur = e; cur != 0 && depth < index->count; cur = index->entries[cur].parent, depth++) {
+        len += 1 + index->entries[cur].name_len;
+    }
+    if (cur != 0 || len + 1 > size) {
+        return 0;
+    }
+    pos = len;
+    buf[pos] = '\0';
+    for (cur = e; cur != 0; cur = entry->parent) {
+        entry = &(index->entries[cur]);
+        pos -= entry->name_len;
+        memcpy(buf + pos, index->names + entry->name, entry->name_len);
+        buf[--pos] = '/';
+    }
+    return len;
+}
+
+void NamespaceIndexPrint(struct NamespaceIndex *index)
+{
+    printf("%llu names, %llu directories, %llu unreadable, %.3f s, %.0f names/s%s\n",
+            index->count, index->dirs, index->errors, index->seconds,
+            index->seconds > 0 ? index->count / index->seconds : 0.0, index->mapped ? ", from the index" : "");
+}
@@ -0,0 +1,42 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include "filesystem.h"
+
+/* Bits of a walk entry id holding the index in the worker's entries */
+#define WALK_ID_SHIFT   40
+
+/*
+ * One name in the namespace. Hard links give an inode several entries,
+ * the root is entry 0 and its own parent.
+ * Entries are numbered breadth first with the names of a directory in
+ * order, so the whole array is sorted by parent then name.
+ */
+struct NamespaceEntry {
+    uint32_t inode;
+    uint32_t parent;    /* entry of the directory holding the name */
+    uint64_t name;      /* offset in names */
+    uint8_t name_len;
+    uint8_t file_type;
+};
+
+struct NamespaceIndex {
+    uint64_t count;
+    struct NamespaceEntry *entries;
+    char *names;
+    uint64_t names_size;
+    uint32_t *by_inode;     /* entries sorted by inode */
+    uint64_t dirs;
+    uint64_t errors;        /* directories that could not be read */
+    double seconds;
+    bool mapped;            /* the arrays are those of the sidecar index, not freed */
+};
+
+int NamespaceWalk(struct FileSystem *, int, struct NamespaceIndex *);
+void NamespaceIndexRelease(struct NamespaceIndex *);
+int64_t NamespaceLookup(struct NamespaceIndex *, const char *);
+uint64_t NamespaceInodeFind(struct NamespaceIndex *, uint32_t, uint64_t *);
+uint64_t NamespacePathGet(struct NamespaceIndex *, uint64_t, char *, uint64_t);
+void NamespaceIndexPrint(struct NamespaceIndex *);
+
+#endif /* WALK_H */
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workpool.h"
+
+struct WorkerArg {
+    struct WorkPool *pool;
+    int id;
+};
+
+/*
+ * Resolve the number of workers, 0 or less means one per online CPU
+ */
+int WorkPoolWorkersGet(int nr_workers)
+{
+    long cpus = 0;
+
+    if (nr_workers > 0) {
+        return nr_workers;
+    }
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return (int)cpus;
+}
+
+/*
+ * Append an item at the tail of the queue, caller holds q->lock
+ */
+static int QueueAppend(struct WorkQueue *q, uint64_t item)
+{
+    uint64_t *items = NULL;
+    uint64_t i = 0;
+
+    if (q->count == q->capacity) {
+        items = (uint64_t *) malloc(sizeof(uint64_t) * (q->capacity ? q->capacity * 2 : 64));
+        if (items == NULL) {
+            return -1;
+        }
+        for (i = 0; i < q->count; i++) {
+            items[i] = q->items[(q->head + i) % q->capacity];
+        }
+        free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->capacity = q->capacity ? q->capacity * 2 : 64;
+    }
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+
+    return 0;
+}
+
+static int QueuePop(struct WorkQueue *q, uint64_t *item)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        *item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return ret;
+}
+
+/*
+ * Steal half of the items from the tail of another worker's queue.
+ * One of them is returned in item, the rest go to the thief's own queue.
+ */
+static int QueueSteal(struct WorkPool *pool, int thief, uint64_t *item)
+{
+    struct WorkQueue *own = &(pool->queues[thief]);
+    struct WorkQueue *victim = NULL;
+    uint64_t stolen[64];
+    uint64_t n = 0, i = 0;
+    int v = 0;
+
+    for (v = 1; v < pool->nr_workers; v++) {
+        victim = &(pool->queues[(thief + v) % pool->nr_workers]);
+        pthread_mutex_lock(&victim->lock);
+        n = (victim->count + 1) / 2;
+        if (n > 64) {
+            n = 64;
+        }
+        for (i = 0; i < n; i++) {
+            victim->count--;
+            stolen[i] = victim->items[(victim->head + victim->count) % victim->capacity];
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (n == 0) {
+            continue;
+        }
+
+        *item = stolen[n - 1];
+        if (n > 1) {
+            pthread_mutex_lock(&own->lock);
+            for (i = n - 1; i > 0; i--) {
+                if (QueueAppend(own, stolen[i - 1]) < 0) {
+                    /* Out of memory, the stolen items are lost so the pool has to stop */
+                    pthread_mutex_unlock(&own->lock);
+                    return -1;
+                }
+            }
+            pthread_mutex_unlock(&own->lock);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+static void PoolStop(struct WorkPool *pool, int error)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->error == 0) {
+        pool->error = error;
+    }
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *Worker(void *data)
+{
+    struct WorkerArg *warg = (struct WorkerArg *)data;
+    struct WorkPool *pool = warg->pool;
+    uint64_t item = 0;
+    uint64_t pushes = 0;
+    int got = 0, ret = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->stop || pool->pending == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pushes = pool->pushes;
+        pthread_mutex_unlock(&pool->lock);
+
+        got = QueuePop(&(pool->queues[warg->id]), &item);
+        if (!got) {
+            got = QueueSteal(pool, warg->id, &item);
+        }
+        if (got < 0) {
+            PoolStop(pool, -1);
+            break;
+        }
+
+        if (got) {
+            ret = pool->func(pool, warg->id, item, pool->arg);
+            if (ret != 0) {
+                PoolStop(pool, ret);
+            }
+            pthread_mutex_lock(&pool->lock);
+            pool->pending--;
+            if (pool->pending == 0) {
+                pthread_cond_broadcast(&pool->cond);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        /* Nothing to do now, wait for a push or the end */
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && pool->pending > 0 && pool->pushes == pushes) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Push a new item from inside a WorkFunc, it goes to the caller's own queue
+ */
+int WorkPoolPush(struct WorkPool *pool, int worker, uint64_t item)
+{
+    struct WorkQueue *q = &(pool->queues[worker]);
+    int ret = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_lock(&q->lock);
+    ret = QueueAppend(q, item);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    if (ret < 0) {
+        pool->pending--;
+    }
+    pool->pushes++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return ret;
+}
+
+/*
+ * Run func over every item with a pool of workers
+ * @nr_workers: number of threads, 0 means one per online CPU
+ * @items: initial items, split in contiguous slices between the workers
+ * @count: number of initial items
+ * @func: called for every item, may push more items with WorkPoolPush
+ * @arg: passed to func
+ * Return 0 when all items are done, otherwise the first error of func
+ */
+int WorkPoolRun(int nr_workers, uint64_t *items, uint64_t count, WorkFunc func, void *arg)
+{
+    struct WorkPool pool;
+    struct WorkerArg *wargs = NULL;
+    pthread_t *threads = NULL;
+    uint64_t i = 0;
+    int w = 0, started = 0;
+    int ret = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    memset(&pool, 0, sizeof(struct WorkPool));
+    pool.nr_workers = WorkPoolWorkersGet(nr_workers);
+    pool.func = func;
+    pool.arg = arg;
+    pool.pending = count;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    pool.queues = (struct WorkQueue *) calloc(pool.nr_workers, sizeof(struct WorkQueue));
+    wargs = (struct WorkerArg *) calloc(pool.nr_workers, sizeof(struct WorkerArg));
+    threads = (pthread_t *) calloc(pool.nr_workers, sizeof(pthread_t));
+    if (pool.queues == NULL || wargs == NULL || threads == NULL) {
+        printf("WorkPoolRun: allocate workers failed\n");
+        ret = -1;
+        goto end;
+    }
+
+    for (w = 0; w < pool.nr_workers; w++) {
+        pthread_mutex_init(&(pool.queues[w].lock), NULL);
+    }
+    for (i = 0; i < count; i++) {
+        w = (int)(i * pool.nr_workers / count);
+        if (QueueAppend(&(pool.queues[w]), items[i]) < 0) {
+            printf("WorkPoolRun: allocate queue failed\n");
+            ret = -1;
+            goto end;
+        }
+    }
+
+    for (w = 0; w < pool.nr_workers; w++) {
+        wargs[w].pool = &pool;
+        wargs[w].id = w;
+        if (pthread_create(&threads[w], NULL, Worker, &wargs[w]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        /* No thread at all, do the work in the caller */
+        wargs[0].pool = &pool;
+        wargs[0].id = 0;
+        Worker(&wargs[0]);
+    }
+    for (w = 0; w < started; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    ret = pool.error;
+
+end:
+    if (pool.queues != NULL) {
+        for (w = 0; w < pool.nr_workers; w++) {
+            free(pool.queues[w].items);
+            pthread_mutex_destroy(&(pool.queues[w].lock));
+        }
+    }
+    free(pool.queues);
+    free(wargs);
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    return ret;
+}
@@ -0,0 +1,49 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct WorkPool;
+
+/*
+ * Called once per item, from any worker thread
+ * @pool: the running pool, for WorkPoolPush
+ * @worker: index of the calling worker, 0 ~ nr_workers - 1
+ * @item: the item
+ * @arg: argument given to WorkPoolRun
+ * Return 0 to go on, anything else stops the pool and is returned by WorkPoolRun
+ */
+typedef int (*WorkFunc)(struct WorkPool *, int, uint64_t, void *);
+
+/*
+ * Per worker deque. The owner pops from the head, thieves steal from the tail,
+ * so a worker walks its own items in order while stolen work comes from the
+ * far end.
+ */
+struct WorkQueue {
+    pthread_mutex_t lock;
+    uint64_t *items;
+    uint64_t head;
+    uint64_t count;
+    uint64_t capacity;
+};
+
+struct WorkPool {
+    int nr_workers;
+    struct WorkQueue *queues;
+    WorkFunc func;
+    void *arg;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t pending;   /* items pushed and not finished yet */
+    uint64_t pushes;    /* bumped on every push, to wake idle workers */
+    int error;
+    int stop;
+};
+
+int WorkPoolWorkersGet(int);
+int WorkPoolRun(int, uint64_t *, uint64_t, WorkFunc, void *);
+int WorkPoolPush(struct WorkPool *, int, uint64_t);
+
+#endif /* WORKPOOL_H */
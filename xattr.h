@@ -16,42 +16,34 @@
 #define EXT4_XATTR_INDEX_ENCRYPTION		9
 #define EXT4_XATTR_INDEX_HURD			10 /* Reserved for Hurd */
 
-static inline void INDEX_TO_STRING(uint8_t index, char *prefix)
+/*
+ * Prefix of the names in a name index, the POSIX ACLs are whole names
+ */
+static inline const char *INDEX_TO_STRING(uint8_t index)
 {
     switch(index) {
         case EXT4_XATTR_INDEX_USER:
-            prefix = "user.";
-            break;
+            return "user.";
         case EXT4_XATTR_INDEX_POSIX_ACL_ACCESS:
-            prefix = "posix_acl_access.";
-            break;
+            return "system.posix_acl_access";
         case EXT4_XATTR_INDEX_POSIX_ACL_DEFAULT:
-            prefix = "posix_acl_default";
-            break;
+            return "system.posix_acl_default";
         case EXT4_XATTR_INDEX_TRUSTED:
-            prefix = "trusted.";
-            break;
+            return "trusted.";
         case EXT4_XATTR_INDEX_LUSTRE:
-            prefix = "lustre.";
-            break;
+            return "lustre.";
         case EXT4_XATTR_INDEX_SECURITY:
-            prefix = "security.";
-            break;
+            return "security.";
         case EXT4_XATTR_INDEX_SYSTEM:
-            prefix = "system.";
-            break;
+            return "system.";
         case EXT4_XATTR_INDEX_RICHACL:
-            prefix = "richacl.";
-            break;
+            return "system.richacl";
         case EXT4_XATTR_INDEX_ENCRYPTION:
-            prefix = "encryption.";
-            break;
+            return "encryption.";
         case EXT4_XATTR_INDEX_HURD:
-            prefix = "hurd.";
-            break;
+            return "hurd.";
         default:
-            prefix = "unknown.";
-            break;
+            return "unknown.";
     }
 }
 
@@ -98,6 +90,7 @@ struct ext4_xattr_entry {
 		EXT4_GOOD_OLD_INODE_SIZE + \
 		inode.i_extra_isize))
 #define IFIRST(hdr) ((struct ext4_xattr_entry *)((hdr)+1))
+#define IS_LAST_ENTRY(entry) (*(uint32_t *)(entry) == 0)
 
 /*
  * XATTR_SIZE_MAX is currently 64k, but for the purposes of checking